@@ -40,6 +40,8 @@
 #include "hw/audio/audio.h"
 #include "sysemu/kvm.h"
 #include "migration/migration.h"
+#include "migration/multifd.h"
+#include "migration/file.h"
 #include "hw/i386/smbios.h"
 #include "exec/address-spaces.h"
 #include "hw/audio/pcspk.h"
@@ -110,11 +112,14 @@ int graphic_depth = 32;
 #endif
 
 const uint32_t arch_type = QEMU_ARCH;
-static bool mig_throttle_on;
 static int dirty_rate_high_cnt;
-static void check_guest_throttling(void);
 
 static uint64_t bitmap_sync_count;
+/* value of bitmap_sync_count when the multifd channels were last synced */
+static uint64_t multifd_sync_count;
+/* Pages of a file: migration whose last saved copy is not zero */
+static unsigned long *ram_file_bitmap;
+static uint8_t *ram_file_zero_page;
 
 /***********************************************************/
 /* ram save/restore */
@@ -126,7 +131,11 @@ static uint64_t bitmap_sync_count;
 #define RAM_SAVE_FLAG_EOS      0x10
 #define RAM_SAVE_FLAG_CONTINUE 0x20
 #define RAM_SAVE_FLAG_XBZRLE   0x40
-/* 0x80 is reserved in migration.h start with 0x100 next */
+/* 0x80 is reserved in migration.h */
+#define RAM_SAVE_FLAG_MULTIFD_SYNC 0x100
+#define RAM_SAVE_FLAG_MAPPED   0x200
+#define RAM_SAVE_FLAG_MULTIFD_SETUP 0x400
+/* start with 0x800 next */
 
 static struct defconfig_file {
     const char *filename;
@@ -195,10 +204,11 @@ static void XBZRLE_cache_unlock(void)
  * a migration is in progress.
  * A running migration maybe using the cache and might finish during this
  * call, hence changes to the cache are protected by XBZRLE.lock().
+ * cache_resize() only swaps in an empty table, the cached pages are
+ * moved over by the migration thread as it goes, so this is quick.
  */
 int64_t xbzrle_cache_resize(int64_t new_size)
 {
-    PageCache *new_cache;
     int64_t ret;
 
     if (new_size < TARGET_PAGE_SIZE) {
@@ -211,16 +221,11 @@ int64_t xbzrle_cache_resize(int64_t new_size)
         if (pow2floor(new_size) == migrate_xbzrle_cache_size()) {
             goto out_new_size;
         }
-        new_cache = cache_init(new_size / TARGET_PAGE_SIZE,
-                                        TARGET_PAGE_SIZE);
-        if (!new_cache) {
-            error_report("Error creating cache");
+        if (cache_resize(XBZRLE.cache, new_size / TARGET_PAGE_SIZE) < 0) {
+            error_report("Error resizing cache");
             ret = -1;
             goto out;
         }
-
-        cache_fini(XBZRLE.cache);
-        XBZRLE.cache = new_cache;
     }
 
 out_new_size:
@@ -533,6 +538,49 @@ static void migration_bitmap_sync_init(void)
     num_dirty_pages_period = 0;
 }
 
+/* Smallest change of the throttle, up or down, in one period */
+#define MIG_THROTTLE_MIN_STEP 5
+
+/*
+ * Called once per period with the bytes dirtied and sent during it.
+ * Once the guest has dirtied more than half of what was sent in the
+ * same time for more than 4 periods, throttle the vCPUs so that it does
+ * not anymore.  The dirty rate was measured while the vCPUs only ran
+ * (100 - pct)% of the time, so the rate at a new percentage scales with
+ * (100 - new_pct).  When the guest dirties less than a quarter of what
+ * is sent, the throttle is lowered again, one step per period since the
+ * estimate is rough, and stopped once it reaches zero.
+ */
+static void mig_throttle_adjust(uint64_t bytes_dirty, uint64_t bytes_xfer)
+{
+    int pct = cpu_throttle_get_percentage();
+    uint64_t run_pct;
+    int new_pct;
+
+    if (bytes_dirty > bytes_xfer / 2) {
+        if (!pct && dirty_rate_high_cnt++ <= 4) {
+            return;
+        }
+        run_pct = (100 - pct) * (bytes_xfer / 2) / bytes_dirty;
+        new_pct = MAX(100 - (int)run_pct, pct + MIG_THROTTLE_MIN_STEP);
+    } else if (pct && bytes_dirty < bytes_xfer / 4) {
+        run_pct = bytes_dirty ?
+                  (100 - pct) * (bytes_xfer / 2) / bytes_dirty : 100;
+        new_pct = 100 - (int)MIN(run_pct, 100);
+        new_pct = MAX(new_pct, pct - MIG_THROTTLE_MIN_STEP);
+    } else {
+        return;
+    }
+
+    trace_migration_throttle(pct, new_pct, bytes_dirty, bytes_xfer);
+    if (new_pct <= 0) {
+        cpu_throttle_stop();
+        dirty_rate_high_cnt = 0;
+    } else {
+        cpu_throttle_set(new_pct);
+    }
+}
+
 /* Called with iothread lock held, to protect ram_list.dirty_memory[] */
 static void migration_bitmap_sync(void)
 {
@@ -540,6 +588,7 @@ static void migration_bitmap_sync(void)
     uint64_t num_dirty_pages_init = migration_dirty_pages;
     MigrationState *s = migrate_get_current();
     int64_t end_time;
+    int64_t sync_start, sync_time;
     int64_t bytes_xfer_now;
     static uint64_t xbzrle_cache_miss_prev;
     static uint64_t iterations_prev;
@@ -555,6 +604,7 @@ static void migration_bitmap_sync(void)
     }
 
     trace_migration_bitmap_sync_start();
+    sync_start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
     address_space_sync_dirty_bitmap(&address_space_memory);
 
     rcu_read_lock();
@@ -563,31 +613,24 @@ static void migration_bitmap_sync(void)
     }
     rcu_read_unlock();
 
+    sync_time = (qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - sync_start)
+                / SCALE_US;
+    s->dirty_sync_time = sync_time;
+    s->dirty_sync_time_max = MAX(s->dirty_sync_time_max, sync_time);
     trace_migration_bitmap_sync_end(migration_dirty_pages
-                                    - num_dirty_pages_init);
+                                    - num_dirty_pages_init, sync_time);
     num_dirty_pages_period += migration_dirty_pages - num_dirty_pages_init;
     end_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
 
     /* more than 1 second = 1000 millisecons */
     if (end_time > start_time + 1000) {
         if (migrate_auto_converge()) {
-            /* The following detection logic can be refined later. For now:
-               Check to see if the dirtied bytes is 50% more than the approx.
-               amount of bytes that just got transferred since the last time we
-               were in this routine. If that happens >N times (for now N==4)
-               we turn on the throttle down logic */
             bytes_xfer_now = ram_bytes_transferred();
-            if (s->dirty_pages_rate &&
-               (num_dirty_pages_period * TARGET_PAGE_SIZE >
-                   (bytes_xfer_now - bytes_xfer_prev)/2) &&
-               (dirty_rate_high_cnt++ > 4)) {
-                    trace_migration_throttle();
-                    mig_throttle_on = true;
-                    dirty_rate_high_cnt = 0;
-             }
-             bytes_xfer_prev = bytes_xfer_now;
-        } else {
-             mig_throttle_on = false;
+            if (s->dirty_pages_rate) {
+                mig_throttle_adjust(num_dirty_pages_period * TARGET_PAGE_SIZE,
+                                    bytes_xfer_now - bytes_xfer_prev);
+            }
+            bytes_xfer_prev = bytes_xfer_now;
         }
         if (migrate_use_xbzrle()) {
             if (iterations_prev != 0) {
@@ -608,6 +651,46 @@ static void migration_bitmap_sync(void)
     }
 }
 
+/**
+ * ram_save_page_file: Write the given page to its place in the file
+ *
+ * Zero pages are not written, unless an older copy of the page was:
+ * restoring by mapping the file must find the latest contents there.
+ *
+ * Returns: Number of pages written.
+ */
+static int ram_save_page_file(QEMUFile *f, RAMBlock *block, ram_addr_t offset,
+                              uint8_t *p, uint64_t *bytes_transferred)
+{
+    unsigned long nr = (block->offset + offset) >> TARGET_PAGE_BITS;
+
+    if (!block->file_pages_offset) {
+        error_report("RAM block %s was added during a file migration",
+                     block->idstr);
+        qemu_file_set_error(f, -EINVAL);
+        return 1;
+    }
+
+    if (is_zero_range(p, TARGET_PAGE_SIZE)) {
+        acct_info.dup_pages++;
+        if (!test_and_clear_bit(nr, ram_file_bitmap)) {
+            return 1;
+        }
+        p = ram_file_zero_page;
+    } else {
+        set_bit(nr, ram_file_bitmap);
+        acct_info.norm_pages++;
+    }
+
+    if (file_migration_queue_page(block->file_pages_offset + offset, p,
+                                  TARGET_PAGE_SIZE) < 0) {
+        qemu_file_set_error(f, -EIO);
+    }
+    qemu_file_credit_transfer(f, TARGET_PAGE_SIZE);
+    *bytes_transferred += TARGET_PAGE_SIZE;
+    return 1;
+}
+
 /**
  * ram_save_page: Send the given page to the stream
  *
@@ -632,6 +715,10 @@ static int ram_save_page(QEMUFile *f, RAMBlock* block, ram_addr_t offset,
 
     p = memory_region_get_ram_ptr(mr) + offset;
 
+    if (file_migration_save_active()) {
+        return ram_save_page_file(f, block, offset, p, bytes_transferred);
+    }
+
     /* In doubt sent page as normal */
     bytes_xmit = 0;
     ret = ram_control_save_page(f, block->offset,
@@ -675,7 +762,16 @@ static int ram_save_page(QEMUFile *f, RAMBlock* block, ram_addr_t offset,
     }
 
     /* XBZRLE overflow or normal page */
-    if (pages == -1) {
+    if (pages == -1 && send_async && multifd_save_active()) {
+        if (multifd_queue_page(block->idstr, offset, p,
+                               TARGET_PAGE_SIZE) < 0) {
+            qemu_file_set_error(f, -EIO);
+        }
+        qemu_file_credit_transfer(f, TARGET_PAGE_SIZE);
+        *bytes_transferred += TARGET_PAGE_SIZE;
+        pages = 1;
+        acct_info.norm_pages++;
+    } else if (pages == -1) {
         *bytes_transferred += save_page_header(f, block,
                                                offset | RAM_SAVE_FLAG_PAGE);
         if (send_async) {
@@ -752,6 +848,35 @@ static int ram_find_and_save_block(QEMUFile *f, bool last_stage,
 
 static uint64_t bytes_transferred;
 
+/*
+ * Flush the multifd channels and put a sync marker on the main stream.
+ * This must happen after every dirty bitmap sync, before any page of the
+ * new pass is sent, so that an older copy of a page still in flight on
+ * one channel cannot overwrite a newer one on the destination.  The
+ * file: transport needs the same for its writer threads, but has no
+ * marker: the destination reads the pages only once, at the end.
+ */
+static void ram_multifd_sync(QEMUFile *f)
+{
+    if (file_migration_save_active()) {
+        if (file_migration_sync() < 0) {
+            qemu_file_set_error(f, -EIO);
+        }
+        multifd_sync_count = bitmap_sync_count;
+        return;
+    }
+    if (!multifd_save_active()) {
+        return;
+    }
+    if (multifd_send_sync_main() < 0) {
+        qemu_file_set_error(f, -EIO);
+        return;
+    }
+    qemu_put_be64(f, RAM_SAVE_FLAG_MULTIFD_SYNC);
+    bytes_transferred += 8;
+    multifd_sync_count = bitmap_sync_count;
+}
+
 void acct_update_position(QEMUFile *f, size_t size, bool zero)
 {
     uint64_t pages = size / TARGET_PAGE_SIZE;
@@ -799,11 +924,16 @@ void free_xbzrle_decoded_buf(void)
 
 static void migration_end(void)
 {
+    cpu_throttle_stop();
     if (migration_bitmap) {
         memory_global_dirty_log_stop();
         g_free(migration_bitmap);
         migration_bitmap = NULL;
     }
+    g_free(ram_file_bitmap);
+    ram_file_bitmap = NULL;
+    qemu_vfree(ram_file_zero_page);
+    ram_file_zero_page = NULL;
 
     XBZRLE_cache_lock();
     if (XBZRLE.cache) {
@@ -833,6 +963,94 @@ static void reset_ram_globals(void)
 
 #define MAX_WAIT 50 /* ms, half buffered_file limit */
 
+/* Size of a block's page bitmap in a file: migration, one bit per page */
+static uint64_t ram_file_bitmap_size(ram_addr_t length)
+{
+    return DIV_ROUND_UP(length >> TARGET_PAGE_BITS, BITS_PER_BYTE);
+}
+
+/*
+ * Reserve the regions of a file: migration where each block's pages and
+ * page bitmap go, and describe them in the stream.
+ * Called within an RCU critical section.
+ */
+static void ram_save_file_layout(QEMUFile *f)
+{
+    RAMBlock *block;
+    uint64_t total = 0;
+    uint32_t nblocks = 0;
+    int64_t start;
+
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        block->file_bitmap_offset = total;
+        total += ROUND_UP(ram_file_bitmap_size(block->max_length),
+                          FILE_MIGRATION_ALIGN);
+        block->file_pages_offset = total;
+        total += ROUND_UP(block->max_length, FILE_MIGRATION_ALIGN);
+        nblocks++;
+    }
+
+    qemu_put_be64(f, RAM_SAVE_FLAG_MAPPED);
+    qemu_put_be64(f, total);
+    qemu_put_be32(f, nblocks);
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        qemu_put_byte(f, strlen(block->idstr));
+        qemu_put_buffer(f, (uint8_t *)block->idstr, strlen(block->idstr));
+        qemu_put_be64(f, block->max_length);
+        qemu_put_be64(f, block->file_bitmap_offset);
+        qemu_put_be64(f, block->file_pages_offset);
+    }
+
+    start = file_migration_skip(f, total);
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        block->file_bitmap_offset += start;
+        block->file_pages_offset += start;
+    }
+
+    ram_file_bitmap = bitmap_new(last_ram_offset() >> TARGET_PAGE_BITS);
+    ram_file_zero_page = qemu_memalign(getpagesize(), TARGET_PAGE_SIZE);
+    memset(ram_file_zero_page, 0, TARGET_PAGE_SIZE);
+}
+
+/*
+ * Write the page bitmaps of a file: migration, once all pages are in the
+ * file.  Bit n of the bitmap, starting from the least significant bit of
+ * the first byte, is set if page n was written.
+ * Called within an RCU critical section.
+ */
+static void ram_save_file_bitmaps(QEMUFile *f)
+{
+    RAMBlock *block;
+
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        unsigned long base = block->offset >> TARGET_PAGE_BITS;
+        unsigned long end = base + (block->max_length >> TARGET_PAGE_BITS);
+        uint64_t size = ram_file_bitmap_size(block->max_length);
+        uint8_t *bitmap;
+        unsigned long nr;
+        int ret;
+
+        if (!block->file_pages_offset) {
+            continue;
+        }
+
+        bitmap = g_malloc0(size);
+        for (nr = find_next_bit(ram_file_bitmap, end, base); nr < end;
+             nr = find_next_bit(ram_file_bitmap, end, nr + 1)) {
+            bitmap[(nr - base) / BITS_PER_BYTE] |= 1 << ((nr - base) %
+                                                         BITS_PER_BYTE);
+        }
+        ret = file_migration_pwrite(bitmap, size, block->file_bitmap_offset);
+        g_free(bitmap);
+        if (ret < 0) {
+            error_report("Cannot write the page bitmap of RAM block %s: %s",
+                         block->idstr, strerror(-ret));
+            qemu_file_set_error(f, ret);
+            return;
+        }
+    }
+}
+
 
 /* Each of ram_save_setup, ram_save_iterate and ram_save_complete has
  * long-running RCU critical section.  When rcu-reclaims in the code
@@ -845,7 +1063,6 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
     RAMBlock *block;
     int64_t ram_bitmap_pages; /* Size of bitmap in pages, including gaps */
 
-    mig_throttle_on = false;
     dirty_rate_high_cnt = 0;
     bitmap_sync_count = 0;
     migration_bitmap_sync_init();
@@ -905,6 +1122,7 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
 
     memory_global_dirty_log_start();
     migration_bitmap_sync();
+    multifd_sync_count = bitmap_sync_count;
     qemu_mutex_unlock_ramlist();
     qemu_mutex_unlock_iothread();
 
@@ -916,6 +1134,16 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
         qemu_put_be64(f, block->used_length);
     }
 
+    if (file_migration_save_active()) {
+        ram_save_file_layout(f);
+    }
+
+    /* let the destination check that it waits for as many channels */
+    if (multifd_save_active()) {
+        qemu_put_be64(f, RAM_SAVE_FLAG_MULTIFD_SETUP);
+        qemu_put_be32(f, migrate_multifd_channels());
+    }
+
     rcu_read_unlock();
 
     ram_control_before_iterate(f, RAM_CONTROL_SETUP);
@@ -941,6 +1169,10 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
     /* Read version before ram_list.blocks */
     smp_rmb();
 
+    if (multifd_sync_count != bitmap_sync_count) {
+        ram_multifd_sync(f);
+    }
+
     ram_control_before_iterate(f, RAM_CONTROL_ROUND);
 
     t0 = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
@@ -955,7 +1187,6 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
         }
         pages_sent += pages;
         acct_info.iterations++;
-        check_guest_throttling();
         /* we want to check in the 1st loop, just in case it was the 1st time
            and we had to sync the dirty bitmap.
            qemu_get_clock_ns() is a bit expensive, so we only check each some
@@ -996,6 +1227,7 @@ static int ram_save_complete(QEMUFile *f, void *opaque)
     rcu_read_lock();
 
     migration_bitmap_sync();
+    ram_multifd_sync(f);
 
     ram_control_before_iterate(f, RAM_CONTROL_FINISH);
 
@@ -1012,6 +1244,12 @@ static int ram_save_complete(QEMUFile *f, void *opaque)
         }
     }
 
+    /* everything must be in guest memory before the device state loads */
+    ram_multifd_sync(f);
+    if (file_migration_save_active()) {
+        ram_save_file_bitmaps(f);
+    }
+
     ram_control_after_iterate(f, RAM_CONTROL_FINISH);
     migration_end();
 
@@ -1108,6 +1346,27 @@ static inline void *host_from_stream_offset(QEMUFile *f,
     return NULL;
 }
 
+/* Host address and size of a RAM block, for the multifd receive threads.
+ * Returns NULL if there is no block called @idstr.
+ */
+void *ram_block_host_from_idstr(const char *idstr, ram_addr_t *length)
+{
+    RAMBlock *block;
+    void *host = NULL;
+
+    rcu_read_lock();
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        if (!strncmp(idstr, block->idstr, sizeof(block->idstr))) {
+            host = memory_region_get_ram_ptr(block->mr);
+            *length = block->max_length;
+            break;
+        }
+    }
+    rcu_read_unlock();
+
+    return host;
+}
+
 /*
  * If a page (or a whole RDMA chunk) has been
  * determined to be zero, then zap it.
@@ -1119,6 +1378,117 @@ void ram_handle_compressed(void *host, uint8_t ch, uint64_t size)
     }
 }
 
+/*
+ * Load a RAM block from its region of a file: migration, by mapping the
+ * region if the file-mmap capability allows, or else by reading the pages
+ * that were saved and clearing the others.
+ */
+static int ram_load_file_block(RAMBlock *block, uint64_t bitmap_offset,
+                               uint64_t pages_offset)
+{
+    uint8_t *host = memory_region_get_ram_ptr(block->mr);
+    ram_addr_t pages = block->used_length >> TARGET_PAGE_BITS;
+    uint64_t size = ram_file_bitmap_size(block->used_length);
+    uint8_t *bitmap;
+    ram_addr_t i;
+    int ret;
+
+    if (migrate_use_file_mmap() && qemu_ram_block_is_anonymous(block) &&
+        !(block->used_length & (getpagesize() - 1)) &&
+        !file_migration_map(host, block->used_length, pages_offset)) {
+        trace_ram_load_file_block(block->idstr, pages_offset,
+                                  block->used_length, true);
+        return 0;
+    }
+
+    bitmap = g_malloc(size);
+    ret = file_migration_pread(bitmap, size, bitmap_offset);
+    if (ret < 0) {
+        error_report("Cannot read the page bitmap of RAM block %s: %s",
+                     block->idstr, strerror(-ret));
+        g_free(bitmap);
+        return ret;
+    }
+
+    for (i = 0; i < pages; i++) {
+        uint8_t *p = host + (i << TARGET_PAGE_BITS);
+
+        if (!(bitmap[i / BITS_PER_BYTE] & (1 << (i % BITS_PER_BYTE)))) {
+            ram_handle_compressed(p, 0, TARGET_PAGE_SIZE);
+        } else if (file_migration_queue_page(pages_offset +
+                                             (i << TARGET_PAGE_BITS),
+                                             p, TARGET_PAGE_SIZE) < 0) {
+            ret = -EIO;
+            break;
+        }
+    }
+    g_free(bitmap);
+    trace_ram_load_file_block(block->idstr, pages_offset, block->used_length,
+                              false);
+    return ret;
+}
+
+/* Must be called from within a rcu critical section. */
+static int ram_load_mapped(QEMUFile *f)
+{
+    RAMBlock **blocks;
+    uint64_t *bitmap_offset, *pages_offset;
+    uint64_t total;
+    uint32_t nblocks, i;
+    int64_t start;
+    int ret = 0;
+
+    if (!file_migration_load_active()) {
+        error_report("RAM was saved to a file, load it with -incoming file:");
+        return -EINVAL;
+    }
+
+    total = qemu_get_be64(f);
+    nblocks = qemu_get_be32(f);
+    blocks = g_new0(RAMBlock *, nblocks);
+    bitmap_offset = g_new(uint64_t, nblocks);
+    pages_offset = g_new(uint64_t, nblocks);
+
+    for (i = 0; i < nblocks; i++) {
+        RAMBlock *block;
+        uint8_t len;
+        char id[256];
+        ram_addr_t length;
+
+        len = qemu_get_byte(f);
+        qemu_get_buffer(f, (uint8_t *)id, len);
+        id[len] = 0;
+        length = qemu_get_be64(f);
+        bitmap_offset[i] = qemu_get_be64(f);
+        pages_offset[i] = qemu_get_be64(f);
+
+        QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+            if (!strncmp(id, block->idstr, sizeof(id))) {
+                break;
+            }
+        }
+        if (!block || block->used_length > length) {
+            error_report("RAM block \"%s\" does not match the file", id);
+            ret = -EINVAL;
+        }
+        blocks[i] = block;
+    }
+
+    start = file_migration_skip(f, total);
+    for (i = 0; !ret && i < nblocks; i++) {
+        ret = ram_load_file_block(blocks[i], start + bitmap_offset[i],
+                                  start + pages_offset[i]);
+    }
+    if (file_migration_sync() < 0 && !ret) {
+        ret = -EIO;
+    }
+
+    g_free(blocks);
+    g_free(bitmap_offset);
+    g_free(pages_offset);
+    return ret;
+}
+
 static int ram_load(QEMUFile *f, void *opaque, int version_id)
 {
     int flags = 0, ret = 0;
@@ -1216,6 +1586,15 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
                 break;
             }
             break;
+        case RAM_SAVE_FLAG_MULTIFD_SETUP:
+            ret = multifd_recv_setup_main(qemu_get_be32(f));
+            break;
+        case RAM_SAVE_FLAG_MULTIFD_SYNC:
+            ret = multifd_recv_sync_main();
+            break;
+        case RAM_SAVE_FLAG_MAPPED:
+            ret = ram_load_mapped(f);
+            break;
         case RAM_SAVE_FLAG_EOS:
             /* normal exit */
             break;
@@ -1453,52 +1832,3 @@ TargetInfo *qmp_query_target(Error **errp)
 
     return info;
 }
-
-/* Stub function that's gets run on the vcpu when its brought out of the
-   VM to run inside qemu via async_run_on_cpu()*/
-static void mig_sleep_cpu(void *opq)
-{
-    qemu_mutex_unlock_iothread();
-    g_usleep(30*1000);
-    qemu_mutex_lock_iothread();
-}
-
-/* To reduce the dirty rate explicitly disallow the VCPUs from spending
-   much time in the VM. The migration thread will try to catchup.
-   Workload will experience a performance drop.
-*/
-static void mig_throttle_guest_down(void)
-{
-    CPUState *cpu;
-
-    qemu_mutex_lock_iothread();
-    CPU_FOREACH(cpu) {
-        async_run_on_cpu(cpu, mig_sleep_cpu, NULL);
-    }
-    qemu_mutex_unlock_iothread();
-}
-
-static void check_guest_throttling(void)
-{
-    static int64_t t0;
-    int64_t        t1;
-
-    if (!mig_throttle_on) {
-        return;
-    }
-
-    if (!t0)  {
-        t0 = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
-        return;
-    }
-
-    t1 = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
-
-    /* If it has been more than 40 ms since the last time the guest
-     * was throttled then do it again.
-     */
-    if (40 < (t1-t0)/1000000) {
-        mig_throttle_guest_down();
-        t0 = t1;
-    }
-}
@@ -136,7 +136,9 @@ static int line_out_init (HWVoiceOut *hw, struct audsettings *as)
     out->sin.base.sif = &playback_sif.base;
     qemu_spice_add_interface (&out->sin.base);
 #if SPICE_INTERFACE_PLAYBACK_MAJOR > 1 || SPICE_INTERFACE_PLAYBACK_MINOR >= 3
+    qemu_spice_lock();
     spice_server_set_playback_rate(&out->sin, settings.freq);
+    qemu_spice_unlock();
 #endif
     return 0;
 }
@@ -145,7 +147,7 @@ static void line_out_fini (HWVoiceOut *hw)
 {
     SpiceVoiceOut *out = container_of (hw, SpiceVoiceOut, hw);
 
-    spice_server_remove_interface (&out->sin.base);
+    qemu_spice_remove_interface(&out->sin.base);
 }
 
 static int line_out_run (HWVoiceOut *hw, int live)
@@ -163,6 +165,7 @@ static int line_out_run (HWVoiceOut *hw, int live)
 
     samples = decr;
     rpos = hw->rpos;
+    qemu_spice_lock();
     while (samples) {
         int left_till_end_samples = hw->samples - rpos;
         int len = audio_MIN (samples, left_till_end_samples);
@@ -184,6 +187,7 @@ static int line_out_run (HWVoiceOut *hw, int live)
         rpos = (rpos + len) % hw->samples;
         samples -= len;
     }
+    qemu_spice_unlock();
     hw->rpos = rpos;
     return decr;
 }
@@ -197,6 +201,7 @@ static int line_out_ctl (HWVoiceOut *hw, int cmd, ...)
 {
     SpiceVoiceOut *out = container_of (hw, SpiceVoiceOut, hw);
 
+    qemu_spice_lock();
     switch (cmd) {
     case VOICE_ENABLE:
         if (out->active) {
@@ -237,6 +242,7 @@ static int line_out_ctl (HWVoiceOut *hw, int cmd, ...)
             break;
         }
     }
+    qemu_spice_unlock();
 
     return 0;
 }
@@ -264,7 +270,9 @@ static int line_in_init (HWVoiceIn *hw, struct audsettings *as)
     in->sin.base.sif = &record_sif.base;
     qemu_spice_add_interface (&in->sin.base);
 #if SPICE_INTERFACE_RECORD_MAJOR > 2 || SPICE_INTERFACE_RECORD_MINOR >= 3
+    qemu_spice_lock();
     spice_server_set_record_rate(&in->sin, settings.freq);
+    qemu_spice_unlock();
 #endif
     return 0;
 }
@@ -273,7 +281,7 @@ static void line_in_fini (HWVoiceIn *hw)
 {
     SpiceVoiceIn *in = container_of (hw, SpiceVoiceIn, hw);
 
-    spice_server_remove_interface (&in->sin.base);
+    qemu_spice_remove_interface(&in->sin.base);
 }
 
 static int line_in_run (HWVoiceIn *hw)
@@ -292,7 +300,9 @@ static int line_in_run (HWVoiceIn *hw)
     delta_samp = rate_get_samples (&hw->info, &in->rate);
     num_samples = audio_MIN (num_samples, delta_samp);
 
+    qemu_spice_lock();
     ready = spice_server_record_get_samples (&in->sin, in->samples, num_samples);
+    qemu_spice_unlock();
     samples = in->samples;
     if (ready == 0) {
         static const uint32_t silence[LINE_IN_SAMPLES];
@@ -330,6 +340,7 @@ static int line_in_ctl (HWVoiceIn *hw, int cmd, ...)
 {
     SpiceVoiceIn *in = container_of (hw, SpiceVoiceIn, hw);
 
+    qemu_spice_lock();
     switch (cmd) {
     case VOICE_ENABLE:
         if (in->active) {
@@ -365,6 +376,7 @@ static int line_in_ctl (HWVoiceIn *hw, int cmd, ...)
             break;
         }
     }
+    qemu_spice_unlock();
 
     return 0;
 }
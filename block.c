@@ -4312,6 +4312,139 @@ int bdrv_load_vmstate(BlockDriverState *bs, uint8_t *buf,
     return -ENOTSUP;
 }
 
+typedef struct BdrvCoVMStateData {
+    BlockDriverState *bs;
+    bool discard;
+    int64_t sector_num;
+    int nb_sectors;
+    int *pnum;
+    int64_t ret;
+    bool done;
+} BdrvCoVMStateData;
+
+static void coroutine_fn bdrv_vmstate_co_entry(void *opaque)
+{
+    BdrvCoVMStateData *data = opaque;
+    BlockDriverState *bs = data->bs;
+
+    if (data->discard) {
+        data->ret = bs->drv->bdrv_co_discard_vmstate(bs, data->sector_num,
+                                                     data->nb_sectors);
+    } else {
+        data->ret = bs->drv->bdrv_co_get_vmstate_status(bs, data->sector_num,
+                                                        data->nb_sectors,
+                                                        data->pnum);
+    }
+    data->done = true;
+}
+
+static int64_t bdrv_vmstate_co(BdrvCoVMStateData *data)
+{
+    Coroutine *co;
+
+    if (qemu_in_coroutine()) {
+        bdrv_vmstate_co_entry(data);
+    } else {
+        AioContext *aio_context = bdrv_get_aio_context(data->bs);
+
+        co = qemu_coroutine_create(bdrv_vmstate_co_entry);
+        qemu_coroutine_enter(co, data);
+        while (!data->done) {
+            aio_poll(aio_context, true);
+        }
+    }
+    return data->ret;
+}
+
+/*
+ * Returns the status of the VM state bytes starting at 'pos', in the same
+ * form as bdrv_get_block_status() does for sectors of the disk.  With
+ * BDRV_BLOCK_OFFSET_VALID, the bytes are stored as is in bs->file.
+ *
+ * Unallocated bytes read as zeroes unless there is a backing file.
+ *
+ * 'pos' and 'size' must be multiples of BDRV_SECTOR_SIZE.  'pnum' is set
+ * to the number of bytes, up to 'size', that are in the same state.
+ */
+int64_t bdrv_get_vmstate_status(BlockDriverState *bs, int64_t pos,
+                                int64_t size, int64_t *pnum)
+{
+    int n = 0;
+    BdrvCoVMStateData data = {
+        .bs = bs,
+        .sector_num = pos >> BDRV_SECTOR_BITS,
+        .nb_sectors = MIN(size >> BDRV_SECTOR_BITS, INT_MAX),
+        .pnum = &n,
+    };
+    int64_t ret;
+
+    assert(!((pos | size) & (BDRV_SECTOR_SIZE - 1)));
+    *pnum = 0;
+    if (!bs->drv) {
+        return -ENOMEDIUM;
+    } else if (!bs->drv->bdrv_co_get_vmstate_status) {
+        return -ENOTSUP;
+    }
+    ret = bdrv_vmstate_co(&data);
+    *pnum = (int64_t)n << BDRV_SECTOR_BITS;
+    if (ret >= 0 && !(ret & BDRV_BLOCK_DATA) && !bs->backing_hd) {
+        ret |= BDRV_BLOCK_ZERO;
+    }
+    return ret;
+}
+
+/*
+ * Open the host file that holds the data of 'bs' at the offsets given with
+ * BDRV_BLOCK_OFFSET_VALID.  Returns a file descriptor, or a negative errno
+ * if that is not a plain file.
+ */
+int bdrv_open_data_file(BlockDriverState *bs, int flags)
+{
+    BlockDriverState *file = bs->file;
+    int fd;
+
+    if (!file || !file->drv || strcmp(file->drv->format_name, "file")) {
+        return -ENOTSUP;
+    }
+    fd = qemu_open(file->filename, flags);
+    return fd < 0 ? -errno : fd;
+}
+
+/*
+ * Make the VM state bytes starting at 'pos' read as zeroes, whatever an
+ * earlier save left there.  Only whole clusters are dropped, so 'pos' and
+ * 'size' should be multiples of the cluster size.  A zero 'size' only
+ * checks that the driver can do it.
+ */
+int bdrv_discard_vmstate(BlockDriverState *bs, int64_t pos, int64_t size)
+{
+    BdrvCoVMStateData data = {
+        .bs = bs,
+        .discard = true,
+    };
+    int ret;
+
+    assert(!((pos | size) & (BDRV_SECTOR_SIZE - 1)));
+    if (!bs->drv) {
+        return -ENOMEDIUM;
+    } else if (!bs->drv->bdrv_co_discard_vmstate) {
+        return -ENOTSUP;
+    }
+    /* 1 GB at a time, a multiple of any cluster size */
+    while (size > 0) {
+        data.sector_num = pos >> BDRV_SECTOR_BITS;
+        data.nb_sectors = MIN(size, 1 << 30) >> BDRV_SECTOR_BITS;
+        data.done = false;
+        ret = bdrv_vmstate_co(&data);
+        if (ret < 0) {
+            return ret;
+        }
+        pos += (int64_t)data.nb_sectors << BDRV_SECTOR_BITS;
+        size -= (int64_t)data.nb_sectors << BDRV_SECTOR_BITS;
+    }
+    return 0;
+}
+
 void bdrv_debug_event(BlockDriverState *bs, BlkDebugEvent event)
 {
     if (!bs || !bs->drv || !bs->drv->bdrv_debug_event) {
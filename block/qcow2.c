@@ -2592,6 +2592,30 @@ static int qcow2_load_vmstate(BlockDriverState *bs, uint8_t *buf,
     return ret;
 }
 
+static int64_t coroutine_fn qcow2_co_get_vmstate_status(BlockDriverState *bs,
+        int64_t sector_num, int nb_sectors, int *pnum)
+{
+    BDRVQcowState *s = bs->opaque;
+
+    return qcow2_co_get_block_status(bs,
+        (qcow2_vm_state_offset(s) >> BDRV_SECTOR_BITS) + sector_num,
+        nb_sectors, pnum);
+}
+
+static int coroutine_fn qcow2_co_discard_vmstate(BlockDriverState *bs,
+    int64_t sector_num, int nb_sectors)
+{
+    BDRVQcowState *s = bs->opaque;
+    int ret;
+
+    qemu_co_mutex_lock(&s->lock);
+    ret = qcow2_discard_clusters(bs, qcow2_vm_state_offset(s) +
+                                 (sector_num << BDRV_SECTOR_BITS),
+                                 nb_sectors, QCOW2_DISCARD_NEVER, false);
+    qemu_co_mutex_unlock(&s->lock);
+    return ret;
+}
+
 /*
  * Downgrades an image's version. To achieve this, any incompatible features
  * have to be removed.
@@ -2935,6 +2959,8 @@ BlockDriver bdrv_qcow2 = {
 
     .bdrv_save_vmstate    = qcow2_save_vmstate,
     .bdrv_load_vmstate    = qcow2_load_vmstate,
+    .bdrv_co_get_vmstate_status = qcow2_co_get_vmstate_status,
+    .bdrv_co_discard_vmstate    = qcow2_co_discard_vmstate,
 
     .supports_backing           = true,
     .bdrv_change_backing_file   = qcow2_change_backing_file,
@@ -882,6 +882,47 @@ void cpu_physical_memory_reset_dirty(ram_addr_t start, ram_addr_t length,
     }
 }
 
+DirtyBitmapSnapshot *cpu_physical_memory_snapshot_and_clear_dirty
+    (ram_addr_t start, ram_addr_t length, unsigned client)
+{
+    unsigned long *src = ram_list.dirty_memory[client];
+    unsigned long first, end, page;
+    DirtyBitmapSnapshot *snap;
+
+    assert(client < DIRTY_MEMORY_NUM);
+    first = start >> TARGET_PAGE_BITS;
+    end = TARGET_PAGE_ALIGN(start + length) >> TARGET_PAGE_BITS;
+    snap = g_malloc0(sizeof(*snap) +
+                     BITS_TO_LONGS(end - first) * sizeof(unsigned long));
+    snap->start = (ram_addr_t)first << TARGET_PAGE_BITS;
+    snap->end = (ram_addr_t)end << TARGET_PAGE_BITS;
+
+    page = find_next_bit(src, end, first);
+    if (page == end) {
+        return snap;
+    }
+    for (; page < end; page = find_next_bit(src, end, page + 1)) {
+        set_bit(page - first, snap->dirty);
+    }
+    cpu_physical_memory_reset_dirty(snap->start, snap->end - snap->start,
+                                    client);
+    return snap;
+}
+
+bool cpu_physical_memory_snapshot_get_dirty(DirtyBitmapSnapshot *snap,
+                                            ram_addr_t start,
+                                            ram_addr_t length)
+{
+    unsigned long page, end;
+
+    if (start < snap->start || start + length > snap->end) {
+        return true;
+    }
+    page = (start - snap->start) >> TARGET_PAGE_BITS;
+    end = (TARGET_PAGE_ALIGN(start + length) - snap->start) >> TARGET_PAGE_BITS;
+    return find_next_bit(snap->dirty, end, page) < end;
+}
+
 static void cpu_physical_memory_set_dirty_tracking(bool enable)
 {
     in_migration = enable;
@@ -1684,6 +1725,15 @@ int qemu_get_ram_fd(ram_addr_t addr)
     return fd;
 }
 
+/* True if the block is private anonymous memory allocated by us, which
+ * can be replaced with another private mapping without anybody noticing.
+ */
+bool qemu_ram_block_is_anonymous(RAMBlock *block)
+{
+    return block->fd < 0 && !(block->flags & (RAM_PREALLOC | RAM_SHARED)) &&
+           !xen_enabled() && phys_mem_alloc == qemu_anon_ram_alloc;
+}
+
 void *qemu_get_ram_block_host_ptr(ram_addr_t addr)
 {
     RAMBlock *block;
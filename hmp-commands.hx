@@ -314,19 +314,42 @@ ETEXI
 
     {
         .name       = "savevm",
-        .args_type  = "name:s?",
-        .params     = "[tag|id]",
-        .help       = "save a VM snapshot. If no tag or id are provided, a new snapshot is created",
+        .args_type  = "live:-l,name:s?",
+        .params     = "[-l] [tag|id]",
+        .help       = "save a VM snapshot. If no tag or id are provided, a new snapshot is created"
+                      "\n\t\t\t -l: save RAM while the guest runs, only pausing it at the end",
         .mhandler.cmd = hmp_savevm,
     },
 
 STEXI
-@item savevm [@var{tag}|@var{id}]
+@item savevm [-l] [@var{tag}|@var{id}]
 @findex savevm
 Create a snapshot of the whole virtual machine. If @var{tag} is
 provided, it is used as human readable identifier. If there is already
 a snapshot with the same tag or ID, it is replaced. More info at
 @ref{vm_snapshots}.
+
+With @option{-l}, the snapshot is taken live: guest RAM is written while
+the guest keeps running, and the guest is only paused for the last dirty
+pages, the device state and the disk snapshots.  The command returns at
+once; @code{info savevm} shows the progress and the outcome, a
+SAVEVM_LIVE_FINISHED QMP event is sent when it is over, and
+@code{savevm_cancel} stops it before the guest is paused.
+ETEXI
+
+    {
+        .name       = "savevm_cancel",
+        .args_type  = "",
+        .params     = "",
+        .help       = "cancel the live snapshot in progress",
+        .mhandler.cmd = hmp_savevm_cancel,
+    },
+
+STEXI
+@item savevm_cancel
+@findex savevm_cancel
+Cancel the live snapshot started with @code{savevm -l}.  The guest keeps
+running and no snapshot is created.
 ETEXI
 
     {
@@ -342,7 +365,12 @@ STEXI
 @item loadvm @var{tag}|@var{id}
 @findex loadvm
 Set the whole virtual machine to the snapshot identified by the tag
-@var{tag} or the unique snapshot ID @var{id}.
+@var{tag} or the unique snapshot ID @var{id}.  With the @code{file-mmap}
+migration capability, the guest RAM of a snapshot saved to a qcow2 image
+in a plain file is mapped from the image rather than read: the guest
+resumes once its devices are loaded and its RAM is read as it is used,
+and in the background.  Until all of it is read, no snapshot can be
+taken, loaded or deleted.
 ETEXI
 
     {
@@ -968,7 +996,8 @@ ETEXI
 STEXI
 @item migrate_set_speed @var{value}
 @findex migrate_set_speed
-Set maximum speed to @var{value} (in bytes) for migrations.
+Set maximum speed to @var{value} (in bytes) for migrations.  Until it
+is set, migrations to @code{file:} are not limited.
 ETEXI
 
     {
@@ -1730,6 +1759,8 @@ show profiling information
 show information about active capturing
 @item info snapshots
 show list of VM snapshots
+@item info savevm
+show the status of the current or last live snapshot
 @item info status
 show the current VM status (running|paused)
 @item info mice
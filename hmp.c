@@ -177,6 +177,10 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
             monitor_printf(mon, "setup: %" PRIu64 " milliseconds\n",
                            info->setup_time);
         }
+        if (info->has_cpu_throttle_percentage) {
+            monitor_printf(mon, "cpu throttle percentage: %" PRIu64 "\n",
+                           info->cpu_throttle_percentage);
+        }
     }
 
     if (info->has_ram) {
@@ -198,6 +202,12 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
                        info->ram->normal_bytes >> 10);
         monitor_printf(mon, "dirty sync count: %" PRIu64 "\n",
                        info->ram->dirty_sync_count);
+        if (info->ram->has_dirty_sync_time) {
+            monitor_printf(mon, "dirty sync time: %" PRIu64 " us "
+                           "(max %" PRIu64 " us)\n",
+                           info->ram->dirty_sync_time,
+                           info->ram->dirty_sync_time_max);
+        }
         if (info->ram->dirty_pages_rate) {
             monitor_printf(mon, "dirty pages rate: %" PRIu64 " pages\n",
                            info->ram->dirty_pages_rate);
@@ -211,6 +221,30 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
                        info->disk->remaining >> 10);
         monitor_printf(mon, "total disk: %" PRIu64 " kbytes\n",
                        info->disk->total >> 10);
+        monitor_printf(mon, "disk zero chunks: %" PRIu64 "\n",
+                       info->disk->duplicate);
+        monitor_printf(mon, "disk normal chunks: %" PRIu64 "\n",
+                       info->disk->normal);
+        monitor_printf(mon, "disk normal bytes: %" PRIu64 " kbytes\n",
+                       info->disk->normal_bytes >> 10);
+    }
+
+    if (info->has_sections) {
+        MigrationSectionStatsList *sect;
+
+        monitor_printf(mon, "sections (kbytes/us):\n");
+        for (sect = info->sections; sect; sect = sect->next) {
+            MigrationSectionStats *st = sect->value;
+
+            monitor_printf(mon, "  %s/%" PRId64 ": setup %" PRId64 "/%" PRId64
+                           " iterate %" PRId64 "/%" PRId64 " (%" PRId64
+                           " times) complete %" PRId64 "/%" PRId64 "\n",
+                           st->name, st->instance_id,
+                           st->setup_bytes >> 10, st->setup_time,
+                           st->iterate_bytes >> 10, st->iterate_time,
+                           st->iterations,
+                           st->complete_bytes >> 10, st->complete_time);
+        }
     }
 
     if (info->has_xbzrle_cache) {
@@ -257,6 +291,30 @@ void hmp_info_migrate_cache_size(Monitor *mon, const QDict *qdict)
                    qmp_query_migrate_cache_size(NULL) >> 10);
 }
 
+void hmp_info_savevm(Monitor *mon, const QDict *qdict)
+{
+    SaveVMLiveInfo *info = qmp_query_savevm(NULL);
+
+    monitor_printf(mon, "Live snapshot status: %s\n",
+                   SaveVMLiveStatus_lookup[info->status]);
+    if (info->has_name) {
+        monitor_printf(mon, "name: %s\n", info->name);
+    }
+    if (info->has_written) {
+        monitor_printf(mon, "written: %" PRIu64 " kbytes\n",
+                       info->written >> 10);
+    }
+    if (info->has_total_time) {
+        monitor_printf(mon, "total time: %" PRIu64 " milliseconds\n",
+                       info->total_time);
+    }
+    if (info->has_error_desc) {
+        monitor_printf(mon, "error: %s\n", info->error_desc);
+    }
+
+    qapi_free_SaveVMLiveInfo(info);
+}
+
 void hmp_info_cpus(Monitor *mon, const QDict *qdict)
 {
     CpuInfoList *cpu_list, *cpu;
@@ -1116,6 +1174,14 @@ void hmp_migrate_cancel(Monitor *mon, const QDict *qdict)
     qmp_migrate_cancel(NULL);
 }
 
+void hmp_savevm_cancel(Monitor *mon, const QDict *qdict)
+{
+    Error *err = NULL;
+
+    qmp_savevm_cancel(&err);
+    hmp_handle_error(mon, &err);
+}
+
 void hmp_migrate_incoming(Monitor *mon, const QDict *qdict)
 {
     Error *err = NULL;
@@ -22,36 +22,92 @@
 #include "qxl.h"
 #include "trace.h"
 
-static void qxl_blit(PCIQXLDevice *qxl, QXLRect *rect)
+static bool qxl_rect_valid(const QXLRect *rect, uint32_t width,
+                           uint32_t height)
 {
-    DisplaySurface *surface = qemu_console_surface(qxl->vga.con);
-    uint8_t *dst = surface_data(surface);
-    uint8_t *src;
+    return rect->left >= 0 &&
+        rect->top >= 0 &&
+        rect->left <= rect->right &&
+        rect->top <= rect->bottom &&
+        rect->right <= width &&
+        rect->bottom <= height;
+}
+
+static void qxl_blit(const QXLRenderTarget *t, const QXLRect *rect)
+{
+    uint8_t *dst = t->dst;
+    uint8_t *src = t->src;
     int len, i;
 
-    if (is_buffer_shared(surface)) {
-        return;
-    }
-    trace_qxl_render_blit(qxl->guest_primary.qxl_stride,
+    trace_qxl_render_blit(t->src_stride,
             rect->left, rect->right, rect->top, rect->bottom);
-    src = qxl->guest_primary.data;
-    if (qxl->guest_primary.qxl_stride < 0) {
+    if (t->src_stride < 0) {
         /* qxl surface is upside down, walk src scanlines
          * in reverse order to flip it */
-        src += (qxl->guest_primary.surface.height - rect->top - 1) *
-            qxl->guest_primary.abs_stride;
+        src += (t->height - rect->top - 1) * t->stride;
     } else {
-        src += rect->top * qxl->guest_primary.abs_stride;
+        src += rect->top * t->stride;
     }
-    dst += rect->top  * qxl->guest_primary.abs_stride;
-    src += rect->left * qxl->guest_primary.bytes_pp;
-    dst += rect->left * qxl->guest_primary.bytes_pp;
-    len  = (rect->right - rect->left) * qxl->guest_primary.bytes_pp;
+    dst += rect->top  * t->stride;
+    src += rect->left * t->bytes_pp;
+    dst += rect->left * t->bytes_pp;
+    len  = (rect->right - rect->left) * t->bytes_pp;
 
     for (i = rect->top; i < rect->bottom; i++) {
         memcpy(dst, src, len);
-        dst += qxl->guest_primary.abs_stride;
-        src += qxl->guest_primary.qxl_stride;
+        dst += t->stride;
+        src += t->src_stride;
+    }
+}
+
+/* Move a finished rectangle from dst to the displayed front buffer. */
+static void qxl_render_publish(const QXLRenderTarget *t, const QXLRect *rect)
+{
+    size_t offset = (size_t)rect->top * t->stride + rect->left * t->bytes_pp;
+    int len = (rect->right - rect->left) * t->bytes_pp;
+    int i;
+
+    for (i = rect->top; i < rect->bottom; i++) {
+        memcpy(t->front + offset, t->dst + offset, len);
+        offset += t->stride;
+    }
+}
+
+/* Free copies that are no longer rendered to, once no blit uses them. */
+static void qxl_render_free_retired(PCIQXLDevice *qxl)
+{
+    if (qxl->render_blits == 0) {
+        g_slist_free_full(qxl->render_retired, g_free);
+        qxl->render_retired = NULL;
+    }
+}
+
+/*
+ * Point the spice server thread at a new guest primary.  Flipped
+ * primaries get fresh local copies: the previous dst may still be
+ * written by a blit running in the server thread, so it is only retired
+ * here and freed later.  The previous front buffer is the caller's to
+ * free once the display surface no longer uses it.
+ */
+static void qxl_render_retarget(PCIQXLDevice *qxl)
+{
+    QXLRenderTarget *t = &qxl->render_target;
+
+    if (t->dst) {
+        qxl->render_retired = g_slist_prepend(qxl->render_retired, t->dst);
+    }
+    t->generation++;
+    t->src = qxl->guest_primary.data;
+    t->src_stride = qxl->guest_primary.qxl_stride;
+    t->stride = qxl->guest_primary.abs_stride;
+    t->width = qxl->guest_primary.surface.width;
+    t->height = qxl->guest_primary.surface.height;
+    t->bytes_pp = qxl->guest_primary.bytes_pp;
+    t->dst = NULL;
+    t->front = NULL;
+    if (t->src_stride < 0) {
+        t->dst = g_malloc((size_t)t->stride * t->height);
+        t->front = g_malloc((size_t)t->stride * t->height);
     }
 }
 
@@ -96,7 +152,9 @@ static void qxl_set_rect_to_surface(PCIQXLDevice *qxl, QXLRect *area)
 static void qxl_render_update_area_unlocked(PCIQXLDevice *qxl)
 {
     VGACommonState *vga = &qxl->vga;
+    QXLRenderTarget *t = &qxl->render_target;
     DisplaySurface *surface;
+    uint8_t *old_front;
     int i;
 
     if (qxl->guest_primary.resized) {
@@ -115,39 +173,49 @@ static void qxl_render_update_area_unlocked(PCIQXLDevice *qxl)
                qxl->guest_primary.qxl_stride,
                qxl->guest_primary.bytes_pp,
                qxl->guest_primary.bits_pp);
-        if (qxl->guest_primary.qxl_stride > 0) {
-            pixman_format_code_t format =
-                qemu_default_pixman_format(qxl->guest_primary.bits_pp, true);
-            surface = qemu_create_displaysurface_from
-                (qxl->guest_primary.surface.width,
-                 qxl->guest_primary.surface.height,
-                 format,
-                 qxl->guest_primary.abs_stride,
-                 qxl->guest_primary.data);
-        } else {
-            surface = qemu_create_displaysurface
-                (qxl->guest_primary.surface.width,
-                 qxl->guest_primary.surface.height);
+        old_front = t->front;
+        qxl_render_retarget(qxl);
+        if (t->dst) {
+            qxl_blit(t, &qxl->dirty[0]);
+            qxl_render_publish(t, &qxl->dirty[0]);
         }
+        surface = qemu_create_displaysurface_from
+            (qxl->guest_primary.surface.width,
+             qxl->guest_primary.surface.height,
+             qemu_default_pixman_format(qxl->guest_primary.bits_pp, true),
+             qxl->guest_primary.abs_stride,
+             t->front ?: qxl->guest_primary.data);
         dpy_gfx_replace_surface(vga->con, surface);
+        g_free(old_front);
+        qxl_render_free_retired(qxl);
+        /* the new front buffer holds the whole primary already */
+        dpy_gfx_update(vga->con, 0, 0, t->width, t->height);
+        qxl->num_dirty_rects = 0;
+        return;
     }
 
     if (!qxl->guest_primary.data) {
         return;
     }
+    if (t->dst && qxl->render_blits) {
+        /* dst is being written; the blit schedules us again when done */
+        return;
+    }
+    /*
+     * The server thread has copied the pixels to dst already; move them
+     * to the front buffer and tell the listeners.  Both happen in the
+     * main loop, so readers of the surface never see a partial frame.
+     */
     for (i = 0; i < qxl->num_dirty_rects; i++) {
         if (qemu_spice_rect_is_empty(qxl->dirty+i)) {
             break;
         }
-        if (qxl->dirty[i].left < 0 ||
-            qxl->dirty[i].top < 0 ||
-            qxl->dirty[i].left > qxl->dirty[i].right ||
-            qxl->dirty[i].top > qxl->dirty[i].bottom ||
-            qxl->dirty[i].right > qxl->guest_primary.surface.width ||
-            qxl->dirty[i].bottom > qxl->guest_primary.surface.height) {
+        if (!qxl_rect_valid(qxl->dirty + i, t->width, t->height)) {
             continue;
         }
-        qxl_blit(qxl, qxl->dirty+i);
+        if (t->dst) {
+            qxl_render_publish(t, qxl->dirty + i);
+        }
         dpy_gfx_update(vga->con,
                        qxl->dirty[i].left, qxl->dirty[i].top,
                        qxl->dirty[i].right - qxl->dirty[i].left,
@@ -161,6 +229,11 @@ static void qxl_render_update_area_unlocked(PCIQXLDevice *qxl)
  * qxl_render_update is called by io thread or vcpu thread, and the completion
  * callbacks are called by spice_server thread, defering to bh called from the
  * io thread.
+ *
+ * Up to QXL_RENDER_MAX_PENDING updates are in flight, so that the server
+ * thread renders the next frame while the bottom half forwards the last
+ * one.  Beyond that, the request is left for the next refresh rather
+ * than queued behind a slow server thread.
  */
 void qxl_render_update(PCIQXLDevice *qxl)
 {
@@ -173,6 +246,10 @@ void qxl_render_update(PCIQXLDevice *qxl)
         qemu_mutex_unlock(&qxl->ssd.lock);
         return;
     }
+    if (qxl->render_update_cookie_num >= QXL_RENDER_MAX_PENDING) {
+        qemu_mutex_unlock(&qxl->ssd.lock);
+        return;
+    }
 
     qxl->guest_primary.commands = 0;
     qxl->render_update_cookie_num++;
@@ -193,6 +270,80 @@ void qxl_render_update_area_bh(void *opaque)
     qemu_mutex_unlock(&qxl->ssd.lock);
 }
 
+static void qxl_render_add_dirty(PCIQXLDevice *qxl, const QXLRect *rect)
+{
+    int i;
+
+    if (qxl->num_dirty_rects == QXL_NUM_DIRTY_RECTS) {
+        /*
+         * overflow - the pixels are copied already, so it is enough to
+         * report the bounding box.  Not expected to be common.
+         */
+        trace_qxl_interface_update_area_complete_overflow(qxl->id,
+                                                          QXL_NUM_DIRTY_RECTS);
+        for (i = 1; i < qxl->num_dirty_rects; i++) {
+            qemu_spice_rect_union(&qxl->dirty[0], &qxl->dirty[i]);
+        }
+        qxl->num_dirty_rects = 1;
+    }
+    qxl->dirty[qxl->num_dirty_rects++] = *rect;
+}
+
+/*
+ * called from spice server thread context only
+ *
+ * The rendered rectangles are copied from guest memory to dst here,
+ * without holding ssd.lock, so the bottom half only has a local copy
+ * to the front buffer left to do.
+ */
+void qxl_render_update_area_complete(PCIQXLDevice *qxl, QXLRect *dirty,
+                                     uint32_t num_updated_rects)
+{
+    QXLRenderTarget target;
+    int i;
+
+    qemu_mutex_lock(&qxl->ssd.lock);
+    if (!qxl->render_update_cookie_num || qxl->guest_primary.resized) {
+        /*
+         * Don't bother copying or scheduling the bh since we will flip
+         * the whole area anyway on completion of the update_area async call
+         */
+        qemu_mutex_unlock(&qxl->ssd.lock);
+        return;
+    }
+    target = qxl->render_target;
+    qxl->render_blits++;
+    qemu_mutex_unlock(&qxl->ssd.lock);
+
+    for (i = 0; i < num_updated_rects; i++) {
+        if (qemu_spice_rect_is_empty(dirty + i)) {
+            num_updated_rects = i;
+            break;
+        }
+        if (target.dst && qxl_rect_valid(dirty + i, target.width,
+                                         target.height)) {
+            qxl_blit(&target, dirty + i);
+        }
+    }
+
+    qemu_mutex_lock(&qxl->ssd.lock);
+    qxl->render_blits--;
+    qxl_render_free_retired(qxl);
+    if (target.generation != qxl->render_target.generation ||
+        qxl->guest_primary.resized) {
+        /* the primary changed meanwhile and will be redrawn in full */
+        qemu_mutex_unlock(&qxl->ssd.lock);
+        return;
+    }
+    for (i = 0; i < num_updated_rects; i++) {
+        qxl_render_add_dirty(qxl, dirty + i);
+    }
+    trace_qxl_interface_update_area_complete_schedule_bh(qxl->id,
+                                                         qxl->num_dirty_rects);
+    qemu_bh_schedule(qxl->update_area_bh);
+    qemu_mutex_unlock(&qxl->ssd.lock);
+}
+
 void qxl_render_update_area_done(PCIQXLDevice *qxl, QXLCookie *cookie)
 {
     qemu_mutex_lock(&qxl->ssd.lock);
@@ -203,6 +354,38 @@ void qxl_render_update_area_done(PCIQXLDevice *qxl, QXLCookie *cookie)
     g_free(cookie);
 }
 
+/*
+ * Drop the local copies on reset.  The display surface may still show
+ * the front buffer, so it is replaced by a blank one first.  The front
+ * buffer is only used by the main loop, but the switch to the new
+ * surface takes ssd.lock in VGA mode, so do it before locking.
+ */
+void qxl_render_reset(PCIQXLDevice *qxl)
+{
+    QXLRenderTarget *t = &qxl->render_target;
+    DisplaySurface *surface = qemu_console_surface(qxl->vga.con);
+    uint8_t *front = t->front;
+
+    if (front && surface && surface_data(surface) == front) {
+        surface = qemu_create_displaysurface(surface_width(surface),
+                                             surface_height(surface));
+        dpy_gfx_replace_surface(qxl->vga.con, surface);
+        graphic_hw_invalidate(qxl->vga.con);
+    }
+
+    qemu_mutex_lock(&qxl->ssd.lock);
+    t->front = NULL;
+    if (t->dst) {
+        qxl->render_retired = g_slist_prepend(qxl->render_retired, t->dst);
+        t->dst = NULL;
+    }
+    t->generation++;
+    qxl->num_dirty_rects = 0;
+    qxl_render_free_retired(qxl);
+    qemu_mutex_unlock(&qxl->ssd.lock);
+    g_free(front);
+}
+
 static QEMUCursor *qxl_cursor(PCIQXLDevice *qxl, QXLCursor *cursor)
 {
     QEMUCursor *c;
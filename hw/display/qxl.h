@@ -26,6 +26,27 @@ enum qxl_mode {
 #define QXL_UNDEFINED_IO UINT32_MAX
 
 #define QXL_NUM_DIRTY_RECTS 64
+#define QXL_RENDER_MAX_PENDING 2
+
+/*
+ * Where the spice server thread copies a rendered guest primary to.
+ * Published by the bottom half under ssd.lock; dst and front are NULL
+ * when the display surface maps the guest primary directly.  Otherwise
+ * the server thread copies to dst, and the bottom half moves finished
+ * rectangles to front, which backs the display surface and is only
+ * touched by the main loop.
+ */
+typedef struct QXLRenderTarget {
+    uint32_t           generation;
+    uint8_t            *dst;
+    uint8_t            *front;
+    uint8_t            *src;
+    int32_t            src_stride;
+    uint32_t           stride;
+    uint32_t           width;
+    uint32_t           height;
+    uint32_t           bytes_pp;
+} QXLRenderTarget;
 
 #define QXL_PAGE_BITS 12
 #define QXL_PAGE_SIZE (1 << QXL_PAGE_BITS);
@@ -120,6 +141,9 @@ typedef struct PCIQXLDevice {
     int                num_dirty_rects;
     QXLRect            dirty[QXL_NUM_DIRTY_RECTS];
     QEMUBH            *update_area_bh;
+    QXLRenderTarget    render_target;
+    GSList             *render_retired;
+    int                render_blits;
 } PCIQXLDevice;
 
 #define PANIC_ON(x) if ((x)) {                         \
@@ -163,6 +187,9 @@ void qxl_render_resize(PCIQXLDevice *qxl);
 void qxl_render_update(PCIQXLDevice *qxl);
 int qxl_render_cursor(PCIQXLDevice *qxl, QXLCommandExt *ext);
 void qxl_render_update_area_done(PCIQXLDevice *qxl, QXLCookie *cookie);
+void qxl_render_update_area_complete(PCIQXLDevice *qxl, QXLRect *dirty,
+                                     uint32_t num_updated_rects);
 void qxl_render_update_area_bh(void *opaque);
+void qxl_render_reset(PCIQXLDevice *qxl);
 
 #endif
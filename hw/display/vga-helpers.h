@@ -278,6 +278,71 @@ static void vga_draw_line8(VGACommonState *s1, uint8_t *d,
     }
 }
 
+#ifdef __SSE2__
+/*
+ * 8 pixels of 15 or 16 bit color at a time, widened like the scalar
+ * loops below.  @bswap is set if the framebuffer is not host endian.
+ * Returns the number of pixels converted.
+ */
+static int vga_draw_line16_vec(uint8_t *d, const uint8_t *s, int width,
+                               bool rgb555, bool bswap)
+{
+    const __m128i mask_g = _mm_set1_epi16(rgb555 ? 0xf800 : 0xfc00);
+    const __m128i mask_rb = _mm_set1_epi16(0x00f8);
+    int w;
+
+    for (w = 0; w + 8 <= width; w += 8) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(s + w * 2));
+        __m128i gb, r;
+
+        if (bswap) {
+            v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+        }
+        /* green in the high byte and blue in the low byte of each word */
+        if (rgb555) {
+            gb = _mm_and_si128(_mm_slli_epi16(v, 6), mask_g);
+            r = _mm_and_si128(_mm_srli_epi16(v, 7), mask_rb);
+        } else {
+            gb = _mm_and_si128(_mm_slli_epi16(v, 5), mask_g);
+            r = _mm_and_si128(_mm_srli_epi16(v, 8), mask_rb);
+        }
+        gb = _mm_or_si128(gb, _mm_and_si128(_mm_slli_epi16(v, 3), mask_rb));
+        _mm_storeu_si128((__m128i *)(d + w * 4), _mm_unpacklo_epi16(gb, r));
+        _mm_storeu_si128((__m128i *)(d + w * 4 + 16),
+                         _mm_unpackhi_epi16(gb, r));
+    }
+    return w;
+}
+
+/* 4 pixels of byteswapped 32 bit color at a time. */
+static int vga_draw_line32_bswap_vec(uint8_t *d, const uint8_t *s, int width)
+{
+    const __m128i mask = _mm_set1_epi32(0x00ffffff);
+    int w;
+
+    for (w = 0; w + 4 <= width; w += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(s + w * 4));
+
+        v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+        v = _mm_shufflehi_epi16(_mm_shufflelo_epi16(v, 0xb1), 0xb1);
+        _mm_storeu_si128((__m128i *)(d + w * 4), _mm_and_si128(v, mask));
+    }
+    return w;
+}
+#else
+static inline int vga_draw_line16_vec(uint8_t *d, const uint8_t *s, int width,
+                                      bool rgb555, bool bswap)
+{
+    return 0;
+}
+
+static inline int vga_draw_line32_bswap_vec(uint8_t *d, const uint8_t *s,
+                                            int width)
+{
+    return 0;
+}
+#endif
+
 /*
  * 15 bit color
  */
@@ -287,8 +352,10 @@ static void vga_draw_line15_le(VGACommonState *s1, uint8_t *d,
     int w;
     uint32_t v, r, g, b;
 
-    w = width;
-    do {
+    w = vga_draw_line16_vec(d, s, width, true, false);
+    s += w * 2;
+    d += w * 4;
+    for (; w < width; w++) {
         v = lduw_le_p((void *)s);
         r = (v >> 7) & 0xf8;
         g = (v >> 2) & 0xf8;
@@ -296,7 +363,7 @@ static void vga_draw_line15_le(VGACommonState *s1, uint8_t *d,
         ((uint32_t *)d)[0] = rgb_to_pixel32(r, g, b);
         s += 2;
         d += 4;
-    } while (--w != 0);
+    }
 }
 
 static void vga_draw_line15_be(VGACommonState *s1, uint8_t *d,
@@ -305,8 +372,10 @@ static void vga_draw_line15_be(VGACommonState *s1, uint8_t *d,
     int w;
     uint32_t v, r, g, b;
 
-    w = width;
-    do {
+    w = vga_draw_line16_vec(d, s, width, true, true);
+    s += w * 2;
+    d += w * 4;
+    for (; w < width; w++) {
         v = lduw_be_p((void *)s);
         r = (v >> 7) & 0xf8;
         g = (v >> 2) & 0xf8;
@@ -314,7 +383,7 @@ static void vga_draw_line15_be(VGACommonState *s1, uint8_t *d,
         ((uint32_t *)d)[0] = rgb_to_pixel32(r, g, b);
         s += 2;
         d += 4;
-    } while (--w != 0);
+    }
 }
 
 /*
@@ -326,8 +395,10 @@ static void vga_draw_line16_le(VGACommonState *s1, uint8_t *d,
     int w;
     uint32_t v, r, g, b;
 
-    w = width;
-    do {
+    w = vga_draw_line16_vec(d, s, width, false, false);
+    s += w * 2;
+    d += w * 4;
+    for (; w < width; w++) {
         v = lduw_le_p((void *)s);
         r = (v >> 8) & 0xf8;
         g = (v >> 3) & 0xfc;
@@ -335,7 +406,7 @@ static void vga_draw_line16_le(VGACommonState *s1, uint8_t *d,
         ((uint32_t *)d)[0] = rgb_to_pixel32(r, g, b);
         s += 2;
         d += 4;
-    } while (--w != 0);
+    }
 }
 
 static void vga_draw_line16_be(VGACommonState *s1, uint8_t *d,
@@ -344,8 +415,10 @@ static void vga_draw_line16_be(VGACommonState *s1, uint8_t *d,
     int w;
     uint32_t v, r, g, b;
 
-    w = width;
-    do {
+    w = vga_draw_line16_vec(d, s, width, false, true);
+    s += w * 2;
+    d += w * 4;
+    for (; w < width; w++) {
         v = lduw_be_p((void *)s);
         r = (v >> 8) & 0xf8;
         g = (v >> 3) & 0xfc;
@@ -353,11 +426,14 @@ static void vga_draw_line16_be(VGACommonState *s1, uint8_t *d,
         ((uint32_t *)d)[0] = rgb_to_pixel32(r, g, b);
         s += 2;
         d += 4;
-    } while (--w != 0);
+    }
 }
 
 /*
  * 24 bit color
+ *
+ * One 32 bit load per pixel, which reads a byte past the pixel; the last
+ * pixel of the line is read bytewise so as not to run past its end.
  */
 static void vga_draw_line24_le(VGACommonState *s1, uint8_t *d,
                                const uint8_t *s, int width)
@@ -365,15 +441,15 @@ static void vga_draw_line24_le(VGACommonState *s1, uint8_t *d,
     int w;
     uint32_t r, g, b;
 
-    w = width;
-    do {
-        b = s[0];
-        g = s[1];
-        r = s[2];
-        ((uint32_t *)d)[0] = rgb_to_pixel32(r, g, b);
+    for (w = width; w > 1; w--) {
+        ((uint32_t *)d)[0] = ldl_le_p((void *)s) & 0xffffff;
         s += 3;
         d += 4;
-    } while (--w != 0);
+    }
+    b = s[0];
+    g = s[1];
+    r = s[2];
+    ((uint32_t *)d)[0] = rgb_to_pixel32(r, g, b);
 }
 
 static void vga_draw_line24_be(VGACommonState *s1, uint8_t *d,
@@ -382,15 +458,15 @@ static void vga_draw_line24_be(VGACommonState *s1, uint8_t *d,
     int w;
     uint32_t r, g, b;
 
-    w = width;
-    do {
-        r = s[0];
-        g = s[1];
-        b = s[2];
-        ((uint32_t *)d)[0] = rgb_to_pixel32(r, g, b);
+    for (w = width; w > 1; w--) {
+        ((uint32_t *)d)[0] = ldl_be_p((void *)s) >> 8;
         s += 3;
         d += 4;
-    } while (--w != 0);
+    }
+    r = s[0];
+    g = s[1];
+    b = s[2];
+    ((uint32_t *)d)[0] = rgb_to_pixel32(r, g, b);
 }
 
 /*
@@ -426,14 +502,16 @@ static void vga_draw_line32_be(VGACommonState *s1, uint8_t *d,
     int w;
     uint32_t r, g, b;
 
-    w = width;
-    do {
+    w = vga_draw_line32_bswap_vec(d, s, width);
+    s += w * 4;
+    d += w * 4;
+    for (; w < width; w++) {
         r = s[1];
         g = s[2];
         b = s[3];
         ((uint32_t *)d)[0] = rgb_to_pixel32(r, g, b);
         s += 4;
         d += 4;
-    } while (--w != 0);
+    }
 #endif
 }
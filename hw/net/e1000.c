@@ -130,13 +130,21 @@ typedef struct E1000State_st {
     QEMUTimer *mit_timer;      /* Mitigation timer. */
     bool mit_timer_on;         /* Mitigation timer is running. */
     bool mit_irq_level;        /* Tracks interrupt pin level. */
-    uint32_t mit_ide;          /* Tracks E1000_TXD_CMD_IDE bit. */
+
+    /* Interrupt delay timers: TIDV/TADV for TX, RDTR/RADV for RX. */
+    struct e1000_intr_delay {
+        QEMUTimer *timer;
+        int64_t abs_deadline;  /* Absolute timer expiry, 0 if not running. */
+        uint32_t cause;        /* Causes held back until expiry. */
+    } tx_delay, rx_delay;
 
 /* Compatibility flags for migration to/from qemu 1.3.0 and older */
 #define E1000_FLAG_AUTONEG_BIT 0
 #define E1000_FLAG_MIT_BIT 1
+#define E1000_FLAG_TIDV_BIT 2
 #define E1000_FLAG_AUTONEG (1 << E1000_FLAG_AUTONEG_BIT)
 #define E1000_FLAG_MIT (1 << E1000_FLAG_MIT_BIT)
+#define E1000_FLAG_TIDV (1 << E1000_FLAG_TIDV_BIT)
     uint32_t compat_flags;
 } E1000State;
 
@@ -168,7 +176,7 @@ enum {
     defreg(TPR),	defreg(TPT),	defreg(TXDCTL),	defreg(WUFC),
     defreg(RA),		defreg(MTA),	defreg(CRCERRS),defreg(VFTA),
     defreg(VET),        defreg(RDTR),   defreg(RADV),   defreg(TADV),
-    defreg(ITR),
+    defreg(ITR),        defreg(TIDV),
 };
 
 static void
@@ -274,21 +282,11 @@ static const uint32_t mac_reg_init[] = {
                 E1000_MANC_RMCP_EN,
 };
 
-/* Helper function, *curr == 0 means the value is not set */
-static inline void
-mit_update_delay(uint32_t *curr, uint32_t value)
-{
-    if (value && (*curr == 0 || value < *curr)) {
-        *curr = value;
-    }
-}
-
 static void
 set_interrupt_cause(E1000State *s, int index, uint32_t val)
 {
     PCIDevice *d = PCI_DEVICE(s);
     uint32_t pending_ints;
-    uint32_t mit_delay;
 
     s->mac_reg[ICR] = val;
 
@@ -307,37 +305,18 @@ set_interrupt_cause(E1000State *s, int index, uint32_t val)
         /*
          * Here we detect a potential raising edge. We postpone raising the
          * interrupt line if we are inside the mitigation delay window
-         * (s->mit_timer_on == 1).
-         * We provide a partial implementation of interrupt mitigation,
-         * emulating only RADV, TADV and ITR (lower 16 bits, 1024ns units for
-         * RADV and TADV, 256ns units for ITR). RDTR is only used to enable
-         * RADV; relative timers based on TIDV and RDTR are not implemented.
+         * (s->mit_timer_on == 1), which enforces the minimum interval
+         * between interrupts programmed in ITR (lower 16 bits, 256ns units).
+         * The per-cause delays (TIDV/TADV, RDTR/RADV) are applied before
+         * the cause reaches ICR, see e1000_delay_cause().
          */
         if (s->mit_timer_on) {
             return;
         }
-        if (s->compat_flags & E1000_FLAG_MIT) {
-            /* Compute the next mitigation delay according to pending
-             * interrupts and the current values of RADV (provided
-             * RDTR!=0), TADV and ITR.
-             * Then rearm the timer.
-             */
-            mit_delay = 0;
-            if (s->mit_ide &&
-                    (pending_ints & (E1000_ICR_TXQE | E1000_ICR_TXDW))) {
-                mit_update_delay(&mit_delay, s->mac_reg[TADV] * 4);
-            }
-            if (s->mac_reg[RDTR] && (pending_ints & E1000_ICS_RXT0)) {
-                mit_update_delay(&mit_delay, s->mac_reg[RADV] * 4);
-            }
-            mit_update_delay(&mit_delay, s->mac_reg[ITR]);
-
-            if (mit_delay) {
-                s->mit_timer_on = 1;
-                timer_mod(s->mit_timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) +
-                          mit_delay * 256);
-            }
-            s->mit_ide = 0;
+        if ((s->compat_flags & E1000_FLAG_MIT) && s->mac_reg[ITR]) {
+            s->mit_timer_on = 1;
+            timer_mod(s->mit_timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) +
+                      s->mac_reg[ITR] * 256);
         }
     }
 
@@ -363,6 +342,59 @@ set_ics(E1000State *s, int index, uint32_t val)
     set_interrupt_cause(s, 0, val | s->mac_reg[ICR]);
 }
 
+/*
+ * Hold back @cause until either the packet timer, restarted by every
+ * event, or the absolute timer, started by the first event, expires.
+ * Both delays are in 1.024us units; an absolute delay of 0 disables the
+ * absolute timer.
+ */
+static void
+e1000_delay_cause(struct e1000_intr_delay *dl, uint32_t cause,
+                  uint32_t delay, uint32_t abs_delay)
+{
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    int64_t deadline = now + delay * 1024;
+
+    if (!dl->cause) {
+        dl->abs_deadline = abs_delay ? now + abs_delay * 1024 : 0;
+    }
+    dl->cause |= cause;
+    if (dl->abs_deadline && dl->abs_deadline < deadline) {
+        deadline = dl->abs_deadline;
+    }
+    timer_mod(dl->timer, deadline);
+}
+
+/* Post the causes held back by an interrupt delay timer right away. */
+static void
+e1000_delay_flush(E1000State *s, struct e1000_intr_delay *dl)
+{
+    uint32_t cause = dl->cause;
+
+    timer_del(dl->timer);
+    dl->abs_deadline = 0;
+    dl->cause = 0;
+    if (cause) {
+        set_ics(s, 0, cause);
+    }
+}
+
+static void
+e1000_tx_delay_timer(void *opaque)
+{
+    E1000State *s = opaque;
+
+    e1000_delay_flush(s, &s->tx_delay);
+}
+
+static void
+e1000_rx_delay_timer(void *opaque)
+{
+    E1000State *s = opaque;
+
+    e1000_delay_flush(s, &s->rx_delay);
+}
+
 static void
 e1000_autoneg_timer(void *opaque)
 {
@@ -410,7 +442,12 @@ static void e1000_reset(void *opaque)
     timer_del(d->mit_timer);
     d->mit_timer_on = 0;
     d->mit_irq_level = 0;
-    d->mit_ide = 0;
+    timer_del(d->tx_delay.timer);
+    d->tx_delay.abs_deadline = 0;
+    d->tx_delay.cause = 0;
+    timer_del(d->rx_delay.timer);
+    d->rx_delay.abs_deadline = 0;
+    d->rx_delay.cause = 0;
     memset(d->phy_reg, 0, sizeof d->phy_reg);
     memmove(d->phy_reg, phy_reg_init, sizeof phy_reg_init);
     d->phy_reg[PHY_ID2] = edc->phy_id2;
@@ -675,7 +712,6 @@ process_tx_desc(E1000State *s, struct e1000_tx_desc *dp)
     struct e1000_context_desc *xp = (struct e1000_context_desc *)dp;
     struct e1000_tx *tp = &s->tx;
 
-    s->mit_ide |= (txd_lower & E1000_TXD_CMD_IDE);
     if (dtype == E1000_TXD_CMD_DEXT) {	// context descriptor
         op = le32_to_cpu(xp->cmd_and_length);
         tp->ipcss = xp->lower_setup.ip_fields.ipcss;
@@ -783,13 +819,37 @@ static uint64_t tx_desc_base(E1000State *s)
     return (bah << 32) + bal;
 }
 
+/* Number of TX descriptors fetched with a single DMA read. */
+#define E1000_TX_DESC_BATCH 32
+
+/*
+ * Number of descriptors that can be fetched in one go starting at TDH:
+ * up to TDT or the end of the ring, whichever comes first.
+ */
+static unsigned int
+tx_desc_batch(E1000State *s)
+{
+    uint32_t ring = s->mac_reg[TDLEN] / sizeof(struct e1000_tx_desc);
+    uint32_t tdh = s->mac_reg[TDH], tdt = s->mac_reg[TDT];
+    uint32_t n;
+
+    if (tdh >= ring) {
+        /* Bogus TDH/TDLEN, let start_xmit deal with it. */
+        return 1;
+    }
+    n = (tdt > tdh && tdt <= ring) ? tdt - tdh : ring - tdh;
+    return MIN(n, E1000_TX_DESC_BATCH);
+}
+
 static void
 start_xmit(E1000State *s)
 {
     PCIDevice *d = PCI_DEVICE(s);
     dma_addr_t base;
-    struct e1000_tx_desc desc;
-    uint32_t tdh_start = s->mac_reg[TDH], cause = E1000_ICS_TXQE;
+    struct e1000_tx_desc desc[E1000_TX_DESC_BATCH];
+    uint32_t tdh_start = s->mac_reg[TDH], cause = 0;
+    unsigned int i, n;
+    bool ide = false;
 
     if (!(s->mac_reg[TCTL] & E1000_TCTL_EN)) {
         DBGOUT(TX, "tx disabled\n");
@@ -797,31 +857,49 @@ start_xmit(E1000State *s)
     }
 
     while (s->mac_reg[TDH] != s->mac_reg[TDT]) {
+        /* Fetch all descriptors up to TDT (or the end of the ring) at
+         * once, like the hardware prefetcher does, and process the whole
+         * batch before raising a single interrupt.
+         */
         base = tx_desc_base(s) +
                sizeof(struct e1000_tx_desc) * s->mac_reg[TDH];
-        pci_dma_read(d, base, &desc, sizeof(desc));
+        n = tx_desc_batch(s);
+        pci_dma_read(d, base, desc, n * sizeof(desc[0]));
 
-        DBGOUT(TX, "index %d: %p : %x %x\n", s->mac_reg[TDH],
-               (void *)(intptr_t)desc.buffer_addr, desc.lower.data,
-               desc.upper.data);
+        for (i = 0; i < n; i++, base += sizeof(desc[0])) {
+            DBGOUT(TX, "index %d: %p : %x %x\n", s->mac_reg[TDH],
+                   (void *)(intptr_t)desc[i].buffer_addr, desc[i].lower.data,
+                   desc[i].upper.data);
 
-        process_tx_desc(s, &desc);
-        cause |= txdesc_writeback(s, base, &desc);
+            process_tx_desc(s, &desc[i]);
+            cause |= txdesc_writeback(s, base, &desc[i]);
+            ide |= !!(le32_to_cpu(desc[i].lower.data) & E1000_TXD_CMD_IDE);
 
-        if (++s->mac_reg[TDH] * sizeof(desc) >= s->mac_reg[TDLEN])
-            s->mac_reg[TDH] = 0;
-        /*
-         * the following could happen only if guest sw assigns
-         * bogus values to TDT/TDLEN.
-         * there's nothing too intelligent we could do about this.
-         */
-        if (s->mac_reg[TDH] == tdh_start) {
-            DBGOUT(TXERR, "TDH wraparound @%x, TDT %x, TDLEN %x\n",
-                   tdh_start, s->mac_reg[TDT], s->mac_reg[TDLEN]);
-            break;
+            if (++s->mac_reg[TDH] * sizeof(desc[0]) >= s->mac_reg[TDLEN]) {
+                s->mac_reg[TDH] = 0;
+            }
+            /*
+             * the following could happen only if guest sw assigns
+             * bogus values to TDT/TDLEN.
+             * there's nothing too intelligent we could do about this.
+             */
+            if (s->mac_reg[TDH] == tdh_start) {
+                DBGOUT(TXERR, "TDH wraparound @%x, TDT %x, TDLEN %x\n",
+                       tdh_start, s->mac_reg[TDT], s->mac_reg[TDLEN]);
+                goto done;
+            }
         }
     }
-    set_ics(s, 0, cause);
+
+done:
+    /* TXDW for descriptors with IDE set is subject to TIDV and TADV. */
+    if ((cause & E1000_ICR_TXDW) && ide && s->mac_reg[TIDV] &&
+        (s->compat_flags & E1000_FLAG_MIT)) {
+        e1000_delay_cause(&s->tx_delay, E1000_ICR_TXDW,
+                          s->mac_reg[TIDV], s->mac_reg[TADV]);
+        cause &= ~E1000_ICR_TXDW;
+    }
+    set_ics(s, 0, cause | E1000_ICS_TXQE);
 }
 
 static int
@@ -1087,7 +1165,19 @@ e1000_receive_iov(NetClientState *nc, const struct iovec *iov, int iovcnt)
         s->rxbuf_min_shift)
         n |= E1000_ICS_RXDMT0;
 
-    set_ics(s, 0, n);
+    /* RXT0 is subject to RDTR and RADV; running low on descriptors is
+     * always signalled immediately.
+     */
+    if ((s->mac_reg[RDTR] & E1000_RDT_DELAY) &&
+        (s->compat_flags & E1000_FLAG_MIT)) {
+        e1000_delay_cause(&s->rx_delay, E1000_ICS_RXT0,
+                          s->mac_reg[RDTR] & E1000_RDT_DELAY,
+                          s->mac_reg[RADV]);
+        n &= ~E1000_ICS_RXT0;
+    }
+    if (n) {
+        set_ics(s, 0, n);
+    }
 
     return size;
 }
@@ -1167,6 +1257,16 @@ set_16bit(E1000State *s, int index, uint32_t val)
     s->mac_reg[index] = val & 0xffff;
 }
 
+static void
+set_rdtr(E1000State *s, int index, uint32_t val)
+{
+    s->mac_reg[index] = val & E1000_RDT_DELAY;
+    if (val & E1000_RDT_FPDB) {
+        /* Flush partial descriptor block: deliver RXT0 now. */
+        e1000_delay_flush(s, &s->rx_delay);
+    }
+}
+
 static void
 set_dlen(E1000State *s, int index, uint32_t val)
 {
@@ -1211,7 +1311,7 @@ static uint32_t (*macreg_readops[])(E1000State *, int) = {
     getreg(RDH),	getreg(RDT),	getreg(VET),	getreg(ICS),
     getreg(TDBAL),	getreg(TDBAH),	getreg(RDBAH),	getreg(RDBAL),
     getreg(TDLEN),      getreg(RDLEN),  getreg(RDTR),   getreg(RADV),
-    getreg(TADV),       getreg(ITR),
+    getreg(TADV),       getreg(ITR),    getreg(TIDV),
 
     [TOTH] = mac_read_clr8,	[TORH] = mac_read_clr8,	[GPRC] = mac_read_clr4,
     [GPTC] = mac_read_clr4,	[TPR] = mac_read_clr4,	[TPT] = mac_read_clr4,
@@ -1233,8 +1333,8 @@ static void (*macreg_writeops[])(E1000State *, int, uint32_t) = {
     [TDH] = set_16bit,	[RDH] = set_16bit,	[RDT] = set_rdt,
     [IMC] = set_imc,	[IMS] = set_ims,	[ICR] = set_icr,
     [EECD] = set_eecd,	[RCTL] = set_rx_control, [CTRL] = set_ctrl,
-    [RDTR] = set_16bit, [RADV] = set_16bit,     [TADV] = set_16bit,
-    [ITR] = set_16bit,
+    [RDTR] = set_rdtr,  [RADV] = set_16bit,     [TADV] = set_16bit,
+    [ITR] = set_16bit,  [TIDV] = set_16bit,
     [RA ... RA+31] = &mac_writereg,
     [MTA ... MTA+127] = &mac_writereg,
     [VFTA ... VFTA+127] = &mac_writereg,
@@ -1316,7 +1416,11 @@ static void e1000_pre_save(void *opaque)
     E1000State *s = opaque;
     NetClientState *nc = qemu_get_queue(s->nic);
 
-    /* If the mitigation timer is active, emulate a timeout now. */
+    /* Deliver delayed interrupt causes and, if the mitigation timer is
+     * active, emulate a timeout now.
+     */
+    e1000_delay_flush(s, &s->tx_delay);
+    e1000_delay_flush(s, &s->rx_delay);
     if (s->mit_timer_on) {
         e1000_mit_timer(s);
     }
@@ -1338,10 +1442,9 @@ static int e1000_post_load(void *opaque, int version_id)
 
     if (!(s->compat_flags & E1000_FLAG_MIT)) {
         s->mac_reg[ITR] = s->mac_reg[RDTR] = s->mac_reg[RADV] =
-            s->mac_reg[TADV] = 0;
+            s->mac_reg[TADV] = s->mac_reg[TIDV] = 0;
         s->mit_irq_level = false;
     }
-    s->mit_ide = 0;
     s->mit_timer_on = false;
 
     /* nc.link_down can't be migrated, so infer link_down according
@@ -1380,6 +1483,27 @@ static const VMStateDescription vmstate_e1000_mit_state = {
     }
 };
 
+static bool e1000_tidv_needed(void *opaque)
+{
+    E1000State *s = opaque;
+
+    /* Older QEMU does not know the subsection, and Linux guests always
+     * program TIDV, so only send it when the machine type allows.
+     */
+    return (s->compat_flags & E1000_FLAG_TIDV) &&
+           (s->compat_flags & E1000_FLAG_MIT) && s->mac_reg[TIDV];
+}
+
+static const VMStateDescription vmstate_e1000_tidv = {
+    .name = "e1000/tidv",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(mac_reg[TIDV], E1000State),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static const VMStateDescription vmstate_e1000 = {
     .name = "e1000",
     .version_id = 2,
@@ -1461,6 +1585,9 @@ static const VMStateDescription vmstate_e1000 = {
         {
             .vmsd = &vmstate_e1000_mit_state,
             .needed = e1000_mit_state_needed,
+        }, {
+            .vmsd = &vmstate_e1000_tidv,
+            .needed = e1000_tidv_needed,
         }, {
             /* empty */
         }
@@ -1511,6 +1638,10 @@ pci_e1000_uninit(PCIDevice *dev)
     timer_free(d->autoneg_timer);
     timer_del(d->mit_timer);
     timer_free(d->mit_timer);
+    timer_del(d->tx_delay.timer);
+    timer_free(d->tx_delay.timer);
+    timer_del(d->rx_delay.timer);
+    timer_free(d->rx_delay.timer);
     qemu_del_nic(d->nic);
 }
 
@@ -1581,6 +1712,10 @@ static void pci_e1000_realize(PCIDevice *pci_dev, Error **errp)
 
     d->autoneg_timer = timer_new_ms(QEMU_CLOCK_VIRTUAL, e1000_autoneg_timer, d);
     d->mit_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, e1000_mit_timer, d);
+    d->tx_delay.timer = timer_new_ns(QEMU_CLOCK_VIRTUAL,
+                                     e1000_tx_delay_timer, d);
+    d->rx_delay.timer = timer_new_ns(QEMU_CLOCK_VIRTUAL,
+                                     e1000_rx_delay_timer, d);
 }
 
 static void qdev_e1000_reset(DeviceState *dev)
@@ -1595,6 +1730,8 @@ static Property e1000_properties[] = {
                     compat_flags, E1000_FLAG_AUTONEG_BIT, true),
     DEFINE_PROP_BIT("mitigation", E1000State,
                     compat_flags, E1000_FLAG_MIT_BIT, true),
+    DEFINE_PROP_BIT("x-tidv-migration", E1000State,
+                    compat_flags, E1000_FLAG_TIDV_BIT, true),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -15,6 +15,7 @@
 #include "hw/virtio/virtio.h"
 #include "net/net.h"
 #include "net/checksum.h"
+#include "net/eth.h"
 #include "net/tap.h"
 #include "qemu/error-report.h"
 #include "qemu/timer.h"
@@ -64,6 +65,164 @@ static int vq2q(int queue_index)
     return queue_index / 2;
 }
 
+/*
+ * Number of NetClientStates backing the device.  With RSS steering all
+ * virtqueue pairs share the single queue of the backend.
+ */
+static int virtio_net_nic_queues(VirtIONet *n)
+{
+    return n->rss.enabled ? 1 : n->max_queues;
+}
+
+static NetClientState *virtio_net_queue_nc(VirtIONet *n, int queue_index)
+{
+    return qemu_get_subqueue(n->nic, n->rss.enabled ? 0 : queue_index);
+}
+
+/* RSS */
+
+/* Default key from the Microsoft RSS specification */
+static const uint8_t rss_default_key[VIRTIO_NET_RSS_MAX_KEY_SIZE] = {
+    0x6d, 0x5a, 0x56, 0xda, 0x25, 0x5b, 0x0e, 0xc2,
+    0x41, 0x67, 0x25, 0x3d, 0x43, 0xa3, 0x8f, 0xb0,
+    0xd0, 0xca, 0x2b, 0xcb, 0xae, 0x7b, 0x30, 0xb4,
+    0x77, 0xcb, 0x2d, 0xa3, 0x80, 0x30, 0xf2, 0x0c,
+    0x6a, 0x42, 0xb7, 0x3b, 0xbe, 0xac, 0x01, 0xfa,
+};
+
+static void virtio_net_rss_set_default_table(VirtIONet *n)
+{
+    int i;
+
+    n->rss.indirection_table_mask = VIRTIO_NET_RSS_MAX_TABLE_LEN - 1;
+    for (i = 0; i < VIRTIO_NET_RSS_MAX_TABLE_LEN; i++) {
+        n->rss.indirection_table[i] = i % n->curr_queues;
+    }
+}
+
+static void virtio_net_rss_reset(VirtIONet *n)
+{
+    n->rss.guest_configured = false;
+    n->rss.hash_types = VIRTIO_NET_RSS_HASH_TYPE_ALL;
+    n->rss.unclassified_queue = 0;
+    memcpy(n->rss.key, rss_default_key, sizeof(n->rss.key));
+    virtio_net_rss_set_default_table(n);
+}
+
+/*
+ * Toeplitz hash of @input.  The key is consumed as a sliding 32 bit
+ * window, so it must be at least @len + 4 bytes long.
+ */
+static uint32_t virtio_net_toeplitz(const uint8_t *key, const uint8_t *input,
+                                    size_t len)
+{
+    uint32_t result = 0;
+    uint32_t window = ldl_be_p(key);
+    size_t i;
+    int bit;
+
+    for (i = 0; i < len; i++) {
+        for (bit = 7; bit >= 0; bit--) {
+            if (input[i] & (1 << bit)) {
+                result ^= window;
+            }
+            window = (window << 1) | ((key[i + 4] >> bit) & 1);
+        }
+    }
+
+    return result;
+}
+
+/*
+ * Collect the flow tuple of an ethernet frame in the order required by
+ * the Toeplitz hash: source address, destination address, source port,
+ * destination port.  Returns the tuple length, or 0 if the packet does
+ * not match any enabled hash type.
+ */
+static size_t virtio_net_rss_tuple(VirtIONet *n, const uint8_t *buf,
+                                   size_t size, uint8_t *tuple)
+{
+    uint32_t types = n->rss.hash_types;
+    size_t l3 = sizeof(struct eth_header), l4, addr_len;
+    uint16_t proto;
+    uint8_t l4proto;
+    bool ports;
+
+    if (size < l3) {
+        return 0;
+    }
+    proto = lduw_be_p(buf + 12);
+    if (proto == ETH_P_VLAN && size >= l3 + sizeof(struct vlan_header)) {
+        proto = lduw_be_p(buf + 16);
+        l3 += sizeof(struct vlan_header);
+    }
+
+    if (proto == ETH_P_IP) {
+        if (size < l3 + 20 || (buf[l3] >> 4) != 4) {
+            return 0;
+        }
+        l4 = l3 + (buf[l3] & 0xf) * 4;
+        l4proto = buf[l3 + 9];
+        /* fragments carry no port numbers, so hash addresses only */
+        ports = !(lduw_be_p(buf + l3 + 6) & 0x3fff) &&
+                ((l4proto == IP_PROTO_TCP &&
+                  (types & VIRTIO_NET_RSS_HASH_TYPE_TCPv4)) ||
+                 (l4proto == IP_PROTO_UDP &&
+                  (types & VIRTIO_NET_RSS_HASH_TYPE_UDPv4)));
+        if (!ports && !(types & VIRTIO_NET_RSS_HASH_TYPE_IPv4)) {
+            return 0;
+        }
+        addr_len = 4;
+        memcpy(tuple, buf + l3 + 12, 2 * addr_len);
+    } else if (proto == ETH_P_IPV6) {
+        if (size < l3 + 40 || (buf[l3] >> 4) != 6) {
+            return 0;
+        }
+        l4 = l3 + 40;
+        l4proto = buf[l3 + 6];
+        ports = (l4proto == IP_PROTO_TCP &&
+                 (types & VIRTIO_NET_RSS_HASH_TYPE_TCPv6)) ||
+                (l4proto == IP_PROTO_UDP &&
+                 (types & VIRTIO_NET_RSS_HASH_TYPE_UDPv6));
+        if (!ports && !(types & VIRTIO_NET_RSS_HASH_TYPE_IPv6)) {
+            return 0;
+        }
+        addr_len = 16;
+        memcpy(tuple, buf + l3 + 8, 2 * addr_len);
+    } else {
+        return 0;
+    }
+
+    if (ports && size >= l4 + 4) {
+        memcpy(tuple + 2 * addr_len, buf + l4, 4);
+        return 2 * addr_len + 4;
+    }
+    return 2 * addr_len;
+}
+
+static VirtIONetQueue *virtio_net_rss_select(VirtIONet *n, const uint8_t *buf,
+                                             size_t size)
+{
+    uint8_t tuple[36];
+    size_t len;
+    uint16_t queue;
+
+    len = virtio_net_rss_tuple(n, buf, size, tuple);
+    if (len) {
+        uint32_t hash = virtio_net_toeplitz(n->rss.key, tuple, len);
+        queue = n->rss.indirection_table[hash &
+                                         n->rss.indirection_table_mask];
+    } else {
+        queue = n->rss.unclassified_queue;
+    }
+
+    if (queue >= n->curr_queues ||
+        !virtio_queue_ready(n->vqs[queue].rx_vq)) {
+        queue = 0;
+    }
+    return &n->vqs[queue];
+}
+
 /* TODO
  * - we could suppress RX interrupt if we were so inclined.
  */
@@ -322,6 +481,7 @@ static RxFilterInfo *virtio_net_query_rxfilter(NetClientState *nc)
 static void virtio_net_reset(VirtIODevice *vdev)
 {
     VirtIONet *n = VIRTIO_NET(vdev);
+    int i;
 
     /* Reset back to compatibility mode */
     n->promisc = 1;
@@ -332,6 +492,20 @@ static void virtio_net_reset(VirtIODevice *vdev)
     n->nobcast = 0;
     /* multiqueue is disabled by default */
     n->curr_queues = 1;
+
+    /* Complete any async TX still queued in the backend */
+    for (i = 0; i < virtio_net_nic_queues(n); i++) {
+        NetClientState *nc = qemu_get_subqueue(n->nic, i);
+
+        if (nc->peer) {
+            qemu_flush_queued_packets(nc->peer);
+            qemu_purge_queued_packets(nc);
+        }
+    }
+    if (n->rss.enabled) {
+        assert(QSIMPLEQ_EMPTY(&n->rss.tx_pending));
+        virtio_net_rss_reset(n);
+    }
     timer_del(n->announce_timer);
     n->announce_counter = 0;
     n->status &= ~VIRTIO_NET_S_ANNOUNCE;
@@ -382,7 +556,7 @@ static void virtio_net_set_mrg_rx_bufs(VirtIONet *n, int mergeable_rx_bufs)
     n->guest_hdr_len = n->mergeable_rx_bufs ?
         sizeof(struct virtio_net_hdr_mrg_rxbuf) : sizeof(struct virtio_net_hdr);
 
-    for (i = 0; i < n->max_queues; i++) {
+    for (i = 0; i < virtio_net_nic_queues(n); i++) {
         nc = qemu_get_subqueue(n->nic, i);
 
         if (peer_has_vnet_hdr(n) &&
@@ -428,7 +602,7 @@ static void virtio_net_set_queues(VirtIONet *n)
     int i;
     int r;
 
-    for (i = 0; i < n->max_queues; i++) {
+    for (i = 0; i < virtio_net_nic_queues(n); i++) {
         if (i < n->curr_queues) {
             r = peer_attach(n, i);
             assert(!r);
@@ -532,7 +706,7 @@ static void virtio_net_set_features(VirtIODevice *vdev, uint32_t features)
         virtio_net_apply_guest_offloads(n);
     }
 
-    for (i = 0;  i < n->max_queues; i++) {
+    for (i = 0;  i < virtio_net_nic_queues(n); i++) {
         NetClientState *nc = qemu_get_subqueue(n->nic, i);
 
         if (!get_vhost_net(nc->peer)) {
@@ -760,6 +934,94 @@ static int virtio_net_handle_announce(VirtIONet *n, uint8_t cmd,
     }
 }
 
+static int virtio_net_handle_rss(VirtIONet *n,
+                                 struct iovec *iov, unsigned int iov_cnt)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    struct virtio_net_rss_config cfg;
+    uint16_t table[VIRTIO_NET_RSS_MAX_TABLE_LEN];
+    uint8_t key[VIRTIO_NET_RSS_MAX_KEY_SIZE];
+    uint32_t table_len;
+    uint16_t mask, unclassified, max_tx_vq, queues;
+    uint8_t key_len;
+    size_t s, offset;
+    int i;
+
+    if (!n->rss.enabled || !n->multiqueue) {
+        return VIRTIO_NET_ERR;
+    }
+
+    s = iov_to_buf(iov, iov_cnt, 0, &cfg, sizeof(cfg));
+    if (s != sizeof(cfg)) {
+        return VIRTIO_NET_ERR;
+    }
+    offset = s;
+
+    mask = virtio_lduw_p(vdev, &cfg.indirection_table_mask);
+    table_len = (uint32_t)mask + 1;
+    if (table_len > VIRTIO_NET_RSS_MAX_TABLE_LEN || (table_len & mask)) {
+        return VIRTIO_NET_ERR;
+    }
+
+    s = iov_to_buf(iov, iov_cnt, offset, table, table_len * sizeof(table[0]));
+    if (s != table_len * sizeof(table[0])) {
+        return VIRTIO_NET_ERR;
+    }
+    offset += s;
+
+    s = iov_to_buf(iov, iov_cnt, offset, &max_tx_vq, sizeof(max_tx_vq));
+    if (s != sizeof(max_tx_vq)) {
+        return VIRTIO_NET_ERR;
+    }
+    offset += s;
+
+    s = iov_to_buf(iov, iov_cnt, offset, &key_len, sizeof(key_len));
+    if (s != sizeof(key_len) || key_len > VIRTIO_NET_RSS_MAX_KEY_SIZE) {
+        return VIRTIO_NET_ERR;
+    }
+    offset += s;
+
+    memset(key, 0, sizeof(key));
+    s = iov_to_buf(iov, iov_cnt, offset, key, key_len);
+    if (s != key_len) {
+        return VIRTIO_NET_ERR;
+    }
+
+    /* Enable enough queue pairs to cover every queue the table uses */
+    queues = virtio_lduw_p(vdev, &max_tx_vq);
+    unclassified = virtio_lduw_p(vdev, &cfg.unclassified_queue);
+    if (queues < VIRTIO_NET_CTRL_MQ_VQ_PAIRS_MIN ||
+        queues > n->max_queues || unclassified >= n->max_queues) {
+        return VIRTIO_NET_ERR;
+    }
+    queues = MAX(queues, unclassified + 1);
+    for (i = 0; i < table_len; i++) {
+        table[i] = virtio_lduw_p(vdev, &table[i]);
+        if (table[i] >= n->max_queues) {
+            return VIRTIO_NET_ERR;
+        }
+        queues = MAX(queues, table[i] + 1);
+    }
+
+    n->rss.guest_configured = true;
+    n->rss.hash_types = virtio_ldl_p(vdev, &cfg.hash_types) &
+                        VIRTIO_NET_RSS_HASH_TYPE_ALL;
+    n->rss.indirection_table_mask = mask;
+    n->rss.unclassified_queue = unclassified;
+    memcpy(n->rss.indirection_table, table, table_len * sizeof(table[0]));
+    if (key_len) {
+        memcpy(n->rss.key, key, sizeof(n->rss.key));
+    }
+
+    n->curr_queues = queues;
+    /* stop the backend before changing the number of queues to avoid handling a
+     * disabled queue */
+    virtio_net_set_status(vdev, vdev->status);
+    virtio_net_set_queues(n);
+
+    return VIRTIO_NET_OK;
+}
+
 static int virtio_net_handle_mq(VirtIONet *n, uint8_t cmd,
                                 struct iovec *iov, unsigned int iov_cnt)
 {
@@ -768,6 +1030,10 @@ static int virtio_net_handle_mq(VirtIONet *n, uint8_t cmd,
     size_t s;
     uint16_t queues;
 
+    if (cmd == VIRTIO_NET_CTRL_MQ_RSS_CONFIG) {
+        return virtio_net_handle_rss(n, iov, iov_cnt);
+    }
+
     s = iov_to_buf(iov, iov_cnt, 0, &mq, sizeof(mq));
     if (s != sizeof(mq)) {
         return VIRTIO_NET_ERR;
@@ -787,6 +1053,9 @@ static int virtio_net_handle_mq(VirtIONet *n, uint8_t cmd,
     }
 
     n->curr_queues = queues;
+    if (n->rss.enabled && !n->rss.guest_configured) {
+        virtio_net_rss_set_default_table(n);
+    }
     /* stop the backend before changing the number of queues to avoid handling a
      * disabled queue */
     virtio_net_set_status(vdev, vdev->status);
@@ -847,7 +1116,7 @@ static void virtio_net_handle_rx(VirtIODevice *vdev, VirtQueue *vq)
     VirtIONet *n = VIRTIO_NET(vdev);
     int queue_index = vq2q(virtio_get_queue_index(vq));
 
-    qemu_flush_queued_packets(qemu_get_subqueue(n->nic, queue_index));
+    qemu_flush_queued_packets(virtio_net_queue_nc(n, queue_index));
 }
 
 static int virtio_net_can_receive(NetClientState *nc)
@@ -1014,6 +1283,11 @@ static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t
         return -1;
     }
 
+    if (n->rss.enabled && size > n->host_hdr_len) {
+        q = virtio_net_rss_select(n, buf + n->host_hdr_len,
+                                  size - n->host_hdr_len);
+    }
+
     /* hdr_len refers to the header we supply to the guest */
     if (!virtio_net_has_buffers(q, size + n->guest_hdr_len - n->host_hdr_len)) {
         return 0;
@@ -1108,6 +1382,15 @@ static void virtio_net_tx_complete(NetClientState *nc, ssize_t len)
     VirtIONetQueue *q = virtio_net_get_subqueue(nc);
     VirtIODevice *vdev = VIRTIO_DEVICE(n);
 
+    if (n->rss.enabled) {
+        /* The shared backend queue completes sends in submission order */
+        q = QSIMPLEQ_FIRST(&n->rss.tx_pending);
+        if (!q) {
+            return;
+        }
+        QSIMPLEQ_REMOVE_HEAD(&n->rss.tx_pending, tx_pending_next);
+    }
+
     virtqueue_push(q->tx_vq, &q->async_tx.elem, 0);
     virtio_notify(vdev, q->tx_vq);
 
@@ -1172,12 +1455,15 @@ static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
 
         len = n->guest_hdr_len;
 
-        ret = qemu_sendv_packet_async(qemu_get_subqueue(n->nic, queue_index),
+        ret = qemu_sendv_packet_async(virtio_net_queue_nc(n, queue_index),
                                       out_sg, out_num, virtio_net_tx_complete);
         if (ret == 0) {
             virtio_queue_set_notification(q->tx_vq, 0);
             q->async_tx.elem = elem;
             q->async_tx.len  = len;
+            if (n->rss.enabled) {
+                QSIMPLEQ_INSERT_TAIL(&n->rss.tx_pending, q, tx_pending_next);
+            }
             return -EBUSY;
         }
 
@@ -1384,6 +1670,17 @@ static void virtio_net_save_device(VirtIODevice *vdev, QEMUFile *f)
     if (virtio_has_feature(vdev, VIRTIO_NET_F_CTRL_GUEST_OFFLOADS)) {
         qemu_put_be64(f, n->curr_guest_offloads);
     }
+
+    if (n->rss.enabled) {
+        qemu_put_byte(f, n->rss.guest_configured);
+        qemu_put_be32(f, n->rss.hash_types);
+        qemu_put_be16(f, n->rss.indirection_table_mask);
+        qemu_put_be16(f, n->rss.unclassified_queue);
+        for (i = 0; i <= n->rss.indirection_table_mask; i++) {
+            qemu_put_be16(f, n->rss.indirection_table[i]);
+        }
+        qemu_put_buffer(f, n->rss.key, sizeof(n->rss.key));
+    }
 }
 
 static int virtio_net_load(QEMUFile *f, void *opaque, int version_id)
@@ -1495,6 +1792,29 @@ static int virtio_net_load_device(VirtIODevice *vdev, QEMUFile *f,
         n->curr_guest_offloads = virtio_net_supported_guest_offloads(n);
     }
 
+    if (n->rss.enabled) {
+        n->rss.guest_configured = qemu_get_byte(f);
+        n->rss.hash_types = qemu_get_be32(f);
+        n->rss.indirection_table_mask = qemu_get_be16(f);
+        n->rss.unclassified_queue = qemu_get_be16(f);
+        if (n->rss.indirection_table_mask >= VIRTIO_NET_RSS_MAX_TABLE_LEN ||
+            (n->rss.indirection_table_mask &
+             (n->rss.indirection_table_mask + 1))) {
+            error_report("virtio-net: invalid RSS indirection table mask %x",
+                         n->rss.indirection_table_mask);
+            return -1;
+        }
+        for (i = 0; i <= n->rss.indirection_table_mask; i++) {
+            n->rss.indirection_table[i] = qemu_get_be16(f);
+            if (n->rss.indirection_table[i] >= n->max_queues) {
+                error_report("virtio-net: RSS queue %u >= max_queues %x",
+                             n->rss.indirection_table[i], n->max_queues);
+                return -1;
+            }
+        }
+        qemu_get_buffer(f, n->rss.key, sizeof(n->rss.key));
+    }
+
     if (peer_has_vnet_hdr(n)) {
         virtio_net_apply_guest_offloads(n);
     }
@@ -1512,7 +1832,7 @@ static int virtio_net_load_device(VirtIODevice *vdev, QEMUFile *f,
     /* nc.link_down can't be migrated, so infer link_down according
      * to link status bit in n->status */
     link_down = (n->status & VIRTIO_NET_S_LINK_UP) == 0;
-    for (i = 0; i < n->max_queues; i++) {
+    for (i = 0; i < virtio_net_nic_queues(n); i++) {
         qemu_get_subqueue(n->nic, i)->link_down = link_down;
     }
 
@@ -1585,14 +1905,38 @@ static void virtio_net_device_realize(DeviceState *dev, Error **errp)
     NetClientState *nc;
     int i;
 
+    n->max_queues = MAX(n->nic_conf.peers.queues, 1);
+    if (n->net_conf.rss_queues > 1) {
+        if (n->max_queues > 1) {
+            error_setg(errp, "virtio-net: rss_queues requires a backend "
+                       "with a single queue");
+            return;
+        }
+        if (get_vhost_net(n->nic_conf.peers.ncs[0])) {
+            error_setg(errp, "virtio-net: rss_queues is not supported "
+                       "with vhost");
+            return;
+        }
+        if (n->net_conf.rss_queues > (VIRTIO_PCI_QUEUE_MAX - 1) / 2) {
+            error_setg(errp, "virtio-net: rss_queues must not exceed %d",
+                       (VIRTIO_PCI_QUEUE_MAX - 1) / 2);
+            return;
+        }
+        n->max_queues = n->net_conf.rss_queues;
+        n->rss.enabled = true;
+        QSIMPLEQ_INIT(&n->rss.tx_pending);
+    }
+
     virtio_init(vdev, "virtio-net", VIRTIO_ID_NET, n->config_size);
 
-    n->max_queues = MAX(n->nic_conf.peers.queues, 1);
     n->vqs = g_malloc0(sizeof(VirtIONetQueue) * n->max_queues);
     n->vqs[0].rx_vq = virtio_add_queue(vdev, 256, virtio_net_handle_rx);
     n->curr_queues = 1;
     n->vqs[0].n = n;
     n->tx_timeout = n->net_conf.txtimer;
+    if (n->rss.enabled) {
+        virtio_net_rss_reset(n);
+    }
 
     if (n->net_conf.tx && strcmp(n->net_conf.tx, "timer")
                        && strcmp(n->net_conf.tx, "bh")) {
@@ -1632,7 +1976,7 @@ static void virtio_net_device_realize(DeviceState *dev, Error **errp)
 
     peer_test_vnet_hdr(n);
     if (peer_has_vnet_hdr(n)) {
-        for (i = 0; i < n->max_queues; i++) {
+        for (i = 0; i < virtio_net_nic_queues(n); i++) {
             qemu_using_vnet_hdr(qemu_get_subqueue(n->nic, i)->peer, true);
         }
         n->host_hdr_len = sizeof(struct virtio_net_hdr);
@@ -1680,9 +2024,10 @@ static void virtio_net_device_unrealize(DeviceState *dev, Error **errp)
 
     for (i = 0; i < n->max_queues; i++) {
         VirtIONetQueue *q = &n->vqs[i];
-        NetClientState *nc = qemu_get_subqueue(n->nic, i);
 
-        qemu_purge_queued_packets(nc);
+        if (i < virtio_net_nic_queues(n)) {
+            qemu_purge_queued_packets(qemu_get_subqueue(n->nic, i));
+        }
 
         if (q->tx_timer) {
             timer_del(q->tx_timer);
@@ -1719,6 +2064,7 @@ static Property virtio_net_properties[] = {
                                                TX_TIMER_INTERVAL),
     DEFINE_PROP_INT32("x-txburst", VirtIONet, net_conf.txburst, TX_BURST),
     DEFINE_PROP_STRING("tx", VirtIONet, net_conf.tx),
+    DEFINE_PROP_UINT16("rss_queues", VirtIONet, net_conf.rss_queues, 0),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -1826,6 +1826,7 @@ static const TypeInfo spapr_machine_2_1_info = {
 static void spapr_machine_2_2_class_init(ObjectClass *oc, void *data)
 {
     static GlobalProperty compat_props[] = {
+        HW_COMPAT_2_2,
         SPAPR_COMPAT_2_2,
         { /* end of list */ }
     };
@@ -431,6 +431,10 @@ int bdrv_save_vmstate(BlockDriverState *bs, const uint8_t *buf,
 
 int bdrv_load_vmstate(BlockDriverState *bs, uint8_t *buf,
                       int64_t pos, int size);
+int64_t bdrv_get_vmstate_status(BlockDriverState *bs, int64_t pos,
+                                int64_t size, int64_t *pnum);
+int bdrv_discard_vmstate(BlockDriverState *bs, int64_t pos, int64_t size);
+int bdrv_open_data_file(BlockDriverState *bs, int flags);
 
 void bdrv_img_create(const char *filename, const char *fmt,
                      const char *base_filename, const char *base_fmt,
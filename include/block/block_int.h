@@ -210,6 +210,12 @@ struct BlockDriver {
                              int64_t pos);
     int (*bdrv_load_vmstate)(BlockDriverState *bs, uint8_t *buf,
                              int64_t pos, int size);
+    /* Like bdrv_co_get_block_status and bdrv_co_discard, for sectors of the
+     * VM state */
+    int64_t coroutine_fn (*bdrv_co_get_vmstate_status)(BlockDriverState *bs,
+        int64_t sector_num, int nb_sectors, int *pnum);
+    int coroutine_fn (*bdrv_co_discard_vmstate)(BlockDriverState *bs,
+        int64_t sector_num, int nb_sectors);
 
     int (*bdrv_change_backing_file)(BlockDriverState *bs,
         const char *backing_file, const char *backing_fmt);
@@ -282,6 +282,9 @@ struct RAMBlock {
     /* RCU-enabled, writes protected by the ramlist lock */
     QLIST_ENTRY(RAMBlock) next;
     int fd;
+    /* Where the block's pages and bitmap are in a file: migration */
+    uint64_t file_pages_offset;
+    uint64_t file_bitmap_offset;
 };
 
 static inline void *ramblock_ptr(RAMBlock *block, ram_addr_t offset)
@@ -690,6 +690,44 @@ void memory_region_sync_dirty_bitmap(MemoryRegion *mr);
 void memory_region_reset_dirty(MemoryRegion *mr, hwaddr addr,
                                hwaddr size, unsigned client);
 
+typedef struct DirtyBitmapSnapshot DirtyBitmapSnapshot;
+
+/**
+ * memory_region_snapshot_and_clear_dirty: Copy a range of the dirty bitmap
+ *                                         and mark it clean.
+ *
+ * Takes a snapshot of the dirty bitmap for a range of pages and clears the
+ * range, in one go.  The snapshot can be queried any number of times with
+ * memory_region_snapshot_get_dirty(), which suits display updates whose
+ * scanlines straddle page boundaries; writes that happen after the
+ * snapshot stay dirty for the next one.  Free it with g_free().
+ *
+ * @mr: the region being queried.
+ * @addr: the start of the subrange being snapshotted.
+ * @size: the size of the subrange being snapshotted.
+ * @client: the user of the logging information; %DIRTY_MEMORY_MIGRATION or
+ *          %DIRTY_MEMORY_VGA.
+ */
+DirtyBitmapSnapshot *memory_region_snapshot_and_clear_dirty(MemoryRegion *mr,
+                                                            hwaddr addr,
+                                                            hwaddr size,
+                                                            unsigned client);
+
+/**
+ * memory_region_snapshot_get_dirty: Check whether a range of bytes was dirty
+ *                                   in a snapshot.
+ *
+ * Ranges that are not fully covered by the snapshot are reported dirty.
+ *
+ * @mr: the region being queried.
+ * @snap: the snapshot, from memory_region_snapshot_and_clear_dirty().
+ * @addr: the address (relative to the start of the region) being queried.
+ * @size: the size of the range being queried.
+ */
+bool memory_region_snapshot_get_dirty(MemoryRegion *mr,
+                                      DirtyBitmapSnapshot *snap,
+                                      hwaddr addr, hwaddr size);
+
 /**
  * memory_region_set_readonly: Turn a memory region read-only (or read-write)
  *
@@ -38,6 +38,7 @@ typedef struct virtio_net_conf
     uint32_t txtimer;
     int32_t txburst;
     char *tx;
+    uint16_t rss_queues;
 } virtio_net_conf;
 
 /* Maximum packet size we can receive from tap device: header + 64k */
@@ -54,8 +55,25 @@ typedef struct VirtIONetQueue {
         ssize_t len;
     } async_tx;
     struct VirtIONet *n;
+    QSIMPLEQ_ENTRY(VirtIONetQueue) tx_pending_next;
 } VirtIONetQueue;
 
+/* Receive side scaling for backends that only provide a single queue */
+#define VIRTIO_NET_RSS_MAX_KEY_SIZE     40
+#define VIRTIO_NET_RSS_MAX_TABLE_LEN    128
+
+typedef struct VirtIONetRss {
+    bool enabled;
+    bool guest_configured;
+    uint32_t hash_types;
+    uint16_t indirection_table_mask;
+    uint16_t unclassified_queue;
+    uint16_t indirection_table[VIRTIO_NET_RSS_MAX_TABLE_LEN];
+    uint8_t key[VIRTIO_NET_RSS_MAX_KEY_SIZE];
+    /* queues waiting for an asynchronous send on the shared backend queue */
+    QSIMPLEQ_HEAD(, VirtIONetQueue) tx_pending;
+} VirtIONetRss;
+
 typedef struct VirtIONet {
     VirtIODevice parent_obj;
     uint8_t mac[ETH_ALEN];
@@ -97,6 +115,7 @@ typedef struct VirtIONet {
     uint64_t curr_guest_offloads;
     QEMUTimer *announce_timer;
     int announce_counter;
+    VirtIONetRss rss;
 } VirtIONet;
 
 /*
@@ -108,6 +127,32 @@ typedef struct VirtIONet {
 #define VIRTIO_NET_CTRL_GUEST_OFFLOADS   5
  #define VIRTIO_NET_CTRL_GUEST_OFFLOADS_SET        0
 
+/*
+ * Control receive side scaling
+ *
+ * Available when the device was created with rss_queues > 1 and the
+ * backend has a single queue.  The device then computes a Toeplitz hash
+ * over the flow of each received packet and uses it to index the
+ * indirection table, which selects the receive virtqueue.  The command
+ * carries a struct virtio_net_rss_config followed by the indirection
+ * table, a 16 bit max_tx_vq, an 8 bit key length and the hash key.
+ */
+struct virtio_net_rss_config {
+    uint32_t hash_types;
+    uint16_t indirection_table_mask;
+    uint16_t unclassified_queue;
+} QEMU_PACKED;
+
+ #define VIRTIO_NET_CTRL_MQ_RSS_CONFIG             1
+
+#define VIRTIO_NET_RSS_HASH_TYPE_IPv4   (1 << 0)
+#define VIRTIO_NET_RSS_HASH_TYPE_TCPv4  (1 << 1)
+#define VIRTIO_NET_RSS_HASH_TYPE_UDPv4  (1 << 2)
+#define VIRTIO_NET_RSS_HASH_TYPE_IPv6   (1 << 3)
+#define VIRTIO_NET_RSS_HASH_TYPE_TCPv6  (1 << 4)
+#define VIRTIO_NET_RSS_HASH_TYPE_UDPv6  (1 << 5)
+#define VIRTIO_NET_RSS_HASH_TYPE_ALL    0x3f
+
 #define DEFINE_VIRTIO_NET_FEATURES(_state, _field) \
         DEFINE_PROP_BIT("any_layout", _state, _field, VIRTIO_F_ANY_LAYOUT, true), \
         DEFINE_PROP_BIT("csum", _state, _field, VIRTIO_NET_F_CSUM, true), \
@@ -135,7 +180,8 @@ typedef struct VirtIONet {
 #define DEFINE_VIRTIO_NET_PROPERTIES(_state, _field)                           \
     DEFINE_PROP_UINT32("x-txtimer", _state, _field.txtimer, TX_TIMER_INTERVAL),\
     DEFINE_PROP_INT32("x-txburst", _state, _field.txburst, TX_BURST),          \
-    DEFINE_PROP_STRING("tx", _state, _field.tx)
+    DEFINE_PROP_STRING("tx", _state, _field.tx),                             \
+    DEFINE_PROP_UINT16("rss_queues", _state, _field.rss_queues, 0)
 
 void virtio_net_set_config_size(VirtIONet *n, uint32_t host_features);
 void virtio_net_set_netclient_name(VirtIONet *n, const char *name,
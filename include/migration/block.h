@@ -19,5 +19,8 @@ int blk_mig_active(void);
 uint64_t blk_mig_bytes_transferred(void);
 uint64_t blk_mig_bytes_remaining(void);
 uint64_t blk_mig_bytes_total(void);
+uint64_t blk_mig_zero_chunks(void);
+uint64_t blk_mig_normal_chunks(void);
+uint64_t blk_mig_normal_bytes(void);
 
 #endif /* BLOCK_MIGRATION_H */
@@ -0,0 +1,90 @@
+/*
+ * Migration to and from a local file with page-indexed RAM
+ *
+ * Copyright (C) 2015 agent <agent@local>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef QEMU_MIGRATION_FILE_H
+#define QEMU_MIGRATION_FILE_H
+
+#include "qemu-common.h"
+
+/* Regions reserved in the file start at a multiple of this */
+#define FILE_MIGRATION_ALIGN (1 << 20)
+
+/*
+ * Storage for the same layout other than a plain file, such as the VM
+ * state area of a disk image.  Offsets are relative to its start.  The
+ * callbacks are only called from the thread doing the migration; pages
+ * are not handed to worker threads.
+ */
+typedef struct FileMigrationOps {
+    /* Transfer @qiov at @offset.  Return 0 or a negative errno.  */
+    int (*writev)(void *opaque, QEMUIOVector *qiov, int64_t offset);
+    int (*readv)(void *opaque, QEMUIOVector *qiov, int64_t offset);
+    /* Read the stream, from start to end; optional, like QEMUFileOps */
+    int (*get_buffer)(void *opaque, uint8_t *buf, int64_t pos, int size);
+    /* Make a region read as zeroes; optional if new storage always does */
+    int (*discard)(void *opaque, int64_t offset, int64_t size);
+    /* See file_migration_map(); optional */
+    int (*map)(void *opaque, void *host, size_t size, uint64_t offset);
+    int (*close)(void *opaque);
+} FileMigrationOps;
+
+QEMUFile *file_migration_open_ops(void *opaque, const FileMigrationOps *ops,
+                                  bool writing, Error **errp);
+
+/* End of what was written so far, once the stream is flushed.  */
+int64_t file_migration_size(void);
+
+/* True while a file: migration is being saved, or loaded.  */
+bool file_migration_save_active(void);
+bool file_migration_load_active(void);
+
+/**
+ * file_migration_skip: reserve a region of the file
+ *
+ * The region starts at the first multiple of FILE_MIGRATION_ALIGN after
+ * the current position of the stream @f, and the stream goes on after
+ * it.  Called at the same point of the stream on both sides, it returns
+ * the same offset.
+ *
+ * Returns the file offset of the region.
+ */
+int64_t file_migration_skip(QEMUFile *f, uint64_t size);
+
+/**
+ * file_migration_queue_page: transfer a page between memory and the file
+ *
+ * Writes @size bytes at @host to @offset of the file when saving, and
+ * reads them back when loading.  Requests are batched and spread over
+ * the worker threads; @host must stay mapped until the next
+ * file_migration_sync(), and a page must not be queued twice before it.
+ *
+ * Returns 0 on success, -1 if a worker failed.
+ */
+int file_migration_queue_page(uint64_t offset, void *host, size_t size);
+
+/* Wait until all queued pages are transferred; returns 0 or -1.  */
+int file_migration_sync(void);
+
+/* Synchronous transfers of metadata; return 0 or a negative errno.  */
+int file_migration_pwrite(const void *buf, size_t size, uint64_t offset);
+int file_migration_pread(void *buf, size_t size, uint64_t offset);
+
+/**
+ * file_migration_map: map part of the file over guest memory
+ *
+ * Replaces the memory at @host with a private mapping of @size bytes at
+ * @offset of the file, and asks the kernel to start reading it in.
+ * Pages the guest touches before that are read on demand.
+ *
+ * Returns 0 on success, or a negative errno.
+ */
+int file_migration_map(void *host, size_t size, uint64_t offset);
+
+#endif
@@ -45,6 +45,8 @@ typedef struct MigrationState MigrationState;
 struct MigrationState
 {
     int64_t bandwidth_limit;
+    /* set with migrate_set_speed, rather than the default */
+    bool bandwidth_limit_set;
     size_t bytes_xfer;
     size_t xfer_limit;
     QemuThread thread;
@@ -61,8 +63,11 @@ struct MigrationState
     int64_t dirty_bytes_rate;
     bool enabled_capabilities[MIGRATION_CAPABILITY_MAX];
     int64_t xbzrle_cache_size;
+    int multifd_channels;
     int64_t setup_time;
     int64_t dirty_sync_count;
+    int64_t dirty_sync_time;
+    int64_t dirty_sync_time_max;
 };
 
 void process_incoming_migration(QEMUFile *f);
@@ -87,6 +92,10 @@ void fd_start_incoming_migration(const char *path, Error **errp);
 
 void fd_start_outgoing_migration(MigrationState *s, const char *fdname, Error **errp);
 
+void file_start_incoming_migration(const char *path, Error **errp);
+
+void file_start_outgoing_migration(MigrationState *s, const char *path, Error **errp);
+
 void rdma_start_outgoing_migration(void *opaque, const char *host_port, Error **errp);
 
 void rdma_start_incoming_migration(const char *host_port, Error **errp);
@@ -100,6 +109,7 @@ int migrate_fd_close(MigrationState *s);
 void add_migration_state_change_notifier(Notifier *notify);
 void remove_migration_state_change_notifier(Notifier *notify);
 bool migration_in_setup(MigrationState *);
+bool migration_is_active(MigrationState *);
 bool migration_has_finished(MigrationState *);
 bool migration_has_failed(MigrationState *);
 MigrationState *migrate_get_current(void);
@@ -124,6 +134,7 @@ uint64_t xbzrle_mig_pages_cache_miss(void);
 double xbzrle_mig_cache_miss_rate(void);
 
 void ram_handle_compressed(void *host, uint8_t ch, uint64_t size);
+void *ram_block_host_from_idstr(const char *idstr, ram_addr_t *length);
 
 /**
  * @migrate_add_blocker - prevent migration from proceeding
@@ -148,9 +159,28 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
                          uint8_t *dst, int dlen);
 int xbzrle_decode_buffer(uint8_t *src, int slen, uint8_t *dst, int dlen);
 
+typedef int XbzrleEncodeFunc(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                             uint8_t *dst, int dlen);
+
+typedef struct XbzrleEncodeImpl {
+    const char *name;
+    XbzrleEncodeFunc *fn;
+    bool usable;        /* supported by the host CPU */
+} XbzrleEncodeImpl;
+
+/* All encoders built in, terminated by an entry with a NULL name.  They
+ * all give the same output; xbzrle_encode_buffer() uses the fastest one.
+ */
+extern XbzrleEncodeImpl xbzrle_encode_impls[];
+
 int migrate_use_xbzrle(void);
 int64_t migrate_xbzrle_cache_size(void);
 
+bool migrate_use_multifd(void);
+int migrate_multifd_channels(void);
+
+bool migrate_use_file_mmap(void);
+
 int64_t xbzrle_cache_resize(int64_t new_size);
 
 void ram_control_before_iterate(QEMUFile *f, uint64_t flags);
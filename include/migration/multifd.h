@@ -0,0 +1,103 @@
+/*
+ * Multiple parallel channels for RAM migration
+ *
+ * Copyright (C) 2015 agent <agent@local>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef QEMU_MIGRATION_MULTIFD_H
+#define QEMU_MIGRATION_MULTIFD_H
+
+#include "qemu-common.h"
+#include "qapi/error.h"
+#include "exec/cpu-common.h"
+#include "block/coroutine.h"
+
+#define MULTIFD_MAX_CHANNELS 16
+
+typedef void MultiFDConnectHandler(Error *err, void *opaque);
+
+/**
+ * multifd_save_setup: open the outgoing channels
+ *
+ * Starts connecting migrate_multifd_channels() extra sockets to
+ * @host_port without blocking.  Must be called after the main migration
+ * connection is established, so that the destination sees the main
+ * stream first.
+ *
+ * Once every connection has completed, @cb is called from the main loop,
+ * possibly before this function returns.  On success one sender thread
+ * runs per channel and @err is NULL; otherwise the sockets are closed and
+ * @err says why the first failed connection did.
+ */
+void multifd_save_setup(const char *host_port, MultiFDConnectHandler *cb,
+                        void *opaque);
+
+/* True once the channels of multifd_save_setup() run, until the cleanup. */
+bool multifd_save_active(void);
+
+/**
+ * multifd_queue_page: send a page on one of the channels
+ *
+ * The page is not copied; @host must stay mapped until the next
+ * multifd_send_sync_main().  Pages are batched per RAM block.
+ *
+ * Returns 0 on success, -1 if a channel failed.
+ */
+int multifd_queue_page(const char *idstr, ram_addr_t offset, void *host,
+                       size_t size);
+
+/**
+ * multifd_send_sync_main: flush all channels
+ *
+ * Sends whatever is queued and a sync packet on every channel, and waits
+ * until they are on the wire.  The caller must then put a sync marker on
+ * the main stream; the destination will not go past that marker before
+ * every page sent before the sync has been written to guest memory.
+ *
+ * Returns 0 on success, -1 if a channel failed.
+ */
+int multifd_send_sync_main(void);
+
+/* Unblock sender threads stuck on the network; used when cancelling. */
+void multifd_save_shutdown(void);
+void multifd_save_cleanup(void);
+
+/* Prepare for migrate_multifd_channels() incoming channels. */
+void multifd_load_setup(void);
+
+/**
+ * multifd_recv_new_channel: hand an accepted connection to multifd
+ *
+ * Starts a receiver thread for @fd.  Once the last channel is there,
+ * resumes the main stream if it is waiting for it in
+ * multifd_recv_sync_main().
+ *
+ * Returns true once all the expected channels are connected.
+ */
+bool multifd_recv_new_channel(int fd);
+
+/**
+ * multifd_recv_setup_main: check the channel count sent by the source
+ *
+ * Returns 0 if the source opens as many channels as are expected here,
+ * or -EINVAL.
+ */
+int multifd_recv_setup_main(uint32_t channels);
+
+/**
+ * multifd_recv_sync_main: wait for the sync packet on all channels
+ *
+ * Called from the incoming migration coroutine when the sync marker is
+ * found on the main stream; yields until all the channels are connected.
+ * Returns 0 once all pages sent before the marker are in guest memory,
+ * or a negative errno value if a channel failed.
+ */
+int coroutine_fn multifd_recv_sync_main(void);
+
+void multifd_load_cleanup(void);
+
+#endif
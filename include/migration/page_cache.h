@@ -45,8 +45,7 @@ void cache_fini(PageCache *cache);
  * @addr: page addr
  * @current_age: current bitmap generation
  */
-bool cache_is_cached(const PageCache *cache, uint64_t addr,
-                     uint64_t current_age);
+bool cache_is_cached(PageCache *cache, uint64_t addr, uint64_t current_age);
 
 /**
  * get_cached_data: Get the data cached for an addr
@@ -56,13 +55,14 @@ bool cache_is_cached(const PageCache *cache, uint64_t addr,
  * @cache pointer to the PageCache struct
  * @addr: page addr
  */
-uint8_t *get_cached_data(const PageCache *cache, uint64_t addr);
+uint8_t *get_cached_data(PageCache *cache, uint64_t addr);
 
 /**
  * cache_insert: insert the page into the cache. the page cache
  * will dup the data on insert. the previous value will be overwritten
  *
- * Returns -1 when the page isn't inserted into cache
+ * Returns -1 when the page isn't inserted into cache, because all the
+ * pages it could replace are more valuable
  *
  * @cache pointer to the PageCache struct
  * @addr: page address
@@ -76,6 +76,9 @@ int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata,
  * cache_resize: resize the page cache. In case of size reduction the extra
  * pages will be freed
  *
+ * This only allocates the new table.  Cached pages are moved over, or
+ * freed, by later lookups and insertions.
+ *
  * Returns -1 on error new cache size on success
  *
  * @cache pointer to the PageCache struct
@@ -477,6 +477,25 @@ can_use_buffer_find_nonzero_offset(const void *buf, size_t len)
 }
 size_t buffer_find_nonzero_offset(const void *buf, size_t len);
 
+typedef size_t BufferFindNonzeroFunc(const void *buf, size_t len);
+
+typedef struct BufferFindNonzeroImpl {
+    const char *name;
+    BufferFindNonzeroFunc *fn;
+    bool usable;        /* supported by the host CPU */
+} BufferFindNonzeroImpl;
+
+/* All implementations of buffer_find_nonzero_offset() built in, terminated
+ * by an entry with a NULL name.  The fastest usable one is picked at
+ * startup.
+ */
+extern BufferFindNonzeroImpl buffer_find_nonzero_offset_impls[];
+
+#ifdef CONFIG_AVX2_OPT
+/* True if AVX2 code built with CONFIG_AVX2_OPT can run on this host. */
+bool host_cpu_has_avx2(void);
+#endif
+
 /*
  * helper to parse debug environment variables
  */
@@ -0,0 +1,48 @@
+/*
+ * Anonymous shared memory
+ *
+ * Copyright (c) 2015 agent <agent@local>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_MEMFD_H
+#define QEMU_MEMFD_H
+
+#include "config-host.h"
+#include <stdint.h>
+#include <stddef.h>
+
+#ifndef F_LINUX_SPECIFIC_BASE
+#define F_LINUX_SPECIFIC_BASE 1024
+#endif
+
+#ifndef F_ADD_SEALS
+#define F_ADD_SEALS (F_LINUX_SPECIFIC_BASE + 9)
+#define F_GET_SEALS (F_LINUX_SPECIFIC_BASE + 10)
+
+#define F_SEAL_SEAL     0x0001  /* prevent further seals from being set */
+#define F_SEAL_SHRINK   0x0002  /* prevent file from shrinking */
+#define F_SEAL_GROW     0x0004  /* prevent file from growing */
+#define F_SEAL_WRITE    0x0008  /* prevent writes */
+#endif
+
+/*
+ * Allocate @size bytes of shared memory backed by an anonymous file and
+ * map it read-write.  The file descriptor is returned in @fd so that it
+ * can be passed to another process; @seals are applied to it when the
+ * host supports sealing.  Returns NULL on failure.
+ */
+void *qemu_memfd_alloc(const char *name, size_t size, unsigned int seals,
+                       int *fd);
+void qemu_memfd_free(void *ptr, size_t size, int fd);
+
+/*
+ * Open a new, read-only descriptor for the memory behind @fd, to give to
+ * a process that must not write to it or resize it.  Returns -1 and sets
+ * errno on failure.
+ */
+int qemu_memfd_open_readonly(int fd);
+
+#endif /* QEMU_MEMFD_H */
@@ -214,6 +214,8 @@ struct kvm_run;
  * @host_tid: Host thread ID.
  * @running: #true if CPU is currently running (usermode).
  * @created: Indicates whether the CPU thread has been successfully created.
+ * @throttle_thread_scheduled: Set while a throttle sleep is queued for this
+ *           CPU, so that a slow CPU does not pile them up.
  * @interrupt_request: Indicates a pending interrupt request.
  * @halted: Nonzero if the CPU is in suspended state.
  * @stop: Indicates a pending stop request.
@@ -258,6 +260,7 @@ struct CPUState {
     struct QemuCond *halt_cond;
     struct qemu_work_item *queued_work_first, *queued_work_last;
     bool thread_kicked;
+    bool throttle_thread_scheduled;
     bool created;
     bool stop;
     bool stopped;
@@ -531,6 +534,37 @@ void run_on_cpu(CPUState *cpu, void (*func)(void *data), void *data);
  */
 void async_run_on_cpu(CPUState *cpu, void (*func)(void *data), void *data);
 
+/**
+ * cpu_throttle_set:
+ * @new_throttle_pct: Percent of sleep time, between 1 and 99.
+ *
+ * Throttles all vCPUs by forcing them to sleep for the given percentage
+ * of time.  Once called, the throttle stays active until cpu_throttle_stop()
+ * and the percentage can be changed by calling this again.
+ */
+void cpu_throttle_set(int new_throttle_pct);
+
+/**
+ * cpu_throttle_stop:
+ *
+ * Stops the vCPU throttling started by cpu_throttle_set().
+ */
+void cpu_throttle_stop(void);
+
+/**
+ * cpu_throttle_active:
+ *
+ * Returns: %true if the vCPUs are currently being throttled.
+ */
+bool cpu_throttle_active(void);
+
+/**
+ * cpu_throttle_get_percentage:
+ *
+ * Returns: The throttle percentage, or 0 if the vCPUs are not throttled.
+ */
+int cpu_throttle_get_percentage(void);
+
 /**
  * qemu_get_cpu:
  * @index: The CPUState@cpu_index value of the CPU to obtain.
@@ -25,6 +25,7 @@
 /* in ms */
 #define GUI_REFRESH_INTERVAL_DEFAULT    30
 #define GUI_REFRESH_INTERVAL_IDLE     3000
+#define GUI_REFRESH_CAP_MAX          60000
 
 typedef void QEMUPutKBDEvent(void *opaque, int keycode);
 typedef void QEMUPutLEDEvent(void *opaque, int ledstate);
@@ -117,6 +118,7 @@ struct DisplaySurface {
     pixman_format_code_t format;
     pixman_image_t *image;
     uint8_t flags;
+    int shmfd;          /* memfd holding the pixels, or -1 */
 };
 
 typedef struct QemuUIInfo {
@@ -150,6 +152,11 @@ void cursor_get_mono_mask(QEMUCursor *c, int transparent, uint8_t *mask);
 
 typedef struct DisplayChangeListenerOps {
     const char *dpy_name;
+    /*
+     * dpy_refresh also polls for user input, so the refresh governor
+     * must not slow it down while the display is idle.
+     */
+    bool dpy_refresh_polls_input;
 
     void (*dpy_refresh)(DisplayChangeListener *dcl);
 
@@ -182,6 +189,14 @@ struct DisplayChangeListener {
     DisplayState *ds;
     QemuConsole *con;
 
+    /* refresh governor state, managed by console.c */
+    uint64_t refresh_interval;
+    uint64_t last_refresh;
+    bool refresh_activity;
+    uint64_t refresh_count;
+    uint64_t refresh_active_count;
+    uint64_t refresh_cpu_ns;
+
     QLIST_ENTRY(DisplayChangeListener) next;
 };
 
@@ -214,8 +229,13 @@ static inline int is_buffer_shared(DisplaySurface *surface)
 }
 
 void register_displaychangelistener(DisplayChangeListener *dcl);
+void qemu_console_set_shm_surfaces(bool enable);
 void update_displaychangelistener(DisplayChangeListener *dcl,
                                   uint64_t interval);
+/* The listener has output pending: don't back off on the next refresh. */
+void dpy_refresh_pending(DisplayChangeListener *dcl);
+/* The user did something: refresh every listener at its normal rate. */
+void dpy_input_activity(void);
 void unregister_displaychangelistener(DisplayChangeListener *dcl);
 
 int dpy_set_ui_info(QemuConsole *con, QemuUIInfo *info);
@@ -327,6 +347,10 @@ void sdl_display_init(DisplayState *ds, int full_screen, int no_frame);
 /* cocoa.m */
 void cocoa_display_init(DisplayState *ds, int full_screen);
 
+/* shm-display.c */
+QemuOpts *shm_display_parse(const char *str);
+int shm_display_init_func(QemuOpts *opts, void *opaque);
+
 /* vnc.c */
 void vnc_display_init(const char *id);
 void vnc_display_open(const char *id, Error **errp);
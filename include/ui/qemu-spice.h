@@ -36,6 +36,7 @@ void qemu_spice_audio_init(void);
 void qemu_spice_display_init(void);
 int qemu_spice_display_add_client(int csock, int skipauth, int tls);
 int qemu_spice_add_interface(SpiceBaseInstance *sin);
+void qemu_spice_remove_interface(SpiceBaseInstance *sin);
 bool qemu_spice_have_display_interface(QemuConsole *con);
 int qemu_spice_add_display_interface(QXLInstance *qxlin, QemuConsole *con);
 int qemu_spice_set_passwd(const char *passwd,
@@ -45,6 +46,15 @@ int qemu_spice_migrate_info(const char *hostname, int port, int tls_port,
                             const char *subject,
                             MonitorCompletion cb, void *opaque);
 
+/*
+ * With -spice iothread=<id>, calls into the spice server must hold the
+ * AioContext of that thread; this is a no-op when spice runs in the main
+ * loop.  Take the global mutex first.  Server callbacks always run with
+ * the global mutex held.
+ */
+void qemu_spice_lock(void);
+void qemu_spice_unlock(void);
+
 CharDriverState *qemu_chr_open_spice_vmc(const char *type);
 #if SPICE_SERVER_VERSION >= 0x000c02
 CharDriverState *qemu_chr_open_spice_port(const char *name);
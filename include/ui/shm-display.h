@@ -0,0 +1,76 @@
+/*
+ * QEMU shared memory display: wire protocol
+ *
+ * Copyright (c) 2015 agent <agent@local>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * A viewer running on the same host connects to the unix socket given
+ * with -shm-display and gets file descriptors for the console surface
+ * instead of the pixels themselves.
+ *
+ * Every message is a ShmDisplayMsg, sent by QEMU only.  Surface and
+ * ring descriptors are attached as SCM_RIGHTS ancillary data; they are
+ * read-only, and sealed against resizing where the host supports it:
+ *
+ * HELLO    carries the ring fd.  Map ShmDisplayRing::size entries of it
+ *          read-only.  Always the first message.
+ * SURFACE  carries the surface fd; width, height, stride and (pixman)
+ *          format describe it.  The whole surface must be redrawn.
+ *          Sent after HELLO and whenever the guest changes mode.
+ * DAMAGE   rectangles up to ring index @head (exclusive) are valid.
+ *
+ * Damage rectangles are written to rects[head % size] before head is
+ * incremented.  A viewer remembers the last head it has processed; if
+ * the new head is more than @size ahead, or if head moved past that
+ * point while the viewer was reading, rectangles were overwritten and
+ * the whole surface must be redrawn.  The generation field in the ring
+ * and in SURFACE messages lets the viewer ignore damage meant for a
+ * surface it has already dropped.
+ */
+
+#ifndef UI_SHM_DISPLAY_H
+#define UI_SHM_DISPLAY_H
+
+#include <stdint.h>
+
+#define SHM_DISPLAY_MAGIC       0x44485351      /* "QSHD" */
+#define SHM_DISPLAY_VERSION     1
+#define SHM_DISPLAY_RING_SIZE   1024
+
+typedef struct ShmDisplayRect {
+    uint32_t x;
+    uint32_t y;
+    uint32_t w;
+    uint32_t h;
+} ShmDisplayRect;
+
+typedef struct ShmDisplayRing {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t size;              /* number of entries in rects[] */
+    uint32_t generation;        /* current surface */
+    uint32_t head;              /* free running */
+    uint32_t padding[3];
+    ShmDisplayRect rects[];
+} ShmDisplayRing;
+
+enum {
+    SHM_DISPLAY_MSG_HELLO = 1,
+    SHM_DISPLAY_MSG_SURFACE,
+    SHM_DISPLAY_MSG_DAMAGE,
+};
+
+typedef struct ShmDisplayMsg {
+    uint32_t type;
+    uint32_t generation;
+    uint32_t width;
+    uint32_t height;
+    uint32_t stride;
+    uint32_t format;
+    uint32_t head;
+    uint32_t padding;
+} ShmDisplayMsg;
+
+#endif /* UI_SHM_DISPLAY_H */
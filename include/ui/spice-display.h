@@ -67,6 +67,21 @@ typedef struct QXLCookie {
 
 QXLCookie *qxl_cookie_new(int type, uint64_t io);
 
+/*
+ * Simple display updates are sent as SPICE_TILE_SIZE square tiles on a
+ * fixed grid.  The ids of tiles sent recently are remembered in a set
+ * associative table, so that content showing up again can be marked for
+ * caching by the client.
+ */
+#define SPICE_TILE_SIZE         64
+#define SPICE_IMAGE_SETS        512
+#define SPICE_IMAGE_WAYS        8
+
+typedef struct SpiceImageEntry {
+    uint64_t id;
+    uint64_t used;              /* image_clock of the last lookup */
+} SpiceImageEntry;
+
 typedef struct SimpleSpiceDisplay SimpleSpiceDisplay;
 typedef struct SimpleSpiceUpdate SimpleSpiceUpdate;
 typedef struct SimpleSpiceCursor SimpleSpiceCursor;
@@ -85,6 +100,8 @@ struct SimpleSpiceDisplay {
 
     QXLRect dirty;
     int notify;
+    SpiceImageEntry image_ids[SPICE_IMAGE_SETS][SPICE_IMAGE_WAYS];
+    uint64_t image_clock;
 
     /*
      * All struct members below this comment can be accessed from
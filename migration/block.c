@@ -16,6 +16,7 @@
 #include "qemu-common.h"
 #include "block/block.h"
 #include "qemu/error-report.h"
+#include "qemu/hbitmap.h"
 #include "qemu/main-loop.h"
 #include "hw/hw.h"
 #include "qemu/queue.h"
@@ -36,6 +37,9 @@
 
 #define MAX_IS_ALLOCATED_SEARCH 65536
 
+/* chunks kept in flight or queued for sending, whatever the rate limit */
+#define BLK_MIG_MIN_INFLIGHT 16
+
 //#define DEBUG_BLK_MIGRATION
 
 #ifdef DEBUG_BLK_MIGRATION
@@ -57,6 +61,7 @@ typedef struct BlkMigDevState {
     int bulk_completed;
     int64_t cur_sector;
     int64_t cur_dirty;
+    HBitmapIter dirty_iter;
 
     /* Protected by block migration lock.  */
     unsigned long *aio_bitmap;
@@ -98,6 +103,11 @@ typedef struct BlkMigState {
     int prev_progress;
     int bulk_completed;
 
+    /* Written by migration thread, read without a lock by query-migrate.  */
+    uint64_t zero_chunks;
+    uint64_t normal_chunks;
+    uint64_t normal_bytes;
+
     /* Lock must be taken _inside_ the iothread lock.  */
     QemuMutex lock;
 } BlkMigState;
@@ -141,11 +151,14 @@ static void blk_send(QEMUFile *f, BlkMigBlock * blk)
      * bandwidth is now a lot higher than the storage device bandwidth.
      * thus if we queue zero blocks we slow down the migration */
     if (flags & BLK_MIG_FLAG_ZERO_BLOCK) {
+        block_mig_state.zero_chunks++;
         qemu_fflush(f);
         return;
     }
 
     qemu_put_buffer(f, blk->buf, BLOCK_SIZE);
+    block_mig_state.normal_chunks++;
+    block_mig_state.normal_bytes += BLOCK_SIZE;
 }
 
 int blk_mig_active(void)
@@ -182,6 +195,21 @@ uint64_t blk_mig_bytes_total(void)
     return sum << BDRV_SECTOR_BITS;
 }
 
+uint64_t blk_mig_zero_chunks(void)
+{
+    return block_mig_state.zero_chunks;
+}
+
+uint64_t blk_mig_normal_chunks(void)
+{
+    return block_mig_state.normal_chunks;
+}
+
+uint64_t blk_mig_normal_bytes(void)
+{
+    return block_mig_state.normal_bytes;
+}
+
 
 /* Called with migration lock held.  */
 
@@ -258,7 +286,9 @@ static int mig_save_device_bulk(QEMUFile *f, BlkMigDevState *bmds)
     int64_t cur_sector = bmds->cur_sector;
     BlockDriverState *bs = bmds->bs;
     BlkMigBlock *blk;
+    int64_t status;
     int nr_sectors;
+    int pnum;
 
     if (bmds->shared_base) {
         qemu_mutex_lock_iothread();
@@ -301,8 +331,16 @@ static int mig_save_device_bulk(QEMUFile *f, BlkMigDevState *bmds)
     blk_mig_unlock();
 
     qemu_mutex_lock_iothread();
-    blk->aiocb = bdrv_aio_readv(bs, cur_sector, &blk->qiov,
-                                nr_sectors, blk_mig_read_cb, blk);
+    status = bdrv_get_block_status(bs, cur_sector, nr_sectors, &pnum);
+    if (status >= 0 && (status & BDRV_BLOCK_ZERO) && pnum == nr_sectors) {
+        /* the chunk reads as zeroes, no need to ask the disk for it */
+        memset(blk->buf, 0, BLOCK_SIZE);
+        blk->aiocb = NULL;
+        blk_mig_read_cb(blk, 0);
+    } else {
+        blk->aiocb = bdrv_aio_readv(bs, cur_sector, &blk->qiov,
+                                    nr_sectors, blk_mig_read_cb, blk);
+    }
 
     bdrv_reset_dirty_bitmap(bs, bmds->dirty_bitmap, cur_sector, nr_sectors);
     qemu_mutex_unlock_iothread();
@@ -359,6 +397,9 @@ static void init_blk_migration(QEMUFile *f)
     block_mig_state.prev_progress = -1;
     block_mig_state.bulk_completed = 0;
     block_mig_state.zero_blocks = migrate_zero_blocks();
+    block_mig_state.zero_chunks = 0;
+    block_mig_state.normal_chunks = 0;
+    block_mig_state.normal_bytes = 0;
 
     for (bs = bdrv_next(NULL); bs; bs = bdrv_next(bs)) {
         if (bdrv_is_read_only(bs)) {
@@ -394,7 +435,11 @@ static void init_blk_migration(QEMUFile *f)
     }
 }
 
-/* Called with no lock taken.  */
+/* Called with no lock taken.
+ *
+ * Reads one chunk of every device that is still in the bulk phase, so
+ * that devices on different disks are read in parallel.
+ */
 
 static int blk_mig_save_bulked_block(QEMUFile *f)
 {
@@ -411,7 +456,6 @@ static int blk_mig_save_bulked_block(QEMUFile *f)
             }
             completed_sector_sum += bmds->completed_sectors;
             ret = 1;
-            break;
         } else {
             completed_sector_sum += bmds->completed_sectors;
         }
@@ -442,7 +486,12 @@ static void blk_mig_reset_dirty_cursor(void)
     }
 }
 
-/* Called with iothread lock taken.  */
+/* Called with iothread lock taken.
+ *
+ * Dirty chunks are found with an iterator on the dirty bitmap, which
+ * skips clean regions a word of the bitmap's upper levels at a time.
+ * Resetting the cursor restarts the walk from the first sector.
+ */
 
 static int mig_save_device_dirty(QEMUFile *f, BlkMigDevState *bmds,
                                  int is_async)
@@ -453,59 +502,65 @@ static int mig_save_device_dirty(QEMUFile *f, BlkMigDevState *bmds,
     int nr_sectors;
     int ret = -EIO;
 
-    for (sector = bmds->cur_dirty; sector < bmds->total_sectors;) {
-        blk_mig_lock();
-        if (bmds_aio_inflight(bmds, sector)) {
-            blk_mig_unlock();
-            bdrv_drain_all();
-        } else {
-            blk_mig_unlock();
-        }
-        if (bdrv_get_dirty(bmds->bs, bmds->dirty_bitmap, sector)) {
+    if (bmds->cur_dirty >= total_sectors) {
+        return 1;
+    }
+    if (bmds->cur_dirty == 0) {
+        bdrv_dirty_iter_init(bmds->bs, bmds->dirty_bitmap, &bmds->dirty_iter);
+    }
 
-            if (total_sectors - sector < BDRV_SECTORS_PER_DIRTY_CHUNK) {
-                nr_sectors = total_sectors - sector;
-            } else {
-                nr_sectors = BDRV_SECTORS_PER_DIRTY_CHUNK;
-            }
-            blk = g_new(BlkMigBlock, 1);
-            blk->buf = g_malloc(BLOCK_SIZE);
-            blk->bmds = bmds;
-            blk->sector = sector;
-            blk->nr_sectors = nr_sectors;
-
-            if (is_async) {
-                blk->iov.iov_base = blk->buf;
-                blk->iov.iov_len = nr_sectors * BDRV_SECTOR_SIZE;
-                qemu_iovec_init_external(&blk->qiov, &blk->iov, 1);
-
-                blk->aiocb = bdrv_aio_readv(bmds->bs, sector, &blk->qiov,
-                                            nr_sectors, blk_mig_read_cb, blk);
-
-                blk_mig_lock();
-                block_mig_state.submitted++;
-                bmds_set_aio_inflight(bmds, sector, nr_sectors, 1);
-                blk_mig_unlock();
-            } else {
-                ret = bdrv_read(bmds->bs, sector, blk->buf, nr_sectors);
-                if (ret < 0) {
-                    goto error;
-                }
-                blk_send(f, blk);
+    sector = hbitmap_iter_next(&bmds->dirty_iter);
+    if (sector < 0 || sector >= total_sectors) {
+        bmds->cur_dirty = total_sectors;
+        return 1;
+    }
 
-                g_free(blk->buf);
-                g_free(blk);
-            }
+    blk_mig_lock();
+    if (bmds_aio_inflight(bmds, sector)) {
+        blk_mig_unlock();
+        bdrv_drain_all();
+    } else {
+        blk_mig_unlock();
+    }
 
-            bdrv_reset_dirty_bitmap(bmds->bs, bmds->dirty_bitmap, sector,
-                                    nr_sectors);
-            break;
+    if (total_sectors - sector < BDRV_SECTORS_PER_DIRTY_CHUNK) {
+        nr_sectors = total_sectors - sector;
+    } else {
+        nr_sectors = BDRV_SECTORS_PER_DIRTY_CHUNK;
+    }
+    blk = g_new(BlkMigBlock, 1);
+    blk->buf = g_malloc(BLOCK_SIZE);
+    blk->bmds = bmds;
+    blk->sector = sector;
+    blk->nr_sectors = nr_sectors;
+
+    if (is_async) {
+        blk->iov.iov_base = blk->buf;
+        blk->iov.iov_len = nr_sectors * BDRV_SECTOR_SIZE;
+        qemu_iovec_init_external(&blk->qiov, &blk->iov, 1);
+
+        blk->aiocb = bdrv_aio_readv(bmds->bs, sector, &blk->qiov,
+                                    nr_sectors, blk_mig_read_cb, blk);
+
+        blk_mig_lock();
+        block_mig_state.submitted++;
+        bmds_set_aio_inflight(bmds, sector, nr_sectors, 1);
+        blk_mig_unlock();
+    } else {
+        ret = bdrv_read(bmds->bs, sector, blk->buf, nr_sectors);
+        if (ret < 0) {
+            goto error;
         }
-        sector += BDRV_SECTORS_PER_DIRTY_CHUNK;
-        bmds->cur_dirty = sector;
+        blk_send(f, blk);
+
+        g_free(blk->buf);
+        g_free(blk);
     }
 
-    return (bmds->cur_dirty >= bmds->total_sectors);
+    bdrv_reset_dirty_bitmap(bmds->bs, bmds->dirty_bitmap, sector, nr_sectors);
+    bmds->cur_dirty = sector + nr_sectors;
+
+    return (bmds->cur_dirty >= total_sectors);
 
 error:
     DPRINTF("Error reading sector %" PRId64 "\n", sector);
@@ -515,6 +570,8 @@ error:
 }
 
 /* Called with iothread lock taken.
+ *
+ * Saves one dirty chunk of every device that has some left.
  *
  * return value:
  * 0: too much data for max_downtime
@@ -524,11 +581,15 @@ static int blk_mig_save_dirty_block(QEMUFile *f, int is_async)
 {
     BlkMigDevState *bmds;
     int ret = 1;
+    int dev_ret;
 
     QSIMPLEQ_FOREACH(bmds, &block_mig_state.bmds_list, entry) {
-        ret = mig_save_device_dirty(f, bmds, is_async);
-        if (ret <= 0) {
-            break;
+        dev_ret = mig_save_device_dirty(f, bmds, is_async);
+        if (dev_ret < 0) {
+            return dev_ret;
+        }
+        if (dev_ret == 0) {
+            ret = 0;
         }
     }
 
@@ -667,11 +728,12 @@ static int block_save_iterate(QEMUFile *f, void *opaque)
 
     blk_mig_reset_dirty_cursor();
 
-    /* control the rate of transfer */
+    /* control the rate of transfer, but keep the disks busy */
     blk_mig_lock();
     while ((block_mig_state.submitted +
             block_mig_state.read_done) * BLOCK_SIZE <
-           qemu_file_get_rate_limit(f)) {
+           MAX(qemu_file_get_rate_limit(f),
+               BLK_MIG_MIN_INFLIGHT * BLOCK_SIZE)) {
         blk_mig_unlock();
         if (block_mig_state.bulk_completed == 0) {
             /* first finish the bulk phase */
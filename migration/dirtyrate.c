@@ -0,0 +1,191 @@
+/*
+ * Guest dirty rate measurement
+ *
+ * Copyright (C) 2015 agent <agent@local>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * Estimates how fast the guest dirties memory without starting a
+ * migration or enabling dirty logging: a random sample of pages is
+ * hashed, hashed again after a while, and the share of pages that
+ * changed is scaled to the size of guest RAM.
+ */
+
+#include <zlib.h>
+#include "qemu-common.h"
+#include "qemu/atomic.h"
+#include "qemu/thread.h"
+#include "qemu/rcu.h"
+#include "qemu/timer.h"
+#include "qapi/qmp/qerror.h"
+#include "exec/cpu-common.h"
+#include "qmp-commands.h"
+#include "trace.h"
+
+/* pages sampled for every GiB of guest RAM */
+#define DIRTYRATE_SAMPLE_PAGES_PER_GB 512
+/* the unit that is sampled, whatever the target page size */
+#define DIRTYRATE_PAGE_SIZE 4096
+#define DIRTYRATE_MAX_CALC_TIME 60
+
+typedef struct DirtyRateBlock {
+    /* blocks are matched by offset and length between the two passes */
+    ram_addr_t offset;
+    ram_addr_t length;
+    unsigned int npages;
+    uint64_t *page_offset;
+    uint32_t *hash;
+} DirtyRateBlock;
+
+typedef struct DirtyRateSample {
+    DirtyRateBlock *blocks;
+    unsigned int nblocks;
+    uint64_t ram_size;
+    uint64_t sampled;
+    uint64_t dirty;
+} DirtyRateSample;
+
+/* Written by the measurement thread before it sets the status. */
+static DirtyRateStatus dirty_rate_status;
+static int64_t dirty_rate_start_time;
+static int64_t dirty_rate_calc_time;
+static int64_t dirty_rate_sample_pages;
+static int64_t dirty_rate_mbps;
+
+static uint32_t dirty_rate_hash(void *host_addr, uint64_t offset)
+{
+    return crc32(0, (uint8_t *)host_addr + offset, DIRTYRATE_PAGE_SIZE);
+}
+
+static void dirty_rate_record_block(void *host_addr, ram_addr_t offset,
+                                    ram_addr_t length, void *opaque)
+{
+    DirtyRateSample *s = opaque;
+    DirtyRateBlock *b;
+    uint64_t num_pages = length / DIRTYRATE_PAGE_SIZE;
+    unsigned int i;
+
+    /* blocks smaller than 2 MiB, such as ROMs, get no sample */
+    if ((length * DIRTYRATE_SAMPLE_PAGES_PER_GB) >> 30 == 0) {
+        return;
+    }
+
+    s->blocks = g_renew(DirtyRateBlock, s->blocks, s->nblocks + 1);
+    b = &s->blocks[s->nblocks++];
+    b->offset = offset;
+    b->length = length;
+    b->npages = (length * DIRTYRATE_SAMPLE_PAGES_PER_GB) >> 30;
+    b->page_offset = g_new(uint64_t, b->npages);
+    b->hash = g_new(uint32_t, b->npages);
+
+    for (i = 0; i < b->npages; i++) {
+        uint64_t r = ((uint64_t)g_random_int() << 32) | g_random_int();
+
+        b->page_offset[i] = (r % num_pages) * DIRTYRATE_PAGE_SIZE;
+        b->hash[i] = dirty_rate_hash(host_addr, b->page_offset[i]);
+    }
+    s->ram_size += length;
+    s->sampled += b->npages;
+}
+
+static void dirty_rate_compare_block(void *host_addr, ram_addr_t offset,
+                                     ram_addr_t length, void *opaque)
+{
+    DirtyRateSample *s = opaque;
+    unsigned int i, j;
+
+    for (i = 0; i < s->nblocks; i++) {
+        DirtyRateBlock *b = &s->blocks[i];
+
+        if (b->offset != offset || b->length != length) {
+            continue;
+        }
+        for (j = 0; j < b->npages; j++) {
+            if (dirty_rate_hash(host_addr, b->page_offset[j]) != b->hash[j]) {
+                s->dirty++;
+            }
+        }
+        return;
+    }
+}
+
+static void *dirty_rate_thread(void *opaque)
+{
+    DirtyRateSample s = { 0 };
+    int64_t start, elapsed, mbps = 0;
+    unsigned int i;
+
+    rcu_register_thread();
+
+    /* the pages are hashed inside the RCU critical section of
+     * qemu_ram_foreach_block, so blocks cannot go away under us
+     */
+    qemu_ram_foreach_block(dirty_rate_record_block, &s);
+    start = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    g_usleep(dirty_rate_calc_time * G_USEC_PER_SEC);
+    qemu_ram_foreach_block(dirty_rate_compare_block, &s);
+    elapsed = qemu_clock_get_ms(QEMU_CLOCK_REALTIME) - start;
+
+    if (s.sampled && elapsed) {
+        mbps = (double)s.dirty / s.sampled * s.ram_size / (1 << 20) *
+               1000 / elapsed;
+    }
+    trace_dirty_rate_calc(s.sampled, s.dirty, elapsed, mbps);
+
+    for (i = 0; i < s.nblocks; i++) {
+        g_free(s.blocks[i].page_offset);
+        g_free(s.blocks[i].hash);
+    }
+    g_free(s.blocks);
+
+    dirty_rate_sample_pages = s.sampled;
+    dirty_rate_mbps = mbps;
+    smp_wmb();
+    atomic_set(&dirty_rate_status, DIRTY_RATE_STATUS_MEASURED);
+
+    rcu_unregister_thread();
+    return NULL;
+}
+
+void qmp_calc_dirty_rate(int64_t calc_time, Error **errp)
+{
+    QemuThread thread;
+
+    if (atomic_read(&dirty_rate_status) == DIRTY_RATE_STATUS_MEASURING) {
+        error_setg(errp, "A dirty rate measurement is already in progress");
+        return;
+    }
+    if (calc_time < 1 || calc_time > DIRTYRATE_MAX_CALC_TIME) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "calc-time",
+                  "a value between 1 and 60");
+        return;
+    }
+
+    dirty_rate_start_time = qemu_clock_get_ms(QEMU_CLOCK_HOST) / 1000;
+    dirty_rate_calc_time = calc_time;
+    atomic_set(&dirty_rate_status, DIRTY_RATE_STATUS_MEASURING);
+    qemu_thread_create(&thread, "dirtyrate", dirty_rate_thread, NULL,
+                       QEMU_THREAD_DETACHED);
+}
+
+DirtyRateInfo *qmp_query_dirty_rate(Error **errp)
+{
+    DirtyRateInfo *info = g_malloc0(sizeof(*info));
+
+    info->status = atomic_read(&dirty_rate_status);
+    smp_rmb();
+    if (info->status != DIRTY_RATE_STATUS_UNSTARTED) {
+        info->has_start_time = true;
+        info->start_time = dirty_rate_start_time;
+        info->has_calc_time = true;
+        info->calc_time = dirty_rate_calc_time;
+    }
+    if (info->status == DIRTY_RATE_STATUS_MEASURED) {
+        info->has_dirty_rate = true;
+        info->dirty_rate = dirty_rate_mbps;
+        info->has_sample_pages = true;
+        info->sample_pages = dirty_rate_sample_pages;
+    }
+    return info;
+}
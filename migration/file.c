@@ -0,0 +1,608 @@
+/*
+ * Migration to and from a local file with page-indexed RAM
+ *
+ * Copyright (C) 2015 agent <agent@local>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * The file holds a normal migration stream, except that RAM migration
+ * reserves a region of the file for every RAM block, and writes each
+ * page at its offset in the block's region instead of putting it in the
+ * stream.  The stream itself is written at the end of the file and skips
+ * over the regions.  Pages dirtied again are simply written again, zero
+ * pages never written stay holes, and the restore can read just the
+ * pages that were saved, in parallel, or map them.
+ *
+ * Pages go through a separate file descriptor, opened with O_DIRECT if
+ * the file system allows, and are handed to a few worker threads in
+ * batches of contiguous pages.
+ *
+ * savevm uses the same layout for the VM state area of a disk image,
+ * through FileMigrationOps.
+ */
+
+#include <sys/mman.h>
+#include "qemu-common.h"
+#include "qemu/error-report.h"
+#include "qemu/main-loop.h"
+#include "qemu/thread.h"
+#include "qemu/atomic.h"
+#include "qemu/iov.h"
+#include "migration/migration.h"
+#include "migration/file.h"
+#include "migration/qemu-file.h"
+#include "migration/qemu-file-internal.h"
+#include "trace.h"
+
+/* Iovecs and bytes in one request handed to a worker */
+#define FILE_REQUEST_IOV_MAX 64
+#define FILE_REQUEST_SIZE (1 << 20)
+
+typedef struct FileRequest {
+    int64_t offset;
+    size_t size;
+    unsigned int iovcnt;
+    struct iovec iov[FILE_REQUEST_IOV_MAX];
+} FileRequest;
+
+typedef struct FileMigration FileMigration;
+
+typedef struct FileWorker {
+    FileMigration *fm;
+    QemuThread thread;
+    /* posted by the migration thread when a request is ready */
+    QemuSemaphore sem;
+    /* posted by the worker when it can take a new request */
+    QemuSemaphore sem_done;
+    bool quit;
+    FileRequest *req;
+} FileWorker;
+
+struct FileMigration {
+    QEMUFile *file;
+    bool writing;
+    /* storage other than a file, or NULL */
+    const FileMigrationOps *ops;
+    void *opaque;
+    /* the stream and the RAM bitmaps */
+    int fd;
+    /* RAM pages */
+    int direct_fd;
+    /* end of the stream so far, when writing */
+    int64_t offset;
+
+    FileWorker *workers;
+    int nworkers;
+    int next;
+    bool error;
+    /* pages being batched by the migration thread */
+    FileRequest *req;
+};
+
+/* There is at most one file: migration, incoming or outgoing */
+static FileMigration *file_migration;
+
+bool file_migration_save_active(void)
+{
+    return file_migration && file_migration->writing;
+}
+
+bool file_migration_load_active(void)
+{
+    return file_migration && !file_migration->writing;
+}
+
+/* Some file systems accept O_DIRECT on open, but not every request.
+ * Returns true if O_DIRECT is now off and the request may be retried;
+ * another worker may have turned it off first.
+ */
+static bool file_drop_direct_io(FileMigration *fm)
+{
+#ifdef O_DIRECT
+    int flags = fcntl(fm->direct_fd, F_GETFL);
+
+    if (flags == -1) {
+        return false;
+    }
+    if (!(flags & O_DIRECT)) {
+        return true;
+    }
+    if (fcntl(fm->direct_fd, F_SETFL, flags & ~O_DIRECT) == 0) {
+        trace_file_migration_direct_io_off();
+        return true;
+    }
+#endif
+    return false;
+}
+
+static int file_ops_transfer(FileMigration *fm, struct iovec *iov, int iovcnt,
+                             int64_t offset)
+{
+    QEMUIOVector qiov;
+
+    qemu_iovec_init_external(&qiov, iov, iovcnt);
+    if (fm->writing) {
+        return fm->ops->writev(fm->opaque, &qiov, offset);
+    }
+    return fm->ops->readv(fm->opaque, &qiov, offset);
+}
+
+static int file_do_request(FileMigration *fm, FileRequest *req)
+{
+    struct iovec *iov = req->iov;
+    unsigned int iovcnt = req->iovcnt;
+    int64_t offset = req->offset;
+    bool retried = false;
+    ssize_t len;
+
+    if (fm->ops) {
+        return file_ops_transfer(fm, iov, iovcnt, offset);
+    }
+    while (iovcnt) {
+        if (fm->writing) {
+            len = pwritev(fm->direct_fd, iov, iovcnt, offset);
+        } else {
+            len = preadv(fm->direct_fd, iov, iovcnt, offset);
+        }
+        if (len < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EINVAL && !retried && file_drop_direct_io(fm)) {
+                retried = true;
+                continue;
+            }
+            return -errno;
+        }
+        if (len == 0) {
+            return -EIO;
+        }
+        offset += len;
+        iov_discard_front(&iov, &iovcnt, len);
+    }
+    return 0;
+}
+
+static void file_run_request(FileMigration *fm, FileRequest *req)
+{
+    int ret = file_do_request(fm, req);
+
+    if (ret < 0) {
+        error_report("file migration: %s of %zu bytes at %" PRId64
+                     " failed: %s", fm->writing ? "write" : "read",
+                     req->size, req->offset, strerror(-ret));
+        atomic_set(&fm->error, true);
+    }
+    req->iovcnt = 0;
+    req->size = 0;
+}
+
+static void *file_worker_thread(void *opaque)
+{
+    FileWorker *w = opaque;
+
+    while (true) {
+        qemu_sem_wait(&w->sem);
+        if (atomic_read(&w->quit)) {
+            break;
+        }
+        file_run_request(w->fm, w->req);
+        qemu_sem_post(&w->sem_done);
+    }
+    return NULL;
+}
+
+/* Hand the batched pages to the next worker, or transfer them now. */
+static int file_dispatch(FileMigration *fm)
+{
+    FileWorker *w;
+    FileRequest *req;
+
+    if (!fm->nworkers) {
+        file_run_request(fm, fm->req);
+        return atomic_read(&fm->error) ? -1 : 0;
+    }
+
+    w = &fm->workers[fm->next];
+    fm->next = (fm->next + 1) % fm->nworkers;
+    qemu_sem_wait(&w->sem_done);
+    if (atomic_read(&fm->error)) {
+        qemu_sem_post(&w->sem_done);
+        return -1;
+    }
+    req = w->req;
+    w->req = fm->req;
+    fm->req = req;
+    qemu_sem_post(&w->sem);
+    return 0;
+}
+
+int file_migration_queue_page(uint64_t offset, void *host, size_t size)
+{
+    FileMigration *fm = file_migration;
+    FileRequest *req = fm->req;
+    struct iovec *last;
+    bool contiguous = false;
+
+    if (req->iovcnt) {
+        last = &req->iov[req->iovcnt - 1];
+        contiguous = (uint8_t *)last->iov_base + last->iov_len == host;
+    }
+    if (req->iovcnt &&
+        (req->offset + req->size != offset ||
+         req->size >= FILE_REQUEST_SIZE ||
+         (req->iovcnt == FILE_REQUEST_IOV_MAX && !contiguous))) {
+        if (file_dispatch(fm) < 0) {
+            return -1;
+        }
+        req = fm->req;
+        contiguous = false;
+    }
+
+    if (!req->iovcnt) {
+        req->offset = offset;
+    }
+    if (contiguous) {
+        req->iov[req->iovcnt - 1].iov_len += size;
+    } else {
+        req->iov[req->iovcnt].iov_base = host;
+        req->iov[req->iovcnt].iov_len = size;
+        req->iovcnt++;
+    }
+    req->size += size;
+    return 0;
+}
+
+int file_migration_sync(void)
+{
+    FileMigration *fm = file_migration;
+    int i;
+
+    if (fm->req->iovcnt && file_dispatch(fm) < 0) {
+        return -1;
+    }
+    for (i = 0; i < fm->nworkers; i++) {
+        qemu_sem_wait(&fm->workers[i].sem_done);
+        qemu_sem_post(&fm->workers[i].sem_done);
+    }
+    return atomic_read(&fm->error) ? -1 : 0;
+}
+
+int file_migration_pwrite(const void *buf, size_t size, uint64_t offset)
+{
+    struct iovec iov = { .iov_base = (void *)buf, .iov_len = size };
+    ssize_t len;
+
+    if (file_migration->ops) {
+        return file_ops_transfer(file_migration, &iov, 1, offset);
+    }
+    while (size) {
+        len = pwrite(file_migration->fd, buf, size, offset);
+        if (len < 0 && errno == EINTR) {
+            continue;
+        } else if (len <= 0) {
+            return len < 0 ? -errno : -EIO;
+        }
+        buf = (const uint8_t *)buf + len;
+        size -= len;
+        offset += len;
+    }
+    return 0;
+}
+
+int file_migration_pread(void *buf, size_t size, uint64_t offset)
+{
+    struct iovec iov = { .iov_base = buf, .iov_len = size };
+    ssize_t len;
+
+    if (file_migration->ops) {
+        return file_ops_transfer(file_migration, &iov, 1, offset);
+    }
+    while (size) {
+        len = pread(file_migration->fd, buf, size, offset);
+        if (len < 0 && errno == EINTR) {
+            continue;
+        } else if (len <= 0) {
+            return len < 0 ? -errno : -EIO;
+        }
+        buf = (uint8_t *)buf + len;
+        size -= len;
+        offset += len;
+    }
+    return 0;
+}
+
+int file_migration_map(void *host, size_t size, uint64_t offset)
+{
+    FileMigration *fm = file_migration;
+    void *p;
+
+    if (fm->ops) {
+        if (!fm->ops->map) {
+            return -ENOTSUP;
+        }
+        return fm->ops->map(fm->opaque, host, size, offset);
+    }
+    p = mmap(host, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED,
+             file_migration->fd, offset);
+    if (p == MAP_FAILED) {
+        return -errno;
+    }
+    qemu_madvise(host, size, QEMU_MADV_WILLNEED);
+    return 0;
+}
+
+int64_t file_migration_skip(QEMUFile *f, uint64_t size)
+{
+    FileMigration *fm = file_migration;
+    int64_t start;
+
+    if (fm->writing) {
+        qemu_fflush(f);
+        start = ROUND_UP(fm->offset, FILE_MIGRATION_ALIGN);
+        fm->offset = start + size;
+        if (fm->ops && fm->ops->discard) {
+            int ret = fm->ops->discard(fm->opaque, start,
+                                       ROUND_UP(size, FILE_MIGRATION_ALIGN));
+            if (ret < 0) {
+                qemu_file_set_error(f, ret);
+            }
+        }
+    } else {
+        /* drop what was read ahead, the stream goes on after the region */
+        start = f->pos - (f->buf_size - f->buf_index);
+        start = ROUND_UP(start, FILE_MIGRATION_ALIGN);
+        f->pos = start + size;
+        f->buf_index = 0;
+        f->buf_size = 0;
+    }
+    trace_file_migration_skip(start, size);
+    return start;
+}
+
+int64_t file_migration_size(void)
+{
+    return file_migration->offset;
+}
+
+/* The stream: writes append, whatever QEMUFile thinks the position is,
+ * because RAM pages are credited to it without going through it.
+ */
+static ssize_t file_writev_buffer(void *opaque, struct iovec *iov, int iovcnt,
+                                  int64_t pos)
+{
+    FileMigration *fm = opaque;
+    unsigned int cnt = iovcnt;
+    ssize_t done = 0, len;
+
+    if (fm->ops) {
+        len = iov_size(iov, iovcnt);
+        done = file_ops_transfer(fm, iov, iovcnt, fm->offset);
+        if (done < 0) {
+            return done;
+        }
+        fm->offset += len;
+        return len;
+    }
+    while (cnt) {
+        len = pwritev(fm->fd, iov, cnt, fm->offset);
+        if (len < 0 && errno == EINTR) {
+            continue;
+        } else if (len < 0) {
+            return -errno;
+        }
+        fm->offset += len;
+        done += len;
+        iov_discard_front(&iov, &cnt, len);
+    }
+    return done;
+}
+
+static int file_get_buffer(void *opaque, uint8_t *buf, int64_t pos, int size)
+{
+    FileMigration *fm = opaque;
+    struct iovec iov = { .iov_base = buf, .iov_len = size };
+    ssize_t len;
+
+    if (fm->ops && fm->ops->get_buffer) {
+        return fm->ops->get_buffer(fm->opaque, buf, pos, size);
+    } else if (fm->ops) {
+        len = file_ops_transfer(fm, &iov, 1, pos);
+        return len < 0 ? len : size;
+    }
+    do {
+        len = pread(fm->fd, buf, size, pos);
+    } while (len < 0 && errno == EINTR);
+    return len < 0 ? -errno : len;
+}
+
+static ssize_t file_readv_buffer(void *opaque, struct iovec *iov, int iovcnt,
+                                 int64_t pos)
+{
+    FileMigration *fm = opaque;
+    ssize_t len;
+
+    if (fm->ops) {
+        len = file_ops_transfer(fm, iov, iovcnt, pos);
+        return len < 0 ? len : iov_size(iov, iovcnt);
+    }
+    do {
+        len = preadv(fm->fd, iov, iovcnt, pos);
+    } while (len < 0 && errno == EINTR);
+    return len < 0 ? -errno : len;
+}
+
+static int file_get_fd(void *opaque)
+{
+    FileMigration *fm = opaque;
+
+    return fm->fd;
+}
+
+static int file_close(void *opaque)
+{
+    FileMigration *fm = opaque;
+    int ret = 0;
+    int i;
+
+    for (i = 0; i < fm->nworkers; i++) {
+        atomic_set(&fm->workers[i].quit, true);
+        qemu_sem_post(&fm->workers[i].sem);
+    }
+    for (i = 0; i < fm->nworkers; i++) {
+        FileWorker *w = &fm->workers[i];
+
+        qemu_thread_join(&w->thread);
+        qemu_sem_destroy(&w->sem);
+        qemu_sem_destroy(&w->sem_done);
+        g_free(w->req);
+    }
+
+    if (fm->ops) {
+        ret = fm->ops->close(fm->opaque);
+    } else {
+        if (fm->writing && fsync(fm->fd) < 0) {
+            ret = -errno;
+        }
+        close(fm->direct_fd);
+        if (close(fm->fd) < 0 && !ret) {
+            ret = -errno;
+        }
+    }
+
+    g_free(fm->workers);
+    g_free(fm->req);
+    g_free(fm);
+    file_migration = NULL;
+    return ret;
+}
+
+static const QEMUFileOps file_read_ops = {
+    .get_fd =       file_get_fd,
+    .get_buffer =   file_get_buffer,
+    .readv_buffer = file_readv_buffer,
+    .close =        file_close
+};
+
+static const QEMUFileOps file_write_ops = {
+    .get_fd =        file_get_fd,
+    .writev_buffer = file_writev_buffer,
+    .close =         file_close
+};
+
+static QEMUFile *file_migration_open(const char *path, bool writing,
+                                     Error **errp)
+{
+    FileMigration *fm;
+    int flags = writing ? O_WRONLY : O_RDONLY;
+    int fd, direct_fd = -1;
+    int i;
+
+    if (file_migration) {
+        error_setg(errp, "A file migration is already in progress");
+        return NULL;
+    }
+
+    /*
+     * A guest restored with file-mmap still has its RAM mapped from the
+     * old file; truncating that inode would SIGBUS the guest, so give the
+     * new save a fresh inode instead.
+     */
+    if (writing && unlink(path) < 0 && errno != ENOENT) {
+        error_setg_errno(errp, errno, "Cannot remove '%s'", path);
+        return NULL;
+    }
+    fd = qemu_open(path, writing ? flags | O_CREAT | O_EXCL : flags, 0600);
+    if (fd < 0) {
+        error_setg_errno(errp, errno, "Cannot open '%s'", path);
+        return NULL;
+    }
+#ifdef O_DIRECT
+    direct_fd = qemu_open(path, flags | O_DIRECT);
+#endif
+    if (direct_fd < 0) {
+        direct_fd = qemu_open(path, flags);
+    }
+    if (direct_fd < 0) {
+        error_setg_errno(errp, errno, "Cannot open '%s'", path);
+        close(fd);
+        return NULL;
+    }
+    trace_file_migration_open(path, writing);
+
+    fm = g_new0(FileMigration, 1);
+    fm->writing = writing;
+    fm->fd = fd;
+    fm->direct_fd = direct_fd;
+    fm->req = g_new0(FileRequest, 1);
+    fm->nworkers = migrate_multifd_channels();
+    fm->workers = g_new0(FileWorker, fm->nworkers);
+    for (i = 0; i < fm->nworkers; i++) {
+        FileWorker *w = &fm->workers[i];
+
+        w->fm = fm;
+        w->req = g_new0(FileRequest, 1);
+        qemu_sem_init(&w->sem, 0);
+        qemu_sem_init(&w->sem_done, 1);
+        qemu_thread_create(&w->thread, "file_migration", file_worker_thread,
+                           w, QEMU_THREAD_JOINABLE);
+    }
+
+    fm->file = qemu_fopen_ops(fm, writing ? &file_write_ops : &file_read_ops);
+    file_migration = fm;
+    return fm->file;
+}
+
+QEMUFile *file_migration_open_ops(void *opaque, const FileMigrationOps *ops,
+                                  bool writing, Error **errp)
+{
+    FileMigration *fm;
+
+    if (file_migration) {
+        error_setg(errp, "A file migration is already in progress");
+        return NULL;
+    }
+
+    fm = g_new0(FileMigration, 1);
+    fm->writing = writing;
+    fm->ops = ops;
+    fm->opaque = opaque;
+    fm->fd = -1;
+    fm->direct_fd = -1;
+    fm->req = g_new0(FileRequest, 1);
+    fm->file = qemu_fopen_ops(fm, writing ? &file_write_ops : &file_read_ops);
+    file_migration = fm;
+    return fm->file;
+}
+
+void file_start_outgoing_migration(MigrationState *s, const char *path,
+                                   Error **errp)
+{
+    s->file = file_migration_open(path, true, errp);
+    if (!s->file) {
+        return;
+    }
+    migrate_fd_connect(s);
+}
+
+static void file_accept_incoming_migration(void *opaque)
+{
+    QEMUFile *f = opaque;
+
+    qemu_set_fd_handler2(qemu_get_fd(f), NULL, NULL, NULL, NULL);
+    process_incoming_migration(f);
+}
+
+void file_start_incoming_migration(const char *path, Error **errp)
+{
+    QEMUFile *f;
+
+    f = file_migration_open(path, false, errp);
+    if (!f) {
+        return;
+    }
+    /* a regular file is always readable: this just waits for the main loop */
+    qemu_set_fd_handler2(qemu_get_fd(f), NULL, file_accept_incoming_migration,
+                         NULL, f);
+}
@@ -22,6 +22,9 @@
 #include "block/block.h"
 #include "qemu/sockets.h"
 #include "migration/block.h"
+#include "migration/multifd.h"
+#include "migration/file.h"
+#include "qom/cpu.h"
 #include "qemu/thread.h"
 #include "qmp-commands.h"
 #include "trace.h"
@@ -46,6 +49,9 @@ enum {
 /* Migration XBZRLE default cache size */
 #define DEFAULT_MIGRATE_CACHE_SIZE (64 * 1024 * 1024)
 
+/* Extra connections used by the multifd capability */
+#define DEFAULT_MIGRATE_MULTIFD_CHANNELS 2
+
 static NotifierList migration_state_notifiers =
     NOTIFIER_LIST_INITIALIZER(migration_state_notifiers);
 
@@ -61,6 +67,7 @@ MigrationState *migrate_get_current(void)
         .state = MIG_STATE_NONE,
         .bandwidth_limit = MAX_THROTTLE,
         .xbzrle_cache_size = DEFAULT_MIGRATE_CACHE_SIZE,
+        .multifd_channels = DEFAULT_MIGRATE_MULTIFD_CHANNELS,
         .mbps = -1,
     };
 
@@ -99,6 +106,8 @@ void qemu_start_incoming_migration(const char *uri, Error **errp)
         unix_start_incoming_migration(p, errp);
     } else if (strstart(uri, "fd:", &p)) {
         fd_start_incoming_migration(p, errp);
+    } else if (strstart(uri, "file:", &p)) {
+        file_start_incoming_migration(p, errp);
 #endif
     } else {
         error_setg(errp, "unknown migration protocol: %s", uri);
@@ -113,6 +122,7 @@ static void process_incoming_migration_co(void *opaque)
 
     ret = qemu_loadvm_state(f);
     qemu_fclose(f);
+    multifd_load_cleanup();
     free_xbzrle_decoded_buf();
     if (ret < 0) {
         error_report("load of migration failed: %s", strerror(-ret));
@@ -221,6 +231,11 @@ MigrationInfo *qmp_query_migrate(Error **errp)
         info->has_setup_time = true;
         info->setup_time = s->setup_time;
 
+        if (cpu_throttle_active()) {
+            info->has_cpu_throttle_percentage = true;
+            info->cpu_throttle_percentage = cpu_throttle_get_percentage();
+        }
+
         info->has_ram = true;
         info->ram = g_malloc0(sizeof(*info->ram));
         info->ram->transferred = ram_bytes_transferred();
@@ -233,6 +248,13 @@ MigrationInfo *qmp_query_migrate(Error **errp)
         info->ram->dirty_pages_rate = s->dirty_pages_rate;
         info->ram->mbps = s->mbps;
         info->ram->dirty_sync_count = s->dirty_sync_count;
+        info->ram->has_dirty_sync_time = true;
+        info->ram->dirty_sync_time = s->dirty_sync_time;
+        info->ram->has_dirty_sync_time_max = true;
+        info->ram->dirty_sync_time_max = s->dirty_sync_time_max;
+
+        info->sections = qemu_savevm_section_stats();
+        info->has_sections = info->sections != NULL;
 
         if (blk_mig_active()) {
             info->has_disk = true;
@@ -240,6 +262,9 @@ MigrationInfo *qmp_query_migrate(Error **errp)
             info->disk->transferred = blk_mig_bytes_transferred();
             info->disk->remaining = blk_mig_bytes_remaining();
             info->disk->total = blk_mig_bytes_total();
+            info->disk->duplicate = blk_mig_zero_chunks();
+            info->disk->normal = blk_mig_normal_chunks();
+            info->disk->normal_bytes = blk_mig_normal_bytes();
         }
 
         get_xbzrle_cache_stats(info);
@@ -267,6 +292,13 @@ MigrationInfo *qmp_query_migrate(Error **errp)
         info->ram->normal_bytes = norm_mig_bytes_transferred();
         info->ram->mbps = s->mbps;
         info->ram->dirty_sync_count = s->dirty_sync_count;
+        info->ram->has_dirty_sync_time = true;
+        info->ram->dirty_sync_time = s->dirty_sync_time;
+        info->ram->has_dirty_sync_time_max = true;
+        info->ram->dirty_sync_time_max = s->dirty_sync_time_max;
+
+        info->sections = qemu_savevm_section_stats();
+        info->has_sections = info->sections != NULL;
         break;
     case MIG_STATE_ERROR:
         info->has_status = true;
@@ -291,6 +323,11 @@ void qmp_migrate_set_capabilities(MigrationCapabilityStatusList *params,
         error_set(errp, QERR_MIGRATION_ACTIVE);
         return;
     }
+    /* the snapshot restores the capabilities it turned off when done */
+    if (savevm_live_active()) {
+        error_setg(errp, "A live snapshot is in progress");
+        return;
+    }
 
     for (cap = params; cap; cap = cap->next) {
         s->enabled_capabilities[cap->value->capability] = cap->value->state;
@@ -322,6 +359,7 @@ static void migrate_fd_cleanup(void *opaque)
         qemu_fclose(s->file);
         s->file = NULL;
     }
+    multifd_save_cleanup();
 
     assert(s->state != MIG_STATE_ACTIVE);
 
@@ -367,6 +405,7 @@ static void migrate_fd_cancel(MigrationState *s)
      */
     if (s->state == MIG_STATE_CANCELLING && f) {
         qemu_file_shutdown(f);
+        multifd_save_shutdown();
     }
 }
 
@@ -385,6 +424,12 @@ bool migration_in_setup(MigrationState *s)
     return s->state == MIG_STATE_SETUP;
 }
 
+bool migration_is_active(MigrationState *s)
+{
+    return s->state == MIG_STATE_SETUP || s->state == MIG_STATE_ACTIVE ||
+           s->state == MIG_STATE_CANCELLING;
+}
+
 bool migration_has_finished(MigrationState *s)
 {
     return s->state == MIG_STATE_COMPLETED;
@@ -400,8 +445,10 @@ static MigrationState *migrate_init(const MigrationParams *params)
 {
     MigrationState *s = migrate_get_current();
     int64_t bandwidth_limit = s->bandwidth_limit;
+    bool bandwidth_limit_set = s->bandwidth_limit_set;
     bool enabled_capabilities[MIGRATION_CAPABILITY_MAX];
     int64_t xbzrle_cache_size = s->xbzrle_cache_size;
+    int multifd_channels = s->multifd_channels;
 
     memcpy(enabled_capabilities, s->enabled_capabilities,
            sizeof(enabled_capabilities));
@@ -411,8 +458,10 @@ static MigrationState *migrate_init(const MigrationParams *params)
     memcpy(s->enabled_capabilities, enabled_capabilities,
            sizeof(enabled_capabilities));
     s->xbzrle_cache_size = xbzrle_cache_size;
+    s->multifd_channels = multifd_channels;
 
     s->bandwidth_limit = bandwidth_limit;
+    s->bandwidth_limit_set = bandwidth_limit_set;
     s->state = MIG_STATE_SETUP;
     trace_migrate_set_state(MIG_STATE_SETUP);
 
@@ -469,6 +518,12 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
         return;
     }
 
+    if (savevm_live_active()) {
+        error_setg(errp, "Cannot migrate while a live snapshot is in "
+                   "progress");
+        return;
+    }
+
     if (runstate_check(RUN_STATE_INMIGRATE)) {
         error_setg(errp, "Guest is waiting for an incoming migration");
         return;
@@ -483,6 +538,11 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
         return;
     }
 
+    if (migrate_use_multifd() && !strstart(uri, "tcp:", NULL)) {
+        error_setg(errp, "The multifd capability requires a tcp: URI");
+        return;
+    }
+
     s = migrate_init(&params);
 
     if (strstart(uri, "tcp:", &p)) {
@@ -498,6 +558,8 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
         unix_start_outgoing_migration(s, p, &local_err);
     } else if (strstart(uri, "fd:", &p)) {
         fd_start_outgoing_migration(s, p, &local_err);
+    } else if (strstart(uri, "file:", &p)) {
+        file_start_outgoing_migration(s, p, &local_err);
 #endif
     } else {
         error_set(errp, QERR_INVALID_PARAMETER_VALUE, "uri", "a valid migration protocol");
@@ -551,6 +613,36 @@ int64_t qmp_query_migrate_cache_size(Error **errp)
     return migrate_xbzrle_cache_size();
 }
 
+void qmp_migrate_set_multifd_channels(int64_t value, Error **errp)
+{
+    MigrationState *s = migrate_get_current();
+
+    if (s->state == MIG_STATE_ACTIVE || s->state == MIG_STATE_SETUP) {
+        error_set(errp, QERR_MIGRATION_ACTIVE);
+        return;
+    }
+
+    if (value < 1 || value > MULTIFD_MAX_CHANNELS) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "value",
+                  "a number of channels between 1 and 16");
+        return;
+    }
+
+    s->multifd_channels = value;
+}
+
+/*
+ * The default speed limit is there to spare the network.  file: writes to
+ * local storage, so it only gets a limit that was asked for.
+ */
+static int64_t migrate_xfer_limit(MigrationState *s)
+{
+    if (file_migration_save_active() && !s->bandwidth_limit_set) {
+        return INT64_MAX;
+    }
+    return s->bandwidth_limit / XFER_LIMIT_RATIO;
+}
+
 void qmp_migrate_set_speed(int64_t value, Error **errp)
 {
     MigrationState *s;
@@ -564,8 +656,9 @@ void qmp_migrate_set_speed(int64_t value, Error **errp)
 
     s = migrate_get_current();
     s->bandwidth_limit = value;
+    s->bandwidth_limit_set = true;
     if (s->file) {
-        qemu_file_set_rate_limit(s->file, s->bandwidth_limit / XFER_LIMIT_RATIO);
+        qemu_file_set_rate_limit(s->file, migrate_xfer_limit(s));
     }
 }
 
@@ -621,6 +714,33 @@ int64_t migrate_xbzrle_cache_size(void)
     return s->xbzrle_cache_size;
 }
 
+bool migrate_use_multifd(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_MULTIFD];
+}
+
+int migrate_multifd_channels(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->multifd_channels;
+}
+
+bool migrate_use_file_mmap(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_FILE_MMAP];
+}
+
 /* migration thread support */
 
 static void *migration_thread(void *opaque)
@@ -680,7 +800,8 @@ static void *migration_thread(void *opaque)
         }
         current_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
         if (current_time >= initial_time + BUFFER_DELAY) {
-            uint64_t transferred_bytes = qemu_ftell(s->file) - initial_bytes;
+            uint64_t transferred_bytes = qemu_file_transferred(s->file) -
+                                         initial_bytes;
             uint64_t time_spent = current_time - initial_time;
             double bandwidth = transferred_bytes / time_spent;
             max_size = bandwidth * migrate_max_downtime() / 1000000;
@@ -698,7 +819,7 @@ static void *migration_thread(void *opaque)
 
             qemu_file_reset_rate_limit(s->file);
             initial_time = current_time;
-            initial_bytes = qemu_ftell(s->file);
+            initial_bytes = qemu_file_transferred(s->file);
         }
         if (qemu_file_rate_limit(s->file)) {
             /* usleep expects microseconds */
@@ -709,7 +830,7 @@ static void *migration_thread(void *opaque)
     qemu_mutex_lock_iothread();
     if (s->state == MIG_STATE_COMPLETED) {
         int64_t end_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
-        uint64_t transferred_bytes = qemu_ftell(s->file);
+        uint64_t transferred_bytes = qemu_file_transferred(s->file);
         s->total_time = end_time - s->total_time;
         s->downtime = end_time - start_time;
         if (s->total_time) {
@@ -737,8 +858,7 @@ void migrate_fd_connect(MigrationState *s)
     s->expected_downtime = max_downtime/1000000;
     s->cleanup_bh = qemu_bh_new(migrate_fd_cleanup, s);
 
-    qemu_file_set_rate_limit(s->file,
-                             s->bandwidth_limit / XFER_LIMIT_RATIO);
+    qemu_file_set_rate_limit(s->file, migrate_xfer_limit(s));
 
     /* Notify before starting migration thread */
     notifier_list_notify(&migration_state_notifiers, s);
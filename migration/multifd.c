@@ -0,0 +1,630 @@
+/*
+ * Multiple parallel channels for RAM migration
+ *
+ * Copyright (C) 2015 agent <agent@local>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * A single socket and a single sender thread cannot saturate a fast
+ * link, so normal RAM pages can be spread over several extra TCP
+ * connections.  Each channel carries packets made of a fixed header,
+ * naming one RAM block and up to MULTIFD_PAGES_PER_PACKET page offsets,
+ * followed by the page contents.  Pages are sent straight from guest
+ * memory and received straight into it.
+ *
+ * Channels are not ordered with respect to each other or to the main
+ * stream, so the same page must never be in flight twice.  RAM migration
+ * syncs the channels before each new pass over the dirty bitmap: every
+ * channel sends a sync packet, and the main stream carries a marker.
+ * When the destination reaches the marker it waits until all channels
+ * have delivered their sync packet, and the receiver threads wait for
+ * the main stream before reading anything sent after it.
+ */
+
+#include "qemu-common.h"
+#include "qemu/error-report.h"
+#include "qemu/sockets.h"
+#include "qemu/thread.h"
+#include "qemu/atomic.h"
+#include "qemu/bswap.h"
+#include "qemu/iov.h"
+#include "qemu/rcu.h"
+#include "migration/migration.h"
+#include "migration/multifd.h"
+#include "trace.h"
+
+#define MULTIFD_MAGIC   0x51454d46      /* "QEMF" */
+#define MULTIFD_VERSION 1
+
+#define MULTIFD_FLAG_SYNC (1 << 0)
+
+/* 512 KiB per packet with 4 KiB pages */
+#define MULTIFD_PAGES_PER_PACKET 128
+
+/* First thing sent on each channel */
+typedef struct QEMU_PACKED {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t id;
+    uint32_t channels;
+} MultiFDInit;
+
+typedef struct QEMU_PACKED {
+    uint32_t magic;
+    uint32_t flags;
+    uint32_t pages;
+    uint32_t page_size;
+    char ramblock[256];
+    uint64_t offset[MULTIFD_PAGES_PER_PACKET];
+} MultiFDPacket;
+
+typedef struct {
+    uint32_t num;
+    uint32_t page_size;
+    char ramblock[256];
+    uint64_t offset[MULTIFD_PAGES_PER_PACKET];
+    /* iov[0] is the packet header */
+    struct iovec iov[MULTIFD_PAGES_PER_PACKET + 1];
+} MultiFDPages;
+
+typedef struct {
+    int id;
+    int fd;
+    QemuThread thread;
+    /* posted by the migration thread when a packet is ready */
+    QemuSemaphore sem;
+    /* posted by the channel when it can take a new packet */
+    QemuSemaphore sem_done;
+    bool quit;
+    uint32_t flags;
+    MultiFDPages *pages;
+    MultiFDPacket packet;
+} MultiFDSendParams;
+
+static struct {
+    MultiFDSendParams *params;
+    int count;
+    int next;
+    bool error;
+    /* pages being batched by the migration thread */
+    MultiFDPages *pages;
+    /* connections still in progress, plus one while they are started */
+    int connecting;
+    Error *connect_err;
+    MultiFDConnectHandler *connect_cb;
+    void *connect_opaque;
+} *multifd_send_state;
+
+typedef struct {
+    int id;
+    int fd;
+    QemuThread thread;
+    /* posted by the main stream once every channel reached the sync */
+    QemuSemaphore sem_sync;
+    bool quit;
+    MultiFDPacket packet;
+    struct iovec iov[MULTIFD_PAGES_PER_PACKET];
+} MultiFDRecvParams;
+
+static struct {
+    MultiFDRecvParams *params;
+    int count;
+    int connected;
+    bool error;
+    /* posted by each channel when it reaches a sync packet */
+    QemuSemaphore sem_sync;
+    /* the main stream, waiting for the channels to connect */
+    Coroutine *co;
+} *multifd_recv_state;
+
+static int multifd_send_packet(MultiFDSendParams *p)
+{
+    MultiFDPages *pages = p->pages;
+    MultiFDPacket *packet = &p->packet;
+    size_t size;
+    int i;
+
+    memset(packet, 0, sizeof(*packet));
+    packet->magic = cpu_to_be32(MULTIFD_MAGIC);
+    packet->flags = cpu_to_be32(p->flags);
+    packet->pages = cpu_to_be32(pages->num);
+    packet->page_size = cpu_to_be32(pages->page_size);
+    if (pages->num) {
+        pstrcpy(packet->ramblock, sizeof(packet->ramblock), pages->ramblock);
+    }
+    for (i = 0; i < pages->num; i++) {
+        packet->offset[i] = cpu_to_be64(pages->offset[i]);
+    }
+
+    pages->iov[0].iov_base = packet;
+    pages->iov[0].iov_len = sizeof(*packet);
+    size = sizeof(*packet) + (size_t)pages->num * pages->page_size;
+    if (iov_send(p->fd, pages->iov, pages->num + 1, 0, size) != size) {
+        return -1;
+    }
+
+    trace_multifd_send(p->id, pages->num, p->flags);
+    pages->num = 0;
+    p->flags = 0;
+    return 0;
+}
+
+static void *multifd_send_thread(void *opaque)
+{
+    MultiFDSendParams *p = opaque;
+    MultiFDInit init = {
+        .magic = cpu_to_be32(MULTIFD_MAGIC),
+        .version = cpu_to_be32(MULTIFD_VERSION),
+        .id = cpu_to_be32(p->id),
+        .channels = cpu_to_be32(multifd_send_state->count),
+    };
+
+    if (qemu_send_full(p->fd, &init, sizeof(init), 0) != sizeof(init)) {
+        goto error;
+    }
+
+    while (true) {
+        qemu_sem_wait(&p->sem);
+        if (atomic_read(&p->quit)) {
+            break;
+        }
+        if (multifd_send_packet(p) < 0) {
+            goto error;
+        }
+        qemu_sem_post(&p->sem_done);
+    }
+    return NULL;
+
+error:
+    if (!atomic_read(&p->quit)) {
+        error_report("multifd: channel %d: send failed: %s", p->id,
+                     strerror(errno));
+    }
+    atomic_set(&multifd_send_state->error, true);
+    qemu_sem_post(&p->sem_done);
+    return NULL;
+}
+
+/* Called once every connection has either succeeded or failed. */
+static void multifd_save_connected(void)
+{
+    MultiFDConnectHandler *cb = multifd_send_state->connect_cb;
+    void *opaque = multifd_send_state->connect_opaque;
+    Error *err = multifd_send_state->connect_err;
+    int i;
+
+    if (err) {
+        for (i = 0; i < multifd_send_state->count; i++) {
+            if (multifd_send_state->params[i].fd >= 0) {
+                closesocket(multifd_send_state->params[i].fd);
+            }
+        }
+        g_free(multifd_send_state->params);
+        g_free(multifd_send_state->pages);
+        g_free(multifd_send_state);
+        multifd_send_state = NULL;
+        cb(err, opaque);
+        error_free(err);
+        return;
+    }
+
+    for (i = 0; i < multifd_send_state->count; i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+
+        qemu_set_block(p->fd);
+        p->pages = g_new0(MultiFDPages, 1);
+        qemu_sem_init(&p->sem, 0);
+        qemu_sem_init(&p->sem_done, 1);
+        qemu_thread_create(&p->thread, "multifd_send", multifd_send_thread,
+                           p, QEMU_THREAD_JOINABLE);
+    }
+    multifd_send_state->connect_cb = NULL;
+    multifd_send_state->connect_opaque = NULL;
+    cb(NULL, opaque);
+}
+
+static void multifd_save_connect_done(Error *err)
+{
+    if (err && !multifd_send_state->connect_err) {
+        multifd_send_state->connect_err = error_copy(err);
+    }
+    if (--multifd_send_state->connecting == 0) {
+        multifd_save_connected();
+    }
+}
+
+static void multifd_new_channel(int fd, Error *err, void *opaque)
+{
+    MultiFDSendParams *p = opaque;
+
+    p->fd = fd;
+    multifd_save_connect_done(err);
+}
+
+void multifd_save_setup(const char *host_port, MultiFDConnectHandler *cb,
+                        void *opaque)
+{
+    int i, count = migrate_multifd_channels();
+
+    assert(!multifd_send_state);
+    multifd_send_state = g_malloc0(sizeof(*multifd_send_state));
+    multifd_send_state->params = g_new0(MultiFDSendParams, count);
+    multifd_send_state->pages = g_new0(MultiFDPages, 1);
+    multifd_send_state->count = count;
+    multifd_send_state->connect_cb = cb;
+    multifd_send_state->connect_opaque = opaque;
+    multifd_send_state->connecting = count + 1;
+
+    for (i = 0; i < count; i++) {
+        multifd_send_state->params[i].id = i;
+        multifd_send_state->params[i].fd = -1;
+    }
+
+    /*
+     * The callback may run before inet_nonblocking_connect() returns, so
+     * the extra reference keeps multifd_save_connected() from running
+     * before every connection is started.
+     */
+    for (i = 0; i < count; i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+        Error *local_err = NULL;
+
+        if (inet_nonblocking_connect(host_port, multifd_new_channel, p,
+                                     &local_err) < 0) {
+            multifd_save_connect_done(local_err);
+            error_free(local_err);
+        }
+    }
+    multifd_save_connect_done(NULL);
+}
+
+bool multifd_save_active(void)
+{
+    return multifd_send_state && !multifd_send_state->connecting;
+}
+
+/* Hand the batched pages, or a sync packet, to channel @p. */
+static int multifd_send_pages(MultiFDSendParams *p, uint32_t flags)
+{
+    MultiFDPages *pages;
+
+    qemu_sem_wait(&p->sem_done);
+    if (atomic_read(&multifd_send_state->error)) {
+        return -1;
+    }
+    if (flags & MULTIFD_FLAG_SYNC) {
+        /* the channel's own buffer is empty once it is done */
+        assert(p->pages->num == 0);
+    } else {
+        pages = p->pages;
+        p->pages = multifd_send_state->pages;
+        multifd_send_state->pages = pages;
+    }
+    p->flags = flags;
+    qemu_sem_post(&p->sem);
+    return 0;
+}
+
+static MultiFDSendParams *multifd_next_channel(void)
+{
+    int next = multifd_send_state->next;
+
+    multifd_send_state->next = (next + 1) % multifd_send_state->count;
+    return &multifd_send_state->params[next];
+}
+
+int multifd_queue_page(const char *idstr, ram_addr_t offset, void *host,
+                       size_t size)
+{
+    MultiFDPages *pages = multifd_send_state->pages;
+
+    if (pages->num &&
+        (pages->num == MULTIFD_PAGES_PER_PACKET ||
+         pages->page_size != size || strcmp(pages->ramblock, idstr))) {
+        if (multifd_send_pages(multifd_next_channel(), 0) < 0) {
+            return -1;
+        }
+        pages = multifd_send_state->pages;
+    }
+
+    if (!pages->num) {
+        pstrcpy(pages->ramblock, sizeof(pages->ramblock), idstr);
+        pages->page_size = size;
+    }
+    pages->offset[pages->num] = offset;
+    pages->iov[pages->num + 1].iov_base = host;
+    pages->iov[pages->num + 1].iov_len = size;
+    pages->num++;
+    return 0;
+}
+
+int multifd_send_sync_main(void)
+{
+    int i;
+
+    if (multifd_send_state->pages->num &&
+        multifd_send_pages(multifd_next_channel(), 0) < 0) {
+        return -1;
+    }
+
+    for (i = 0; i < multifd_send_state->count; i++) {
+        if (multifd_send_pages(&multifd_send_state->params[i],
+                               MULTIFD_FLAG_SYNC) < 0) {
+            return -1;
+        }
+    }
+    for (i = 0; i < multifd_send_state->count; i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+
+        qemu_sem_wait(&p->sem_done);
+        if (atomic_read(&multifd_send_state->error)) {
+            return -1;
+        }
+        qemu_sem_post(&p->sem_done);
+    }
+
+    trace_multifd_send_sync_main();
+    return 0;
+}
+
+void multifd_save_shutdown(void)
+{
+    int i;
+
+    if (!multifd_send_state) {
+        return;
+    }
+    for (i = 0; i < multifd_send_state->count; i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+
+        atomic_set(&p->quit, true);
+        /* channels still connecting are left alone */
+        if (p->fd >= 0) {
+            shutdown(p->fd, SHUT_RDWR);
+        }
+    }
+}
+
+void multifd_save_cleanup(void)
+{
+    int i;
+
+    if (!multifd_send_state) {
+        return;
+    }
+
+    for (i = 0; i < multifd_send_state->count; i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+
+        atomic_set(&p->quit, true);
+        qemu_sem_post(&p->sem);
+    }
+    for (i = 0; i < multifd_send_state->count; i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+
+        qemu_thread_join(&p->thread);
+        closesocket(p->fd);
+        qemu_sem_destroy(&p->sem);
+        qemu_sem_destroy(&p->sem_done);
+        g_free(p->pages);
+    }
+    g_free(multifd_send_state->params);
+    g_free(multifd_send_state->pages);
+    g_free(multifd_send_state);
+    multifd_send_state = NULL;
+}
+
+static int multifd_recv_packet(MultiFDRecvParams *p, uint32_t *flags)
+{
+    MultiFDPacket *packet = &p->packet;
+    uint32_t num, page_size;
+    ram_addr_t length;
+    uint8_t *host;
+    size_t size;
+    int i;
+
+    if (qemu_recv_full(p->fd, packet, sizeof(*packet), 0) !=
+        sizeof(*packet)) {
+        return -1;
+    }
+    *flags = be32_to_cpu(packet->flags);
+    num = be32_to_cpu(packet->pages);
+    page_size = be32_to_cpu(packet->page_size);
+    if (be32_to_cpu(packet->magic) != MULTIFD_MAGIC ||
+        num > MULTIFD_PAGES_PER_PACKET) {
+        error_report("multifd: channel %d: bad packet", p->id);
+        return -1;
+    }
+    trace_multifd_recv(p->id, num, *flags);
+    if (!num) {
+        return 0;
+    }
+
+    packet->ramblock[sizeof(packet->ramblock) - 1] = 0;
+    host = ram_block_host_from_idstr(packet->ramblock, &length);
+    if (!host) {
+        error_report("multifd: channel %d: unknown block %s", p->id,
+                     packet->ramblock);
+        return -1;
+    }
+    for (i = 0; i < num; i++) {
+        uint64_t offset = be64_to_cpu(packet->offset[i]);
+
+        if (offset > length || length - offset < page_size) {
+            error_report("multifd: channel %d: offset %" PRIx64
+                         " out of range for block %s", p->id, offset,
+                         packet->ramblock);
+            return -1;
+        }
+        p->iov[i].iov_base = host + offset;
+        p->iov[i].iov_len = page_size;
+    }
+
+    size = (size_t)num * page_size;
+    if (iov_recv(p->fd, p->iov, num, 0, size) != size) {
+        return -1;
+    }
+    return 0;
+}
+
+static void *multifd_recv_thread(void *opaque)
+{
+    MultiFDRecvParams *p = opaque;
+    MultiFDInit init;
+
+    rcu_register_thread();
+
+    if (qemu_recv_full(p->fd, &init, sizeof(init), 0) != sizeof(init)) {
+        goto error;
+    }
+    if (be32_to_cpu(init.magic) != MULTIFD_MAGIC ||
+        be32_to_cpu(init.version) != MULTIFD_VERSION) {
+        error_report("multifd: channel %d: not a multifd connection", p->id);
+        goto error;
+    }
+    if (be32_to_cpu(init.channels) != multifd_recv_state->count) {
+        error_report("multifd: source uses %u channels, expected %d",
+                     be32_to_cpu(init.channels), multifd_recv_state->count);
+        goto error;
+    }
+    trace_multifd_recv_new_channel(p->id, be32_to_cpu(init.id));
+
+    while (true) {
+        uint32_t flags;
+
+        if (multifd_recv_packet(p, &flags) < 0) {
+            goto error;
+        }
+        if (flags & MULTIFD_FLAG_SYNC) {
+            qemu_sem_post(&multifd_recv_state->sem_sync);
+            qemu_sem_wait(&p->sem_sync);
+        }
+        if (atomic_read(&p->quit)) {
+            break;
+        }
+    }
+    rcu_unregister_thread();
+    return NULL;
+
+error:
+    /* Wake up the main stream if it is waiting for our sync packet.  */
+    atomic_set(&multifd_recv_state->error, true);
+    qemu_sem_post(&multifd_recv_state->sem_sync);
+    rcu_unregister_thread();
+    return NULL;
+}
+
+void multifd_load_setup(void)
+{
+    int count = migrate_multifd_channels();
+
+    assert(!multifd_recv_state);
+    multifd_recv_state = g_malloc0(sizeof(*multifd_recv_state));
+    multifd_recv_state->params = g_new0(MultiFDRecvParams, count);
+    multifd_recv_state->count = count;
+    qemu_sem_init(&multifd_recv_state->sem_sync, 0);
+}
+
+bool multifd_recv_new_channel(int fd)
+{
+    MultiFDRecvParams *p;
+    Coroutine *co;
+
+    assert(multifd_recv_state->connected < multifd_recv_state->count);
+    p = &multifd_recv_state->params[multifd_recv_state->connected];
+    p->id = multifd_recv_state->connected++;
+    p->fd = fd;
+    qemu_set_block(fd);
+    qemu_sem_init(&p->sem_sync, 0);
+    qemu_thread_create(&p->thread, "multifd_recv", multifd_recv_thread, p,
+                       QEMU_THREAD_JOINABLE);
+
+    if (multifd_recv_state->connected < multifd_recv_state->count) {
+        return false;
+    }
+    co = multifd_recv_state->co;
+    if (co) {
+        /* this may run the rest of the incoming migration */
+        multifd_recv_state->co = NULL;
+        qemu_coroutine_enter(co, NULL);
+    }
+    return true;
+}
+
+int multifd_recv_setup_main(uint32_t channels)
+{
+    if (!multifd_recv_state) {
+        error_report("multifd: the source uses %u channels, but the multifd "
+                     "capability is not enabled", channels);
+        return -EINVAL;
+    }
+    if (channels != multifd_recv_state->count) {
+        error_report("multifd: the source uses %u channels, expected %d",
+                     channels, multifd_recv_state->count);
+        return -EINVAL;
+    }
+    return 0;
+}
+
+int coroutine_fn multifd_recv_sync_main(void)
+{
+    int i;
+
+    if (!multifd_recv_state) {
+        error_report("multifd: sync found on the stream, but the multifd "
+                     "capability is not enabled");
+        return -EINVAL;
+    }
+
+    /*
+     * The main stream is loaded while the channels are still being
+     * accepted; their pages can only be waited for once they are all
+     * there.
+     */
+    while (multifd_recv_state->connected < multifd_recv_state->count) {
+        multifd_recv_state->co = qemu_coroutine_self();
+        qemu_coroutine_yield();
+    }
+
+    for (i = 0; i < multifd_recv_state->count; i++) {
+        qemu_sem_wait(&multifd_recv_state->sem_sync);
+    }
+    if (atomic_read(&multifd_recv_state->error)) {
+        return -EIO;
+    }
+    for (i = 0; i < multifd_recv_state->count; i++) {
+        qemu_sem_post(&multifd_recv_state->params[i].sem_sync);
+    }
+
+    trace_multifd_recv_sync_main();
+    return 0;
+}
+
+void multifd_load_cleanup(void)
+{
+    int i;
+
+    if (!multifd_recv_state) {
+        return;
+    }
+
+    for (i = 0; i < multifd_recv_state->connected; i++) {
+        MultiFDRecvParams *p = &multifd_recv_state->params[i];
+
+        atomic_set(&p->quit, true);
+        shutdown(p->fd, SHUT_RDWR);
+        qemu_sem_post(&p->sem_sync);
+    }
+    for (i = 0; i < multifd_recv_state->connected; i++) {
+        MultiFDRecvParams *p = &multifd_recv_state->params[i];
+
+        qemu_thread_join(&p->thread);
+        closesocket(p->fd);
+        qemu_sem_destroy(&p->sem_sync);
+    }
+    qemu_sem_destroy(&multifd_recv_state->sem_sync);
+    g_free(multifd_recv_state->params);
+    g_free(multifd_recv_state);
+    multifd_recv_state = NULL;
+}
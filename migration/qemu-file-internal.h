@@ -29,7 +29,8 @@
 #include "qemu/iov.h"
 
 #define IO_BUF_SIZE 32768
-#define MAX_IOV_SIZE MIN(IOV_MAX, 64)
+/* Enough for a few megabytes of pages and their headers per sendmsg */
+#define MAX_IOV_SIZE MIN(IOV_MAX, 1024)
 
 struct QEMUFile {
     const QEMUFileOps *ops;
@@ -37,6 +38,8 @@ struct QEMUFile {
 
     int64_t bytes_xfer;
     int64_t xfer_limit;
+    /* sent on behalf of the file on other connections, not part of pos */
+    int64_t bytes_credited;
 
     int64_t pos; /* start of buffer when writing, end of buffer
                     when reading */
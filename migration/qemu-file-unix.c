@@ -77,6 +77,33 @@ static int socket_get_buffer(void *opaque, uint8_t *buf, int64_t pos, int size)
     return len;
 }
 
+#ifdef CONFIG_POSIX
+static ssize_t socket_readv_buffer(void *opaque, struct iovec *iov,
+                                   int iovcnt, int64_t pos)
+{
+    QEMUFileSocket *s = opaque;
+    struct msghdr msg = { .msg_iov = iov, .msg_iovlen = iovcnt };
+    ssize_t len;
+
+    for (;;) {
+        len = recvmsg(s->fd, &msg, 0);
+        if (len != -1) {
+            break;
+        }
+        if (errno == EAGAIN) {
+            yield_until_fd_readable(s->fd);
+        } else if (errno != EINTR) {
+            break;
+        }
+    }
+
+    if (len == -1) {
+        len = -errno;
+    }
+    return len;
+}
+#endif
+
 static int socket_close(void *opaque)
 {
     QEMUFileSocket *s = opaque;
@@ -161,6 +188,32 @@ static int unix_get_buffer(void *opaque, uint8_t *buf, int64_t pos, int size)
     return len;
 }
 
+#ifdef CONFIG_POSIX
+static ssize_t unix_readv_buffer(void *opaque, struct iovec *iov, int iovcnt,
+                                 int64_t pos)
+{
+    QEMUFileSocket *s = opaque;
+    ssize_t len;
+
+    for (;;) {
+        len = readv(s->fd, iov, iovcnt);
+        if (len != -1) {
+            break;
+        }
+        if (errno == EAGAIN) {
+            yield_until_fd_readable(s->fd);
+        } else if (errno != EINTR) {
+            break;
+        }
+    }
+
+    if (len == -1) {
+        len = -errno;
+    }
+    return len;
+}
+#endif
+
 static int unix_close(void *opaque)
 {
     QEMUFileSocket *s = opaque;
@@ -172,6 +225,9 @@ static int unix_close(void *opaque)
 static const QEMUFileOps unix_read_ops = {
     .get_fd =     socket_get_fd,
     .get_buffer = unix_get_buffer,
+#ifdef CONFIG_POSIX
+    .readv_buffer = unix_readv_buffer,
+#endif
     .close =      unix_close
 };
 
@@ -206,6 +262,9 @@ QEMUFile *qemu_fdopen(int fd, const char *mode)
 static const QEMUFileOps socket_read_ops = {
     .get_fd     = socket_get_fd,
     .get_buffer = socket_get_buffer,
+#ifdef CONFIG_POSIX
+    .readv_buffer = socket_readv_buffer,
+#endif
     .close      = socket_close,
     .shut_down  = socket_shutdown
 
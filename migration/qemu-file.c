@@ -218,6 +218,46 @@ static ssize_t qemu_fill_buffer(QEMUFile *f)
     return len;
 }
 
+/*
+ * Refill the buffer, which must be empty, with a single call to the
+ * underlying file: the first @size bytes go straight to @dest, anything
+ * after them into the buffer.  This lets large reads, such as RAM pages,
+ * land in place instead of being copied out of the buffer.
+ *
+ * Returns the number of bytes stored at @dest, or a negative value for
+ * an error.
+ */
+static ssize_t qemu_fill_buffer_direct(QEMUFile *f, uint8_t *dest, int size)
+{
+    struct iovec iov[2];
+    ssize_t len;
+
+    assert(!qemu_file_is_writable(f));
+    assert(f->buf_index == f->buf_size);
+
+    f->buf_index = 0;
+    f->buf_size = 0;
+
+    iov[0].iov_base = dest;
+    iov[0].iov_len = size;
+    iov[1].iov_base = f->buf;
+    iov[1].iov_len = IO_BUF_SIZE;
+    len = f->ops->readv_buffer(f->opaque, iov, 2, f->pos);
+    if (len > 0) {
+        f->pos += len;
+        if (len > size) {
+            f->buf_size = len - size;
+            len = size;
+        }
+    } else if (len == 0) {
+        qemu_file_set_error(f, -EIO);
+    } else if (len != -EAGAIN) {
+        qemu_file_set_error(f, len);
+    }
+
+    return len;
+}
+
 int qemu_get_fd(QEMUFile *f)
 {
     if (f->ops->get_fd) {
@@ -231,6 +271,17 @@ void qemu_update_position(QEMUFile *f, size_t size)
     f->pos += size;
 }
 
+/*
+ * Account for data sent on behalf of @f on another connection, so that
+ * rate limiting and the bandwidth estimate take it into account.  The
+ * stream position is not affected.
+ */
+void qemu_file_credit_transfer(QEMUFile *f, size_t size)
+{
+    f->bytes_xfer += size;
+    f->bytes_credited += size;
+}
+
 /** Closes the file
  *
  * Returns negative error value if any error happened on previous operations or
@@ -411,11 +462,24 @@ int qemu_get_buffer(QEMUFile *f, uint8_t *buf, int size)
     while (pending > 0) {
         int res;
 
-        res = qemu_peek_buffer(f, buf, MIN(pending, IO_BUF_SIZE), 0);
-        if (res == 0) {
-            return done;
+        if (f->ops->readv_buffer && f->buf_index == f->buf_size) {
+            res = qemu_fill_buffer_direct(f, buf, pending);
+            if (res <= 0) {
+                return done;
+            }
+        } else {
+            int chunk = IO_BUF_SIZE;
+
+            if (f->ops->readv_buffer) {
+                /* use up what is buffered, the rest is read directly */
+                chunk = f->buf_size - f->buf_index;
+            }
+            res = qemu_peek_buffer(f, buf, MIN(pending, chunk), 0);
+            if (res == 0) {
+                return done;
+            }
+            qemu_file_skip(f, res);
         }
-        qemu_file_skip(f, res);
         buf += res;
         pending -= res;
         done += res;
@@ -475,6 +539,17 @@ int64_t qemu_ftell(QEMUFile *f)
     return f->pos;
 }
 
+/* Bytes sent so far, on the stream and on behalf of it elsewhere */
+int64_t qemu_file_transferred_fast(QEMUFile *f)
+{
+    return qemu_ftell_fast(f) + f->bytes_credited;
+}
+
+int64_t qemu_file_transferred(QEMUFile *f)
+{
+    return qemu_ftell(f) + f->bytes_credited;
+}
+
 int qemu_file_rate_limit(QEMUFile *f)
 {
     if (qemu_file_get_error(f)) {
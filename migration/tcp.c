@@ -20,6 +20,7 @@
 #include "qemu/sockets.h"
 #include "migration/migration.h"
 #include "migration/qemu-file.h"
+#include "migration/multifd.h"
 #include "block/block.h"
 #include "qemu/main-loop.h"
 
@@ -33,6 +34,28 @@
     do { } while (0)
 #endif
 
+/* Destination of the outgoing migration, for the multifd channels */
+static char *tcp_outgoing_host_port;
+
+/* The main stream is being loaded, accept the multifd channels */
+static bool tcp_incoming_multifd;
+
+static void tcp_multifd_connected(Error *err, void *opaque)
+{
+    MigrationState *s = opaque;
+
+    if (err) {
+        error_report("could not open multifd channels: %s",
+                     error_get_pretty(err));
+        qemu_fclose(s->file);
+        s->file = NULL;
+        migrate_fd_error(s);
+    } else {
+        DPRINTF("multifd channels connected\n");
+        migrate_fd_connect(s);
+    }
+}
+
 static void tcp_wait_for_connect(int fd, Error *err, void *opaque)
 {
     MigrationState *s = opaque;
@@ -44,12 +67,21 @@ static void tcp_wait_for_connect(int fd, Error *err, void *opaque)
     } else {
         DPRINTF("migrate connect success\n");
         s->file = qemu_fopen_socket(fd, "wb");
-        migrate_fd_connect(s);
+        if (migrate_use_multifd()) {
+            multifd_save_setup(tcp_outgoing_host_port, tcp_multifd_connected,
+                               s);
+        } else {
+            migrate_fd_connect(s);
+        }
     }
+    g_free(tcp_outgoing_host_port);
+    tcp_outgoing_host_port = NULL;
 }
 
 void tcp_start_outgoing_migration(MigrationState *s, const char *host_port, Error **errp)
 {
+    g_free(tcp_outgoing_host_port);
+    tcp_outgoing_host_port = g_strdup(host_port);
     inet_nonblocking_connect(host_port, tcp_wait_for_connect, s, errp);
 }
 
@@ -65,8 +97,24 @@ static void tcp_accept_incoming_migration(void *opaque)
         c = qemu_accept(s, (struct sockaddr *)&addr, &addrlen);
         err = socket_error();
     } while (c < 0 && err == EINTR);
-    qemu_set_fd_handler2(s, NULL, NULL, NULL, NULL);
-    closesocket(s);
+
+    if (c >= 0 && tcp_incoming_multifd) {
+        /* The main stream came first, this is one of the multifd channels.
+         * Stop listening once they are all there.
+         */
+        DPRINTF("accepted multifd channel\n");
+        if (multifd_recv_new_channel(c)) {
+            qemu_set_fd_handler2(s, NULL, NULL, NULL, NULL);
+            closesocket(s);
+            tcp_incoming_multifd = false;
+        }
+        return;
+    }
+
+    if (c < 0 || !migrate_use_multifd()) {
+        qemu_set_fd_handler2(s, NULL, NULL, NULL, NULL);
+        closesocket(s);
+    }
 
     DPRINTF("accepted migration\n");
 
@@ -82,6 +130,12 @@ static void tcp_accept_incoming_migration(void *opaque)
         goto out;
     }
 
+    if (migrate_use_multifd()) {
+        /* keep listening for the channels */
+        multifd_load_setup();
+        tcp_incoming_multifd = true;
+    }
+
     process_incoming_migration(f);
     return;
 
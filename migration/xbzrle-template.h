@@ -0,0 +1,77 @@
+/*
+ * Xor Based Zero Run Length Encoding, encoder loop
+ *
+ * Copyright 2013 Red Hat, Inc. and/or its affiliates
+ * Copyright (C) 2015 agent <agent@local>
+ *
+ * Authors:
+ *  Orit Wasserman  <owasserm@redhat.com>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * Included once per implementation, with NAME set to its suffix.
+ * ZRUN_END(old, new, i, slen) must return the first index from i on
+ * where the buffers differ, NZRUN_END(old, new, i, slen) the first index
+ * where they are equal; both return slen if there is none.  Runs are
+ * always maximal, so every implementation produces the same output.
+ */
+
+#define CONCAT_I(a, b) a ## b
+#define CONCAT(a, b) CONCAT_I(a, b)
+
+static int CONCAT(xbzrle_encode_buffer_, NAME)(uint8_t *old_buf,
+                                               uint8_t *new_buf, int slen,
+                                               uint8_t *dst, int dlen)
+{
+    uint32_t zrun_len, nzrun_len;
+    int d = 0, i = 0, start;
+
+    while (i < slen) {
+        /* overflow */
+        if (d + 2 > dlen) {
+            return -1;
+        }
+
+        start = i;
+        i = ZRUN_END(old_buf, new_buf, i, slen);
+        zrun_len = i - start;
+
+        /* buffer unchanged */
+        if (zrun_len == slen) {
+            return 0;
+        }
+
+        /* skip last zero run */
+        if (i == slen) {
+            return d;
+        }
+
+        d += uleb128_encode_small(dst + d, zrun_len);
+
+        /* overflow */
+        if (d + 2 > dlen) {
+            return -1;
+        }
+
+        start = i;
+        i = NZRUN_END(old_buf, new_buf, i, slen);
+        nzrun_len = i - start;
+
+        d += uleb128_encode_small(dst + d, nzrun_len);
+        /* overflow */
+        if (d + nzrun_len > dlen) {
+            return -1;
+        }
+        memcpy(dst + d, new_buf + start, nzrun_len);
+        d += nzrun_len;
+    }
+
+    return d;
+}
+
+#undef NAME
+#undef ZRUN_END
+#undef NZRUN_END
+#undef CONCAT_I
+#undef CONCAT
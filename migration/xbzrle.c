@@ -11,118 +11,217 @@
  *
  */
 #include "qemu-common.h"
+#include "qemu/host-utils.h"
 #include "include/migration/migration.h"
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 /*
-  page = zrun nzrun
-       | zrun nzrun page
+ * The encoder spends its time looking for the end of runs of equal and
+ * of different bytes.  The generic version compares a long at a time;
+ * the vector ones compare 16 or 32 bytes and locate the first
+ * (mis)match from the comparison mask.
+ */
 
-  zrun = length
+static inline int xbzrle_zrun_end_generic(const uint8_t *old_buf,
+                                          const uint8_t *new_buf,
+                                          int i, int slen)
+{
+    /* not aligned to sizeof(long) */
+    while (i < slen && i % sizeof(long)) {
+        if (old_buf[i] != new_buf[i]) {
+            return i;
+        }
+        i++;
+    }
 
-  nzrun = length byte...
+    /* word at a time for speed */
+    while (i < slen &&
+           *(const long *)(old_buf + i) == *(const long *)(new_buf + i)) {
+        i += sizeof(long);
+    }
 
-  length = uleb128 encoded integer
- */
-int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
-                         uint8_t *dst, int dlen)
+    /* go over the rest */
+    while (i < slen && old_buf[i] == new_buf[i]) {
+        i++;
+    }
+    return i;
+}
+
+static inline int xbzrle_nzrun_end_generic(const uint8_t *old_buf,
+                                           const uint8_t *new_buf,
+                                           int i, int slen)
 {
-    uint32_t zrun_len = 0, nzrun_len = 0;
-    int d = 0, i = 0;
-    long res;
-    uint8_t *nzrun_start = NULL;
+    /* truncation to 32-bit long okay */
+    unsigned long mask = (unsigned long)0x0101010101010101ULL;
 
-    g_assert(!(((uintptr_t)old_buf | (uintptr_t)new_buf | slen) %
-               sizeof(long)));
+    /* not aligned to sizeof(long) */
+    while (i < slen && i % sizeof(long)) {
+        if (old_buf[i] == new_buf[i]) {
+            return i;
+        }
+        i++;
+    }
 
+    /* word at a time for speed, use of 32-bit long okay */
     while (i < slen) {
-        /* overflow */
-        if (d + 2 > dlen) {
-            return -1;
+        unsigned long xor;
+        xor = *(const unsigned long *)(old_buf + i)
+            ^ *(const unsigned long *)(new_buf + i);
+        if ((xor - mask) & ~xor & (mask << 7)) {
+            /* found the end of an nzrun within the current long */
+            while (old_buf[i] != new_buf[i]) {
+                i++;
+            }
+            break;
         }
+        i += sizeof(long);
+    }
+    return i;
+}
 
-        /* not aligned to sizeof(long) */
-        res = (slen - i) % sizeof(long);
-        while (res && old_buf[i] == new_buf[i]) {
-            zrun_len++;
-            i++;
-            res--;
-        }
+#define NAME generic
+#define ZRUN_END xbzrle_zrun_end_generic
+#define NZRUN_END xbzrle_nzrun_end_generic
+#include "xbzrle-template.h"
 
-        /* word at a time for speed */
-        if (!res) {
-            while (i < slen &&
-                   (*(long *)(old_buf + i)) == (*(long *)(new_buf + i))) {
-                i += sizeof(long);
-                zrun_len += sizeof(long);
-            }
+#ifdef __SSE2__
+static inline int xbzrle_zrun_end_sse2(const uint8_t *old_buf,
+                                       const uint8_t *new_buf,
+                                       int i, int slen)
+{
+    while (i + 16 <= slen) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(old_buf + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(new_buf + i));
+        unsigned ne = _mm_movemask_epi8(_mm_cmpeq_epi8(a, b)) ^ 0xffff;
 
-            /* go over the rest */
-            while (i < slen && old_buf[i] == new_buf[i]) {
-                zrun_len++;
-                i++;
-            }
+        if (ne) {
+            return i + ctz32(ne);
         }
+        i += 16;
+    }
+    return xbzrle_zrun_end_generic(old_buf, new_buf, i, slen);
+}
 
-        /* buffer unchanged */
-        if (zrun_len == slen) {
-            return 0;
-        }
+static inline int xbzrle_nzrun_end_sse2(const uint8_t *old_buf,
+                                        const uint8_t *new_buf,
+                                        int i, int slen)
+{
+    while (i + 16 <= slen) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(old_buf + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(new_buf + i));
+        unsigned eq = _mm_movemask_epi8(_mm_cmpeq_epi8(a, b));
 
-        /* skip last zero run */
-        if (i == slen) {
-            return d;
+        if (eq) {
+            return i + ctz32(eq);
         }
+        i += 16;
+    }
+    return xbzrle_nzrun_end_generic(old_buf, new_buf, i, slen);
+}
 
-        d += uleb128_encode_small(dst + d, zrun_len);
+#define NAME sse2
+#define ZRUN_END xbzrle_zrun_end_sse2
+#define NZRUN_END xbzrle_nzrun_end_sse2
+#include "xbzrle-template.h"
+#endif
 
-        zrun_len = 0;
-        nzrun_start = new_buf + i;
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#include <immintrin.h>
 
-        /* overflow */
-        if (d + 2 > dlen) {
-            return -1;
-        }
-        /* not aligned to sizeof(long) */
-        res = (slen - i) % sizeof(long);
-        while (res && old_buf[i] != new_buf[i]) {
-            i++;
-            nzrun_len++;
-            res--;
+static inline int xbzrle_zrun_end_avx2(const uint8_t *old_buf,
+                                       const uint8_t *new_buf,
+                                       int i, int slen)
+{
+    while (i + 32 <= slen) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(old_buf + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(new_buf + i));
+        uint32_t eq = _mm256_movemask_epi8(_mm256_cmpeq_epi8(a, b));
+
+        if (~eq) {
+            return i + ctz32(~eq);
         }
+        i += 32;
+    }
+    return xbzrle_zrun_end_generic(old_buf, new_buf, i, slen);
+}
 
-        /* word at a time for speed, use of 32-bit long okay */
-        if (!res) {
-            /* truncation to 32-bit long okay */
-            unsigned long mask = (unsigned long)0x0101010101010101ULL;
-            while (i < slen) {
-                unsigned long xor;
-                xor = *(unsigned long *)(old_buf + i)
-                    ^ *(unsigned long *)(new_buf + i);
-                if ((xor - mask) & ~xor & (mask << 7)) {
-                    /* found the end of an nzrun within the current long */
-                    while (old_buf[i] != new_buf[i]) {
-                        nzrun_len++;
-                        i++;
-                    }
-                    break;
-                } else {
-                    i += sizeof(long);
-                    nzrun_len += sizeof(long);
-                }
-            }
+static inline int xbzrle_nzrun_end_avx2(const uint8_t *old_buf,
+                                        const uint8_t *new_buf,
+                                        int i, int slen)
+{
+    while (i + 32 <= slen) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(old_buf + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(new_buf + i));
+        uint32_t eq = _mm256_movemask_epi8(_mm256_cmpeq_epi8(a, b));
+
+        if (eq) {
+            return i + ctz32(eq);
         }
+        i += 32;
+    }
+    return xbzrle_nzrun_end_generic(old_buf, new_buf, i, slen);
+}
 
-        d += uleb128_encode_small(dst + d, nzrun_len);
-        /* overflow */
-        if (d + nzrun_len > dlen) {
-            return -1;
+#define NAME avx2
+#define ZRUN_END xbzrle_zrun_end_avx2
+#define NZRUN_END xbzrle_nzrun_end_avx2
+#include "xbzrle-template.h"
+
+#pragma GCC pop_options
+#endif
+
+XbzrleEncodeImpl xbzrle_encode_impls[] = {
+    { "generic", xbzrle_encode_buffer_generic, true },
+#ifdef __SSE2__
+    { "sse2", xbzrle_encode_buffer_sse2, true },
+#endif
+#ifdef CONFIG_AVX2_OPT
+    { "avx2", xbzrle_encode_buffer_avx2, false },
+#endif
+    { NULL, NULL, false }
+};
+
+static XbzrleEncodeFunc *xbzrle_encode_fn = xbzrle_encode_buffer_generic;
+
+static void __attribute__((constructor)) xbzrle_init(void)
+{
+    XbzrleEncodeImpl *impl;
+
+    for (impl = xbzrle_encode_impls; impl->name; impl++) {
+#ifdef CONFIG_AVX2_OPT
+        if (impl->fn == xbzrle_encode_buffer_avx2) {
+            impl->usable = host_cpu_has_avx2();
+        }
+#endif
+        /* The table is sorted from slowest to fastest.  */
+        if (impl->usable) {
+            xbzrle_encode_fn = impl->fn;
         }
-        memcpy(dst + d, nzrun_start, nzrun_len);
-        d += nzrun_len;
-        nzrun_len = 0;
     }
+}
 
-    return d;
+/*
+  page = zrun nzrun
+       | zrun nzrun page
+
+  zrun = length
+
+  nzrun = length byte...
+
+  length = uleb128 encoded integer
+ */
+int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                         uint8_t *dst, int dlen)
+{
+    g_assert(!(((uintptr_t)old_buf | (uintptr_t)new_buf | slen) %
+               sizeof(long)));
+
+    return xbzrle_encode_fn(old_buf, new_buf, slen, dst, dlen);
 }
 
 int xbzrle_decode_buffer(uint8_t *src, int slen, uint8_t *dst, int dlen)
@@ -2787,6 +2787,13 @@ static mon_cmd_t info_cmds[] = {
         .help       = "show the currently saved VM snapshots",
         .mhandler.cmd = hmp_info_snapshots,
     },
+    {
+        .name       = "savevm",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show the status of the current or last live snapshot",
+        .mhandler.cmd = hmp_info_savevm,
+    },
     {
         .name       = "status",
         .args_type  = "",
@@ -0,0 +1,657 @@
+/*
+ * QEMU network backend using memory mapped AF_PACKET rings
+ *
+ * Copyright (c) 2015 agent <agent@local>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <net/if.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+
+#include "net/net.h"
+#include "net/tap.h"
+#include "net/checksum.h"
+#include "clients.h"
+#include "qemu-common.h"
+#include "qemu/error-report.h"
+#include "qemu/sockets.h"
+#include "qemu/iov.h"
+#include "qemu/main-loop.h"
+#include "qemu/atomic.h"
+
+#define AF_PACKET_DEFAULT_BLOCK_SIZE    (128 * 1024)
+#define AF_PACKET_DEFAULT_BLOCKS        64
+#define AF_PACKET_DEFAULT_BLOCK_TIMEOUT 1
+#define AF_PACKET_DEFAULT_TX_FRAMES     128
+
+/* Nominal frame size of the RX ring; TPACKET_V3 packs frames tightly. */
+#define AF_PACKET_RX_FRAME_SIZE         2048
+
+/* TX frames must hold a full GSO packet when a vnet header is used. */
+#define AF_PACKET_TX_FRAME_SIZE         (16 * 1024)
+#define AF_PACKET_TX_GSO_FRAME_SIZE     (68 * 1024)
+
+/* Kick the kernel at least this often while filling the TX ring. */
+#define AF_PACKET_TX_BATCH              32
+
+/* Offset of the frame data in a TPACKET_V2 TX slot. */
+#define AF_PACKET_TX_DATA_OFFSET \
+    (TPACKET2_HDRLEN - sizeof(struct sockaddr_ll))
+
+typedef struct AfPacketState {
+    NetClientState nc;
+    char ifname[IFNAMSIZ];
+
+    /* Receive side: TPACKET_V3 block ring. */
+    int fd;
+    uint8_t *rx_ring;
+    size_t rx_ring_size;
+    unsigned int block_size;
+    unsigned int block_nr;
+    unsigned int rx_block;          /* Block currently being processed. */
+    bool rx_block_open;             /* rx_frame/rx_frames_left are valid. */
+    struct tpacket3_hdr *rx_frame;  /* Next frame to process in rx_block. */
+    unsigned int rx_frames_left;
+
+    /* Transmit side: TPACKET_V2 frame ring on a separate socket. */
+    int tx_fd;
+    uint8_t *tx_ring;
+    size_t tx_ring_size;
+    unsigned int tx_frame_size;
+    unsigned int tx_frame_nr;
+    unsigned int tx_head;           /* Next frame to fill. */
+    unsigned int tx_pending;        /* Frames filled since the last kick. */
+    QEMUBH *tx_bh;
+
+    bool read_poll;
+    bool write_poll;
+    bool vnet_hdr;          /* The sockets carry a virtio_net_hdr. */
+    bool using_vnet_hdr;    /* So do the packets exchanged with the peer. */
+
+    /* Offloads the guest accepts on receive, from set_offload. */
+    bool guest_csum;
+    bool guest_tso4;
+    bool guest_tso6;
+    bool guest_ecn;
+    bool guest_ufo;
+} AfPacketState;
+
+static int af_packet_can_send(void *opaque)
+{
+    AfPacketState *s = opaque;
+
+    return qemu_can_send_packet(&s->nc);
+}
+
+static void af_packet_send(void *opaque);
+static void af_packet_writable(void *opaque);
+
+static void af_packet_update_fd_handler(AfPacketState *s)
+{
+    qemu_set_fd_handler2(s->fd,
+                         s->read_poll ? af_packet_can_send : NULL,
+                         s->read_poll ? af_packet_send : NULL,
+                         NULL, s);
+    qemu_set_fd_handler2(s->tx_fd, NULL, NULL,
+                         s->write_poll ? af_packet_writable : NULL, s);
+}
+
+static void af_packet_read_poll(AfPacketState *s, bool enable)
+{
+    if (s->read_poll != enable) {
+        s->read_poll = enable;
+        af_packet_update_fd_handler(s);
+    }
+}
+
+static void af_packet_write_poll(AfPacketState *s, bool enable)
+{
+    if (s->write_poll != enable) {
+        s->write_poll = enable;
+        af_packet_update_fd_handler(s);
+    }
+}
+
+static void af_packet_poll(NetClientState *nc, bool enable)
+{
+    AfPacketState *s = DO_UPCAST(AfPacketState, nc, nc);
+
+    if (s->read_poll != enable || s->write_poll != enable) {
+        s->read_poll = enable;
+        s->write_poll = enable;
+        af_packet_update_fd_handler(s);
+    }
+}
+
+/* Hand all frames queued since the last kick to the kernel at once. */
+static void af_packet_tx_flush(AfPacketState *s)
+{
+    if (!s->tx_pending) {
+        return;
+    }
+    s->tx_pending = 0;
+    if (send(s->tx_fd, NULL, 0, MSG_DONTWAIT) < 0 &&
+        errno != EAGAIN && errno != EWOULDBLOCK && errno != ENOBUFS) {
+        error_report("af-packet: %s: transmit failed: %s",
+                     s->ifname, strerror(errno));
+    }
+}
+
+static void af_packet_tx_bh(void *opaque)
+{
+    af_packet_tx_flush(opaque);
+}
+
+static void af_packet_writable(void *opaque)
+{
+    AfPacketState *s = opaque;
+
+    af_packet_write_poll(s, false);
+    qemu_flush_queued_packets(&s->nc);
+}
+
+static ssize_t af_packet_receive_iov(NetClientState *nc,
+                                     const struct iovec *iov, int iovcnt)
+{
+    AfPacketState *s = DO_UPCAST(AfPacketState, nc, nc);
+    size_t size = iov_size(iov, iovcnt);
+    size_t hdr_len = 0;
+    struct tpacket2_hdr *hdr;
+    uint8_t *data;
+
+    /* The kernel expects a header even if the peer does not provide one. */
+    if (s->vnet_hdr && !s->using_vnet_hdr) {
+        hdr_len = sizeof(struct virtio_net_hdr);
+    }
+
+    if (unlikely(size + hdr_len >
+                 s->tx_frame_size - AF_PACKET_TX_DATA_OFFSET)) {
+        /* Drop. */
+        return size;
+    }
+
+    hdr = (struct tpacket2_hdr *)(s->tx_ring +
+                                  s->tx_head * s->tx_frame_size);
+    if (atomic_read(&hdr->tp_status) != TP_STATUS_AVAILABLE) {
+        /* Ring full; push what we have and wait until a slot is free. */
+        af_packet_tx_flush(s);
+        af_packet_write_poll(s, true);
+        return 0;
+    }
+    smp_rmb();
+
+    data = (uint8_t *)hdr + AF_PACKET_TX_DATA_OFFSET;
+    memset(data, 0, hdr_len);
+    iov_to_buf(iov, iovcnt, 0, data + hdr_len, size);
+    hdr->tp_len = size + hdr_len;
+    smp_wmb();
+    atomic_set(&hdr->tp_status, TP_STATUS_SEND_REQUEST);
+
+    s->tx_head = (s->tx_head + 1) % s->tx_frame_nr;
+    if (++s->tx_pending >= AF_PACKET_TX_BATCH) {
+        af_packet_tx_flush(s);
+    } else {
+        qemu_bh_schedule(s->tx_bh);
+    }
+
+    return size;
+}
+
+static ssize_t af_packet_receive(NetClientState *nc,
+                                 const uint8_t *buf, size_t size)
+{
+    struct iovec iov = {
+        .iov_base = (void *)buf,
+        .iov_len = size,
+    };
+
+    return af_packet_receive_iov(nc, &iov, 1);
+}
+
+static void af_packet_send_completed(NetClientState *nc, ssize_t len)
+{
+    AfPacketState *s = DO_UPCAST(AfPacketState, nc, nc);
+
+    af_packet_read_poll(s, true);
+}
+
+/*
+ * The kernel has no per-socket equivalent of TUNSETOFFLOAD, so fix up
+ * frames the guest did not agree to receive.  A peer that does not use
+ * the header never enables any offload, so it only gets complete frames.
+ * Returns false if the frame must be dropped.
+ */
+static bool af_packet_fixup_vnet_hdr(AfPacketState *s,
+                                     struct virtio_net_hdr *vh,
+                                     uint8_t *data, size_t len)
+{
+    switch (vh->gso_type & ~VIRTIO_NET_HDR_GSO_ECN) {
+    case VIRTIO_NET_HDR_GSO_NONE:
+        break;
+    case VIRTIO_NET_HDR_GSO_TCPV4:
+        if (!s->guest_tso4) {
+            return false;
+        }
+        break;
+    case VIRTIO_NET_HDR_GSO_TCPV6:
+        if (!s->guest_tso6) {
+            return false;
+        }
+        break;
+    case VIRTIO_NET_HDR_GSO_UDP:
+        if (!s->guest_ufo) {
+            return false;
+        }
+        break;
+    default:
+        return false;
+    }
+    if ((vh->gso_type & VIRTIO_NET_HDR_GSO_ECN) && !s->guest_ecn) {
+        return false;
+    }
+
+    if ((vh->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) && !s->guest_csum) {
+        net_checksum_calculate(data, len);
+        vh->flags &= ~VIRTIO_NET_HDR_F_NEEDS_CSUM;
+    }
+    return true;
+}
+
+/* Give a fully processed block back to the kernel. */
+static void af_packet_release_block(AfPacketState *s,
+                                    struct tpacket_block_desc *desc)
+{
+    smp_mb();
+    atomic_set(&desc->hdr.bh1.block_status, TP_STATUS_KERNEL);
+    s->rx_block = (s->rx_block + 1) % s->block_nr;
+    s->rx_block_open = false;
+}
+
+static void af_packet_send(void *opaque)
+{
+    AfPacketState *s = opaque;
+
+    /* Walk retired blocks and forward every frame in them while the
+     * peer keeps accepting packets.
+     */
+    while (qemu_can_send_packet(&s->nc)) {
+        struct tpacket_block_desc *desc = (struct tpacket_block_desc *)
+            (s->rx_ring + s->rx_block * s->block_size);
+
+        if (!(atomic_read(&desc->hdr.bh1.block_status) & TP_STATUS_USER)) {
+            break;
+        }
+        smp_rmb();
+
+        if (!s->rx_block_open) {
+            s->rx_frame = (struct tpacket3_hdr *)
+                ((uint8_t *)desc + desc->hdr.bh1.offset_to_first_pkt);
+            s->rx_frames_left = desc->hdr.bh1.num_pkts;
+            s->rx_block_open = true;
+        }
+
+        while (s->rx_frames_left) {
+            struct tpacket3_hdr *hdr = s->rx_frame;
+            struct sockaddr_ll *sll = (struct sockaddr_ll *)
+                ((uint8_t *)hdr + TPACKET_ALIGN(sizeof(struct tpacket3_hdr)));
+            uint8_t *data = (uint8_t *)hdr + hdr->tp_mac;
+            size_t len = hdr->tp_snaplen;
+            ssize_t sent;
+
+            s->rx_frame = (struct tpacket3_hdr *)
+                ((uint8_t *)hdr + hdr->tp_next_offset);
+            s->rx_frames_left--;
+
+            /* Our own transmissions and truncated frames are skipped. */
+            if (sll->sll_pkttype == PACKET_OUTGOING ||
+                hdr->tp_snaplen != hdr->tp_len) {
+                continue;
+            }
+
+            if (s->vnet_hdr) {
+                struct virtio_net_hdr *vh = (struct virtio_net_hdr *)
+                    (data - sizeof(struct virtio_net_hdr));
+
+                if (!af_packet_fixup_vnet_hdr(s, vh, data, len)) {
+                    continue;
+                }
+                if (s->using_vnet_hdr) {
+                    data = (uint8_t *)vh;
+                    len += sizeof(struct virtio_net_hdr);
+                }
+            }
+
+            sent = qemu_send_packet_async(&s->nc, data, len,
+                                          af_packet_send_completed);
+            if (sent == 0) {
+                /* The peer queued a copy of the packet.  Stop reading
+                 * until it drains; the rest of the block is forwarded
+                 * after af_packet_send_completed() re-enables polling.
+                 */
+                af_packet_read_poll(s, false);
+                return;
+            }
+        }
+
+        af_packet_release_block(s, desc);
+    }
+}
+
+static void af_packet_cleanup(NetClientState *nc)
+{
+    AfPacketState *s = DO_UPCAST(AfPacketState, nc, nc);
+
+    qemu_purge_queued_packets(nc);
+
+    /* Also called on a partially set up backend from net_init_af_packet. */
+    if (s->fd >= 0) {
+        qemu_set_fd_handler2(s->fd, NULL, NULL, NULL, NULL);
+        munmap(s->rx_ring, s->rx_ring_size);
+        close(s->fd);
+        s->fd = -1;
+    }
+    if (s->tx_fd >= 0) {
+        af_packet_tx_flush(s);
+        qemu_set_fd_handler2(s->tx_fd, NULL, NULL, NULL, NULL);
+        munmap(s->tx_ring, s->tx_ring_size);
+        close(s->tx_fd);
+        s->tx_fd = -1;
+    }
+    if (s->tx_bh) {
+        qemu_bh_delete(s->tx_bh);
+        s->tx_bh = NULL;
+    }
+}
+
+static bool af_packet_has_ufo(NetClientState *nc)
+{
+    AfPacketState *s = DO_UPCAST(AfPacketState, nc, nc);
+
+    return s->vnet_hdr;
+}
+
+static bool af_packet_has_vnet_hdr(NetClientState *nc)
+{
+    AfPacketState *s = DO_UPCAST(AfPacketState, nc, nc);
+
+    return s->vnet_hdr;
+}
+
+static bool af_packet_has_vnet_hdr_len(NetClientState *nc, int len)
+{
+    return len == sizeof(struct virtio_net_hdr);
+}
+
+static void af_packet_using_vnet_hdr(NetClientState *nc, bool using_vnet_hdr)
+{
+    AfPacketState *s = DO_UPCAST(AfPacketState, nc, nc);
+
+    assert(nc->info->type == NET_CLIENT_OPTIONS_KIND_AF_PACKET);
+    assert(s->vnet_hdr == using_vnet_hdr);
+
+    s->using_vnet_hdr = using_vnet_hdr;
+}
+
+static void af_packet_set_offload(NetClientState *nc, int csum, int tso4,
+                                  int tso6, int ecn, int ufo)
+{
+    AfPacketState *s = DO_UPCAST(AfPacketState, nc, nc);
+
+    s->guest_csum = csum;
+    s->guest_tso4 = tso4;
+    s->guest_tso6 = tso6;
+    s->guest_ecn = ecn;
+    s->guest_ufo = ufo;
+}
+
+static NetClientInfo net_af_packet_info = {
+    .type = NET_CLIENT_OPTIONS_KIND_AF_PACKET,
+    .size = sizeof(AfPacketState),
+    .receive = af_packet_receive,
+    .receive_iov = af_packet_receive_iov,
+    .poll = af_packet_poll,
+    .cleanup = af_packet_cleanup,
+    .has_ufo = af_packet_has_ufo,
+    .has_vnet_hdr = af_packet_has_vnet_hdr,
+    .has_vnet_hdr_len = af_packet_has_vnet_hdr_len,
+    .using_vnet_hdr = af_packet_using_vnet_hdr,
+    .set_offload = af_packet_set_offload,
+};
+
+static int af_packet_socket(const char *ifname, int protocol, int version,
+                            bool vnet_hdr)
+{
+    int fd;
+    int one = 1;
+
+    fd = qemu_socket(AF_PACKET, SOCK_RAW, htons(protocol));
+    if (fd < 0) {
+        error_report("af-packet: %s: cannot create socket: %s",
+                     ifname, strerror(errno));
+        return -1;
+    }
+    if (setsockopt(fd, SOL_PACKET, PACKET_VERSION,
+                   &version, sizeof(version)) < 0) {
+        error_report("af-packet: %s: TPACKET_V%d not supported: %s",
+                     ifname, version + 1, strerror(errno));
+        goto fail;
+    }
+    if (vnet_hdr && setsockopt(fd, SOL_PACKET, PACKET_VNET_HDR,
+                               &one, sizeof(one)) < 0) {
+        error_report("af-packet: %s: PACKET_VNET_HDR not supported: %s",
+                     ifname, strerror(errno));
+        goto fail;
+    }
+    return fd;
+
+fail:
+    close(fd);
+    return -1;
+}
+
+static int af_packet_bind(int fd, const char *ifname, int ifindex,
+                          int protocol)
+{
+    struct sockaddr_ll sll;
+
+    memset(&sll, 0, sizeof(sll));
+    sll.sll_family = AF_PACKET;
+    sll.sll_protocol = htons(protocol);
+    sll.sll_ifindex = ifindex;
+    if (bind(fd, (struct sockaddr *)&sll, sizeof(sll)) < 0) {
+        error_report("af-packet: %s: cannot bind: %s",
+                     ifname, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static void *af_packet_map_ring(int fd, const char *ifname, size_t size)
+{
+    void *ring;
+
+    ring = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_LOCKED, fd, 0);
+    if (ring == MAP_FAILED) {
+        /* MAP_LOCKED may be refused by RLIMIT_MEMLOCK; it is only a hint. */
+        ring = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    if (ring == MAP_FAILED) {
+        error_report("af-packet: %s: cannot map ring: %s",
+                     ifname, strerror(errno));
+        return NULL;
+    }
+    return ring;
+}
+
+static int af_packet_open_rx(AfPacketState *s, int ifindex,
+                             unsigned int block_timeout)
+{
+    struct tpacket_req3 req;
+    struct packet_mreq mr;
+    int fd;
+
+    fd = af_packet_socket(s->ifname, ETH_P_ALL, TPACKET_V3, s->vnet_hdr);
+    if (fd < 0) {
+        return -1;
+    }
+
+    memset(&req, 0, sizeof(req));
+    req.tp_block_size = s->block_size;
+    req.tp_block_nr = s->block_nr;
+    req.tp_frame_size = AF_PACKET_RX_FRAME_SIZE;
+    req.tp_frame_nr = s->block_size / AF_PACKET_RX_FRAME_SIZE * s->block_nr;
+    req.tp_retire_blk_tov = block_timeout;
+    if (setsockopt(fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) < 0) {
+        error_report("af-packet: %s: cannot set up RX ring: %s",
+                     s->ifname, strerror(errno));
+        goto fail;
+    }
+    s->rx_ring_size = (size_t)s->block_size * s->block_nr;
+    s->rx_ring = af_packet_map_ring(fd, s->ifname, s->rx_ring_size);
+    if (!s->rx_ring) {
+        goto fail;
+    }
+
+    if (af_packet_bind(fd, s->ifname, ifindex, ETH_P_ALL) < 0) {
+        goto fail_unmap;
+    }
+
+    memset(&mr, 0, sizeof(mr));
+    mr.mr_ifindex = ifindex;
+    mr.mr_type = PACKET_MR_PROMISC;
+    if (setsockopt(fd, SOL_PACKET, PACKET_ADD_MEMBERSHIP,
+                   &mr, sizeof(mr)) < 0) {
+        error_report("af-packet: %s: cannot enable promiscuous mode: %s",
+                     s->ifname, strerror(errno));
+        goto fail_unmap;
+    }
+
+    s->fd = fd;
+    return 0;
+
+fail_unmap:
+    munmap(s->rx_ring, s->rx_ring_size);
+fail:
+    close(fd);
+    return -1;
+}
+
+static int af_packet_open_tx(AfPacketState *s, int ifindex)
+{
+    struct tpacket_req req;
+    int one = 1;
+    int fd;
+
+    /* Protocol 0: this socket only transmits and never queues input. */
+    fd = af_packet_socket(s->ifname, 0, TPACKET_V2, s->vnet_hdr);
+    if (fd < 0) {
+        return -1;
+    }
+
+    /* Let the kernel skip malformed frames instead of stalling the ring. */
+    setsockopt(fd, SOL_PACKET, PACKET_LOSS, &one, sizeof(one));
+
+    memset(&req, 0, sizeof(req));
+    req.tp_block_size = s->tx_frame_size;
+    req.tp_block_nr = s->tx_frame_nr;
+    req.tp_frame_size = s->tx_frame_size;
+    req.tp_frame_nr = s->tx_frame_nr;
+    if (setsockopt(fd, SOL_PACKET, PACKET_TX_RING, &req, sizeof(req)) < 0) {
+        error_report("af-packet: %s: cannot set up TX ring: %s",
+                     s->ifname, strerror(errno));
+        goto fail;
+    }
+    s->tx_ring_size = (size_t)s->tx_frame_size * s->tx_frame_nr;
+    s->tx_ring = af_packet_map_ring(fd, s->ifname, s->tx_ring_size);
+    if (!s->tx_ring) {
+        goto fail;
+    }
+
+    if (af_packet_bind(fd, s->ifname, ifindex, 0) < 0) {
+        munmap(s->tx_ring, s->tx_ring_size);
+        goto fail;
+    }
+
+    s->tx_fd = fd;
+    return 0;
+
+fail:
+    close(fd);
+    return -1;
+}
+
+/* The exported init function
+ *
+ * ... -net af-packet,ifname="..."
+ */
+int net_init_af_packet(const NetClientOptions *opts,
+                       const char *name, NetClientState *peer)
+{
+    const NetdevAfPacketOptions *ap = opts->af_packet;
+    unsigned int block_size, block_nr, block_timeout, tx_frames;
+    NetClientState *nc;
+    AfPacketState *s;
+    bool vnet_hdr;
+    int ifindex;
+
+    block_size = ap->has_block_size ? ap->block_size
+                                    : AF_PACKET_DEFAULT_BLOCK_SIZE;
+    block_nr = ap->has_blocks ? ap->blocks : AF_PACKET_DEFAULT_BLOCKS;
+    block_timeout = ap->has_block_timeout ? ap->block_timeout
+                                          : AF_PACKET_DEFAULT_BLOCK_TIMEOUT;
+    tx_frames = ap->has_tx_frames ? ap->tx_frames
+                                  : AF_PACKET_DEFAULT_TX_FRAMES;
+    vnet_hdr = ap->has_vnet_hdr && ap->vnet_hdr;
+
+    if (strlen(ap->ifname) >= IFNAMSIZ) {
+        error_report("af-packet: interface name '%s' too long", ap->ifname);
+        return -1;
+    }
+    if (block_size < getpagesize() || block_size % getpagesize()) {
+        error_report("af-packet: block-size must be a multiple of %d",
+                     getpagesize());
+        return -1;
+    }
+    if (block_nr == 0 || tx_frames == 0) {
+        error_report("af-packet: blocks and tx-frames must be positive");
+        return -1;
+    }
+    ifindex = if_nametoindex(ap->ifname);
+    if (ifindex == 0) {
+        error_report("af-packet: interface '%s' not found", ap->ifname);
+        return -1;
+    }
+
+    nc = qemu_new_net_client(&net_af_packet_info, peer, "af-packet", name);
+    s = DO_UPCAST(AfPacketState, nc, nc);
+    pstrcpy(s->ifname, sizeof(s->ifname), ap->ifname);
+    s->fd = -1;
+    s->tx_fd = -1;
+    s->block_size = block_size;
+    s->block_nr = block_nr;
+    s->tx_frame_size = vnet_hdr ? AF_PACKET_TX_GSO_FRAME_SIZE
+                                : AF_PACKET_TX_FRAME_SIZE;
+    s->tx_frame_nr = tx_frames;
+    s->vnet_hdr = vnet_hdr;
+
+    if (af_packet_open_rx(s, ifindex, block_timeout) < 0 ||
+        af_packet_open_tx(s, ifindex) < 0) {
+        qemu_del_net_client(nc);
+        return -1;
+    }
+    s->tx_bh = qemu_bh_new(af_packet_tx_bh, s);
+
+    snprintf(nc->info_str, sizeof(nc->info_str),
+             "ifname=%s,blocks=%ux%u,tx-frames=%u%s", s->ifname,
+             s->block_nr, s->block_size, s->tx_frame_nr,
+             s->vnet_hdr ? ",vnet-hdr" : "");
+
+    af_packet_read_poll(s, true);
+    return 0;
+}
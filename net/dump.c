@@ -25,17 +25,71 @@
 #include "clients.h"
 #include "qemu-common.h"
 #include "qemu/error-report.h"
+#include "qemu/iov.h"
 #include "qemu/log.h"
+#include "qemu/queue.h"
+#include "qemu/thread.h"
 #include "qemu/timer.h"
+#include "qmp-commands.h"
 #include "hub.h"
 
+#define DUMP_DEFAULT_RING_SIZE  (4 * 1024 * 1024)
+#define DUMP_MIN_RING_SIZE      (64 * 1024)
+#define DUMP_MAX_RING_SIZE      (1024 * 1024 * 1024)
+
+/* Maximum number of packets written with a single writev(). */
+#define DUMP_WRITE_BATCH        64
+
+/*
+ * Packets travel from the delivery path to the writer thread through a
+ * single-producer single-consumer ring.  Each packet is stored as a
+ * DumpRecord followed by its data; a record with len == 0, or less than
+ * sizeof(DumpRecord) bytes left before the end of the ring, means that
+ * the next record starts at the beginning of the ring.
+ */
+typedef struct DumpRecord {
+    uint32_t len;       /* Size of the record including data, 8-aligned. */
+    uint32_t caplen;
+    uint32_t orig_len;
+    uint32_t reserved;
+    int64_t ts;         /* Microseconds since the epoch. */
+} DumpRecord;
+
 typedef struct DumpState {
     NetClientState nc;
     int64_t start_ts;
     int fd;
     int pcap_caplen;
+    NetDumpFormat format;
+    char *filename;
+    char ifname[32];
+
+    /* Ring buffer; head is owned by the producer, tail by the writer. */
+    uint8_t *ring;
+    uint32_t ring_size;
+    uint32_t head;
+    uint32_t tail;
+    QemuEvent event;
+    QemuThread thread;
+    bool stop;
+    bool failed;
+
+    /* Owned by the writer thread. */
+    uint64_t rotate_size;
+    uint64_t file_bytes;
+    uint64_t bytes;
+    uint32_t files;
+
+    /* Owned by the delivery path. */
+    uint64_t packets;
+    uint64_t dropped;
+
+    QTAILQ_ENTRY(DumpState) next;
 } DumpState;
 
+static QTAILQ_HEAD(, DumpState) dump_states =
+    QTAILQ_HEAD_INITIALIZER(dump_states);
+
 #define PCAP_MAGIC 0xa1b2c3d4
 
 struct pcap_file_hdr {
@@ -57,31 +111,348 @@ struct pcap_sf_pkthdr {
     uint32_t len;
 };
 
+#define PCAPNG_SHB_TYPE         0x0a0d0d0a
+#define PCAPNG_IDB_TYPE         0x00000001
+#define PCAPNG_EPB_TYPE         0x00000006
+#define PCAPNG_BYTE_ORDER_MAGIC 0x1a2b3c4d
+
+#define PCAPNG_OPT_ENDOFOPT     0
+#define PCAPNG_OPT_SHB_USERAPPL 4
+#define PCAPNG_OPT_IF_NAME      2
+#define PCAPNG_OPT_IF_DESCR     3
+#define PCAPNG_OPT_IF_TSRESOL   9
+
+struct pcapng_shb {
+    uint32_t type;
+    uint32_t len;
+    uint32_t magic;
+    uint16_t version_major;
+    uint16_t version_minor;
+    int64_t section_len;
+} QEMU_PACKED;
+
+struct pcapng_idb {
+    uint32_t type;
+    uint32_t len;
+    uint16_t linktype;
+    uint16_t reserved;
+    uint32_t snaplen;
+} QEMU_PACKED;
+
+struct pcapng_epb {
+    uint32_t type;
+    uint32_t len;
+    uint32_t if_id;
+    uint32_t ts_high;
+    uint32_t ts_low;
+    uint32_t caplen;
+    uint32_t orig_len;
+} QEMU_PACKED;
+
+static size_t pcapng_put_option(uint8_t *buf, uint16_t code,
+                                const void *data, uint16_t len)
+{
+    uint16_t opt[2] = { code, len };
+
+    memcpy(buf, opt, sizeof(opt));
+    memcpy(buf + sizeof(opt), data, len);
+    memset(buf + sizeof(opt) + len, 0, ROUND_UP(len, 4) - len);
+    return sizeof(opt) + ROUND_UP(len, 4);
+}
+
+static size_t pcapng_put_string_option(uint8_t *buf, uint16_t code,
+                                       const char *str)
+{
+    return pcapng_put_option(buf, code, str, MIN(strlen(str), 255));
+}
+
+/* Close a block started at @start, appending the trailing length. */
+static size_t pcapng_end_block(uint8_t *start, size_t len)
+{
+    uint32_t total = len + sizeof(uint32_t);
+
+    memset(start + len, 0, sizeof(uint32_t));   /* opt_endofopt */
+    total += sizeof(uint32_t);
+    memcpy(start + len + sizeof(uint32_t), &total, sizeof(total));
+    memcpy(start + sizeof(uint32_t), &total, sizeof(total));
+    return total;
+}
+
+static size_t pcapng_file_header(DumpState *s, uint8_t *buf)
+{
+    struct pcapng_shb shb;
+    struct pcapng_idb idb;
+    uint8_t tsresol = 6;    /* microseconds */
+    size_t len, off;
+
+    shb.type = PCAPNG_SHB_TYPE;
+    shb.len = 0;
+    shb.magic = PCAPNG_BYTE_ORDER_MAGIC;
+    shb.version_major = 1;
+    shb.version_minor = 0;
+    shb.section_len = -1;
+    memcpy(buf, &shb, sizeof(shb));
+    len = sizeof(shb);
+    len += pcapng_put_string_option(buf + len, PCAPNG_OPT_SHB_USERAPPL,
+                                    "QEMU " QEMU_VERSION);
+    off = pcapng_end_block(buf, len);
+
+    idb.type = PCAPNG_IDB_TYPE;
+    idb.len = 0;
+    idb.linktype = 1;
+    idb.reserved = 0;
+    idb.snaplen = s->pcap_caplen;
+    memcpy(buf + off, &idb, sizeof(idb));
+    len = sizeof(idb);
+    len += pcapng_put_string_option(buf + off + len, PCAPNG_OPT_IF_NAME,
+                                    s->ifname);
+    len += pcapng_put_string_option(buf + off + len, PCAPNG_OPT_IF_DESCR,
+                                    s->nc.name);
+    len += pcapng_put_option(buf + off + len, PCAPNG_OPT_IF_TSRESOL,
+                             &tsresol, sizeof(tsresol));
+    return off + pcapng_end_block(buf + off, len);
+}
+
+static size_t pcap_file_header(DumpState *s, uint8_t *buf)
+{
+    struct pcap_file_hdr hdr;
+
+    hdr.magic = PCAP_MAGIC;
+    hdr.version_major = 2;
+    hdr.version_minor = 4;
+    hdr.thiszone = 0;
+    hdr.sigfigs = 0;
+    hdr.snaplen = s->pcap_caplen;
+    hdr.linktype = 1;
+    memcpy(buf, &hdr, sizeof(hdr));
+    return sizeof(hdr);
+}
+
+/* Create @filename and write the file header.  Returns -errno on failure. */
+static int dump_open(DumpState *s, const char *filename)
+{
+    uint8_t buf[1024];
+    size_t len;
+    int fd;
+
+    fd = open(filename, O_CREAT | O_TRUNC | O_WRONLY | O_BINARY, 0644);
+    if (fd < 0) {
+        return -errno;
+    }
+
+    if (s->format == NET_DUMP_FORMAT_PCAPNG) {
+        len = pcapng_file_header(s, buf);
+    } else {
+        len = pcap_file_header(s, buf);
+    }
+    if (write(fd, buf, len) != len) {
+        int ret = errno ? -errno : -EIO;
+
+        close(fd);
+        return ret;
+    }
+
+    s->fd = fd;
+    s->file_bytes = len;
+    atomic_set(&s->bytes, s->bytes + len);
+    return 0;
+}
+
+static int dump_rotate(DumpState *s)
+{
+    char *filename = g_strdup_printf("%s.%u", s->filename, s->files);
+    int ret;
+
+    close(s->fd);
+    s->fd = -1;
+    ret = dump_open(s, filename);
+    if (ret == 0) {
+        atomic_inc(&s->files);
+    }
+    g_free(filename);
+    return ret;
+}
+
+static int dump_writev(int fd, struct iovec *iov, unsigned int iovcnt)
+{
+    ssize_t ret;
+
+    while (iovcnt) {
+        ret = writev(fd, iov, iovcnt);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        iov_discard_front(&iov, &iovcnt, ret);
+    }
+    return 0;
+}
+
+/*
+ * Set up the iovecs for one record; @hdr and @trailer are scratch space.
+ * Returns the number of iovecs used.
+ */
+static unsigned int dump_fill_record(DumpState *s, DumpRecord *rec,
+                                     struct iovec *iov,
+                                     uint8_t *hdr, uint8_t *trailer)
+{
+    if (s->format == NET_DUMP_FORMAT_PCAPNG) {
+        struct pcapng_epb epb;
+        uint32_t pad = ROUND_UP(rec->caplen, 4) - rec->caplen;
+
+        epb.type = PCAPNG_EPB_TYPE;
+        epb.len = sizeof(epb) + rec->caplen + pad + sizeof(uint32_t);
+        epb.if_id = 0;
+        epb.ts_high = (uint64_t)rec->ts >> 32;
+        epb.ts_low = rec->ts;
+        epb.caplen = rec->caplen;
+        epb.orig_len = rec->orig_len;
+        memcpy(hdr, &epb, sizeof(epb));
+        memset(trailer, 0, pad);
+        memcpy(trailer + pad, &epb.len, sizeof(epb.len));
+
+        iov[0].iov_base = hdr;
+        iov[0].iov_len = sizeof(epb);
+        iov[1].iov_base = rec + 1;
+        iov[1].iov_len = rec->caplen;
+        iov[2].iov_base = trailer;
+        iov[2].iov_len = pad + sizeof(epb.len);
+        return 3;
+    } else {
+        struct pcap_sf_pkthdr ph;
+
+        ph.ts.tv_sec = rec->ts / 1000000;
+        ph.ts.tv_usec = rec->ts % 1000000;
+        ph.caplen = rec->caplen;
+        ph.len = rec->orig_len;
+        memcpy(hdr, &ph, sizeof(ph));
+
+        iov[0].iov_base = hdr;
+        iov[0].iov_len = sizeof(ph);
+        iov[1].iov_base = rec + 1;
+        iov[1].iov_len = rec->caplen;
+        return 2;
+    }
+}
+
+static void *dump_writer_thread(void *opaque)
+{
+    DumpState *s = opaque;
+    struct iovec iov[DUMP_WRITE_BATCH * 3];
+    uint8_t hdr[DUMP_WRITE_BATCH][sizeof(struct pcapng_epb)];
+    uint8_t trailer[DUMP_WRITE_BATCH][8];
+
+    for (;;) {
+        uint32_t head, tail, consumed = 0;
+        unsigned int i, n = 0, iovcnt = 0;
+
+        qemu_event_reset(&s->event);
+        head = atomic_mb_read(&s->head);
+        tail = s->tail;
+        if (head == tail) {
+            if (atomic_mb_read(&s->stop)) {
+                break;
+            }
+            qemu_event_wait(&s->event);
+            continue;
+        }
+
+        while (tail + consumed != head && n < DUMP_WRITE_BATCH) {
+            uint32_t pos = (tail + consumed) & (s->ring_size - 1);
+            uint32_t contig = s->ring_size - pos;
+            DumpRecord *rec = (DumpRecord *)(s->ring + pos);
+
+            if (contig < sizeof(*rec) || rec->len == 0) {
+                consumed += contig;
+                continue;
+            }
+            iovcnt += dump_fill_record(s, rec, &iov[iovcnt],
+                                       hdr[n], trailer[n]);
+            consumed += rec->len;
+            n++;
+        }
+
+        if (iovcnt) {
+            size_t bytes = 0;
+
+            for (i = 0; i < iovcnt; i++) {
+                bytes += iov[i].iov_len;
+            }
+            if (dump_writev(s->fd, iov, iovcnt) < 0) {
+                qemu_log("-net dump write error - stop dump\n");
+                break;
+            }
+            s->file_bytes += bytes;
+            atomic_set(&s->bytes, s->bytes + bytes);
+        }
+
+        /* The records have been written, give the space back. */
+        atomic_mb_set(&s->tail, tail + consumed);
+
+        if (s->rotate_size && s->file_bytes >= s->rotate_size &&
+            dump_rotate(s) < 0) {
+            qemu_log("-net dump: cannot rotate %s - stop dump\n",
+                     s->filename);
+            break;
+        }
+    }
+
+    if (!atomic_mb_read(&s->stop)) {
+        /* Stopped by an error; the delivery path drops packets from now. */
+        if (s->fd >= 0) {
+            close(s->fd);
+            s->fd = -1;
+        }
+        atomic_mb_set(&s->failed, true);
+    }
+    return NULL;
+}
+
 static ssize_t dump_receive(NetClientState *nc, const uint8_t *buf, size_t size)
 {
     DumpState *s = DO_UPCAST(DumpState, nc, nc);
-    struct pcap_sf_pkthdr hdr;
+    DumpRecord *rec;
+    uint32_t caplen, reclen, pos, contig, need;
     int64_t ts;
-    int caplen;
 
     /* Early return in case of previous error. */
-    if (s->fd < 0) {
+    if (atomic_read(&s->failed)) {
         return size;
     }
 
-    ts = muldiv64(qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL), 1000000, get_ticks_per_sec());
-    caplen = size > s->pcap_caplen ? s->pcap_caplen : size;
-
-    hdr.ts.tv_sec = ts / 1000000 + s->start_ts;
-    hdr.ts.tv_usec = ts % 1000000;
-    hdr.caplen = caplen;
-    hdr.len = size;
-    if (write(s->fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
-        write(s->fd, buf, caplen) != caplen) {
-        qemu_log("-net dump write error - stop dump\n");
-        close(s->fd);
-        s->fd = -1;
+    s->packets++;
+    caplen = MIN(size, s->pcap_caplen);
+    reclen = ROUND_UP(sizeof(*rec) + caplen, sizeof(uint64_t));
+    pos = s->head & (s->ring_size - 1);
+    contig = s->ring_size - pos;
+    need = contig < reclen ? contig + reclen : reclen;
+    if (need > s->ring_size - (s->head - atomic_mb_read(&s->tail))) {
+        /* The writer is behind, never block the datapath. */
+        s->dropped++;
+        return size;
     }
+    if (contig < reclen) {
+        if (contig >= sizeof(*rec)) {
+            rec = (DumpRecord *)(s->ring + pos);
+            rec->len = 0;
+        }
+        pos = 0;
+    }
+
+    ts = muldiv64(qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL), 1000000,
+                  get_ticks_per_sec());
+
+    rec = (DumpRecord *)(s->ring + pos);
+    rec->len = reclen;
+    rec->caplen = caplen;
+    rec->orig_len = size;
+    rec->ts = ts + s->start_ts * 1000000;
+    memcpy(rec + 1, buf, caplen);
+
+    atomic_mb_set(&s->head, s->head + need);
+    qemu_event_set(&s->event);
 
     return size;
 }
@@ -90,7 +461,19 @@ static void dump_cleanup(NetClientState *nc)
 {
     DumpState *s = DO_UPCAST(DumpState, nc, nc);
 
-    close(s->fd);
+    if (s->ring) {
+        /* The writer drains the ring before exiting. */
+        atomic_mb_set(&s->stop, true);
+        qemu_event_set(&s->event);
+        qemu_thread_join(&s->thread);
+        qemu_event_destroy(&s->event);
+        QTAILQ_REMOVE(&dump_states, s, next);
+        g_free(s->ring);
+    }
+    if (s->fd >= 0) {
+        close(s->fd);
+    }
+    g_free(s->filename);
 }
 
 static NetClientInfo net_dump_info = {
@@ -101,47 +484,51 @@ static NetClientInfo net_dump_info = {
 };
 
 static int net_dump_init(NetClientState *peer, const char *device,
-                         const char *name, const char *filename, int len)
+                         const char *name, const char *filename, int len,
+                         NetDumpFormat format, uint32_t ring_size,
+                         uint64_t rotate_size)
 {
-    struct pcap_file_hdr hdr;
     NetClientState *nc;
     DumpState *s;
     struct tm tm;
-    int fd;
+    int ret, id;
 
-    fd = open(filename, O_CREAT | O_TRUNC | O_WRONLY | O_BINARY, 0644);
-    if (fd < 0) {
-        error_report("-net dump: can't open %s", filename);
-        return -1;
-    }
+    nc = qemu_new_net_client(&net_dump_info, peer, device, name);
+    s = DO_UPCAST(DumpState, nc, nc);
 
-    hdr.magic = PCAP_MAGIC;
-    hdr.version_major = 2;
-    hdr.version_minor = 4;
-    hdr.thiszone = 0;
-    hdr.sigfigs = 0;
-    hdr.snaplen = len;
-    hdr.linktype = 1;
+    s->fd = -1;
+    s->pcap_caplen = len;
+    s->format = format;
+    s->filename = g_strdup(filename);
+    if (net_hub_id_for_client(peer, &id) == 0) {
+        snprintf(s->ifname, sizeof(s->ifname), "vlan%d", id);
+    } else {
+        pstrcpy(s->ifname, sizeof(s->ifname), peer->name);
+    }
+    s->rotate_size = rotate_size;
+    s->files = 1;
 
-    if (write(fd, &hdr, sizeof(hdr)) < sizeof(hdr)) {
-        error_report("-net dump write error: %s", strerror(errno));
-        close(fd);
+    ret = dump_open(s, filename);
+    if (ret < 0) {
+        error_report("-net dump: can't open %s: %s", filename,
+                     strerror(-ret));
+        qemu_del_net_client(nc);
         return -1;
     }
 
-    nc = qemu_new_net_client(&net_dump_info, peer, device, name);
-
     snprintf(nc->info_str, sizeof(nc->info_str),
              "dump to %s (len=%d)", filename, len);
 
-    s = DO_UPCAST(DumpState, nc, nc);
-
-    s->fd = fd;
-    s->pcap_caplen = len;
-
     qemu_get_timedate(&tm, 0);
     s->start_ts = mktime(&tm);
 
+    s->ring_size = ring_size;
+    s->ring = g_malloc(ring_size);
+    qemu_event_init(&s->event, false);
+    QTAILQ_INSERT_TAIL(&dump_states, s, next);
+    qemu_thread_create(&s->thread, "net-dump", dump_writer_thread, s,
+                       QEMU_THREAD_JOINABLE);
+
     return 0;
 }
 
@@ -152,6 +539,7 @@ int net_init_dump(const NetClientOptions *opts, const char *name,
     const char *file;
     char def_file[128];
     const NetdevDumpOptions *dump;
+    uint64_t ring_size;
 
     assert(opts->kind == NET_CLIENT_OPTIONS_KIND_DUMP);
     dump = opts->dump;
@@ -181,5 +569,61 @@ int net_init_dump(const NetClientOptions *opts, const char *name,
         len = 65536;
     }
 
-    return net_dump_init(peer, "dump", name, file, len);
+    ring_size = dump->has_ring_size ? dump->ring_size : DUMP_DEFAULT_RING_SIZE;
+    if (ring_size < DUMP_MIN_RING_SIZE || ring_size > DUMP_MAX_RING_SIZE) {
+        error_report("invalid ring-size: %"PRIu64, ring_size);
+        return -1;
+    }
+    ring_size = pow2ceil(ring_size);
+    /* Two full-sized packets must fit, one of them after a wrap. */
+    if (ring_size < 2 * ROUND_UP(sizeof(DumpRecord) + (uint64_t)len, 8)) {
+        error_report("ring-size %"PRIu64" too small for len %d",
+                     ring_size, len);
+        return -1;
+    }
+
+    return net_dump_init(peer, "dump", name, file, len,
+                         dump->has_format ? dump->format : NET_DUMP_FORMAT_PCAP,
+                         ring_size,
+                         dump->has_rotate_size ? dump->rotate_size : 0);
+}
+
+NetDumpInfoList *qmp_query_net_dump(Error **errp)
+{
+    NetDumpInfoList *dump_list = NULL, *last_entry = NULL;
+    DumpState *s;
+
+    QTAILQ_FOREACH(s, &dump_states, next) {
+        NetDumpInfoList *entry;
+        NetDumpInfo *info;
+        uint32_t files = atomic_mb_read(&s->files);
+
+        info = g_malloc0(sizeof(*info));
+        info->name = g_strdup(s->nc.name);
+        if (files > 1) {
+            info->file = g_strdup_printf("%s.%u", s->filename, files - 1);
+        } else {
+            info->file = g_strdup(s->filename);
+        }
+        info->format = s->format;
+        info->snaplen = s->pcap_caplen;
+        info->ring_size = s->ring_size;
+        info->rotate_size = s->rotate_size;
+        info->packets = s->packets;
+        info->dropped = s->dropped;
+        info->bytes = atomic_read(&s->bytes);
+        info->files = files;
+        info->error = atomic_read(&s->failed);
+
+        entry = g_malloc0(sizeof(*entry));
+        entry->value = info;
+        if (!dump_list) {
+            dump_list = entry;
+        } else {
+            last_entry->next = entry;
+        }
+        last_entry = entry;
+    }
+
+    return dump_list;
 }
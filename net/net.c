@@ -826,6 +826,9 @@ static int (* const net_client_init_fun[NET_CLIENT_OPTIONS_KIND_MAX])(
 #ifdef CONFIG_L2TPV3
         [NET_CLIENT_OPTIONS_KIND_L2TPV3]    = net_init_l2tpv3,
 #endif
+#ifdef CONFIG_AF_PACKET
+        [NET_CLIENT_OPTIONS_KIND_AF_PACKET] = net_init_af_packet,
+#endif
 };
 
 
@@ -864,6 +867,9 @@ static int net_client_init1(const void *object, int is_netdev, Error **errp)
 #endif
 #ifdef CONFIG_L2TPV3
         case NET_CLIENT_OPTIONS_KIND_L2TPV3:
+#endif
+#ifdef CONFIG_AF_PACKET
+        case NET_CLIENT_OPTIONS_KIND_AF_PACKET:
 #endif
             break;
 
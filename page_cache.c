@@ -36,26 +36,69 @@
 /* the page in cache will not be replaced in two cycles */
 #define CACHED_PAGE_LIFETIME 2
 
+/* number of pages that share one set */
+#define CACHE_WAYS 8
+
+/* hits are counted at most once per bitmap sync, up to this value */
+#define CACHE_MAX_HITS 64
+
+/* sets of the pre-resize table moved over on every insertion */
+#define CACHE_DRAIN_SETS 4
+
 typedef struct CacheItem CacheItem;
 
 struct CacheItem {
     uint64_t it_addr;
     uint64_t it_age;
+    uint32_t it_hits;
     uint8_t *it_data;
 };
 
+typedef struct CacheTable {
+    CacheItem *items;
+    int64_t num_sets;
+    unsigned int ways;
+} CacheTable;
+
+/*
+ * The cache is set associative: a page can go in any of the CACHE_WAYS
+ * slots of the set picked by hashing its address.  When a set is full,
+ * the page that was dirtied in the fewest sync rounds, counting down for
+ * every round it has not been seen, is replaced.  Pages younger than
+ * CACHED_PAGE_LIFETIME rounds are never replaced.
+ *
+ * Resizing allocates a new, empty table and keeps the old one around.
+ * Lookups fall back to the old table and move the pages they find, and
+ * every insertion moves a few more sets, until the old table is empty.
+ */
 struct PageCache {
-    CacheItem *page_cache;
+    CacheTable table;
+    CacheTable old;
+    int64_t drain_pos;
     unsigned int page_size;
     int64_t max_num_items;
-    uint64_t max_item_age;
     int64_t num_items;
+    uint64_t current_age;
 };
 
-PageCache *cache_init(int64_t num_pages, unsigned int page_size)
+static bool cache_table_init(CacheTable *t, int64_t num_pages)
 {
-    int64_t i;
+    t->ways = MIN(CACHE_WAYS, num_pages);
+    t->num_sets = num_pages / t->ways;
+
+    /* We prefer not to abort if there is no memory.  Zeroed memory is
+     * mapped lazily, so this is cheap even for a large cache.
+     */
+    t->items = g_try_malloc0(num_pages * sizeof(*t->items));
+    if (!t->items) {
+        DPRINTF("Failed to allocate cache table\n");
+        return false;
+    }
+    return true;
+}
 
+PageCache *cache_init(int64_t num_pages, unsigned int page_size)
+{
     PageCache *cache;
 
     if (num_pages <= 0) {
@@ -64,7 +107,7 @@ PageCache *cache_init(int64_t num_pages, unsigned int page_size)
     }
 
     /* We prefer not to abort if there is no memory */
-    cache = g_try_malloc(sizeof(*cache));
+    cache = g_try_malloc0(sizeof(*cache));
     if (!cache) {
         DPRINTF("Failed to allocate cache\n");
         return NULL;
@@ -75,102 +118,214 @@ PageCache *cache_init(int64_t num_pages, unsigned int page_size)
         DPRINTF("rounding down to %" PRId64 "\n", num_pages);
     }
     cache->page_size = page_size;
-    cache->num_items = 0;
-    cache->max_item_age = 0;
     cache->max_num_items = num_pages;
 
     DPRINTF("Setting cache buckets to %" PRId64 "\n", cache->max_num_items);
 
-    /* We prefer not to abort if there is no memory */
-    cache->page_cache = g_try_malloc((cache->max_num_items) *
-                                     sizeof(*cache->page_cache));
-    if (!cache->page_cache) {
-        DPRINTF("Failed to allocate cache->page_cache\n");
+    if (!cache_table_init(&cache->table, num_pages)) {
         g_free(cache);
         return NULL;
     }
 
-    for (i = 0; i < cache->max_num_items; i++) {
-        cache->page_cache[i].it_data = NULL;
-        cache->page_cache[i].it_age = 0;
-        cache->page_cache[i].it_addr = -1;
-    }
-
     return cache;
 }
 
-void cache_fini(PageCache *cache)
+static void cache_table_free(PageCache *cache, CacheTable *t)
 {
     int64_t i;
 
+    for (i = 0; i < t->num_sets * t->ways; i++) {
+        if (t->items[i].it_data) {
+            g_free(t->items[i].it_data);
+            cache->num_items--;
+        }
+    }
+    g_free(t->items);
+    t->items = NULL;
+}
+
+void cache_fini(PageCache *cache)
+{
     g_assert(cache);
-    g_assert(cache->page_cache);
+    g_assert(cache->table.items);
 
-    for (i = 0; i < cache->max_num_items; i++) {
-        g_free(cache->page_cache[i].it_data);
+    if (cache->old.items) {
+        cache_table_free(cache, &cache->old);
     }
-
-    g_free(cache->page_cache);
-    cache->page_cache = NULL;
+    cache_table_free(cache, &cache->table);
     g_free(cache);
 }
 
-static size_t cache_get_cache_pos(const PageCache *cache,
-                                  uint64_t address)
+static CacheItem *cache_get_set(const PageCache *cache, const CacheTable *t,
+                                uint64_t addr)
 {
+    uint64_t hash = (addr / cache->page_size) * 0x9e3779b97f4a7c15ULL;
     size_t pos;
 
-    g_assert(cache->max_num_items);
-    pos = (address / cache->page_size) & (cache->max_num_items - 1);
-    return pos;
+    g_assert(t->num_sets);
+    /* fold the high bits in, so that strided addresses spread too */
+    pos = (hash ^ (hash >> 32)) & (t->num_sets - 1);
+    return &t->items[pos * t->ways];
 }
 
-static CacheItem *cache_get_by_addr(const PageCache *cache, uint64_t addr)
+static CacheItem *cache_table_find(const PageCache *cache,
+                                   const CacheTable *t, uint64_t addr)
 {
-    size_t pos;
+    CacheItem *set = cache_get_set(cache, t, addr);
+    unsigned int i;
 
-    g_assert(cache);
-    g_assert(cache->page_cache);
+    for (i = 0; i < t->ways; i++) {
+        if (set[i].it_data && set[i].it_addr == addr) {
+            return &set[i];
+        }
+    }
+    return NULL;
+}
 
-    pos = cache_get_cache_pos(cache, addr);
+static int64_t cache_item_score(const CacheItem *it, uint64_t current_age)
+{
+    return (int64_t)it->it_hits - (int64_t)(current_age - it->it_age);
+}
 
-    return &cache->page_cache[pos];
+/*
+ * Pick the slot for a new page with the given score: a free one, or
+ * the lowest scored page that is old enough and scores lower.  Returns
+ * NULL if the page should not go in.
+ */
+static CacheItem *cache_pick_slot(const PageCache *cache, uint64_t addr,
+                                  int64_t score)
+{
+    CacheItem *set = cache_get_set(cache, &cache->table, addr);
+    CacheItem *victim = NULL;
+    int64_t victim_score = score;
+    unsigned int i;
+
+    for (i = 0; i < cache->table.ways; i++) {
+        CacheItem *it = &set[i];
+        int64_t it_score;
+
+        if (!it->it_data) {
+            return it;
+        }
+        if (it->it_age + CACHED_PAGE_LIFETIME > cache->current_age) {
+            /* the cache page is fresh, don't replace it */
+            continue;
+        }
+        it_score = cache_item_score(it, cache->current_age);
+        if (it_score <= victim_score) {
+            victim = it;
+            victim_score = it_score;
+        }
+    }
+    return victim;
 }
 
-uint8_t *get_cached_data(const PageCache *cache, uint64_t addr)
+/* Move a page out of the pre-resize table; returns its new slot, if any. */
+static CacheItem *cache_move_item(PageCache *cache, CacheItem *old_it)
 {
-    return cache_get_by_addr(cache, addr)->it_data;
+    CacheItem *it;
+
+    it = cache_pick_slot(cache, old_it->it_addr,
+                         cache_item_score(old_it, cache->current_age));
+    if (!it) {
+        g_free(old_it->it_data);
+        cache->num_items--;
+    } else {
+        if (it->it_data) {
+            g_free(it->it_data);
+            cache->num_items--;
+        }
+        *it = *old_it;
+    }
+    old_it->it_data = NULL;
+    return it;
 }
 
-bool cache_is_cached(const PageCache *cache, uint64_t addr,
-                     uint64_t current_age)
+static void cache_drain(PageCache *cache, int64_t num_sets)
+{
+    CacheTable *old = &cache->old;
+    unsigned int i;
+
+    while (num_sets-- && cache->drain_pos < old->num_sets) {
+        CacheItem *set = &old->items[cache->drain_pos * old->ways];
+
+        for (i = 0; i < old->ways; i++) {
+            if (set[i].it_data) {
+                cache_move_item(cache, &set[i]);
+            }
+        }
+        cache->drain_pos++;
+    }
+
+    if (cache->drain_pos == old->num_sets) {
+        g_free(old->items);
+        old->items = NULL;
+    }
+}
+
+static CacheItem *cache_get_by_addr(PageCache *cache, uint64_t addr)
 {
     CacheItem *it;
 
+    g_assert(cache);
+    g_assert(cache->table.items);
+
+    it = cache_table_find(cache, &cache->table, addr);
+    if (!it && cache->old.items) {
+        it = cache_table_find(cache, &cache->old, addr);
+        if (it) {
+            it = cache_move_item(cache, it);
+        }
+    }
+    return it;
+}
+
+uint8_t *get_cached_data(PageCache *cache, uint64_t addr)
+{
+    CacheItem *it = cache_get_by_addr(cache, addr);
+
+    return it ? it->it_data : NULL;
+}
+
+bool cache_is_cached(PageCache *cache, uint64_t addr, uint64_t current_age)
+{
+    CacheItem *it;
+
+    cache->current_age = MAX(cache->current_age, current_age);
     it = cache_get_by_addr(cache, addr);
+    if (!it) {
+        return false;
+    }
 
-    if (it->it_addr == addr) {
-        /* update the it_age when the cache hit */
-        it->it_age = current_age;
-        return true;
+    /* update the it_age when the cache hit */
+    if (it->it_age != current_age && it->it_hits < CACHE_MAX_HITS) {
+        it->it_hits++;
     }
-    return false;
+    it->it_age = current_age;
+    return true;
 }
 
 int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata,
                  uint64_t current_age)
 {
-
     CacheItem *it;
 
-    /* actual update of entry */
-    it = cache_get_by_addr(cache, addr);
+    cache->current_age = MAX(cache->current_age, current_age);
+    if (cache->old.items) {
+        cache_drain(cache, CACHE_DRAIN_SETS);
+    }
 
-    if (it->it_data && it->it_addr != addr &&
-        it->it_age + CACHED_PAGE_LIFETIME > current_age) {
-        /* the cache page is fresh, don't replace it */
-        return -1;
+    it = cache_get_by_addr(cache, addr);
+    if (!it) {
+        it = cache_pick_slot(cache, addr, 0);
+        if (!it) {
+            return -1;
+        }
+        it->it_hits = 0;
+    } else if (it->it_age != current_age && it->it_hits < CACHE_MAX_HITS) {
+        it->it_hits++;
     }
+
     /* allocate page */
     if (!it->it_data) {
         it->it_data = g_try_malloc(cache->page_size);
@@ -191,15 +346,12 @@ int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata,
 
 int64_t cache_resize(PageCache *cache, int64_t new_num_pages)
 {
-    PageCache *new_cache;
-    int64_t i;
-
-    CacheItem *old_it, *new_it;
+    CacheTable table;
 
     g_assert(cache);
 
     /* cache was not inited */
-    if (cache->page_cache == NULL) {
+    if (cache->table.items == NULL || new_num_pages <= 0) {
         return -1;
     }
 
@@ -208,39 +360,20 @@ int64_t cache_resize(PageCache *cache, int64_t new_num_pages)
         return cache->max_num_items;
     }
 
-    new_cache = cache_init(new_num_pages, cache->page_size);
-    if (!(new_cache)) {
+    if (!cache_table_init(&table, pow2floor(new_num_pages))) {
         DPRINTF("Error creating new cache\n");
         return -1;
     }
 
-    /* move all data from old cache */
-    for (i = 0; i < cache->max_num_items; i++) {
-        old_it = &cache->page_cache[i];
-        if (old_it->it_addr != -1) {
-            /* check for collision, if there is, keep MRU page */
-            new_it = cache_get_by_addr(new_cache, old_it->it_addr);
-            if (new_it->it_data && new_it->it_age >= old_it->it_age) {
-                /* keep the MRU page */
-                g_free(old_it->it_data);
-            } else {
-                if (!new_it->it_data) {
-                    new_cache->num_items++;
-                }
-                g_free(new_it->it_data);
-                new_it->it_data = old_it->it_data;
-                new_it->it_age = old_it->it_age;
-                new_it->it_addr = old_it->it_addr;
-            }
-        }
+    /* finish the previous resize, if any */
+    if (cache->old.items) {
+        cache_drain(cache, cache->old.num_sets);
     }
 
-    g_free(cache->page_cache);
-    cache->page_cache = new_cache->page_cache;
-    cache->max_num_items = new_cache->max_num_items;
-    cache->num_items = new_cache->num_items;
-
-    g_free(new_cache);
+    cache->old = cache->table;
+    cache->table = table;
+    cache->drain_pos = 0;
+    cache->max_num_items = pow2floor(new_num_pages);
 
     return cache->max_num_items;
 }
@@ -987,6 +987,7 @@ DEF("spice", HAS_ARG, QEMU_OPTION_spice,
     "       [,streaming-video=[off|all|filter]][,disable-copy-paste]\n"
     "       [,disable-agent-file-xfer][,agent-mouse=[on|off]]\n"
     "       [,playback-compression=[on|off]][,seamless-migration=[on|off]]\n"
+    "       [,iothread=id]\n"
     "   enable spice\n"
     "   at least one of {port, tls-port} is mandatory\n",
     QEMU_ARCH_ALL)
@@ -1078,6 +1079,13 @@ Enable/disable audio stream compression (using celt 0.5.1).  Default is on.
 @item seamless-migration=[on|off]
 Enable/disable spice seamless migration. Default is off.
 
+@item iothread=@var{id}
+Serve the spice channel sockets and timers from the IOThread @var{id},
+created with @option{-object iothread,id=@var{id}}, instead of the main
+loop.  The server still runs with the global mutex held, so this only
+saves spice from waiting for its turn in the main loop, not for work
+done under that mutex.
+
 @end table
 ETEXI
 
@@ -1302,6 +1310,26 @@ This can be really helpful to save bandwidth when playing videos. Disabling
 adaptive encodings restores the original static behavior of encodings
 like Tight.
 
+@item video
+
+Stream screen regions that keep changing at a high rate, like video
+playback, as a single JPEG rectangle per frame instead of re-encoding
+them piece by piece on every refresh.  The JPEG quality and the frame
+rate are lowered when the measured bandwidth and latency of the client
+connection cannot keep up, and the regions are sent again losslessly once
+they stop changing.  This requires the @option{lossy} option and has no
+effect with @option{non-adaptive} or with clients that do not use Tight
+with JPEG.
+
+@item latency=@var{ms}
+
+Pace framebuffer updates so that no more data is queued for a client
+than its connection delivers in @var{ms} milliseconds, based on the
+bandwidth and round trip time measured for each client.  Screen changes
+made while an update is held back are merged into the next one.  This
+keeps slow clients responsive instead of letting them fall seconds
+behind.  By default updates are sent whenever the socket accepts data.
+
 @item share=[allow-exclusive|force-shared|ignore]
 
 Set display sharing policy.  'allow-exclusive' allows clients to ask
@@ -1318,6 +1346,22 @@ spec but is traditional QEMU behavior.
 @end table
 ETEXI
 
+DEF("shm-display", HAS_ARG, QEMU_OPTION_shm_display,
+    "-shm-display [path=]path[,console=n]\n"
+    "                export a console to local viewers through shared memory\n",
+    QEMU_ARCH_ALL)
+STEXI
+@item -shm-display [path=]@var{path}[,console=@var{n}]
+@findex -shm-display
+Listen on the unix socket @var{path} for viewers running on the same host
+and export graphic console @var{n} (default 0) to them.  Instead of
+sending pixels, QEMU passes the viewer a file descriptor for the console
+surface and a ring of damage rectangles in shared memory, so a frame costs
+no copy when the display device renders into memory allocated by QEMU.
+Only available on Linux.  The protocol is described in
+@file{include/ui/shm-display.h}.
+ETEXI
+
 STEXI
 @end table
 ETEXI
@@ -1535,8 +1579,17 @@ DEF("net", HAS_ARG, QEMU_OPTION_net,
     "                VALE port (created on the fly) called 'name' ('nmname' is name of the \n"
     "                netmap device, defaults to '/dev/netmap')\n"
 #endif
-    "-net dump[,vlan=n][,file=f][,len=n]\n"
+#ifdef CONFIG_AF_PACKET
+    "-net af-packet,ifname=name[,block-size=n][,blocks=n][,block-timeout=ms]\n"
+    "         [,tx-frames=n][,vnet-hdr=on|off]\n"
+    "                attach to the host network interface 'name' through memory\n"
+    "                mapped AF_PACKET rings\n"
+#endif
+    "-net dump[,vlan=n][,file=f][,len=n][,format=pcap|pcapng]\n"
+    "         [,ring-size=n][,rotate-size=n]\n"
     "                dump traffic on vlan 'n' to file 'f' (max n bytes per packet)\n"
+    "                packets are buffered in a ring of 'ring-size' bytes and written\n"
+    "                in the background; a new file is started every 'rotate-size' bytes\n"
     "-net none       use it alone to have zero network devices. If no -net option\n"
     "                is provided, the default is '-net nic -net user'\n", QEMU_ARCH_ALL)
 DEF("netdev", HAS_ARG, QEMU_OPTION_netdev,
@@ -1551,6 +1604,9 @@ DEF("netdev", HAS_ARG, QEMU_OPTION_netdev,
 #endif
 #ifdef CONFIG_NETMAP
     "netmap|"
+#endif
+#ifdef CONFIG_AF_PACKET
+    "af-packet|"
 #endif
     "vhost-user|"
     "socket|"
@@ -1919,6 +1975,30 @@ qemu-system-i386 linux.img -net nic -net l2tpv3,src=4.2.3.1,dst=1.2.3.4,udp,srcp
 
 @end example
 
+@item -netdev af-packet,id=@var{id},ifname=@var{name}[,block-size=@var{n}][,blocks=@var{n}][,block-timeout=@var{ms}][,tx-frames=@var{n}][,vnet-hdr=on|off]
+@item -net af-packet[,vlan=@var{n}][,name=@var{name}],ifname=@var{name}[,block-size=@var{n}][,blocks=@var{n}][,block-timeout=@var{ms}][,tx-frames=@var{n}][,vnet-hdr=on|off]
+Connect the VLAN to the existing host network interface @var{ifname} using a
+memory mapped AF_PACKET socket.  Received frames are taken from a TPACKET_V3
+ring of @var{blocks} blocks of @var{block-size} bytes each; a block is handed
+to QEMU when it is full or after @var{block-timeout} milliseconds, and all of
+its frames are processed in one go.  Transmitted frames are queued in a ring
+of @var{tx-frames} frames and handed to the kernel in batches.  The interface
+is put in promiscuous mode.  With @option{vnet-hdr=on}, a virtio-net header is
+exchanged with the kernel for every frame so that checksum and segmentation
+offloads are passed through.  Only NICs that support the header, such as
+virtio-net, see it and get the offloads; other NICs exchange plain frames.
+This requires the CAP_NET_RAW capability.
+
+Example:
+@example
+# create a veth pair, QEMU uses one end, the host uses the other one
+ip link add vm0 type veth peer name vm0-host
+ip link set vm0 up
+ip link set vm0-host up
+qemu-system-i386 linux.img -netdev af-packet,id=n0,ifname=vm0,vnet-hdr=on \
+                 -device virtio-net-pci,netdev=n0
+@end example
+
 @item -netdev vde,id=@var{id}[,sock=@var{socketpath}][,port=@var{n}][,group=@var{groupname}][,mode=@var{octalmode}]
 @item -net vde[,vlan=@var{n}][,name=@var{name}][,sock=@var{socketpath}] [,port=@var{n}][,group=@var{groupname}][,mode=@var{octalmode}]
 Connect VLAN @var{n} to PORT @var{n} of a vde switch running on host and
@@ -1960,10 +2040,18 @@ qemu -m 512 -object memory-backend-file,id=mem,size=512M,mem-path=/hugetlbfs,sha
      -device virtio-net-pci,netdev=net0
 @end example
 
-@item -net dump[,vlan=@var{n}][,file=@var{file}][,len=@var{len}]
+@item -net dump[,vlan=@var{n}][,file=@var{file}][,len=@var{len}][,format=pcap|pcapng][,ring-size=@var{size}][,rotate-size=@var{size}]
 Dump network traffic on VLAN @var{n} to file @var{file} (@file{qemu-vlan0.pcap} by default).
 At most @var{len} bytes (64k by default) per packet are stored. The file format is
-libpcap, so it can be analyzed with tools such as tcpdump or Wireshark.
+libpcap by default, or pcap-ng with @option{format=pcapng}, so it can be analyzed
+with tools such as tcpdump or Wireshark.
+
+Packets are copied to a buffer of @var{ring-size} bytes (4M by default) and
+written to disk by a separate thread, so that a slow disk does not stall the
+network.  Packets that arrive while the buffer is full are dropped; the number
+of dropped packets is reported by the @code{query-net-dump} QMP command.  If
+@var{rotate-size} is given, a new file called @var{file}.1, @var{file}.2, ...
+is started whenever the current one grows beyond that size.
 
 @item -net none
 Indicate that no network devices should be configured. It is used to
@@ -3226,7 +3314,9 @@ DEF("incoming", HAS_ARG, QEMU_OPTION_incoming, \
     "-incoming fd:fd\n" \
     "-incoming exec:cmdline\n" \
     "                accept incoming migration on given file descriptor\n" \
-    "                or from given external command\n",
+    "                or from given external command\n" \
+    "-incoming file:path\n" \
+    "                load a migration saved to a file with migrate file:\n",
     QEMU_ARCH_ALL)
 STEXI
 @item -incoming tcp:[@var{host}]:@var{port}[,to=@var{maxport}][,ipv4][,ipv6]
@@ -3242,6 +3332,18 @@ Accept incoming migration from a given filedescriptor.
 
 @item -incoming exec:@var{cmdline}
 Accept incoming migration as an output from specified external command.
+
+@item -incoming file:@var{path}
+Load a migration saved to @var{path} with @code{migrate file:@var{path}}.
+RAM is stored in the file at fixed offsets, so restore reads only the pages
+that were saved, or maps them with the @code{file-mmap} migration capability.
+The load starts as soon as QEMU is running, before the monitor can set
+capabilities; to use @code{file-mmap}, start with @code{-incoming defer},
+set the capability and then run @code{migrate_incoming file:@var{path}}.
+Saving over a file that a running guest was restored from with
+@code{file-mmap} replaces the file rather than rewriting it in place.
+Saving to a file is not limited by the default migration speed, only by
+one set with @code{migrate_set_speed}.
 ETEXI
 
 DEF("nodefaults", 0, QEMU_OPTION_nodefaults, \
@@ -164,6 +164,64 @@ Example:
 -> { "execute": "screendump", "arguments": { "filename": "/tmp/image" } }
 <- { "return": {} }
 
+EQMP
+
+    {
+        .name       = "set-display-refresh-cap",
+        .args_type  = "console:i?,min-interval:i",
+        .mhandler.cmd_new = qmp_marshal_input_set_display_refresh_cap,
+    },
+
+SQMP
+set-display-refresh-cap
+-----------------------
+
+Set the minimum refresh interval of the displays of a console.
+
+Arguments:
+
+- "console": console index, all consoles if omitted (json-int, optional)
+- "min-interval": minimum interval in milliseconds, 0 for no limit
+                  (json-int)
+
+Example:
+
+-> { "execute": "set-display-refresh-cap",
+     "arguments": { "console": 0, "min-interval": 100 } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "query-display-refresh",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_display_refresh,
+    },
+
+SQMP
+query-display-refresh
+---------------------
+
+Show refresh statistics of the displays that poll the guest screen.
+
+Return a json-array of json-objects, each one containing:
+
+- "display": display type (json-string)
+- "console": console index (json-int, optional)
+- "interval": current refresh interval in milliseconds (json-int)
+- "min-interval": refresh interval while the screen changes (json-int)
+- "refreshes": number of refreshes (json-int)
+- "active-refreshes": refreshes that found screen updates (json-int)
+- "cpu-time": CPU time spent refreshing in nanoseconds (json-int)
+
+Example:
+
+-> { "execute": "query-display-refresh" }
+<- { "return": [
+       { "display": "vnc", "console": 0, "interval": 3000,
+         "min-interval": 30, "refreshes": 1375,
+         "active-refreshes": 212, "cpu-time": 48213377 } ] }
+
 EQMP
 
     {
@@ -660,6 +718,28 @@ Example:
 -> { "execute": "migrate_cancel" }
 <- { "return": {} }
 
+EQMP
+
+    {
+        .name       = "savevm-cancel",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_savevm_cancel,
+    },
+
+SQMP
+savevm-cancel
+-------------
+
+Cancel the live snapshot in progress.  The guest keeps running and no
+snapshot is created.
+
+Arguments: None.
+
+Example:
+
+-> { "execute": "savevm-cancel" }
+<- { "return": {} }
+
 EQMP
 
     {
@@ -733,6 +813,87 @@ Example:
 -> { "execute": "query-migrate-cache-size" }
 <- { "return": 67108864 }
 
+EQMP
+
+    {
+        .name       = "migrate-set-multifd-channels",
+        .args_type  = "value:i",
+        .mhandler.cmd_new = qmp_marshal_input_migrate_set_multifd_channels,
+    },
+
+SQMP
+migrate-set-multifd-channels
+----------------------------
+
+Set the number of extra connections used by the multifd capability.  Both
+sides of the migration must use the same value; the destination fails the
+migration on a mismatch.
+
+Arguments:
+
+- "value": number of channels, 1 to 16 (json-int)
+
+Example:
+
+-> { "execute": "migrate-set-multifd-channels", "arguments": { "value": 4 } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "calc-dirty-rate",
+        .args_type  = "calc-time:i",
+        .mhandler.cmd_new = qmp_marshal_input_calc_dirty_rate,
+    },
+
+SQMP
+calc-dirty-rate
+---------------
+
+Start measuring how fast the guest dirties its memory, by hashing a sample
+of guest pages at the start and at the end of the measurement.  Does not
+need a migration to be running.
+
+Arguments:
+
+- "calc-time": length of the measurement in seconds, 1 to 60 (json-int)
+
+Example:
+
+-> { "execute": "calc-dirty-rate", "arguments": { "calc-time": 1 } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "query-dirty-rate",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_dirty_rate,
+    },
+
+SQMP
+query-dirty-rate
+----------------
+
+Show the state and result of the dirty rate measurement.
+
+Return a json-object with the following information:
+
+- "status": "unstarted", "measuring" or "measured" (json-string)
+- "start-time": when the last measurement started, in seconds since the
+                Epoch (json-int, optional)
+- "calc-time": length of the last measurement in seconds (json-int, optional)
+- "dirty-rate": estimated dirty rate in MiB/s, once measured
+                (json-int, optional)
+- "sample-pages": number of 4 KiB pages sampled, once measured
+                  (json-int, optional)
+
+Example:
+
+-> { "execute": "query-dirty-rate" }
+<- { "return": { "status": "measured", "start-time": 1423149712,
+                 "calc-time": 1, "dirty-rate": 108, "sample-pages": 2048 } }
+
 EQMP
 
     {
@@ -2885,6 +3046,18 @@ Clients are described by a json-object, each one contain the following:
 - "service": client's port number (json-string)
 - "x509_dname": TLS dname (json-string, optional)
 - "sasl_username": SASL username (json-string, optional)
+- "stats": traffic statistics (json-object, optional), containing:
+  - "bytes-sent": total bytes sent (json-int)
+  - "bytes-per-second": bytes sent in the last second (json-int)
+  - "updates": framebuffer updates sent (json-int)
+  - "updates-per-second": updates per second in the last second
+                          (json-number)
+  - "updates-skipped": updates held back by pacing (json-int)
+  - "rtt": estimated round trip time in microseconds (json-int)
+  - "bandwidth": estimated bandwidth in bytes per second (json-int)
+  - "in-flight": bytes not acknowledged by the client yet (json-int)
+  - "encodings": json-array of json-objects with "encoding"
+                 (json-string), "rects" and "bytes" (json-int)
 
 Example:
 
@@ -2900,7 +3073,21 @@ Example:
             {
                "host":"127.0.0.1",
                "service":"50401",
-               "family":"ipv4"
+               "family":"ipv4",
+               "stats":{
+                  "bytes-sent":5242880,
+                  "bytes-per-second":262144,
+                  "updates":1200,
+                  "updates-per-second":25.0,
+                  "updates-skipped":40,
+                  "rtt":32000,
+                  "bandwidth":1048576,
+                  "in-flight":16384,
+                  "encodings":[
+                     { "encoding":"tight", "rects":5400, "bytes":5200000 },
+                     { "encoding":"copyrect", "rects":12, "bytes":192 }
+                  ]
+               }
             }
          ]
       }
@@ -3120,6 +3307,9 @@ The main json-object contains the following:
 - "expected-downtime": only present while migration is active
                 total amount in ms for downtime that was calculated on
                 the last bitmap round (json-int)
+- "cpu-throttle-percentage": only present while auto-converge throttles
+                the guest, percentage of time the vCPUs are forced to
+                sleep (json-int)
 - "ram": only present if "status" is "active", it is a json-object with the
   following RAM information:
          - "transferred": amount transferred in bytes (json-int)
@@ -3136,11 +3326,32 @@ The main json-object contains the following:
             but this way upper levels don't need to care about page
             size (json-int)
          - "dirty-sync-count": times that dirty ram was synchronized (json-int)
+         - "dirty-sync-time": microseconds taken by the last synchronization
+            of dirty ram (json-int)
+         - "dirty-sync-time-max": microseconds taken by the longest
+            synchronization of dirty ram (json-int)
+- "sections": only present if "status" is "active" or "completed", a
+  json-array with one json-object for every section of the migration
+  stream that was saved, usually one per device.  Times are in
+  microseconds:
+         - "name": the section's id string (json-string)
+         - "instance-id": the instance of the section (json-int)
+         - "setup-bytes", "setup-time": bytes written and time taken when
+            the migration started (json-int)
+         - "iterate-bytes", "iterate-time": bytes written and time taken
+            while the guest was running (json-int)
+         - "iterations": times the section was saved while the guest was
+            running (json-int)
+         - "complete-bytes", "complete-time": bytes written and time taken
+            after the guest was stopped (json-int)
 - "disk": only present if "status" is "active" and it is a block migration,
   it is a json-object with the following disk information:
          - "transferred": amount transferred in bytes (json-int)
          - "remaining": amount remaining to transfer in bytes json-int)
          - "total": total disk size in bytes (json-int)
+         - "duplicate": number of 1 MiB chunks sent as zeroes (json-int)
+         - "normal": number of 1 MiB chunks sent with data (json-int)
+         - "normal-bytes": number of bytes sent in data chunks (json-int)
 - "xbzrle-cache": only present if XBZRLE is active.
   It is a json-object with the following XBZRLE information:
          - "cache-size": XBZRLE cache size in bytes
@@ -3270,6 +3481,39 @@ EQMP
         .mhandler.cmd_new = qmp_marshal_input_query_migrate,
     },
 
+SQMP
+query-savevm
+------------
+
+Return information about the current or last live snapshot taken with
+"savevm -l".
+
+The main json-object contains the following:
+
+- "status": "none", "active", "cancelling", "completed", "failed" or
+            "cancelled" (json-string)
+- "name": the name of the snapshot (json-string, optional)
+- "written": the number of bytes of VM state written so far (json-int,
+             optional)
+- "total-time": time since the snapshot was started, or the time it took
+                if it is over, in milliseconds (json-int, optional)
+- "error-desc": a description of the error, if "status" is "failed"
+                (json-string, optional)
+
+Example:
+
+-> { "execute": "query-savevm" }
+<- { "return": { "status": "active", "name": "vm-20150301120000",
+                 "written": 536870912, "total-time": 1520 } }
+
+EQMP
+
+    {
+        .name       = "query-savevm",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_savevm,
+    },
+
 SQMP
 migrate-set-capabilities
 ------------------------
@@ -3280,6 +3524,8 @@ Enable/Disable migration capabilities
 - "rdma-pin-all": pin all pages when using RDMA during migration
 - "auto-converge": throttle down guest to help convergence of migration
 - "zero-blocks": compress zero blocks during block migration
+- "multifd": send RAM pages over several parallel connections
+- "file-mmap": map RAM from the file when loading a file: migration
 
 Arguments:
 
@@ -3307,6 +3553,8 @@ Query current migration capabilities
          - "rdma-pin-all" : RDMA Pin Page state (json-bool)
          - "auto-converge" : Auto Converge state (json-bool)
          - "zero-blocks" : Zero Blocks state (json-bool)
+         - "multifd" : Multiple channels state (json-bool)
+         - "file-mmap" : File mapping state (json-bool)
 
 Arguments:
 
@@ -3626,6 +3874,54 @@ Example:
       ]
    }
 
+EQMP
+
+    {
+        .name       = "query-net-dump",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_net_dump,
+    },
+
+SQMP
+query-net-dump
+--------------
+
+Show the state of all network dumps (-net dump).
+
+Each array entry contains the following:
+
+- "name": net client name (json-string)
+- "file": file currently being written (json-string)
+- "format": file format, "pcap" or "pcapng" (json-string)
+- "snaplen": per-packet size limit (json-int)
+- "ring-size": size of the buffer holding packets not yet written (json-int)
+- "rotate-size": file size that triggers rotation, 0 if disabled (json-int)
+- "packets": number of packets captured (json-int)
+- "dropped": number of packets dropped because the buffer was full (json-int)
+- "bytes": number of bytes written to all files (json-int)
+- "files": number of files written, including the current one (json-int)
+- "error": whether writing stopped because of an I/O error (json-bool)
+
+Example:
+
+-> { "execute": "query-net-dump" }
+<- { "return": [
+        {
+            "name": "dump.0",
+            "file": "qemu-vlan0.pcap.2",
+            "format": "pcapng",
+            "snaplen": 65536,
+            "ring-size": 4194304,
+            "rotate-size": 104857600,
+            "packets": 1853342,
+            "dropped": 0,
+            "bytes": 229384120,
+            "files": 3,
+            "error": false
+        }
+      ]
+   }
+
 EQMP
 
     {
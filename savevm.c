@@ -23,6 +23,9 @@
  */
 
 #include "config-host.h"
+#ifdef CONFIG_POSIX
+#include <sys/mman.h>
+#endif
 #include "qemu-common.h"
 #include "hw/boards.h"
 #include "hw/hw.h"
@@ -33,13 +36,19 @@
 #include "qemu/timer.h"
 #include "audio/audio.h"
 #include "migration/migration.h"
+#include "migration/file.h"
 #include "qemu/sockets.h"
 #include "qemu/queue.h"
 #include "sysemu/cpus.h"
 #include "exec/memory.h"
 #include "qmp-commands.h"
+#include "qapi-event.h"
 #include "trace.h"
 #include "qemu/iov.h"
+#include "qemu/rcu.h"
+#include "qemu/atomic.h"
+#include "qemu/thread.h"
+#include "qemu/error-report.h"
 #include "block/snapshot.h"
 #include "block/qapi.h"
 
@@ -166,6 +175,385 @@ static QEMUFile *qemu_fopen_bdrv(BlockDriverState *bs, int is_writable)
     return qemu_fopen_ops(bs, &bdrv_read_ops);
 }
 
+/*
+ * Loading a snapshot reads the VM state from start to end.  Instead of
+ * one synchronous 32 KB read every time the QEMUFile buffer runs dry,
+ * read it in big windows, and read the next window in a coroutine while
+ * the current one is being parsed, so that the disk and the loader work
+ * at the same time.
+ */
+#define VMSTATE_READAHEAD_SIZE (4 * 1024 * 1024)
+
+typedef struct VMStateReadahead VMStateReadahead;
+
+typedef struct VMStateReadaheadBuf {
+    VMStateReadahead *ra;
+    uint8_t *data;
+    int64_t pos;
+    int len;            /* bytes read, or a negative errno */
+    bool busy;
+} VMStateReadaheadBuf;
+
+struct VMStateReadahead {
+    BlockDriverState *bs;
+    int64_t size;
+    VMStateReadaheadBuf bufs[2];
+    int cur;
+};
+
+static void coroutine_fn vmstate_readahead_co(void *opaque)
+{
+    VMStateReadaheadBuf *b = opaque;
+    int size = MIN(VMSTATE_READAHEAD_SIZE, b->ra->size - b->pos);
+    int ret;
+
+    ret = bdrv_load_vmstate(b->ra->bs, b->data, b->pos, size);
+    b->len = ret < 0 ? ret : size;
+    b->busy = false;
+}
+
+static void vmstate_readahead_start(VMStateReadahead *ra,
+                                    VMStateReadaheadBuf *b, int64_t pos)
+{
+    Coroutine *co;
+
+    b->pos = pos;
+    b->len = 0;
+    if (pos >= ra->size) {
+        return;
+    }
+    b->busy = true;
+    co = qemu_coroutine_create(vmstate_readahead_co);
+    qemu_coroutine_enter(co, b);
+}
+
+static void vmstate_readahead_wait(VMStateReadahead *ra,
+                                   VMStateReadaheadBuf *b)
+{
+    while (b->busy) {
+        aio_poll(bdrv_get_aio_context(ra->bs), true);
+    }
+}
+
+static int block_readahead_get_buffer(void *opaque, uint8_t *buf,
+                                      int64_t pos, int size)
+{
+    VMStateReadahead *ra = opaque;
+    VMStateReadaheadBuf *b = &ra->bufs[ra->cur];
+
+    vmstate_readahead_wait(ra, b);
+    if (pos < b->pos || pos >= b->pos + b->len) {
+        /* move on to the other window, normally read ahead already */
+        ra->cur ^= 1;
+        b = &ra->bufs[ra->cur];
+        vmstate_readahead_wait(ra, b);
+        if (b->len < 0) {
+            return b->len;
+        }
+        if (pos < b->pos || pos >= b->pos + b->len) {
+            if (pos >= ra->size) {
+                return 0;
+            }
+            vmstate_readahead_start(ra, b, pos);
+            vmstate_readahead_wait(ra, b);
+            if (b->len < 0) {
+                return b->len;
+            }
+        }
+        vmstate_readahead_start(ra, &ra->bufs[ra->cur ^ 1], b->pos + b->len);
+    }
+
+    size = MIN(size, b->pos + b->len - pos);
+    memcpy(buf, b->data + (pos - b->pos), size);
+    return size;
+}
+
+static int block_readahead_fclose(void *opaque)
+{
+    VMStateReadahead *ra = opaque;
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(ra->bufs); i++) {
+        vmstate_readahead_wait(ra, &ra->bufs[i]);
+        qemu_vfree(ra->bufs[i].data);
+    }
+    g_free(ra);
+    return 0;
+}
+
+static const QEMUFileOps bdrv_readahead_ops = {
+    .get_buffer = block_readahead_get_buffer,
+    .close =      block_readahead_fclose
+};
+
+static VMStateReadahead *vmstate_readahead_new(BlockDriverState *bs,
+                                               int64_t size)
+{
+    VMStateReadahead *ra;
+    int i;
+
+    ra = g_new0(VMStateReadahead, 1);
+    ra->bs = bs;
+    ra->size = size;
+    for (i = 0; i < ARRAY_SIZE(ra->bufs); i++) {
+        ra->bufs[i].ra = ra;
+        ra->bufs[i].data = qemu_blockalign(bs, VMSTATE_READAHEAD_SIZE);
+    }
+    return ra;
+}
+
+/*
+ * When the image can drop what an earlier save left in its VM state area,
+ * the VM state is saved with the page-indexed layout of the file:
+ * transport (see migration/file.c): each RAM page has a fixed place in
+ * the area, pages dirtied again during a live snapshot are overwritten
+ * there, and zero pages are never allocated.  Other images get a plain
+ * migration stream; loadvm reads both.
+ */
+static int vmstate_file_writev(void *opaque, QEMUIOVector *qiov, int64_t pos)
+{
+    int ret = bdrv_writev_vmstate(opaque, qiov, pos);
+
+    return ret < 0 ? ret : 0;
+}
+
+static int vmstate_file_discard(void *opaque, int64_t pos, int64_t size)
+{
+    return bdrv_discard_vmstate(opaque, pos, size);
+}
+
+static const FileMigrationOps vmstate_file_write_ops = {
+    .writev  = vmstate_file_writev,
+    .discard = vmstate_file_discard,
+    .close   = bdrv_fclose
+};
+
+static bool vmstate_file_supported(BlockDriverState *bs)
+{
+    BlockDriverInfo bdi;
+
+    /* regions are dropped in whole clusters */
+    return bdrv_get_info(bs, &bdi) == 0 && bdi.cluster_size > 0 &&
+           FILE_MIGRATION_ALIGN % bdi.cluster_size == 0 &&
+           bdrv_discard_vmstate(bs, 0, 0) == 0;
+}
+
+/* Size of the VM state written to @f */
+static uint64_t vmstate_file_size(QEMUFile *f)
+{
+    if (file_migration_save_active()) {
+        qemu_fflush(f);
+        return file_migration_size();
+    }
+    return qemu_ftell(f);
+}
+
+/*
+ * Loading goes through the same layout, so that with the file-mmap
+ * capability guest RAM can be mapped from the image file instead of read:
+ * the guest resumes as soon as the device state is loaded, pages are read
+ * from the snapshot when first touched, and a thread touches the others in
+ * the background.  Until it is done, the clusters of the snapshot must not
+ * be freed or rewritten, so the image is blocked and no snapshot can be
+ * taken, loaded or deleted.
+ */
+typedef struct LoadVMMapping {
+    uint8_t *host;
+    size_t size;
+} LoadVMMapping;
+
+typedef struct LoadVMState {
+    BlockDriverState *bs;
+    VMStateReadahead *ra;
+    /* the image file, and the parts of guest RAM mapped from it */
+    int fd;
+    GArray *mappings;
+    QemuThread thread;
+    QEMUBH *bh;
+    Error *blocker;
+} LoadVMState;
+
+static LoadVMState *loadvm_lazy;
+
+static int loadvm_file_readv(void *opaque, QEMUIOVector *qiov, int64_t pos)
+{
+    LoadVMState *s = opaque;
+    int i, ret;
+
+    for (i = 0; i < qiov->niov; i++) {
+        ret = bdrv_load_vmstate(s->bs, qiov->iov[i].iov_base, pos,
+                                qiov->iov[i].iov_len);
+        if (ret < 0) {
+            return ret;
+        }
+        pos += qiov->iov[i].iov_len;
+    }
+    return 0;
+}
+
+static int loadvm_file_get_buffer(void *opaque, uint8_t *buf, int64_t pos,
+                                  int size)
+{
+    LoadVMState *s = opaque;
+
+    return block_readahead_get_buffer(s->ra, buf, pos, size);
+}
+
+#ifdef CONFIG_POSIX
+static int loadvm_file_map(void *opaque, void *host, size_t size,
+                           uint64_t pos)
+{
+    LoadVMState *s = opaque;
+    int64_t pagesize = getpagesize();
+    int64_t status, n;
+    size_t done;
+    void *p;
+
+    if (s->fd < 0) {
+        s->fd = bdrv_open_data_file(s->bs, O_RDONLY);
+        if (s->fd < 0) {
+            return s->fd;
+        }
+    }
+
+    /* check the whole range before replacing any of it */
+    for (done = 0; done < size; done += n) {
+        status = bdrv_get_vmstate_status(s->bs, pos + done, size - done, &n);
+        if (status < 0) {
+            return status;
+        }
+        if (!n || (n & (pagesize - 1))) {
+            return -ENOTSUP;
+        }
+        if (status & BDRV_BLOCK_DATA) {
+            /* compressed, encrypted or not aligned to host pages */
+            if (!(status & BDRV_BLOCK_OFFSET_VALID) ||
+                (status & BDRV_BLOCK_OFFSET_MASK & (pagesize - 1))) {
+                return -ENOTSUP;
+            }
+        } else if (!(status & BDRV_BLOCK_ZERO)) {
+            return -ENOTSUP;
+        }
+    }
+
+    for (done = 0; done < size; done += n) {
+        LoadVMMapping m = { .host = (uint8_t *)host + done };
+
+        status = bdrv_get_vmstate_status(s->bs, pos + done, size - done, &n);
+        if (status < 0) {
+            return status;
+        }
+        if (status & BDRV_BLOCK_DATA) {
+            p = mmap(m.host, n, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_FIXED, s->fd,
+                     status & BDRV_BLOCK_OFFSET_MASK);
+        } else {
+            p = mmap(m.host, n, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+        }
+        if (p == MAP_FAILED) {
+            return -errno;
+        }
+        if (status & BDRV_BLOCK_DATA) {
+            m.size = n;
+            g_array_append_val(s->mappings, m);
+            qemu_madvise(m.host, n, QEMU_MADV_WILLNEED);
+        }
+    }
+    return 0;
+}
+#endif
+
+static int loadvm_file_close(void *opaque)
+{
+    LoadVMState *s = opaque;
+
+    return block_readahead_fclose(s->ra);
+}
+
+static const FileMigrationOps loadvm_file_ops = {
+    .readv      = loadvm_file_readv,
+    .get_buffer = loadvm_file_get_buffer,
+#ifdef CONFIG_POSIX
+    .map        = loadvm_file_map,
+#endif
+    .close      = loadvm_file_close
+};
+
+static void loadvm_state_free(LoadVMState *s)
+{
+    if (s->fd >= 0) {
+        close(s->fd);
+    }
+    g_array_free(s->mappings, true);
+    g_free(s);
+}
+
+/* Write to every mapped page, which gives the guest its own copy. */
+static void *loadvm_lazy_thread(void *opaque)
+{
+    LoadVMState *s = opaque;
+    size_t pagesize = getpagesize();
+    ram_addr_t ram_addr;
+    size_t off;
+    guint i;
+
+    rcu_register_thread();
+    for (i = 0; i < s->mappings->len; i++) {
+        LoadVMMapping *m = &g_array_index(s->mappings, LoadVMMapping, i);
+
+        for (off = 0; off < m->size; off += pagesize) {
+            uint32_t *p = (uint32_t *)(m->host + off);
+
+            /* RAM unplugged since is only unmapped after a grace period */
+            rcu_read_lock();
+            if (qemu_ram_addr_from_host(p, &ram_addr)) {
+                atomic_fetch_add(p, 0);
+            }
+            rcu_read_unlock();
+        }
+    }
+    qemu_bh_schedule(s->bh);
+    rcu_unregister_thread();
+    return NULL;
+}
+
+static void loadvm_lazy_bh(void *opaque)
+{
+    LoadVMState *s = opaque;
+
+    qemu_thread_join(&s->thread);
+    qemu_bh_delete(s->bh);
+    bdrv_op_unblock_all(s->bs, s->blocker);
+    error_free(s->blocker);
+    trace_loadvm_lazy_end();
+    loadvm_lazy = NULL;
+    loadvm_state_free(s);
+}
+
+/* Once the VM state is loaded, detach guest RAM from the image file. */
+static void loadvm_lazy_start(LoadVMState *s)
+{
+    uint64_t size = 0;
+    guint i;
+
+    if (!s->mappings->len) {
+        loadvm_state_free(s);
+        return;
+    }
+    for (i = 0; i < s->mappings->len; i++) {
+        size += g_array_index(s->mappings, LoadVMMapping, i).size;
+    }
+    trace_loadvm_lazy_start(size);
+
+    error_setg(&s->blocker, "Guest RAM is still being read from a snapshot");
+    bdrv_op_block_all(s->bs, s->blocker);
+    s->bh = qemu_bh_new(loadvm_lazy_bh, s);
+    loadvm_lazy = s;
+    qemu_thread_create(&s->thread, "loadvm", loadvm_lazy_thread, s,
+                       QEMU_THREAD_JOINABLE);
+}
+
 
 /* QEMUFile timer support.
  * Not in qemu-file.c to not add qemu-timer.c as dependency to qemu-file.c
@@ -221,6 +609,26 @@ typedef struct CompatEntry {
     int instance_id;
 } CompatEntry;
 
+typedef enum {
+    SAVEVM_PHASE_SETUP,
+    SAVEVM_PHASE_ITERATE,
+    SAVEVM_PHASE_COMPLETE,
+    SAVEVM_PHASE_MAX,
+} SaveVMPhase;
+
+static const char *const savevm_phase_names[SAVEVM_PHASE_MAX] = {
+    [SAVEVM_PHASE_SETUP] = "setup",
+    [SAVEVM_PHASE_ITERATE] = "iterate",
+    [SAVEVM_PHASE_COMPLETE] = "complete",
+};
+
+/* What one section wrote, and how long it took, in one phase */
+typedef struct SaveStateStats {
+    int64_t bytes;
+    int64_t time_ns;
+    int64_t count;
+} SaveStateStats;
+
 typedef struct SaveStateEntry {
     QTAILQ_ENTRY(SaveStateEntry) entry;
     char idstr[256];
@@ -233,6 +641,7 @@ typedef struct SaveStateEntry {
     void *opaque;
     CompatEntry *compat;
     int is_ram;
+    SaveStateStats stats[SAVEVM_PHASE_MAX];
 } SaveStateEntry;
 
 
@@ -616,14 +1025,75 @@ bool qemu_savevm_state_blocked(Error **errp)
     return false;
 }
 
+static void savevm_section_stats_start(QEMUFile *f, int64_t *pos,
+                                       int64_t *time_ns)
+{
+    *pos = qemu_file_transferred_fast(f);
+    *time_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+}
+
+static void savevm_section_stats_end(QEMUFile *f, SaveStateEntry *se,
+                                     SaveVMPhase phase, int64_t pos,
+                                     int64_t time_ns)
+{
+    SaveStateStats *stats = &se->stats[phase];
+
+    pos = qemu_file_transferred_fast(f) - pos;
+    time_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - time_ns;
+    stats->bytes += pos;
+    stats->time_ns += time_ns;
+    stats->count++;
+    trace_savevm_section_stats(se->idstr, se->instance_id,
+                               savevm_phase_names[phase], pos,
+                               time_ns / SCALE_US);
+}
+
+/* Per section statistics of the last migration or snapshot */
+MigrationSectionStatsList *qemu_savevm_section_stats(void)
+{
+    MigrationSectionStatsList *head = NULL, **tail = &head;
+    MigrationSectionStatsList *entry;
+    MigrationSectionStats *info;
+    SaveStateEntry *se;
+
+    QTAILQ_FOREACH(se, &savevm_handlers, entry) {
+        SaveStateStats *stats = se->stats;
+
+        if (!stats[SAVEVM_PHASE_SETUP].count &&
+            !stats[SAVEVM_PHASE_ITERATE].count &&
+            !stats[SAVEVM_PHASE_COMPLETE].count) {
+            continue;
+        }
+
+        info = g_malloc0(sizeof(*info));
+        info->name = g_strdup(se->idstr);
+        info->instance_id = se->instance_id;
+        info->setup_bytes = stats[SAVEVM_PHASE_SETUP].bytes;
+        info->setup_time = stats[SAVEVM_PHASE_SETUP].time_ns / SCALE_US;
+        info->iterate_bytes = stats[SAVEVM_PHASE_ITERATE].bytes;
+        info->iterate_time = stats[SAVEVM_PHASE_ITERATE].time_ns / SCALE_US;
+        info->iterations = stats[SAVEVM_PHASE_ITERATE].count;
+        info->complete_bytes = stats[SAVEVM_PHASE_COMPLETE].bytes;
+        info->complete_time = stats[SAVEVM_PHASE_COMPLETE].time_ns / SCALE_US;
+
+        entry = g_malloc0(sizeof(*entry));
+        entry->value = info;
+        *tail = entry;
+        tail = &entry->next;
+    }
+    return head;
+}
+
 void qemu_savevm_state_begin(QEMUFile *f,
                              const MigrationParams *params)
 {
     SaveStateEntry *se;
+    int64_t pos, time_ns;
     int ret;
 
     trace_savevm_state_begin();
     QTAILQ_FOREACH(se, &savevm_handlers, entry) {
+        memset(se->stats, 0, sizeof(se->stats));
         if (!se->ops || !se->ops->set_params) {
             continue;
         }
@@ -644,6 +1114,7 @@ void qemu_savevm_state_begin(QEMUFile *f,
                 continue;
             }
         }
+        savevm_section_stats_start(f, &pos, &time_ns);
         /* Section type */
         qemu_put_byte(f, QEMU_VM_SECTION_START);
         qemu_put_be32(f, se->section_id);
@@ -657,6 +1128,7 @@ void qemu_savevm_state_begin(QEMUFile *f,
         qemu_put_be32(f, se->version_id);
 
         ret = se->ops->save_live_setup(f, se->opaque);
+        savevm_section_stats_end(f, se, SAVEVM_PHASE_SETUP, pos, time_ns);
         if (ret < 0) {
             qemu_file_set_error(f, ret);
             break;
@@ -673,6 +1145,7 @@ void qemu_savevm_state_begin(QEMUFile *f,
 int qemu_savevm_state_iterate(QEMUFile *f)
 {
     SaveStateEntry *se;
+    int64_t pos, time_ns;
     int ret = 1;
 
     trace_savevm_state_iterate();
@@ -689,11 +1162,13 @@ int qemu_savevm_state_iterate(QEMUFile *f)
             return 0;
         }
         trace_savevm_section_start(se->idstr, se->section_id);
+        savevm_section_stats_start(f, &pos, &time_ns);
         /* Section type */
         qemu_put_byte(f, QEMU_VM_SECTION_PART);
         qemu_put_be32(f, se->section_id);
 
         ret = se->ops->save_live_iterate(f, se->opaque);
+        savevm_section_stats_end(f, se, SAVEVM_PHASE_ITERATE, pos, time_ns);
         trace_savevm_section_end(se->idstr, se->section_id, ret);
 
         if (ret < 0) {
@@ -721,6 +1196,7 @@ void qemu_savevm_state_complete(QEMUFile *f)
     QJSON *vmdesc;
     int vmdesc_len;
     SaveStateEntry *se;
+    int64_t pos, time_ns;
     int ret;
 
     trace_savevm_state_complete();
@@ -737,11 +1213,13 @@ void qemu_savevm_state_complete(QEMUFile *f)
             }
         }
         trace_savevm_section_start(se->idstr, se->section_id);
+        savevm_section_stats_start(f, &pos, &time_ns);
         /* Section type */
         qemu_put_byte(f, QEMU_VM_SECTION_END);
         qemu_put_be32(f, se->section_id);
 
         ret = se->ops->save_live_complete(f, se->opaque);
+        savevm_section_stats_end(f, se, SAVEVM_PHASE_COMPLETE, pos, time_ns);
         trace_savevm_section_end(se->idstr, se->section_id, ret);
         if (ret < 0) {
             qemu_file_set_error(f, ret);
@@ -759,6 +1237,7 @@ void qemu_savevm_state_complete(QEMUFile *f)
             continue;
         }
         trace_savevm_section_start(se->idstr, se->section_id);
+        savevm_section_stats_start(f, &pos, &time_ns);
 
         json_start_object(vmdesc, NULL);
         json_prop_str(vmdesc, "name", se->idstr);
@@ -779,6 +1258,7 @@ void qemu_savevm_state_complete(QEMUFile *f)
         vmstate_save(f, se, vmdesc);
 
         json_end_object(vmdesc);
+        savevm_section_stats_end(f, se, SAVEVM_PHASE_COMPLETE, pos, time_ns);
         trace_savevm_section_end(se->idstr, se->section_id, 0);
     }
 
@@ -1120,19 +1600,425 @@ static int del_existing_snapshots(Monitor *mon, const char *name)
     return 0;
 }
 
+/* Record the time and the guest clock at which the VM state is taken. */
+static void savevm_snapshot_set_time(QEMUSnapshotInfo *sn)
+{
+    qemu_timeval tv;
+
+    qemu_gettimeofday(&tv);
+    sn->date_sec = tv.tv_sec;
+    sn->date_nsec = tv.tv_usec * 1000;
+    sn->vm_clock_nsec = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+}
+
+/*
+ * Create the snapshots; @bs is the image that contains the VM state.
+ * Failures are reported as they happen, and the first one is also
+ * returned in @errp.
+ */
+static void savevm_create_snapshots(BlockDriverState *bs,
+                                    QEMUSnapshotInfo *sn,
+                                    uint64_t vm_state_size, Error **errp)
+{
+    BlockDriverState *bs1 = NULL;
+    int ret;
+
+    while ((bs1 = bdrv_next(bs1))) {
+        if (bdrv_can_snapshot(bs1)) {
+            /* Write VM state size only to the image that contains the state */
+            sn->vm_state_size = (bs == bs1 ? vm_state_size : 0);
+            ret = bdrv_snapshot_create(bs1, sn);
+            if (ret < 0) {
+                error_report("Error while creating snapshot on '%s'",
+                             bdrv_get_device_name(bs1));
+                if (errp && !*errp) {
+                    error_setg_errno(errp, -ret,
+                                     "Error while creating snapshot on '%s'",
+                                     bdrv_get_device_name(bs1));
+                }
+            }
+        }
+    }
+}
+
+/*
+ * Live snapshots
+ *
+ * RAM is written to the VM state area while the guest keeps running,
+ * tracking the pages it dirties like a migration does.  Once what is left
+ * can be written in about the maximum migration downtime, the VM is
+ * stopped, the remaining pages and the device state are written, and the
+ * disk snapshots are taken, so that they all match the moment the guest
+ * was stopped.  The guest is restarted from a bottom half once the
+ * snapshot thread is done.
+ *
+ * Meanwhile the images are protected by op blockers, and the migration
+ * capabilities that only make sense for a real migration are turned off.
+ *
+ * Until the guest is stopped the snapshot can be cancelled; its progress
+ * is reported by query-savevm and its end by a SAVEVM_LIVE_FINISHED event.
+ */
+static const MigrationCapability savevm_live_disabled_caps[] = {
+    MIGRATION_CAPABILITY_XBZRLE,
+    MIGRATION_CAPABILITY_AUTO_CONVERGE,
+    MIGRATION_CAPABILITY_MULTIFD,
+};
+
+typedef struct SaveVMLiveState {
+    QemuThread thread;
+    QEMUBH *bh;
+    BlockDriverState *bs;
+    QEMUSnapshotInfo sn;
+    QEMUFile *file;
+    /* set while the snapshot thread holds the iothread lock */
+    bool locked;
+    bool was_running;
+    Error *blocker;
+    GSList *blocked_bs;
+    bool saved_caps[ARRAY_SIZE(savevm_live_disabled_caps)];
+
+    /* changed with the iothread lock held */
+    SaveVMLiveStatus status;
+    char *error;
+    /* set by savevm-cancel, polled by the snapshot thread */
+    bool cancelled;
+    int64_t start_time;
+    /* updated by the snapshot thread after each pass */
+    uint64_t written;
+} SaveVMLiveState;
+
+static SaveVMLiveState *savevm_live;
+
+/* The outcome of the last live snapshot, for query-savevm */
+static struct {
+    SaveVMLiveStatus status;
+    char *name;
+    uint64_t written;
+    int64_t total_time;
+    char *error;
+} savevm_live_last;
+
+bool savevm_live_active(void)
+{
+    return savevm_live != NULL;
+}
+
+/* The block layer needs the iothread lock, which RAM saving drops. */
+static void savevm_live_lock(SaveVMLiveState *s)
+{
+    if (!s->locked) {
+        qemu_mutex_lock_iothread();
+    }
+}
+
+static void savevm_live_unlock(SaveVMLiveState *s)
+{
+    if (!s->locked) {
+        qemu_mutex_unlock_iothread();
+    }
+}
+
+static ssize_t savevm_live_writev_buffer(void *opaque, struct iovec *iov,
+                                         int iovcnt, int64_t pos)
+{
+    SaveVMLiveState *s = opaque;
+    ssize_t ret;
+
+    savevm_live_lock(s);
+    ret = block_writev_buffer(s->bs, iov, iovcnt, pos);
+    savevm_live_unlock(s);
+    return ret;
+}
+
+static int savevm_live_file_writev(void *opaque, QEMUIOVector *qiov,
+                                   int64_t pos)
+{
+    SaveVMLiveState *s = opaque;
+    int ret;
+
+    savevm_live_lock(s);
+    ret = vmstate_file_writev(s->bs, qiov, pos);
+    savevm_live_unlock(s);
+    return ret;
+}
+
+static int savevm_live_file_discard(void *opaque, int64_t pos, int64_t size)
+{
+    SaveVMLiveState *s = opaque;
+    int ret;
+
+    savevm_live_lock(s);
+    ret = vmstate_file_discard(s->bs, pos, size);
+    savevm_live_unlock(s);
+    return ret;
+}
+
+static int savevm_live_fclose(void *opaque)
+{
+    SaveVMLiveState *s = opaque;
+
+    assert(s->locked);
+    return bdrv_fclose(s->bs);
+}
+
+static const QEMUFileOps savevm_live_write_ops = {
+    .writev_buffer  = savevm_live_writev_buffer,
+    .close          = savevm_live_fclose
+};
+
+static const FileMigrationOps savevm_live_file_ops = {
+    .writev  = savevm_live_file_writev,
+    .discard = savevm_live_file_discard,
+    .close   = savevm_live_fclose
+};
+
+static void *savevm_live_thread(void *opaque)
+{
+    SaveVMLiveState *s = opaque;
+    MigrationParams params = {
+        .blk = 0,
+        .shared = 0
+    };
+    int64_t start_time = s->start_time;
+    uint64_t max_size = 0;
+    uint64_t vm_state_size;
+    Error *local_err = NULL;
+    int ret;
+
+    rcu_register_thread();
+
+    qemu_savevm_state_begin(s->file, &params);
+    while (qemu_file_get_error(s->file) == 0 &&
+           !atomic_read(&s->cancelled)) {
+        int64_t time_spent;
+        uint64_t pending;
+
+        pending = qemu_savevm_state_pending(s->file, max_size);
+        /* Give up on a guest that dirties RAM faster than we can write
+         * it; the final pause is then as long as a plain savevm.
+         */
+        if (pending <= max_size ||
+            qemu_file_transferred(s->file) > 2 * ram_bytes_total()) {
+            break;
+        }
+        qemu_savevm_state_iterate(s->file);
+        atomic_set(&s->written, qemu_file_transferred(s->file));
+
+        time_spent = qemu_clock_get_ms(QEMU_CLOCK_REALTIME) - start_time;
+        if (time_spent > 0) {
+            max_size = (double)qemu_file_transferred(s->file) /
+                       time_spent * migrate_max_downtime() / 1000000;
+        }
+    }
+
+    qemu_mutex_lock_iothread();
+    s->locked = true;
+
+    /* savevm-cancel runs with the iothread lock, so this is final */
+    if (s->cancelled) {
+        qemu_savevm_state_cancel();
+        qemu_fclose(s->file);
+        s->status = SAVEVM_LIVE_STATUS_CANCELLED;
+        goto out;
+    }
+
+    s->was_running = runstate_is_running();
+    vm_stop_force_state(RUN_STATE_SAVE_VM);
+    savevm_snapshot_set_time(&s->sn);
+    trace_savevm_live_stop(qemu_file_transferred(s->file),
+                           qemu_clock_get_ms(QEMU_CLOCK_REALTIME) -
+                           start_time);
+
+    ret = qemu_file_get_error(s->file);
+    if (ret == 0) {
+        qemu_savevm_state_complete(s->file);
+        ret = qemu_file_get_error(s->file);
+    }
+    if (ret != 0) {
+        qemu_savevm_state_cancel();
+    }
+    vm_state_size = vmstate_file_size(s->file);
+    s->written = qemu_file_transferred(s->file);
+    qemu_fclose(s->file);
+
+    if (ret == 0) {
+        savevm_create_snapshots(s->bs, &s->sn, vm_state_size, &local_err);
+    } else {
+        error_setg_errno(&local_err, -ret, "Error while writing VM state");
+        error_report("%s", error_get_pretty(local_err));
+    }
+    if (local_err) {
+        s->error = g_strdup(error_get_pretty(local_err));
+        s->status = SAVEVM_LIVE_STATUS_FAILED;
+        error_free(local_err);
+    } else {
+        s->status = SAVEVM_LIVE_STATUS_COMPLETED;
+    }
+
+out:
+    s->locked = false;
+    qemu_bh_schedule(s->bh);
+    qemu_mutex_unlock_iothread();
+
+    rcu_unregister_thread();
+    return NULL;
+}
+
+static void savevm_live_bh(void *opaque)
+{
+    SaveVMLiveState *s = opaque;
+    MigrationState *ms = migrate_get_current();
+    GSList *l;
+    int i;
+
+    qemu_thread_join(&s->thread);
+    qemu_bh_delete(s->bh);
+
+    for (l = s->blocked_bs; l; l = l->next) {
+        bdrv_op_unblock_all(l->data, s->blocker);
+    }
+    g_slist_free(s->blocked_bs);
+    error_free(s->blocker);
+    for (i = 0; i < ARRAY_SIZE(savevm_live_disabled_caps); i++) {
+        ms->enabled_capabilities[savevm_live_disabled_caps[i]] =
+            s->saved_caps[i];
+    }
+    if (s->was_running) {
+        vm_start();
+    }
+
+    g_free(savevm_live_last.name);
+    g_free(savevm_live_last.error);
+    savevm_live_last.status = s->status;
+    savevm_live_last.name = g_strdup(s->sn.name);
+    savevm_live_last.written = s->written;
+    savevm_live_last.total_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME) -
+                                  s->start_time;
+    savevm_live_last.error = s->error;
+
+    qapi_event_send_savevm_live_finished(s->sn.name, s->status,
+                                         !!s->error, s->error, &error_abort);
+    trace_savevm_live_end();
+    savevm_live = NULL;
+    g_free(s);
+}
+
+SaveVMLiveInfo *qmp_query_savevm(Error **errp)
+{
+    SaveVMLiveInfo *info = g_new0(SaveVMLiveInfo, 1);
+    SaveVMLiveState *s = savevm_live;
+
+    if (s) {
+        info->status = s->status;
+        info->has_name = true;
+        info->name = g_strdup(s->sn.name);
+        info->has_written = true;
+        info->written = atomic_read(&s->written);
+        info->has_total_time = true;
+        info->total_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME) -
+                           s->start_time;
+        return info;
+    }
+
+    info->status = savevm_live_last.status;
+    if (info->status != SAVEVM_LIVE_STATUS_NONE) {
+        info->has_name = true;
+        info->name = g_strdup(savevm_live_last.name);
+        info->has_written = true;
+        info->written = savevm_live_last.written;
+        info->has_total_time = true;
+        info->total_time = savevm_live_last.total_time;
+    }
+    if (savevm_live_last.error) {
+        info->has_error_desc = true;
+        info->error_desc = g_strdup(savevm_live_last.error);
+    }
+    return info;
+}
+
+void qmp_savevm_cancel(Error **errp)
+{
+    SaveVMLiveState *s = savevm_live;
+
+    if (!s) {
+        error_setg(errp, "No live snapshot is in progress");
+        return;
+    }
+    if (s->status != SAVEVM_LIVE_STATUS_ACTIVE) {
+        /* already cancelled, or over and waiting for the bottom half */
+        return;
+    }
+    s->status = SAVEVM_LIVE_STATUS_CANCELLING;
+    atomic_set(&s->cancelled, true);
+}
+
+static void savevm_live_start(BlockDriverState *bs, QEMUSnapshotInfo *sn)
+{
+    SaveVMLiveState *s = g_new0(SaveVMLiveState, 1);
+    MigrationState *ms = migrate_get_current();
+    BlockDriverState *bs1 = NULL;
+    int i;
+
+    /* the images must stay until the snapshots are taken */
+    error_setg(&s->blocker, "A live snapshot is being taken");
+    while ((bs1 = bdrv_next(bs1))) {
+        if (bdrv_can_snapshot(bs1)) {
+            bdrv_op_block_all(bs1, s->blocker);
+            s->blocked_bs = g_slist_prepend(s->blocked_bs, bs1);
+        }
+    }
+    for (i = 0; i < ARRAY_SIZE(savevm_live_disabled_caps); i++) {
+        s->saved_caps[i] =
+            ms->enabled_capabilities[savevm_live_disabled_caps[i]];
+        ms->enabled_capabilities[savevm_live_disabled_caps[i]] = false;
+    }
+
+    s->bs = bs;
+    s->sn = *sn;
+    s->status = SAVEVM_LIVE_STATUS_ACTIVE;
+    s->start_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    if (vmstate_file_supported(bs)) {
+        s->file = file_migration_open_ops(s, &savevm_live_file_ops, true,
+                                          NULL);
+    }
+    if (!s->file) {
+        s->file = qemu_fopen_ops(s, &savevm_live_write_ops);
+    }
+    s->bh = qemu_bh_new(savevm_live_bh, s);
+    savevm_live = s;
+
+    qemu_thread_create(&s->thread, "savevm", savevm_live_thread, s,
+                       QEMU_THREAD_JOINABLE);
+}
+
 void hmp_savevm(Monitor *mon, const QDict *qdict)
 {
-    BlockDriverState *bs, *bs1;
+    BlockDriverState *bs;
     QEMUSnapshotInfo sn1, *sn = &sn1, old_sn1, *old_sn = &old_sn1;
     int ret;
     QEMUFile *f;
     int saved_vm_running;
     uint64_t vm_state_size;
-    qemu_timeval tv;
+    time_t date_sec;
     struct tm tm;
     const char *name = qdict_get_try_str(qdict, "name");
+    bool live = qdict_get_try_bool(qdict, "live", false);
     Error *local_err = NULL;
 
+    if (savevm_live_active()) {
+        monitor_printf(mon, "A live snapshot is already in progress\n");
+        return;
+    }
+    if (loadvm_lazy) {
+        monitor_printf(mon, "Cannot take a snapshot while guest RAM is "
+                       "still being read from one\n");
+        return;
+    }
+    if (migration_is_active(migrate_get_current())) {
+        monitor_printf(mon, "Cannot take a snapshot during migration\n");
+        return;
+    }
+
     /* Verify if there is a device that doesn't support snapshots and is writable */
     bs = NULL;
     while ((bs = bdrv_next(bs))) {
@@ -1154,16 +2040,23 @@ void hmp_savevm(Monitor *mon, const QDict *qdict)
         return;
     }
 
+    /* a stopped guest cannot dirty RAM, so save it in one go */
+    live = live && runstate_is_running();
+    if (live && qemu_savevm_state_blocked(&local_err)) {
+        monitor_printf(mon, "%s\n", error_get_pretty(local_err));
+        error_free(local_err);
+        return;
+    }
+
     saved_vm_running = runstate_is_running();
-    vm_stop(RUN_STATE_SAVE_VM);
+    if (!live) {
+        vm_stop(RUN_STATE_SAVE_VM);
+    }
 
     memset(sn, 0, sizeof(*sn));
 
     /* fill auxiliary fields */
-    qemu_gettimeofday(&tv);
-    sn->date_sec = tv.tv_sec;
-    sn->date_nsec = tv.tv_usec * 1000;
-    sn->vm_clock_nsec = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    savevm_snapshot_set_time(sn);
 
     if (name) {
         ret = bdrv_snapshot_find(bs, old_sn, name);
@@ -1174,8 +2067,8 @@ void hmp_savevm(Monitor *mon, const QDict *qdict)
             pstrcpy(sn->name, sizeof(sn->name), name);
         }
     } else {
-        /* cast below needed for OpenBSD where tv_sec is still 'long' */
-        localtime_r((const time_t *)&tv.tv_sec, &tm);
+        date_sec = sn->date_sec;
+        localtime_r(&date_sec, &tm);
         strftime(sn->name, sizeof(sn->name), "vm-%Y%m%d%H%M%S", &tm);
     }
 
@@ -1184,14 +2077,25 @@ void hmp_savevm(Monitor *mon, const QDict *qdict)
         goto the_end;
     }
 
+    if (live) {
+        savevm_live_start(bs, sn);
+        return;
+    }
+
     /* save the VM state */
-    f = qemu_fopen_bdrv(bs, 1);
+    f = NULL;
+    if (vmstate_file_supported(bs)) {
+        f = file_migration_open_ops(bs, &vmstate_file_write_ops, true, NULL);
+    }
+    if (!f) {
+        f = qemu_fopen_bdrv(bs, 1);
+    }
     if (!f) {
         monitor_printf(mon, "Could not open VM state file\n");
         goto the_end;
     }
     ret = qemu_savevm_state(f, &local_err);
-    vm_state_size = qemu_ftell(f);
+    vm_state_size = vmstate_file_size(f);
     qemu_fclose(f);
     if (ret < 0) {
         monitor_printf(mon, "%s\n", error_get_pretty(local_err));
@@ -1200,19 +2104,7 @@ void hmp_savevm(Monitor *mon, const QDict *qdict)
     }
 
     /* create the snapshots */
-
-    bs1 = NULL;
-    while ((bs1 = bdrv_next(bs1))) {
-        if (bdrv_can_snapshot(bs1)) {
-            /* Write VM state size only to the image that contains the state */
-            sn->vm_state_size = (bs == bs1 ? vm_state_size : 0);
-            ret = bdrv_snapshot_create(bs1, sn);
-            if (ret < 0) {
-                monitor_printf(mon, "Error while creating snapshot on '%s'\n",
-                               bdrv_get_device_name(bs1));
-            }
-        }
-    }
+    savevm_create_snapshots(bs, sn, vm_state_size, NULL);
 
  the_end:
     if (saved_vm_running) {
@@ -1250,9 +2142,22 @@ int load_vmstate(const char *name)
 {
     BlockDriverState *bs, *bs_vm_state;
     QEMUSnapshotInfo sn;
+    LoadVMState *s;
     QEMUFile *f;
+    uint64_t vm_state_size;
     int ret;
 
+    if (savevm_live_active()) {
+        error_report("Cannot load a snapshot while a live snapshot is "
+                     "in progress");
+        return -EBUSY;
+    }
+    if (loadvm_lazy) {
+        error_report("Cannot load a snapshot while guest RAM is still being "
+                     "read from one");
+        return -EBUSY;
+    }
+
     bs_vm_state = find_vmstate_bs();
     if (!bs_vm_state) {
         error_report("No block device supports snapshots");
@@ -1268,6 +2173,7 @@ int load_vmstate(const char *name)
             "using qemu-img.");
         return -EINVAL;
     }
+    vm_state_size = sn.vm_state_size;
 
     /* Verify if there is any device that doesn't support snapshots and is
     writable and check if the requested snapshot is available too. */
@@ -1308,16 +2214,21 @@ int load_vmstate(const char *name)
     }
 
     /* restore the VM state */
-    f = qemu_fopen_bdrv(bs_vm_state, 0);
+    s = g_new0(LoadVMState, 1);
+    s->bs = bs_vm_state;
+    s->ra = vmstate_readahead_new(bs_vm_state, vm_state_size);
+    s->fd = -1;
+    s->mappings = g_array_new(false, false, sizeof(LoadVMMapping));
+    f = file_migration_open_ops(s, &loadvm_file_ops, false, NULL);
     if (!f) {
-        error_report("Could not open VM state file");
-        return -EINVAL;
+        f = qemu_fopen_ops(s->ra, &bdrv_readahead_ops);
     }
 
     qemu_system_reset(VMRESET_SILENT);
     ret = qemu_loadvm_state(f);
 
     qemu_fclose(f);
+    loadvm_lazy_start(s);
     if (ret < 0) {
         error_report("Error %d while loading VM state", ret);
         return ret;
@@ -1332,6 +2243,16 @@ void hmp_delvm(Monitor *mon, const QDict *qdict)
     Error *err;
     const char *name = qdict_get_str(qdict, "name");
 
+    if (savevm_live_active()) {
+        monitor_printf(mon, "Cannot delete a snapshot while a live snapshot "
+                       "is in progress\n");
+        return;
+    }
+    if (loadvm_lazy) {
+        monitor_printf(mon, "Cannot delete a snapshot while guest RAM is "
+                       "still being read from one\n");
+        return;
+    }
     if (!find_vmstate_bs()) {
         monitor_printf(mon, "No block device supports snapshots\n");
         return;
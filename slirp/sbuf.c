@@ -60,6 +60,38 @@ sbreserve(struct sbuf *sb, int size)
 	}
 }
 
+/*
+ * Grow the buffer to size bytes, keeping the data it holds.  Unlike
+ * sbreserve() this may be called on a buffer that is in use.
+ */
+void
+sbgrow(struct sbuf *sb, int size)
+{
+	char *data;
+	int n;
+
+	if (size <= sb->sb_datalen)
+		return;
+
+	data = (char *)malloc(size);
+	if (data == NULL)
+		return;
+
+	/* Linearize the ring, the oldest byte goes first */
+	n = sb->sb_data + sb->sb_datalen - sb->sb_rptr;
+	if (n >= sb->sb_cc) {
+		memcpy(data, sb->sb_rptr, sb->sb_cc);
+	} else {
+		memcpy(data, sb->sb_rptr, n);
+		memcpy(data + n, sb->sb_data, sb->sb_cc - n);
+	}
+
+	free(sb->sb_data);
+	sb->sb_data = sb->sb_rptr = data;
+	sb->sb_wptr = data + sb->sb_cc;
+	sb->sb_datalen = size;
+}
+
 /*
  * Try and write() to the socket, whatever doesn't get written
  * append to the buffer... for a host with a fast net connection,
@@ -234,6 +234,18 @@ Slirp *slirp_init(int restricted, struct in_addr vnetwork,
 
     slirp->opaque = opaque;
 
+#ifdef CONFIG_EPOLL
+    slirp->epoll_idx = -1;
+#ifdef CONFIG_EPOLL_CREATE1
+    slirp->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+#else
+    slirp->epoll_fd = epoll_create(SLIRP_EPOLL_EVENTS);
+    if (slirp->epoll_fd >= 0) {
+        qemu_set_cloexec(slirp->epoll_fd);
+    }
+#endif
+#endif
+
     register_savevm(NULL, "slirp", 0, 3,
                     slirp_state_save, slirp_state_load, slirp);
 
@@ -251,6 +263,12 @@ void slirp_cleanup(Slirp *slirp)
     ip_cleanup(slirp);
     m_cleanup(slirp);
 
+#ifdef CONFIG_EPOLL
+    if (slirp->epoll_fd >= 0) {
+        close(slirp->epoll_fd);
+    }
+#endif
+
     g_free(slirp->vdnssearch);
     g_free(slirp->tftp_prefix);
     g_free(slirp->bootp_filename);
@@ -286,6 +304,144 @@ static void slirp_update_timeout(uint32_t *timeout)
     *timeout = t;
 }
 
+#ifdef CONFIG_EPOLL
+static uint32_t slirp_gio_to_epoll(int events)
+{
+    return (events & G_IO_IN ? EPOLLIN : 0) |
+           (events & G_IO_PRI ? EPOLLPRI : 0) |
+           (events & G_IO_OUT ? EPOLLOUT : 0) |
+           (events & G_IO_ERR ? EPOLLERR : 0) |
+           (events & G_IO_HUP ? EPOLLHUP : 0);
+}
+
+static int slirp_epoll_to_gio(uint32_t events)
+{
+    return (events & EPOLLIN ? G_IO_IN : 0) |
+           (events & EPOLLPRI ? G_IO_PRI : 0) |
+           (events & EPOLLOUT ? G_IO_OUT : 0) |
+           (events & EPOLLERR ? G_IO_ERR : 0) |
+           (events & EPOLLHUP ? G_IO_HUP : 0);
+}
+
+/*
+ * Go back to one GPollFD per socket.  Sockets that were only in the set
+ * are picked up again on the next slirp_pollfds_fill().
+ */
+static void slirp_epoll_disable(Slirp *slirp)
+{
+    struct socket *heads[] = { &slirp->tcb, &slirp->udb, &slirp->icmp };
+    struct socket *so;
+    int i;
+
+    error_report("slirp: epoll_ctl failed: %s", strerror(errno));
+    close(slirp->epoll_fd);
+    slirp->epoll_fd = -1;
+    for (i = 0; i < ARRAY_SIZE(heads); i++) {
+        for (so = heads[i]->so_next; so != heads[i]; so = so->so_next) {
+            so->pollfd = -1;
+        }
+    }
+}
+#endif
+
+/*
+ * Watch @so for @events, or stop watching it if @events is 0.  With
+ * epoll the set is only updated when the events change, so the main
+ * loop polls one descriptor per slirp instance instead of one per
+ * socket, and only the sockets that are ready get looked at.
+ */
+static void slirp_poll_set(GArray *pollfds, struct socket *so, int events,
+                           void (*poll_cb)(struct socket *, int))
+{
+#ifdef CONFIG_EPOLL
+    Slirp *slirp = so->slirp;
+
+    if (slirp->epoll_fd >= 0) {
+        struct epoll_event ev = {
+            .events = slirp_gio_to_epoll(events),
+            .data.ptr = so,
+        };
+
+        so->poll_cb = poll_cb;
+        if (!events) {
+            /* ERR and HUP are always reported, so leave the set */
+            if (so->pollfd != -1) {
+                epoll_ctl(slirp->epoll_fd, EPOLL_CTL_DEL, so->pollfd, NULL);
+                so->pollfd = -1;
+            }
+            return;
+        }
+        if (so->pollfd != -1 && so->pollevents == events) {
+            return;
+        }
+        if (epoll_ctl(slirp->epoll_fd,
+                      so->pollfd == -1 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD,
+                      so->s, &ev) == 0) {
+            so->pollfd = so->s;
+            so->pollevents = events;
+            return;
+        }
+        slirp_epoll_disable(slirp);
+    }
+#endif
+
+    /* Without a GArray the socket waits for slirp_pollfds_fill() */
+    if (events && pollfds) {
+        GPollFD pfd = {
+            .fd = so->s,
+            .events = events,
+        };
+        so->pollfds_idx = pollfds->len;
+        g_array_append_val(pollfds, pfd);
+    }
+}
+
+static void slirp_tcp_poll(struct socket *so, int revents);
+
+/* Events to watch for on a connected TCP socket */
+static int slirp_tcp_events(struct socket *so)
+{
+    int events = 0;
+
+    /*
+     * Set for writing if we are connected, can send more, and
+     * we have something to send
+     */
+    if (CONN_CANFSEND(so) && so->so_rcv.sb_cc) {
+        events |= G_IO_OUT | G_IO_ERR;
+    }
+
+    /*
+     * Set for reading (and urgent data) if we are connected, can
+     * receive more, and we have room for it XXX /2 ?
+     */
+    if (CONN_CANFRCV(so) &&
+        (so->so_snd.sb_cc < (so->so_snd.sb_datalen/2))) {
+        events |= G_IO_IN | G_IO_HUP | G_IO_ERR | G_IO_PRI;
+    }
+    return events;
+}
+
+/*
+ * Called when the guest has acked data on @so.  The epoll set is
+ * watched by the kernel even while the main loop is already polling,
+ * so resume reading from the socket right away instead of on the next
+ * slirp_pollfds_fill().
+ */
+void slirp_tcp_poll_update(struct socket *so)
+{
+#ifdef CONFIG_EPOLL
+    if (so->slirp->epoll_fd < 0 || so->s == -1 ||
+        (so->so_state & (SS_NOFDREF | SS_FACCEPTCONN | SS_ISFCONNECTING))) {
+        return;
+    }
+    slirp_poll_set(NULL, so, slirp_tcp_events(so), slirp_tcp_poll);
+#endif
+}
+
+static void slirp_udp_poll(struct socket *so, int revents);
+static void slirp_icmp_poll(struct socket *so, int revents);
+
 void slirp_pollfds_fill(GArray *pollfds, uint32_t *timeout)
 {
     Slirp *slirp;
@@ -309,8 +465,6 @@ void slirp_pollfds_fill(GArray *pollfds, uint32_t *timeout)
 
         for (so = slirp->tcb.so_next; so != &slirp->tcb;
                 so = so_next) {
-            int events = 0;
-
             so_next = so->so_next;
 
             so->pollfds_idx = -1;
@@ -328,6 +482,7 @@ void slirp_pollfds_fill(GArray *pollfds, uint32_t *timeout)
              * newly socreated() sockets etc. Don't want to select these.
              */
             if (so->so_state & SS_NOFDREF || so->s == -1) {
+                slirp_poll_set(pollfds, so, 0, slirp_tcp_poll);
                 continue;
             }
 
@@ -335,12 +490,8 @@ void slirp_pollfds_fill(GArray *pollfds, uint32_t *timeout)
              * Set for reading sockets which are accepting
              */
             if (so->so_state & SS_FACCEPTCONN) {
-                GPollFD pfd = {
-                    .fd = so->s,
-                    .events = G_IO_IN | G_IO_HUP | G_IO_ERR,
-                };
-                so->pollfds_idx = pollfds->len;
-                g_array_append_val(pollfds, pfd);
+                slirp_poll_set(pollfds, so, G_IO_IN | G_IO_HUP | G_IO_ERR,
+                               slirp_tcp_poll);
                 continue;
             }
 
@@ -348,40 +499,13 @@ void slirp_pollfds_fill(GArray *pollfds, uint32_t *timeout)
              * Set for writing sockets which are connecting
              */
             if (so->so_state & SS_ISFCONNECTING) {
-                GPollFD pfd = {
-                    .fd = so->s,
-                    .events = G_IO_OUT | G_IO_ERR,
-                };
-                so->pollfds_idx = pollfds->len;
-                g_array_append_val(pollfds, pfd);
+                slirp_poll_set(pollfds, so, G_IO_OUT | G_IO_ERR,
+                               slirp_tcp_poll);
                 continue;
             }
 
-            /*
-             * Set for writing if we are connected, can send more, and
-             * we have something to send
-             */
-            if (CONN_CANFSEND(so) && so->so_rcv.sb_cc) {
-                events |= G_IO_OUT | G_IO_ERR;
-            }
-
-            /*
-             * Set for reading (and urgent data) if we are connected, can
-             * receive more, and we have room for it XXX /2 ?
-             */
-            if (CONN_CANFRCV(so) &&
-                (so->so_snd.sb_cc < (so->so_snd.sb_datalen/2))) {
-                events |= G_IO_IN | G_IO_HUP | G_IO_ERR | G_IO_PRI;
-            }
-
-            if (events) {
-                GPollFD pfd = {
-                    .fd = so->s,
-                    .events = events,
-                };
-                so->pollfds_idx = pollfds->len;
-                g_array_append_val(pollfds, pfd);
-            }
+            slirp_poll_set(pollfds, so, slirp_tcp_events(so),
+                           slirp_tcp_poll);
         }
 
         /*
@@ -389,6 +513,8 @@ void slirp_pollfds_fill(GArray *pollfds, uint32_t *timeout)
          */
         for (so = slirp->udb.so_next; so != &slirp->udb;
                 so = so_next) {
+            int events = 0;
+
             so_next = so->so_next;
 
             so->pollfds_idx = -1;
@@ -416,13 +542,9 @@ void slirp_pollfds_fill(GArray *pollfds, uint32_t *timeout)
              * (XXX <= 4 ?)
              */
             if ((so->so_state & SS_ISFCONNECTED) && so->so_queued <= 4) {
-                GPollFD pfd = {
-                    .fd = so->s,
-                    .events = G_IO_IN | G_IO_HUP | G_IO_ERR,
-                };
-                so->pollfds_idx = pollfds->len;
-                g_array_append_val(pollfds, pfd);
+                events = G_IO_IN | G_IO_HUP | G_IO_ERR;
             }
+            slirp_poll_set(pollfds, so, events, slirp_udp_poll);
         }
 
         /*
@@ -430,6 +552,8 @@ void slirp_pollfds_fill(GArray *pollfds, uint32_t *timeout)
          */
         for (so = slirp->icmp.so_next; so != &slirp->icmp;
                 so = so_next) {
+            int events = 0;
+
             so_next = so->so_next;
 
             so->pollfds_idx = -1;
@@ -447,23 +571,205 @@ void slirp_pollfds_fill(GArray *pollfds, uint32_t *timeout)
             }
 
             if (so->so_state & SS_ISFCONNECTED) {
-                GPollFD pfd = {
-                    .fd = so->s,
-                    .events = G_IO_IN | G_IO_HUP | G_IO_ERR,
-                };
-                so->pollfds_idx = pollfds->len;
-                g_array_append_val(pollfds, pfd);
+                events = G_IO_IN | G_IO_HUP | G_IO_ERR;
             }
+            slirp_poll_set(pollfds, so, events, slirp_icmp_poll);
+        }
+
+#ifdef CONFIG_EPOLL
+        slirp->epoll_idx = -1;
+        if (slirp->epoll_fd >= 0) {
+            GPollFD pfd = {
+                .fd = slirp->epoll_fd,
+                .events = G_IO_IN,
+            };
+            slirp->epoll_idx = pollfds->len;
+            g_array_append_val(pollfds, pfd);
         }
+#endif
     }
     slirp_update_timeout(timeout);
 }
 
+static void slirp_tcp_poll(struct socket *so, int revents)
+{
+    int ret;
+
+    if (so->so_state & SS_NOFDREF || so->s == -1) {
+        return;
+    }
+
+    /*
+     * Check for URG data
+     * This will soread as well, so no need to
+     * test for G_IO_IN below if this succeeds
+     */
+    if (revents & G_IO_PRI) {
+        sorecvoob(so);
+    }
+    /*
+     * Check sockets for reading
+     */
+    else if (revents & (G_IO_IN | G_IO_HUP | G_IO_ERR)) {
+        /*
+         * Check for incoming connections
+         */
+        if (so->so_state & SS_FACCEPTCONN) {
+            tcp_connect(so);
+            return;
+        } /* else */
+        ret = soread(so);
+
+        /* Output it if we read something */
+        if (ret > 0) {
+            tcp_output(sototcpcb(so));
+        }
+    }
+
+    /*
+     * Check sockets for writing
+     */
+    if (!(so->so_state & SS_NOFDREF) &&
+            (revents & (G_IO_OUT | G_IO_ERR))) {
+        /*
+         * Check for non-blocking, still-connecting sockets
+         */
+        if (so->so_state & SS_ISFCONNECTING) {
+            /* Connected */
+            so->so_state &= ~SS_ISFCONNECTING;
+
+            ret = send(so->s, (const void *) &ret, 0, 0);
+            if (ret < 0) {
+                /* XXXXX Must fix, zero bytes is a NOP */
+                if (errno == EAGAIN || errno == EWOULDBLOCK ||
+                    errno == EINPROGRESS || errno == ENOTCONN) {
+                    return;
+                }
+
+                /* else failed */
+                so->so_state &= SS_PERSISTENT_MASK;
+                so->so_state |= SS_NOFDREF;
+            }
+            /* else so->so_state &= ~SS_ISFCONNECTING; */
+
+            /*
+             * Continue tcp_input
+             */
+            tcp_input((struct mbuf *)NULL, sizeof(struct ip), so);
+            /* continue; */
+        } else {
+            ret = sowrite(so);
+        }
+        /*
+         * XXXXX If we wrote something (a lot), there
+         * could be a need for a window update.
+         * In the worst case, the remote will send
+         * a window probe to get things going again
+         */
+    }
+
+    /*
+     * Probe a still-connecting, non-blocking socket
+     * to check if it's still alive
+     */
+#ifdef PROBE_CONN
+    if (so->so_state & SS_ISFCONNECTING) {
+        ret = qemu_recv(so->s, &ret, 0, 0);
+
+        if (ret < 0) {
+            /* XXX */
+            if (errno == EAGAIN || errno == EWOULDBLOCK ||
+                errno == EINPROGRESS || errno == ENOTCONN) {
+                return; /* Still connecting, continue */
+            }
+
+            /* else failed */
+            so->so_state &= SS_PERSISTENT_MASK;
+            so->so_state |= SS_NOFDREF;
+
+            /* tcp_input will take care of it */
+        } else {
+            ret = send(so->s, &ret, 0, 0);
+            if (ret < 0) {
+                /* XXX */
+                if (errno == EAGAIN || errno == EWOULDBLOCK ||
+                    errno == EINPROGRESS || errno == ENOTCONN) {
+                    return;
+                }
+                /* else failed */
+                so->so_state &= SS_PERSISTENT_MASK;
+                so->so_state |= SS_NOFDREF;
+            } else {
+                so->so_state &= ~SS_ISFCONNECTING;
+            }
+
+        }
+        tcp_input((struct mbuf *)NULL, sizeof(struct ip), so);
+    } /* SS_ISFCONNECTING */
+#endif
+}
+
+/*
+ * Incoming packets are sent straight away, they're not buffered.
+ * Incoming UDP data isn't buffered either.
+ */
+static void slirp_udp_poll(struct socket *so, int revents)
+{
+    if (so->s != -1 && (revents & (G_IO_IN | G_IO_HUP | G_IO_ERR))) {
+        sorecvfrom(so);
+    }
+}
+
+/*
+ * Check incoming ICMP relies.
+ */
+static void slirp_icmp_poll(struct socket *so, int revents)
+{
+    if (so->s != -1 && (revents & (G_IO_IN | G_IO_HUP | G_IO_ERR))) {
+        icmp_receive(so);
+    }
+}
+
+#ifdef CONFIG_EPOLL
+/* Handle the sockets that the epoll set reports as ready */
+static void slirp_epoll_poll(Slirp *slirp, GArray *pollfds)
+{
+    int i, n;
+
+    if (slirp->epoll_idx == -1 ||
+        !(g_array_index(pollfds, GPollFD, slirp->epoll_idx).revents &
+          G_IO_IN)) {
+        return;
+    }
+
+    n = epoll_wait(slirp->epoll_fd, slirp->epoll_events,
+                   SLIRP_EPOLL_EVENTS, 0);
+    slirp->epoll_nready = MAX(n, 0);
+    for (i = 0; i < slirp->epoll_nready; i++) {
+        struct socket *so = slirp->epoll_events[i].data.ptr;
+
+        /* NULL if an earlier event freed it, see sofree() */
+        if (so) {
+            so->poll_cb(so, slirp_epoll_to_gio(
+                                slirp->epoll_events[i].events));
+        }
+    }
+    slirp->epoll_nready = 0;
+}
+#endif
+
+static int slirp_revents(GArray *pollfds, struct socket *so)
+{
+    if (so->pollfds_idx == -1) {
+        return 0;
+    }
+    return g_array_index(pollfds, GPollFD, so->pollfds_idx).revents;
+}
+
 void slirp_pollfds_poll(GArray *pollfds, int select_error)
 {
     Slirp *slirp;
     struct socket *so, *so_next;
-    int ret;
 
     if (QTAILQ_EMPTY(&slirp_instances)) {
         return;
@@ -491,176 +797,26 @@ void slirp_pollfds_poll(GArray *pollfds, int select_error)
          * Check sockets
          */
         if (!select_error) {
-            /*
-             * Check TCP sockets
-             */
-            for (so = slirp->tcb.so_next; so != &slirp->tcb;
-                    so = so_next) {
-                int revents;
-
-                so_next = so->so_next;
-
-                revents = 0;
-                if (so->pollfds_idx != -1) {
-                    revents = g_array_index(pollfds, GPollFD,
-                                            so->pollfds_idx).revents;
-                }
-
-                if (so->so_state & SS_NOFDREF || so->s == -1) {
-                    continue;
-                }
-
-                /*
-                 * Check for URG data
-                 * This will soread as well, so no need to
-                 * test for G_IO_IN below if this succeeds
-                 */
-                if (revents & G_IO_PRI) {
-                    sorecvoob(so);
-                }
-                /*
-                 * Check sockets for reading
-                 */
-                else if (revents & (G_IO_IN | G_IO_HUP | G_IO_ERR)) {
-                    /*
-                     * Check for incoming connections
-                     */
-                    if (so->so_state & SS_FACCEPTCONN) {
-                        tcp_connect(so);
-                        continue;
-                    } /* else */
-                    ret = soread(so);
-
-                    /* Output it if we read something */
-                    if (ret > 0) {
-                        tcp_output(sototcpcb(so));
-                    }
-                }
-
-                /*
-                 * Check sockets for writing
-                 */
-                if (!(so->so_state & SS_NOFDREF) &&
-                        (revents & (G_IO_OUT | G_IO_ERR))) {
-                    /*
-                     * Check for non-blocking, still-connecting sockets
-                     */
-                    if (so->so_state & SS_ISFCONNECTING) {
-                        /* Connected */
-                        so->so_state &= ~SS_ISFCONNECTING;
-
-                        ret = send(so->s, (const void *) &ret, 0, 0);
-                        if (ret < 0) {
-                            /* XXXXX Must fix, zero bytes is a NOP */
-                            if (errno == EAGAIN || errno == EWOULDBLOCK ||
-                                errno == EINPROGRESS || errno == ENOTCONN) {
-                                continue;
-                            }
-
-                            /* else failed */
-                            so->so_state &= SS_PERSISTENT_MASK;
-                            so->so_state |= SS_NOFDREF;
-                        }
-                        /* else so->so_state &= ~SS_ISFCONNECTING; */
-
-                        /*
-                         * Continue tcp_input
-                         */
-                        tcp_input((struct mbuf *)NULL, sizeof(struct ip), so);
-                        /* continue; */
-                    } else {
-                        ret = sowrite(so);
-                    }
-                    /*
-                     * XXXXX If we wrote something (a lot), there
-                     * could be a need for a window update.
-                     * In the worst case, the remote will send
-                     * a window probe to get things going again
-                     */
-                }
-
-                /*
-                 * Probe a still-connecting, non-blocking socket
-                 * to check if it's still alive
-                 */
-#ifdef PROBE_CONN
-                if (so->so_state & SS_ISFCONNECTING) {
-                    ret = qemu_recv(so->s, &ret, 0, 0);
-
-                    if (ret < 0) {
-                        /* XXX */
-                        if (errno == EAGAIN || errno == EWOULDBLOCK ||
-                            errno == EINPROGRESS || errno == ENOTCONN) {
-                            continue; /* Still connecting, continue */
-                        }
-
-                        /* else failed */
-                        so->so_state &= SS_PERSISTENT_MASK;
-                        so->so_state |= SS_NOFDREF;
-
-                        /* tcp_input will take care of it */
-                    } else {
-                        ret = send(so->s, &ret, 0, 0);
-                        if (ret < 0) {
-                            /* XXX */
-                            if (errno == EAGAIN || errno == EWOULDBLOCK ||
-                                errno == EINPROGRESS || errno == ENOTCONN) {
-                                continue;
-                            }
-                            /* else failed */
-                            so->so_state &= SS_PERSISTENT_MASK;
-                            so->so_state |= SS_NOFDREF;
-                        } else {
-                            so->so_state &= ~SS_ISFCONNECTING;
-                        }
-
-                    }
-                    tcp_input((struct mbuf *)NULL, sizeof(struct ip), so);
-                } /* SS_ISFCONNECTING */
+#ifdef CONFIG_EPOLL
+            if (slirp->epoll_fd >= 0) {
+                slirp_epoll_poll(slirp, pollfds);
+            } else
 #endif
-            }
-
-            /*
-             * Now UDP sockets.
-             * Incoming packets are sent straight away, they're not buffered.
-             * Incoming UDP data isn't buffered either.
-             */
-            for (so = slirp->udb.so_next; so != &slirp->udb;
-                    so = so_next) {
-                int revents;
-
-                so_next = so->so_next;
-
-                revents = 0;
-                if (so->pollfds_idx != -1) {
-                    revents = g_array_index(pollfds, GPollFD,
-                            so->pollfds_idx).revents;
+            {
+                for (so = slirp->tcb.so_next; so != &slirp->tcb;
+                        so = so_next) {
+                    so_next = so->so_next;
+                    slirp_tcp_poll(so, slirp_revents(pollfds, so));
                 }
-
-                if (so->s != -1 &&
-                    (revents & (G_IO_IN | G_IO_HUP | G_IO_ERR))) {
-                    sorecvfrom(so);
+                for (so = slirp->udb.so_next; so != &slirp->udb;
+                        so = so_next) {
+                    so_next = so->so_next;
+                    slirp_udp_poll(so, slirp_revents(pollfds, so));
                 }
-            }
-
-            /*
-             * Check incoming ICMP relies.
-             */
-            for (so = slirp->icmp.so_next; so != &slirp->icmp;
-                    so = so_next) {
-                    int revents;
-
+                for (so = slirp->icmp.so_next; so != &slirp->icmp;
+                        so = so_next) {
                     so_next = so->so_next;
-
-                    revents = 0;
-                    if (so->pollfds_idx != -1) {
-                        revents = g_array_index(pollfds, GPollFD,
-                                                so->pollfds_idx).revents;
-                    }
-
-                    if (so->s != -1 &&
-                        (revents & (G_IO_IN | G_IO_HUP | G_IO_ERR))) {
-                    icmp_receive(so);
+                    slirp_icmp_poll(so, slirp_revents(pollfds, so));
                 }
             }
         }
@@ -846,7 +1002,7 @@ int slirp_remove_hostfwd(Slirp *slirp, int is_udp, struct in_addr host_addr,
             getsockname(so->s, (struct sockaddr *)&addr, &addr_len) == 0 &&
             addr.sin_addr.s_addr == host_addr.s_addr &&
             addr.sin_port == port) {
-            close(so->s);
+            soclosefd(so);
             sofree(so);
             return 0;
         }
@@ -122,6 +122,10 @@ void free(void *ptr);
 
 #include <sys/stat.h>
 
+#ifdef CONFIG_EPOLL
+#include <sys/epoll.h>
+#endif
+
 /* Avoid conflicting with the libc insque() and remque(), which
    have different prototypes. */
 #define insque slirp_insque
@@ -201,12 +205,22 @@ void arp_table_add(Slirp *slirp, uint32_t ip_addr, uint8_t ethaddr[ETH_ALEN]);
 bool arp_table_search(Slirp *slirp, uint32_t ip_addr,
                       uint8_t out_ethaddr[ETH_ALEN]);
 
+#define SLIRP_EPOLL_EVENTS 64
+
 struct Slirp {
     QTAILQ_ENTRY(Slirp) entry;
     u_int time_fasttimo;
     u_int last_slowtimo;
     bool do_slowtimo;
 
+#ifdef CONFIG_EPOLL
+    /* sockets are watched through this set, see slirp_pollfds_fill() */
+    int epoll_fd;
+    int epoll_idx;          /* GPollFD GArray index of epoll_fd */
+    struct epoll_event epoll_events[SLIRP_EPOLL_EVENTS];
+    int epoll_nready;       /* events being handled */
+#endif
+
     /* virtual network configuration */
     struct in_addr vnetwork_addr;
     struct in_addr vnetwork_mask;
@@ -296,6 +310,9 @@ void if_start(struct ttys *);
 #define SO_OPTIONS DO_KEEPALIVE
 #define TCP_MAXIDLE (TCPTV_KEEPCNT * TCPTV_KEEPINTVL)
 
+/* slirp.c */
+void slirp_tcp_poll_update(struct socket *so);
+
 /* dnssearch.c */
 int translate_dnssearch(Slirp *s, const char ** names);
 
@@ -52,10 +52,46 @@ socreate(Slirp *slirp)
     so->s = -1;
     so->slirp = slirp;
     so->pollfds_idx = -1;
+    so->pollfd = -1;
   }
   return(so);
 }
 
+/*
+ * Take a socket out of the epoll set.  This must happen before its
+ * descriptor is closed: the set refers to the open file, which a forked
+ * child may keep alive after we close the descriptor.
+ */
+static void sounwatch(struct socket *so)
+{
+#ifdef CONFIG_EPOLL
+  Slirp *slirp = so->slirp;
+  int i;
+
+  if (so->pollfd != -1) {
+    epoll_ctl(slirp->epoll_fd, EPOLL_CTL_DEL, so->pollfd, NULL);
+    so->pollfd = -1;
+  }
+  /* an event of this round may still refer to it */
+  for (i = 0; i < slirp->epoll_nready; i++) {
+    if (slirp->epoll_events[i].data.ptr == so) {
+      slirp->epoll_events[i].data.ptr = NULL;
+    }
+  }
+#endif
+}
+
+/*
+ * Close the host socket
+ */
+void
+soclosefd(struct socket *so)
+{
+  sounwatch(so);
+  closesocket(so->s);
+  so->s = -1;
+}
+
 /*
  * remque and free a socket, clobber cache
  */
@@ -76,6 +112,7 @@ sofree(struct socket *so)
       slirp->icmp_last_so = &slirp->icmp;
   }
   m_free(so->so_m);
+  sounwatch(so);
 
   if(so->so_next && so->so_prev)
     remque(so);  /* crashes if so is not in a queue */
@@ -152,11 +189,21 @@ soread(struct socket *so)
 {
 	int n, nn;
 	struct sbuf *sb = &so->so_snd;
+	struct tcpcb *tp = sototcpcb(so);
 	struct iovec iov[2];
 
 	DEBUG_CALL("soread");
 	DEBUG_ARG("so = %lx", (long )so);
 
+	/*
+	 * Grow so_snd while the guest advertises a window at least as
+	 * large as the buffer, which then limits the data in flight.
+	 */
+	if (tp && sb->sb_datalen < TCP_SNDSPACE_MAX &&
+	    tp->snd_wnd >= sb->sb_datalen) {
+		sbgrow(sb, min(2 * sb->sb_datalen, TCP_SNDSPACE_MAX));
+	}
+
 	/*
 	 * No need to check if there's enough room to read.
 	 * soread wouldn't have been called if there weren't
@@ -21,6 +21,9 @@ struct socket {
   int s;                           /* The actual socket */
 
   int pollfds_idx;                 /* GPollFD GArray index */
+  int pollfd;                      /* descriptor in the epoll set, or -1 */
+  int pollevents;                  /* G_IO_* events it is watched for */
+  void (*poll_cb)(struct socket *, int); /* handles the events */
 
   Slirp *slirp;			   /* managing slirp instance */
 
@@ -79,6 +82,7 @@ struct socket {
 struct socket * solookup(struct socket *, struct in_addr, u_int, struct in_addr, u_int);
 struct socket * socreate(Slirp *);
 void sofree(struct socket *);
+void soclosefd(struct socket *);
 int soread(struct socket *);
 void sorecvoob(struct socket *);
 int sosendoob(struct socket *);
@@ -41,6 +41,13 @@ typedef	uint32_t tcp_seq;
 #define TCP_SNDSPACE 8192
 #define TCP_RCVSPACE 8192
 
+/*
+ * Socket buffers start at TCP_SNDSPACE/TCP_RCVSPACE and are grown on
+ * demand up to these limits, see soread() and tcp_input().
+ */
+#define TCP_SNDSPACE_MAX (4 * 1024 * 1024)
+#define TCP_RCVSPACE_MAX (4 * 1024 * 1024)
+
 /*
  * TCP header.
  * Per RFC 793, September, 1981.
@@ -101,6 +101,35 @@ static void tcp_dooptions(struct tcpcb *tp, u_char *cp, int cnt,
                           struct tcpiphdr *ti);
 static void tcp_xmit_timer(register struct tcpcb *tp, int rtt);
 
+/*
+ * Window scaling takes effect once both SYNs carried the option.
+ */
+static void
+tcp_set_scale(struct tcpcb *tp)
+{
+	if ((tp->t_flags & (TF_RCVD_SCALE|TF_REQ_SCALE)) ==
+	    (TF_RCVD_SCALE|TF_REQ_SCALE)) {
+		tp->snd_scale = tp->requested_s_scale;
+		tp->rcv_scale = tp->request_r_scale;
+	}
+}
+
+/*
+ * Grow so_rcv when the guest has used up most of the window we
+ * advertised although the host socket keeps up with the data: the
+ * window, not the host, is then what limits throughput.
+ */
+static void
+tcp_rcvbuf_autotune(struct tcpcb *tp)
+{
+	struct sbuf *sb = &tp->t_socket->so_rcv;
+
+	if (sb->sb_cc == 0 && sb->sb_datalen < TCP_RCVSPACE_MAX &&
+	    (int)(tp->rcv_adv - tp->rcv_nxt) < sb->sb_datalen / 4) {
+		sbgrow(sb, min(2 * sb->sb_datalen, TCP_RCVSPACE_MAX));
+	}
+}
+
 static int
 tcp_reass(register struct tcpcb *tp, register struct tcpiphdr *ti,
           struct mbuf *m)
@@ -403,6 +432,8 @@ findso:
 		goto drop;
 
 	tiwin = ti->ti_win;
+	if ((tiflags & TH_SYN) == 0)
+		tiwin <<= tp->snd_scale;
 
 	/*
 	 * Segment received on connection.
@@ -456,6 +487,7 @@ findso:
 					tcp_xmit_timer(tp, tp->t_rtt);
 				acked = ti->ti_ack - tp->snd_una;
 				sbdrop(&so->so_snd, acked);
+				slirp_tcp_poll_update(so);
 				tp->snd_una = ti->ti_ack;
 				m_free(m);
 
@@ -500,6 +532,8 @@ findso:
 			} else
 				sbappend(so, m);
 
+			tcp_rcvbuf_autotune(tp);
+
 			/*
 			 * If this is a short packet, then ACK now - with Nagel
 			 *	congestion avoidance sender won't send more until
@@ -688,6 +722,7 @@ findso:
 		if (tiflags & TH_ACK && SEQ_GT(tp->snd_una, tp->iss)) {
 			soisfconnected(so);
 			tp->t_state = TCPS_ESTABLISHED;
+			tcp_set_scale(tp);
 
 			(void) tcp_reass(tp, (struct tcpiphdr *)0,
 				(struct mbuf *)0);
@@ -868,6 +903,7 @@ trimthenstep6:
 		    SEQ_GT(ti->ti_ack, tp->snd_max))
 			goto dropwithreset;
 		tp->t_state = TCPS_ESTABLISHED;
+		tcp_set_scale(tp);
 		/*
 		 * The sent SYN is ack'ed with our sequence number +1
 		 * The first data byte already in the buffer will get
@@ -1033,6 +1069,7 @@ trimthenstep6:
 			tp->snd_wnd -= acked;
 			ourfinisacked = 0;
 		}
+		slirp_tcp_poll_update(so);
 		tp->snd_una = ti->ti_ack;
 		if (SEQ_LT(tp->snd_nxt, tp->snd_una))
 			tp->snd_nxt = tp->snd_una;
@@ -1323,6 +1360,15 @@ tcp_dooptions(struct tcpcb *tp, u_char *cp, int cnt, struct tcpiphdr *ti)
 			NTOHS(mss);
 			(void) tcp_mss(tp, mss);	/* sets t_maxseg */
 			break;
+
+		case TCPOPT_WINDOW:
+			if (optlen != TCPOLEN_WINDOW)
+				continue;
+			if (!(ti->ti_flags & TH_SYN))
+				continue;
+			tp->t_flags |= TF_RCVD_SCALE;
+			tp->requested_s_scale = min(cp[2], TCP_MAX_WINSHIFT);
+			break;
 		}
 	}
 }
@@ -322,7 +322,7 @@ udp_attach(struct socket *so)
 void
 udp_detach(struct socket *so)
 {
-	closesocket(so->s);
+	soclosefd(so);
 	sofree(so);
 }
 
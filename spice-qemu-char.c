@@ -61,7 +61,14 @@ static int vmc_read(SpiceCharDeviceInstance *sin, uint8_t *buf, int len)
     }
     if (scd->datalen == 0) {
         scd->datapos = 0;
-        scd->blocked = false;
+        if (scd->blocked) {
+            /*
+             * The client drained the channel; with a spice iothread we
+             * are not in the main loop, so kick it to re-poll the watch.
+             */
+            scd->blocked = false;
+            qemu_notify_event();
+        }
     }
     trace_spice_vmc_read(bytes, len);
     return bytes;
@@ -129,7 +136,7 @@ static void vmc_unregister_interface(SpiceCharDriver *scd)
     if (!scd->active) {
         return;
     }
-    spice_server_remove_interface(&scd->sin.base);
+    qemu_spice_remove_interface(&scd->sin.base);
     scd->active = false;
     trace_spice_vmc_unregister_interface(scd);
 }
@@ -186,7 +193,9 @@ static int spice_chr_write(CharDriverState *chr, const uint8_t *buf, int len)
     assert(s->datalen == 0);
     s->datapos = buf;
     s->datalen = len;
+    qemu_spice_lock();
     spice_server_char_device_wakeup(&s->sin);
+    qemu_spice_unlock();
     read_bytes = len - s->datalen;
     if (read_bytes != len) {
         /* We'll get passed in the unconsumed data with the next call */
@@ -226,11 +235,13 @@ static void spice_port_set_fe_open(struct CharDriverState *chr, int fe_open)
 #if SPICE_SERVER_VERSION >= 0x000c02
     SpiceCharDriver *s = chr->opaque;
 
+    qemu_spice_lock();
     if (fe_open) {
         spice_server_port_event(&s->sin, SPICE_PORT_EVENT_OPENED);
     } else {
         spice_server_port_event(&s->sin, SPICE_PORT_EVENT_CLOSED);
     }
+    qemu_spice_unlock();
 #endif
 }
 
@@ -239,7 +250,9 @@ static void spice_chr_fe_event(struct CharDriverState *chr, int event)
 #if SPICE_SERVER_VERSION >= 0x000c02
     SpiceCharDriver *s = chr->opaque;
 
+    qemu_spice_lock();
     spice_server_port_event(&s->sin, event);
+    qemu_spice_unlock();
 #endif
 }
 
@@ -0,0 +1,55 @@
+#include "qemu-common.h"
+#include "qapi/error.h"
+#include "migration/file.h"
+
+bool file_migration_save_active(void)
+{
+    return false;
+}
+
+bool file_migration_load_active(void)
+{
+    return false;
+}
+
+int64_t file_migration_skip(QEMUFile *f, uint64_t size)
+{
+    abort();
+}
+
+int file_migration_queue_page(uint64_t offset, void *host, size_t size)
+{
+    return -1;
+}
+
+int file_migration_sync(void)
+{
+    return -1;
+}
+
+int file_migration_pwrite(const void *buf, size_t size, uint64_t offset)
+{
+    return -ENOTSUP;
+}
+
+int file_migration_pread(void *buf, size_t size, uint64_t offset)
+{
+    return -ENOTSUP;
+}
+
+int file_migration_map(void *host, size_t size, uint64_t offset)
+{
+    return -ENOTSUP;
+}
+
+QEMUFile *file_migration_open_ops(void *opaque, const FileMigrationOps *ops,
+                                  bool writing, Error **errp)
+{
+    error_setg(errp, "Page-indexed migration is not supported on this host");
+    return NULL;
+}
+
+int64_t file_migration_size(void)
+{
+    abort();
+}
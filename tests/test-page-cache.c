@@ -0,0 +1,212 @@
+/*
+ * Page cache unit tests.
+ *
+ * Copyright (c) 2015 agent <agent@local>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include <stdint.h>
+#include <string.h>
+#include <glib.h>
+#include "qemu-common.h"
+#include "migration/page_cache.h"
+
+#define PAGE_SIZE 4096
+
+/* must match page_cache.c */
+#define CACHE_WAYS 8
+
+static void fill_page(uint8_t *buf, uint64_t addr, uint8_t gen)
+{
+    memset(buf, (addr / PAGE_SIZE) ^ gen, PAGE_SIZE);
+    memcpy(buf, &addr, sizeof(addr));
+}
+
+static bool page_matches(const uint8_t *data, uint64_t addr, uint8_t gen)
+{
+    uint8_t buf[PAGE_SIZE];
+
+    fill_page(buf, addr, gen);
+    return data && !memcmp(data, buf, PAGE_SIZE);
+}
+
+static void test_insert_lookup(void)
+{
+    PageCache *cache = cache_init(64, PAGE_SIZE);
+    uint8_t buf[PAGE_SIZE];
+    uint64_t addr;
+
+    g_assert(cache);
+    for (addr = 0; addr < 16 * PAGE_SIZE; addr += PAGE_SIZE) {
+        fill_page(buf, addr, 0);
+        g_assert_cmpint(cache_insert(cache, addr, buf, 0), ==, 0);
+    }
+    for (addr = 0; addr < 16 * PAGE_SIZE; addr += PAGE_SIZE) {
+        g_assert(cache_is_cached(cache, addr, 0));
+        g_assert(page_matches(get_cached_data(cache, addr), addr, 0));
+    }
+    g_assert(!cache_is_cached(cache, 16 * PAGE_SIZE, 0));
+    g_assert(!get_cached_data(cache, 16 * PAGE_SIZE));
+
+    /* inserting again replaces the data */
+    fill_page(buf, 0, 1);
+    g_assert_cmpint(cache_insert(cache, 0, buf, 1), ==, 0);
+    g_assert(page_matches(get_cached_data(cache, 0), 0, 1));
+
+    /* the size is rounded down to a power of 2 */
+    g_assert_cmpint(cache_resize(cache, 100), ==, 64);
+    g_assert_cmpint(cache_resize(cache, 0), ==, -1);
+
+    cache_fini(cache);
+}
+
+/*
+ * A cache of CACHE_WAYS pages is a single set, so every page competes
+ * with every other one.  The page replaced is the one with the lowest
+ * score, that is the number of sync rounds in which it was dirtied minus
+ * the number of rounds since it was last seen.
+ */
+static void test_eviction(void)
+{
+    PageCache *cache = cache_init(CACHE_WAYS, PAGE_SIZE);
+    uint8_t buf[PAGE_SIZE];
+    uint64_t addr, new_addr = 0x100000;
+    int i;
+
+    for (i = 0; i < CACHE_WAYS; i++) {
+        addr = i * PAGE_SIZE;
+        fill_page(buf, addr, 0);
+        g_assert_cmpint(cache_insert(cache, addr, buf, 0), ==, 0);
+    }
+
+    /* everything was inserted in this round: nothing can be replaced */
+    fill_page(buf, new_addr, 0);
+    g_assert_cmpint(cache_insert(cache, new_addr, buf, 1), ==, -1);
+    g_assert(!get_cached_data(cache, new_addr));
+
+    /* pages 0-3 are dirtied again in round 2, pages 0-1 in round 3 too */
+    for (i = 0; i < 4; i++) {
+        g_assert(cache_is_cached(cache, i * PAGE_SIZE, 2));
+    }
+    for (i = 0; i < 2; i++) {
+        g_assert(cache_is_cached(cache, i * PAGE_SIZE, 3));
+    }
+
+    /*
+     * In round 6, pages 0-1 score 2 - 3, pages 2-3 score 1 - 4 and pages
+     * 4-7 score 0 - 6.  New pages go in over pages 4-7 first, then over
+     * pages 2-3, then over pages 0-1.
+     */
+    for (i = 0; i < CACHE_WAYS; i++) {
+        addr = new_addr + i * PAGE_SIZE;
+        fill_page(buf, addr, 0);
+        g_assert_cmpint(cache_insert(cache, addr, buf, 6), ==, 0);
+        g_assert(page_matches(get_cached_data(cache, addr), addr, 0));
+
+        if (i == 3 || i == 5 || i == 7) {
+            int kept = CACHE_WAYS - 1 - i;
+            int j;
+
+            for (j = 0; j < CACHE_WAYS; j++) {
+                uint8_t *data = get_cached_data(cache, j * PAGE_SIZE);
+
+                if (j < kept) {
+                    g_assert(page_matches(data, j * PAGE_SIZE, 0));
+                } else {
+                    g_assert(!data);
+                }
+            }
+        }
+    }
+
+    /* and the new pages are fresh in this round */
+    fill_page(buf, 0, 0);
+    g_assert_cmpint(cache_insert(cache, 0, buf, 6), ==, -1);
+
+    cache_fini(cache);
+}
+
+/*
+ * Resizing keeps the old table around; every insertion moves a few of
+ * its sets over, and lookups find pages in either table.
+ */
+static void test_resize_drain(void)
+{
+    PageCache *cache = cache_init(64, PAGE_SIZE);
+    uint8_t buf[PAGE_SIZE];
+    bool cached[128];
+    uint64_t addr, extra = 0x100000;
+    int i, n = 0;
+
+    /* sets that fill up refuse the rest of the pages of the round */
+    for (i = 0; i < ARRAY_SIZE(cached); i++) {
+        addr = i * PAGE_SIZE;
+        fill_page(buf, addr, 0);
+        cached[i] = cache_insert(cache, addr, buf, 0) == 0;
+        n += cached[i];
+    }
+    g_assert_cmpint(n, >, 32);
+    g_assert_cmpint(n, <=, 64);
+
+    g_assert_cmpint(cache_resize(cache, 512), ==, 512);
+
+    /* the first insertion moves 4 of the 8 old sets */
+    fill_page(buf, extra, 0);
+    g_assert_cmpint(cache_insert(cache, extra, buf, 0), ==, 0);
+
+    for (i = 0; i < ARRAY_SIZE(cached); i++) {
+        uint8_t *data = get_cached_data(cache, i * PAGE_SIZE);
+
+        if (cached[i]) {
+            g_assert(page_matches(data, i * PAGE_SIZE, 0));
+        } else {
+            g_assert(!data);
+        }
+    }
+
+    /* the next insertion moves the other 4 sets */
+    for (i = ARRAY_SIZE(cached) - 1; !cached[i]; i--) {
+        /* find the last page that went in */
+    }
+    addr = i * PAGE_SIZE;
+    fill_page(buf, addr, 1);
+    g_assert_cmpint(cache_insert(cache, addr, buf, 1), ==, 0);
+    g_assert(page_matches(get_cached_data(cache, addr), addr, 1));
+    cached[i] = false;
+
+    /* resizing again first finishes the pending resize */
+    g_assert_cmpint(cache_resize(cache, 1024), ==, 1024);
+    fill_page(buf, extra + PAGE_SIZE, 0);
+    g_assert_cmpint(cache_insert(cache, extra + PAGE_SIZE, buf, 1), ==, 0);
+    for (i = 0; i < ARRAY_SIZE(cached); i++) {
+        if (cached[i]) {
+            g_assert(page_matches(get_cached_data(cache, i * PAGE_SIZE),
+                                  i * PAGE_SIZE, 0));
+        }
+    }
+    g_assert(page_matches(get_cached_data(cache, addr), addr, 1));
+    g_assert(page_matches(get_cached_data(cache, extra), extra, 0));
+
+    /* shrinking may drop pages, but never returns the wrong data */
+    g_assert_cmpint(cache_resize(cache, 16), ==, 16);
+    for (i = 0; i < ARRAY_SIZE(cached); i++) {
+        uint8_t *data = get_cached_data(cache, i * PAGE_SIZE);
+
+        if (data) {
+            g_assert(page_matches(data, i * PAGE_SIZE,
+                                  i * PAGE_SIZE == addr));
+        }
+    }
+
+    cache_fini(cache);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/page_cache/insert_lookup", test_insert_lookup);
+    g_test_add_func("/page_cache/eviction", test_eviction);
+    g_test_add_func("/page_cache/resize_drain", test_resize_drain);
+    return g_test_run();
+}
@@ -0,0 +1,184 @@
+/*
+ * Test and benchmark the VNC framebuffer compare and copy routines
+ *
+ * Copyright (C) 2015 agent <agent@local>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * Run with "-m perf" to measure each implementation on full
+ * 2560x1600 frames.
+ */
+
+#include <glib.h>
+#include <string.h>
+#include "qemu/osdep.h"
+#include "qemu/bitmap.h"
+#include "ui/vnc-cmp.h"
+
+#define ROW_CELLS   160         /* 2560 pixels */
+#define ROW_BYTES   (ROW_CELLS * VNC_CMP_CELL_BYTES)
+#define ROWS        1600
+
+/* Reference implementation: what vnc_refresh_server_surface used to do. */
+static int cmp_copy_row_ref(uint8_t *dst, const uint8_t *src, size_t len,
+                            const unsigned long *dirty,
+                            unsigned long *changed, int ncells)
+{
+    int x, count = 0;
+
+    bitmap_zero(changed, ncells);
+    for (x = 0; x < ncells; x++) {
+        size_t off = x * VNC_CMP_CELL_BYTES;
+        size_t n = MIN(VNC_CMP_CELL_BYTES, len - off);
+
+        if (!test_bit(x, dirty) || memcmp(dst + off, src + off, n) == 0) {
+            continue;
+        }
+        memcpy(dst + off, src + off, n);
+        set_bit(x, changed);
+        count++;
+    }
+    return count;
+}
+
+static void fill_row(GRand *rand, uint8_t *src, uint8_t *dst,
+                     unsigned long *dirty, size_t len, int ncells)
+{
+    size_t off;
+    int i;
+
+    for (off = 0; off < len; off++) {
+        src[off] = dst[off] = g_rand_int(rand);
+    }
+    bitmap_zero(dirty, ncells);
+    for (i = 0; i < ncells; i++) {
+        if (g_rand_boolean(rand)) {
+            set_bit(i, dirty);
+        }
+        if (g_rand_boolean(rand)) {
+            /* change one byte anywhere in the cell, dirty or not */
+            off = i * VNC_CMP_CELL_BYTES +
+                  g_rand_int_range(rand, 0, VNC_CMP_CELL_BYTES);
+            if (off < len) {
+                src[off]++;
+            }
+        }
+    }
+}
+
+static void check_impl(const VncCmpCopyImpl *impl, size_t len, int ncells)
+{
+    GRand *rand = g_rand_new_with_seed(len);
+    /* one byte off so that vector accesses are unaligned */
+    uint8_t *src = (uint8_t *)g_malloc(ROW_BYTES + 1) + 1;
+    uint8_t *dst = g_malloc(ROW_BYTES);
+    uint8_t *ref = g_malloc(ROW_BYTES);
+    unsigned long dirty[BITS_TO_LONGS(ROW_CELLS)];
+    unsigned long changed[BITS_TO_LONGS(ROW_CELLS)];
+    unsigned long ref_changed[BITS_TO_LONGS(ROW_CELLS)];
+    int iter;
+
+    for (iter = 0; iter < 100; iter++) {
+        int count, ref_count;
+
+        fill_row(rand, src, dst, dirty, len, ncells);
+        memcpy(ref, dst, len);
+        ref_count = cmp_copy_row_ref(ref, src, len, dirty, ref_changed,
+                                     ncells);
+        count = impl->fn(dst, src, len, dirty, changed, ncells);
+
+        g_assert_cmpint(count, ==, ref_count);
+        g_assert(memcmp(dst, ref, len) == 0);
+        g_assert(bitmap_equal(changed, ref_changed, ncells));
+    }
+
+    g_free(src - 1);
+    g_free(dst);
+    g_free(ref);
+    g_rand_free(rand);
+}
+
+static void test_cmp_copy(gconstpointer opaque)
+{
+    const VncCmpCopyImpl *impl = opaque;
+
+    if (!impl->usable) {
+        g_test_message("%s not supported by this CPU, skipping", impl->name);
+        return;
+    }
+    /* full rows */
+    check_impl(impl, ROW_BYTES, ROW_CELLS);
+    /* a word's worth of cells and a partial word */
+    check_impl(impl, 64 * VNC_CMP_CELL_BYTES, 64);
+    check_impl(impl, 67 * VNC_CMP_CELL_BYTES, 67);
+    /* short last cell, and a surface narrower than one cell */
+    check_impl(impl, 99 * VNC_CMP_CELL_BYTES + 20, 100);
+    check_impl(impl, 12, 1);
+}
+
+static void perf_cmp_copy(const VncCmpCopyImpl *impl, int changed_pct)
+{
+    uint8_t *src = g_malloc0(ROWS * ROW_BYTES);
+    uint8_t *dst = g_malloc0(ROWS * ROW_BYTES);
+    unsigned long dirty[BITS_TO_LONGS(ROW_CELLS)];
+    unsigned long changed[BITS_TO_LONGS(ROW_CELLS)];
+    GRand *rand = g_rand_new_with_seed(0);
+    int frames = 100, i, y;
+    size_t off;
+    double duration = 0;
+
+    bitmap_fill(dirty, ROW_CELLS);
+    for (i = 0; i < frames; i++) {
+        for (off = 0; off < ROWS * ROW_BYTES; off += VNC_CMP_CELL_BYTES) {
+            src[off] = dst[off] +
+                (g_rand_int_range(rand, 0, 100) < changed_pct);
+        }
+        g_test_timer_start();
+        for (y = 0; y < ROWS; y++) {
+            impl->fn(dst + y * ROW_BYTES, src + y * ROW_BYTES, ROW_BYTES,
+                     dirty, changed, ROW_CELLS);
+        }
+        duration += g_test_timer_elapsed();
+    }
+
+    g_test_message("%s, %d%% of cells changed: %f ms per frame",
+                   impl->name, changed_pct, duration * 1000 / frames);
+
+    g_rand_free(rand);
+    g_free(src);
+    g_free(dst);
+}
+
+static void perf_cmp_copy_all(gconstpointer opaque)
+{
+    const VncCmpCopyImpl *impl;
+
+    for (impl = vnc_cmp_copy_impls; impl->name; impl++) {
+        if (impl->usable) {
+            perf_cmp_copy(impl, GPOINTER_TO_INT(opaque));
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    const VncCmpCopyImpl *impl;
+
+    g_test_init(&argc, &argv, NULL);
+
+    for (impl = vnc_cmp_copy_impls; impl->name; impl++) {
+        gchar *path = g_strdup_printf("/vnc-cmp/%s", impl->name);
+        g_test_add_data_func(path, impl, test_cmp_copy);
+        g_free(path);
+    }
+    if (g_test_perf()) {
+        g_test_add_data_func("/perf/vnc-cmp/unchanged", GINT_TO_POINTER(0),
+                             perf_cmp_copy_all);
+        g_test_add_data_func("/perf/vnc-cmp/10pct", GINT_TO_POINTER(10),
+                             perf_cmp_copy_all);
+        g_test_add_data_func("/perf/vnc-cmp/changed", GINT_TO_POINTER(100),
+                             perf_cmp_copy_all);
+    }
+    return g_test_run();
+}
@@ -9,6 +9,8 @@
  * This work is licensed under the terms of the GNU GPL, version 2 or later.
  * See the COPYING file in the top-level directory.
  *
+ * Run with "-m perf" to measure the throughput of each encoder and zero
+ * page check implementation.
  */
 #include <stdint.h>
 #include <stdio.h>
@@ -179,8 +181,260 @@ static void test_encode_decode(void)
     }
 }
 
+/* Reference implementation: the original long-at-a-time encoder. */
+static int encode_buffer_ref(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                             uint8_t *dst, int dlen)
+{
+    uint32_t zrun_len = 0, nzrun_len = 0;
+    int d = 0, i = 0;
+    long res;
+    uint8_t *nzrun_start = NULL;
+
+    while (i < slen) {
+        if (d + 2 > dlen) {
+            return -1;
+        }
+
+        res = (slen - i) % sizeof(long);
+        while (res && old_buf[i] == new_buf[i]) {
+            zrun_len++;
+            i++;
+            res--;
+        }
+
+        if (!res) {
+            while (i < slen &&
+                   (*(long *)(old_buf + i)) == (*(long *)(new_buf + i))) {
+                i += sizeof(long);
+                zrun_len += sizeof(long);
+            }
+
+            while (i < slen && old_buf[i] == new_buf[i]) {
+                zrun_len++;
+                i++;
+            }
+        }
+
+        if (zrun_len == slen) {
+            return 0;
+        }
+
+        if (i == slen) {
+            return d;
+        }
+
+        d += uleb128_encode_small(dst + d, zrun_len);
+
+        zrun_len = 0;
+        nzrun_start = new_buf + i;
+
+        if (d + 2 > dlen) {
+            return -1;
+        }
+        res = (slen - i) % sizeof(long);
+        while (res && old_buf[i] != new_buf[i]) {
+            i++;
+            nzrun_len++;
+            res--;
+        }
+
+        if (!res) {
+            unsigned long mask = (unsigned long)0x0101010101010101ULL;
+            while (i < slen) {
+                unsigned long xor;
+                xor = *(unsigned long *)(old_buf + i)
+                    ^ *(unsigned long *)(new_buf + i);
+                if ((xor - mask) & ~xor & (mask << 7)) {
+                    while (old_buf[i] != new_buf[i]) {
+                        nzrun_len++;
+                        i++;
+                    }
+                    break;
+                } else {
+                    i += sizeof(long);
+                    nzrun_len += sizeof(long);
+                }
+            }
+        }
+
+        d += uleb128_encode_small(dst + d, nzrun_len);
+        if (d + nzrun_len > dlen) {
+            return -1;
+        }
+        memcpy(dst + d, nzrun_start, nzrun_len);
+        d += nzrun_len;
+        nzrun_len = 0;
+    }
+
+    return d;
+}
+
+/* Change @count runs of up to @max_run bytes at random places. */
+static void dirty_page(GRand *rand, uint8_t *page, int count, int max_run)
+{
+    int i, j;
+
+    for (i = 0; i < count; i++) {
+        int len = g_rand_int_range(rand, 1, max_run + 1);
+        int off = g_rand_int_range(rand, 0, PAGE_SIZE);
+
+        for (j = off; j < off + len && j < PAGE_SIZE; j++) {
+            /* never leave the byte unchanged */
+            page[j] += g_rand_int_range(rand, 1, 256);
+        }
+    }
+}
+
+static void test_encode_impl(gconstpointer opaque)
+{
+    const XbzrleEncodeImpl *impl = opaque;
+    GRand *rand = g_rand_new_with_seed(PAGE_SIZE);
+    uint8_t *old_buf = g_malloc(PAGE_SIZE);
+    uint8_t *new_buf = g_malloc(PAGE_SIZE);
+    uint8_t *out = g_malloc(PAGE_SIZE);
+    uint8_t *ref = g_malloc(PAGE_SIZE);
+    int iter, i;
+
+    if (!impl->usable) {
+        g_test_message("%s not supported by this CPU, skipping", impl->name);
+        goto out;
+    }
+
+    for (iter = 0; iter < 5000; iter++) {
+        int count = g_rand_int_range(rand, 0, 64);
+        int max_run = g_rand_int_range(rand, 1, 300);
+        int dlen = g_rand_boolean(rand) ? PAGE_SIZE
+                                        : g_rand_int_range(rand, 0, 512);
+        int rc, ref_rc;
+
+        for (i = 0; i < PAGE_SIZE; i++) {
+            old_buf[i] = g_rand_int(rand);
+        }
+        memcpy(new_buf, old_buf, PAGE_SIZE);
+        dirty_page(rand, new_buf, count, max_run);
+
+        ref_rc = encode_buffer_ref(old_buf, new_buf, PAGE_SIZE, ref, dlen);
+        rc = impl->fn(old_buf, new_buf, PAGE_SIZE, out, dlen);
+        g_assert_cmpint(rc, ==, ref_rc);
+        if (rc > 0) {
+            g_assert(memcmp(out, ref, rc) == 0);
+        }
+    }
+
+out:
+    g_free(old_buf);
+    g_free(new_buf);
+    g_free(out);
+    g_free(ref);
+    g_rand_free(rand);
+}
+
+static void test_find_nonzero_impl(gconstpointer opaque)
+{
+    const BufferFindNonzeroImpl *impl = opaque;
+    BufferFindNonzeroFunc *ref = buffer_find_nonzero_offset_impls[0].fn;
+    GRand *rand = g_rand_new_with_seed(PAGE_SIZE);
+    uint8_t *page = qemu_memalign(64, PAGE_SIZE);
+    int iter;
+
+    if (!impl->usable) {
+        g_test_message("%s not supported by this CPU, skipping", impl->name);
+        goto out;
+    }
+
+    memset(page, 0, PAGE_SIZE);
+    g_assert_cmpint(impl->fn(page, PAGE_SIZE), ==, PAGE_SIZE);
+    for (iter = 0; iter < 10000; iter++) {
+        int off = g_rand_int_range(rand, 0, PAGE_SIZE);
+        size_t len = PAGE_SIZE >> g_rand_int_range(rand, 0, 5);
+
+        page[off] = g_rand_int_range(rand, 1, 256);
+        g_assert_cmpint(impl->fn(page, len), ==, ref(page, len));
+        page[off] = 0;
+    }
+
+out:
+    qemu_vfree(page);
+    g_rand_free(rand);
+}
+
+#define PERF_PAGES 4096
+
+static void perf_encode(const XbzrleEncodeImpl *impl, int count, int max_run)
+{
+    GRand *rand = g_rand_new_with_seed(0);
+    uint8_t *old_buf = g_malloc(PERF_PAGES * PAGE_SIZE);
+    uint8_t *new_buf = g_malloc(PERF_PAGES * PAGE_SIZE);
+    uint8_t *out = g_malloc(PAGE_SIZE);
+    double duration;
+    int i;
+
+    for (i = 0; i < PERF_PAGES * PAGE_SIZE; i++) {
+        old_buf[i] = g_rand_int(rand);
+    }
+    memcpy(new_buf, old_buf, PERF_PAGES * PAGE_SIZE);
+    for (i = 0; i < PERF_PAGES; i++) {
+        dirty_page(rand, new_buf + i * PAGE_SIZE, count, max_run);
+    }
+
+    g_test_timer_start();
+    for (i = 0; i < PERF_PAGES; i++) {
+        impl->fn(old_buf + i * PAGE_SIZE, new_buf + i * PAGE_SIZE, PAGE_SIZE,
+                 out, PAGE_SIZE);
+    }
+    duration = g_test_timer_elapsed();
+
+    g_test_message("xbzrle %s, %d runs of up to %d bytes: %.2f GB/s",
+                   impl->name, count, max_run,
+                   PERF_PAGES * PAGE_SIZE / duration / 1e9);
+
+    g_free(old_buf);
+    g_free(new_buf);
+    g_free(out);
+    g_rand_free(rand);
+}
+
+static void perf_encode_all(void)
+{
+    const XbzrleEncodeImpl *impl;
+
+    for (impl = xbzrle_encode_impls; impl->name; impl++) {
+        if (impl->usable) {
+            perf_encode(impl, 0, 1);
+            perf_encode(impl, 4, 8);
+            perf_encode(impl, 32, 64);
+        }
+    }
+}
+
+static void perf_find_nonzero_all(void)
+{
+    const BufferFindNonzeroImpl *impl;
+    uint8_t *buf = qemu_memalign(64, PERF_PAGES * PAGE_SIZE);
+    double duration;
+    int i;
+
+    memset(buf, 0, PERF_PAGES * PAGE_SIZE);
+    for (impl = buffer_find_nonzero_offset_impls; impl->name; impl++) {
+        if (!impl->usable) {
+            continue;
+        }
+        g_test_timer_start();
+        for (i = 0; i < PERF_PAGES; i++) {
+            impl->fn(buf + i * PAGE_SIZE, PAGE_SIZE);
+        }
+        duration = g_test_timer_elapsed();
+        g_test_message("zero page check %s: %.2f GB/s", impl->name,
+                       PERF_PAGES * PAGE_SIZE / duration / 1e9);
+    }
+    qemu_vfree(buf);
+}
+
 int main(int argc, char **argv)
 {
+    const XbzrleEncodeImpl *impl;
+    const BufferFindNonzeroImpl *zimpl;
+
     g_test_init(&argc, &argv, NULL);
     g_test_rand_int();
     g_test_add_func("/xbzrle/uleb", test_uleb);
@@ -192,5 +446,21 @@ int main(int argc, char **argv)
                     test_encode_decode_overflow);
     g_test_add_func("/xbzrle/encode_decode", test_encode_decode);
 
+    for (impl = xbzrle_encode_impls; impl->name; impl++) {
+        gchar *path = g_strdup_printf("/xbzrle/encode/%s", impl->name);
+        g_test_add_data_func(path, impl, test_encode_impl);
+        g_free(path);
+    }
+    for (zimpl = buffer_find_nonzero_offset_impls; zimpl->name; zimpl++) {
+        gchar *path = g_strdup_printf("/xbzrle/find_nonzero/%s",
+                                      zimpl->name);
+        g_test_add_data_func(path, zimpl, test_find_nonzero_impl);
+        g_free(path);
+    }
+    if (g_test_perf()) {
+        g_test_add_func("/perf/xbzrle/encode", perf_encode_all);
+        g_test_add_func("/perf/xbzrle/find_nonzero", perf_find_nonzero_all);
+    }
+
     return g_test_run();
 }
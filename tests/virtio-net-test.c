@@ -2,6 +2,7 @@
  * QTest testcase for VirtIO NIC
  *
  * Copyright (c) 2014 SUSE LINUX Products GmbH
+ * Copyright (c) 2015 agent <agent@local>
  *
  * This work is licensed under the terms of the GNU GPL, version 2 or later.
  * See the COPYING file in the top-level directory.
@@ -9,35 +10,426 @@
 
 #include <glib.h>
 #include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
 #include "libqtest.h"
 #include "qemu/osdep.h"
-#include "libqos/pci.h"
+#include "qemu/bswap.h"
+#include "libqos/virtio.h"
+#include "libqos/virtio-pci.h"
+#include "libqos/pci-pc.h"
+#include "libqos/malloc.h"
+#include "libqos/malloc-pc.h"
 
+#define QVIRTIO_NET_F_CTRL_VQ       0x00020000
+#define QVIRTIO_NET_F_MQ            0x00400000
+
+#define QVIRTIO_NET_CTRL_MQ             4
+#define QVIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET 0
+
+#define QVIRTIO_NET_TIMEOUT_US  (30 * 1000 * 1000)
+#define VNET_HDR_SIZE           10
+#define RSS_QUEUES              4
+#define RX_BUFS                 4
+#define RX_BUF_SIZE             2048
+#define TX_PACKETS              16
+#define TX_FRAME_SIZE           1000
 #define PCI_SLOT_HP             0x06
+#define PCI_SLOT                0x04
+#define PCI_FN                  0x00
+
+typedef struct QVirtioNetRss {
+    QPCIBus *bus;
+    QVirtioPCIDevice *dev;
+    QGuestAllocator *alloc;
+    QVirtQueue *rx[RSS_QUEUES];
+    QVirtQueue *tx[RSS_QUEUES];
+    QVirtQueue *ctrl;
+    int socket;
+} QVirtioNetRss;
+
+/* Verification values from the Microsoft RSS specification */
+typedef struct RssVector {
+    uint8_t src[4];
+    uint8_t dst[4];
+    uint16_t sport;
+    uint16_t dport;
+    uint32_t ipv4_hash;
+    uint32_t tcp_hash;
+} RssVector;
+
+static const RssVector rss_vectors[] = {
+    { { 66, 9, 149, 187 }, { 161, 142, 100, 80 }, 2794, 1766,
+      0x323e8fc2, 0x51ccc178 },
+    { { 199, 92, 111, 2 }, { 65, 69, 140, 83 }, 14230, 4739,
+      0xd718262a, 0xc626b0ea },
+    { { 24, 19, 198, 95 }, { 12, 22, 207, 184 }, 12898, 38024,
+      0xd2d0a5de, 0x5c2b394a },
+    { { 38, 27, 205, 30 }, { 209, 142, 163, 6 }, 48228, 2217,
+      0x82989176, 0xafc7327f },
+    { { 153, 39, 163, 191 }, { 202, 188, 127, 2 }, 44251, 1303,
+      0x5d1809c5, 0x10e828a2 },
+};
 
 /* Tests only initialization so far. TODO: Replace with functional tests */
 static void pci_nop(void)
 {
+    qtest_start("-device virtio-net-pci");
+    qtest_end();
 }
 
 static void hotplug(void)
 {
+    qtest_start("-device virtio-net-pci");
     qpci_plug_device_test("virtio-net-pci", "net1", PCI_SLOT_HP, NULL);
     qpci_unplug_acpi_device_test("net1", PCI_SLOT_HP);
+    qtest_end();
 }
 
-int main(int argc, char **argv)
+static void rss_test_start(QVirtioNetRss *s, int sndbuf)
 {
-    int ret;
+    char *cmdline;
+    int sv[2], ret;
 
-    g_test_init(&argc, &argv, NULL);
-    qtest_add_func("/virtio/net/pci/nop", pci_nop);
-    qtest_add_func("/virtio/net/pci/hotplug", hotplug);
+    ret = socketpair(PF_UNIX, SOCK_STREAM, 0, sv);
+    g_assert_cmpint(ret, !=, -1);
+    if (sndbuf) {
+        /* Keep the backend socket small so that sends have to be queued */
+        ret = setsockopt(sv[1], SOL_SOCKET, SO_SNDBUF, &sndbuf,
+                         sizeof(sndbuf));
+        g_assert_cmpint(ret, ==, 0);
+    }
 
-    qtest_start("-device virtio-net-pci");
-    ret = g_test_run();
+    cmdline = g_strdup_printf("-netdev socket,fd=%d,id=hs0 "
+                              "-device virtio-net-pci,netdev=hs0,mq=on,"
+                              "rss_queues=%d,addr=%x.%x",
+                              sv[1], RSS_QUEUES, PCI_SLOT, PCI_FN);
+    qtest_start(cmdline);
+    g_free(cmdline);
+    close(sv[1]);
+
+    s->socket = sv[0];
+    s->bus = qpci_init_pc();
+    s->alloc = pc_alloc_init();
+    s->dev = qvirtio_pci_device_find(s->bus, QVIRTIO_NET_DEVICE_ID);
+    g_assert(s->dev != NULL);
+    g_assert_cmphex(s->dev->pdev->devfn, ==, ((PCI_SLOT << 3) | PCI_FN));
+    qvirtio_pci_device_enable(s->dev);
+}
 
+static void rss_test_end(QVirtioNetRss *s)
+{
+    pc_alloc_uninit(s->alloc);
+    qvirtio_pci_device_disable(s->dev);
+    g_free(s->dev);
+    qpci_free_pc(s->bus);
+    close(s->socket);
     qtest_end();
+}
+
+static uint16_t virtio_net_used_idx(QVirtQueue *vq)
+{
+    /* vq->used->idx */
+    return readw(vq->used + 2);
+}
+
+static void virtio_net_wait_used(QVirtQueue *vq, uint16_t idx)
+{
+    gint64 start_time = g_get_monotonic_time();
+
+    while (virtio_net_used_idx(vq) != idx) {
+        clock_step(100);
+        g_assert(g_get_monotonic_time() - start_time <=
+                 QVIRTIO_NET_TIMEOUT_US);
+    }
+}
+
+/*
+ * Reset the device and bring it up with RSS_QUEUES queue pairs.  The
+ * indirection table is left at its default, which spreads its 128
+ * entries round robin over the enabled queues.
+ */
+static void virtio_net_rss_init(QVirtioNetRss *s)
+{
+    uint8_t ctrl[2] = {
+        QVIRTIO_NET_CTRL_MQ, QVIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET
+    };
+    uint8_t pairs[2] = { RSS_QUEUES, 0 };
+    uint8_t ack = 0xff;
+    uint32_t features, free_head;
+    uint64_t req_addr;
+    int i;
+
+    qvirtio_reset(&qvirtio_pci, &s->dev->vdev);
+    qvirtio_set_acknowledge(&qvirtio_pci, &s->dev->vdev);
+    qvirtio_set_driver(&qvirtio_pci, &s->dev->vdev);
+
+    features = qvirtio_get_features(&qvirtio_pci, &s->dev->vdev);
+    g_assert(features & QVIRTIO_NET_F_MQ);
+    g_assert(features & QVIRTIO_NET_F_CTRL_VQ);
+    /* Without mergeable buffers the guest header is VNET_HDR_SIZE */
+    qvirtio_set_features(&qvirtio_pci, &s->dev->vdev,
+                         QVIRTIO_NET_F_MQ | QVIRTIO_NET_F_CTRL_VQ);
+
+    for (i = 0; i < RSS_QUEUES; i++) {
+        s->rx[i] = qvirtqueue_setup(&qvirtio_pci, &s->dev->vdev, s->alloc,
+                                    2 * i);
+        s->tx[i] = qvirtqueue_setup(&qvirtio_pci, &s->dev->vdev, s->alloc,
+                                    2 * i + 1);
+    }
+    s->ctrl = qvirtqueue_setup(&qvirtio_pci, &s->dev->vdev, s->alloc,
+                               2 * RSS_QUEUES);
+
+    qvirtio_set_driver_ok(&qvirtio_pci, &s->dev->vdev);
+
+    req_addr = guest_alloc(s->alloc, sizeof(ctrl) + sizeof(pairs) +
+                           sizeof(ack));
+    memwrite(req_addr, ctrl, sizeof(ctrl));
+    memwrite(req_addr + 2, pairs, sizeof(pairs));
+    memwrite(req_addr + 4, &ack, sizeof(ack));
+
+    free_head = qvirtqueue_add(s->ctrl, req_addr, 2, false, true);
+    qvirtqueue_add(s->ctrl, req_addr + 2, 2, false, true);
+    qvirtqueue_add(s->ctrl, req_addr + 4, 1, true, false);
+    qvirtqueue_kick(&qvirtio_pci, &s->dev->vdev, s->ctrl, free_head);
+
+    virtio_net_wait_used(s->ctrl, 1);
+    g_assert_cmpint(readb(req_addr + 4), ==, 0);
+    guest_free(s->alloc, req_addr);
+}
+
+static void virtio_net_rss_free(QVirtioNetRss *s)
+{
+    int i;
+
+    for (i = 0; i < RSS_QUEUES; i++) {
+        guest_free(s->alloc, s->rx[i]->desc);
+        guest_free(s->alloc, s->tx[i]->desc);
+        g_free(s->rx[i]);
+        g_free(s->tx[i]);
+    }
+    guest_free(s->alloc, s->ctrl->desc);
+    g_free(s->ctrl);
+}
+
+static size_t rss_build_frame(uint8_t *buf, const RssVector *v, bool tcp)
+{
+    memset(buf, 0, 60);
+    memset(buf, 0xff, 6);
+    buf[6] = 0x52;
+    buf[7] = 0x54;
+    buf[11] = 0x01;
+    stw_be_p(buf + 12, 0x0800);
+
+    buf[14] = 0x45;
+    stw_be_p(buf + 16, 40);
+    buf[22] = 64;
+    buf[23] = tcp ? 6 : 1;
+    memcpy(buf + 26, v->src, 4);
+    memcpy(buf + 30, v->dst, 4);
+    if (tcp) {
+        stw_be_p(buf + 34, v->sport);
+        stw_be_p(buf + 36, v->dport);
+        buf[46] = 0x50;
+    }
+
+    return 60;
+}
+
+static void net_socket_send(int fd, const uint8_t *buf, size_t len)
+{
+    uint32_t be_len = cpu_to_be32(len);
+    ssize_t ret;
+
+    ret = write(fd, &be_len, sizeof(be_len));
+    g_assert_cmpint(ret, ==, sizeof(be_len));
+    ret = write(fd, buf, len);
+    g_assert_cmpint(ret, ==, len);
+}
+
+static void net_socket_recv(int fd, uint8_t *buf, size_t size)
+{
+    ssize_t ret;
+
+    while (size) {
+        ret = read(fd, buf, size);
+        g_assert_cmpint(ret, >, 0);
+        buf += ret;
+        size -= ret;
+    }
+}
+
+static void pci_rss_steering(void)
+{
+    QVirtioNetRss s;
+    uint64_t rx_buf[RSS_QUEUES][RX_BUFS];
+    uint16_t used[RSS_QUEUES] = { 0 };
+    uint8_t frame[60], data[60];
+    uint32_t free_head, hash;
+    size_t len;
+    int i, j, queue;
+
+    rss_test_start(&s, 0);
+    virtio_net_rss_init(&s);
+
+    for (i = 0; i < RSS_QUEUES; i++) {
+        for (j = 0; j < RX_BUFS; j++) {
+            rx_buf[i][j] = guest_alloc(s.alloc, RX_BUF_SIZE);
+            free_head = qvirtqueue_add(s.rx[i], rx_buf[i][j], RX_BUF_SIZE,
+                                       true, false);
+            qvirtqueue_kick(&qvirtio_pci, &s.dev->vdev, s.rx[i], free_head);
+        }
+    }
+
+    /*
+     * TCP frames hash the full 4-tuple, everything else only the
+     * addresses; between them the vectors cover every queue.
+     */
+    for (i = 0; i < 2 * ARRAY_SIZE(rss_vectors); i++) {
+        const RssVector *v = &rss_vectors[i % ARRAY_SIZE(rss_vectors)];
+        bool tcp = i < ARRAY_SIZE(rss_vectors);
+
+        hash = tcp ? v->tcp_hash : v->ipv4_hash;
+        queue = (hash & 0x7f) % RSS_QUEUES;
+        if (used[queue] == RX_BUFS) {
+            continue;
+        }
+
+        len = rss_build_frame(frame, v, tcp);
+        net_socket_send(s.socket, frame, len);
+
+        virtio_net_wait_used(s.rx[queue], used[queue] + 1);
+        for (j = 0; j < RSS_QUEUES; j++) {
+            if (j != queue) {
+                g_assert_cmpint(virtio_net_used_idx(s.rx[j]), ==, used[j]);
+            }
+        }
+
+        memread(rx_buf[queue][used[queue]] + VNET_HDR_SIZE, data, len);
+        g_assert(memcmp(data, frame, len) == 0);
+        used[queue]++;
+    }
+
+    for (i = 0; i < RSS_QUEUES; i++) {
+        g_assert_cmpint(used[i], >, 0);
+    }
+
+    virtio_net_rss_free(&s);
+    rss_test_end(&s);
+}
+
+/*
+ * Queue TX_PACKETS frames on every TX queue while the backend socket is
+ * full.  The queues share the backend, so their sends complete through
+ * the backend's packet queue in submission order.
+ */
+static void virtio_net_rss_fill_tx(QVirtioNetRss *s)
+{
+    uint8_t frame[VNET_HDR_SIZE + TX_FRAME_SIZE];
+    uint64_t req_addr;
+    uint32_t free_head;
+    int i, j, completed;
+
+    for (j = 0; j < TX_PACKETS; j++) {
+        for (i = 0; i < RSS_QUEUES; i++) {
+            memset(frame, 0, sizeof(frame));
+            memset(frame + VNET_HDR_SIZE, 0xff, 6);
+            frame[VNET_HDR_SIZE + 14] = i;
+            frame[VNET_HDR_SIZE + 15] = j;
+
+            req_addr = guest_alloc(s->alloc, sizeof(frame));
+            memwrite(req_addr, frame, sizeof(frame));
+            free_head = qvirtqueue_add(s->tx[i], req_addr, sizeof(frame),
+                                       false, false);
+            qvirtqueue_kick(&qvirtio_pci, &s->dev->vdev, s->tx[i],
+                            free_head);
+        }
+    }
+
+    /* The socket cannot hold everything, so some sends are still pending */
+    completed = 0;
+    for (i = 0; i < RSS_QUEUES; i++) {
+        completed += virtio_net_used_idx(s->tx[i]);
+    }
+    g_assert_cmpint(completed, <, RSS_QUEUES * TX_PACKETS);
+}
+
+static void pci_rss_async_tx(void)
+{
+    QVirtioNetRss s;
+    uint8_t frame[TX_FRAME_SIZE];
+    int next[RSS_QUEUES] = { 0 };
+    uint32_t len;
+    int i, j;
+
+    rss_test_start(&s, 4096);
+    virtio_net_rss_init(&s);
+    virtio_net_rss_fill_tx(&s);
+
+    for (i = 0; i < RSS_QUEUES * TX_PACKETS; i++) {
+        net_socket_recv(s.socket, (uint8_t *)&len, sizeof(len));
+        g_assert_cmpint(be32_to_cpu(len), ==, TX_FRAME_SIZE);
+        net_socket_recv(s.socket, frame, TX_FRAME_SIZE);
+
+        g_assert_cmpint(frame[14], <, RSS_QUEUES);
+        g_assert_cmpint(frame[15], ==, next[frame[14]]);
+        next[frame[14]]++;
+    }
+
+    /* Every queue gets back exactly its own buffers, in order */
+    for (i = 0; i < RSS_QUEUES; i++) {
+        virtio_net_wait_used(s.tx[i], TX_PACKETS);
+        for (j = 0; j < TX_PACKETS; j++) {
+            /* vq->used->ring[j].id */
+            g_assert_cmpint(readl(s.tx[i]->used + 4 + 8 * j), ==, j);
+        }
+    }
+
+    virtio_net_rss_free(&s);
+    rss_test_end(&s);
+}
+
+static void pci_rss_tx_reset(void)
+{
+    QVirtioNetRss s, old;
+    struct pollfd pfd;
+    uint8_t buf[4096];
+    int i;
+
+    rss_test_start(&s, 4096);
+    virtio_net_rss_init(&s);
+    virtio_net_rss_fill_tx(&s);
+
+    /* Reset drops the queued sends and hands their buffers back */
+    old = s;
+    virtio_net_rss_init(&s);
+
+    /* Let the backend drain; nothing may complete into the new rings */
+    pfd.fd = s.socket;
+    pfd.events = POLLIN;
+    while (poll(&pfd, 1, 500) > 0) {
+        g_assert_cmpint(read(s.socket, buf, sizeof(buf)), >, 0);
+    }
+
+    for (i = 0; i < RSS_QUEUES; i++) {
+        g_assert_cmpint(virtio_net_used_idx(s.tx[i]), ==, 0);
+    }
+
+    virtio_net_rss_free(&old);
+    virtio_net_rss_free(&s);
+    rss_test_end(&s);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    qtest_add_func("/virtio/net/pci/nop", pci_nop);
+    qtest_add_func("/virtio/net/pci/hotplug", hotplug);
+    qtest_add_func("/virtio/net/pci/rss/steering", pci_rss_steering);
+    qtest_add_func("/virtio/net/pci/rss/async-tx", pci_rss_async_tx);
+    qtest_add_func("/virtio/net/pci/rss/tx-reset", pci_rss_tx_reset);
 
-    return ret;
+    return g_test_run();
 }
@@ -1111,6 +1111,7 @@ static void cocoa_cleanup(void)
 
 static const DisplayChangeListenerOps dcl_ops = {
     .dpy_name          = "cocoa",
+    .dpy_refresh_polls_input = true,
     .dpy_gfx_update = cocoa_update,
     .dpy_gfx_switch = cocoa_switch,
     .dpy_refresh = cocoa_refresh,
@@ -29,6 +29,7 @@
 #include "sysemu/char.h"
 #include "trace.h"
 #include "exec/memory.h"
+#include "qemu/memfd.h"
 
 #define DEFAULT_BACKSCROLL 512
 #define CONSOLE_CURSOR_PERIOD 500
@@ -128,6 +129,7 @@ struct QemuConsole {
     QemuUIInfo ui_info;
     const GraphicHwOps *hw_ops;
     void *hw;
+    uint64_t refresh_cap;       /* minimum refresh interval in ms, or 0 */
 
     /* Text console state */
     int width;
@@ -177,6 +179,7 @@ static QemuConsole **consoles;
 static int nb_consoles = 0;
 static bool cursor_visible_phase;
 static QEMUTimer *cursor_timer;
+static bool shm_surfaces;
 
 static void text_console_do_init(CharDriverState *chr, DisplayState *ds);
 static void dpy_refresh(DisplayState *s);
@@ -184,10 +187,78 @@ static DisplayState *get_alloc_displaystate(void);
 static void text_console_update_cursor_timer(void);
 static void text_console_update_cursor(void *opaque);
 
+/*
+ * Refresh governor.  Each listener is refreshed at the interval it asked
+ * for with update_displaychangelistener() (but not faster than the cap
+ * of its console) as long as the display changes.  Every refresh that
+ * sees no display update doubles the interval, up to
+ * GUI_REFRESH_INTERVAL_IDLE, and the next update brings it straight
+ * back down.  So does user input, since most devices only report their
+ * updates when they are refreshed.
+ */
+static uint64_t dcl_refresh_base(DisplayChangeListener *dcl)
+{
+    QemuConsole *con = dcl->con ? dcl->con : active_console;
+    uint64_t interval = dcl->update_interval ?
+        dcl->update_interval : GUI_REFRESH_INTERVAL_DEFAULT;
+
+    if (con && con->refresh_cap > interval) {
+        interval = con->refresh_cap;
+    }
+    return interval;
+}
+
+static void dcl_refresh_govern(DisplayChangeListener *dcl)
+{
+    uint64_t base = dcl_refresh_base(dcl);
+    uint64_t idle = MAX(base, GUI_REFRESH_INTERVAL_IDLE);
+
+    if (dcl->refresh_activity || dcl->ops->dpy_refresh_polls_input) {
+        dcl->refresh_interval = base;
+    } else {
+        dcl->refresh_interval = MIN(MAX(dcl->refresh_interval * 2, base),
+                                    idle);
+    }
+    dcl->refresh_activity = false;
+}
+
+static void dcl_refresh_activity(DisplayChangeListener *dcl)
+{
+    DisplayState *ds = dcl->ds;
+    uint64_t base;
+
+    dcl->refresh_activity = true;
+    if (ds->refreshing || !ds->gui_timer || !dcl->ops->dpy_refresh) {
+        return;
+    }
+    base = dcl_refresh_base(dcl);
+    if (dcl->refresh_interval > base) {
+        dcl->refresh_interval = base;
+        timer_mod_anticipate(ds->gui_timer, dcl->last_refresh + base);
+    }
+}
+
+void dpy_refresh_pending(DisplayChangeListener *dcl)
+{
+    dcl_refresh_activity(dcl);
+}
+
+void dpy_input_activity(void)
+{
+    DisplayChangeListener *dcl;
+
+    if (!display_state) {
+        return;
+    }
+    QLIST_FOREACH(dcl, &display_state->listeners, next) {
+        dcl_refresh_activity(dcl);
+    }
+}
+
 static void gui_update(void *opaque)
 {
     uint64_t interval = GUI_REFRESH_INTERVAL_IDLE;
-    uint64_t dcl_interval;
+    uint64_t next = UINT64_MAX;
     DisplayState *ds = opaque;
     DisplayChangeListener *dcl;
     int i;
@@ -197,11 +268,16 @@ static void gui_update(void *opaque)
     ds->refreshing = false;
 
     QLIST_FOREACH(dcl, &ds->listeners, next) {
-        dcl_interval = dcl->update_interval ?
-            dcl->update_interval : GUI_REFRESH_INTERVAL_DEFAULT;
-        if (interval > dcl_interval) {
-            interval = dcl_interval;
+        if (!dcl->ops->dpy_refresh) {
+            continue;
+        }
+        if (dcl->refresh_activity) {
+            /* updated while refreshing another listener */
+            dcl->refresh_interval = MIN(dcl->refresh_interval,
+                                        dcl_refresh_base(dcl));
         }
+        interval = MIN(interval, dcl->refresh_interval);
+        next = MIN(next, dcl->last_refresh + dcl->refresh_interval);
     }
     if (ds->update_interval != interval) {
         ds->update_interval = interval;
@@ -213,7 +289,7 @@ static void gui_update(void *opaque)
         trace_console_refresh(interval);
     }
     ds->last_update = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
-    timer_mod(ds->gui_timer, ds->last_update + interval);
+    timer_mod(ds->gui_timer, next);
 }
 
 static void gui_setup_refresh(DisplayState *ds)
@@ -332,6 +408,76 @@ void qmp_screendump(const char *filename, Error **errp)
     ppm_save(filename, surface, errp);
 }
 
+void qmp_set_display_refresh_cap(bool has_console, int64_t console,
+                                 int64_t min_interval, Error **errp)
+{
+    DisplayChangeListener *dcl;
+    QemuConsole *con;
+    int i;
+
+    if (min_interval < 0 || min_interval > GUI_REFRESH_CAP_MAX) {
+        error_setg(errp, "min-interval must be between 0 and %d ms",
+                   GUI_REFRESH_CAP_MAX);
+        return;
+    }
+    if (has_console) {
+        con = qemu_console_lookup_by_index(console);
+        if (!con) {
+            error_setg(errp, "console %" PRId64 " not found", console);
+            return;
+        }
+        con->refresh_cap = min_interval;
+    } else {
+        for (i = 0; i < nb_consoles; i++) {
+            consoles[i]->refresh_cap = min_interval;
+        }
+    }
+
+    if (!display_state) {
+        return;
+    }
+    QLIST_FOREACH(dcl, &display_state->listeners, next) {
+        if (dcl->ops->dpy_refresh) {
+            update_displaychangelistener(dcl, dcl->update_interval);
+        }
+    }
+}
+
+DisplayRefreshInfoList *qmp_query_display_refresh(Error **errp)
+{
+    DisplayRefreshInfoList *head = NULL, *entry;
+    DisplayRefreshInfo *info;
+    DisplayChangeListener *dcl;
+    QemuConsole *con;
+
+    if (!display_state) {
+        return NULL;
+    }
+    QLIST_FOREACH(dcl, &display_state->listeners, next) {
+        if (!dcl->ops->dpy_refresh) {
+            continue;
+        }
+        info = g_new0(DisplayRefreshInfo, 1);
+        info->display = g_strdup(dcl->ops->dpy_name);
+        con = dcl->con ? dcl->con : active_console;
+        if (con) {
+            info->has_console = true;
+            info->console = con->index;
+        }
+        info->interval = dcl->refresh_interval;
+        info->min_interval = dcl_refresh_base(dcl);
+        info->refreshes = dcl->refresh_count;
+        info->active_refreshes = dcl->refresh_active_count;
+        info->cpu_time = dcl->refresh_cpu_ns;
+
+        entry = g_new0(DisplayRefreshInfoList, 1);
+        entry->value = info;
+        entry->next = head;
+        head = entry;
+    }
+    return head;
+}
+
 void graphic_hw_text_update(QemuConsole *con, console_ch_t *chardata)
 {
     if (!con) {
@@ -1225,18 +1371,60 @@ static QemuConsole *new_console(DisplayState *ds, console_type_t console_type,
     return s;
 }
 
+/*
+ * Allocate console surfaces in shared memory, so that a local viewer can
+ * map them instead of having the pixels copied to it.
+ */
+void qemu_console_set_shm_surfaces(bool enable)
+{
+    shm_surfaces = enable;
+}
+
+#ifdef CONFIG_POSIX
+static void qemu_free_shm_display(pixman_image_t *image, void *opaque)
+{
+    size_t size = (size_t)pixman_image_get_stride(image) *
+        pixman_image_get_height(image);
+
+    qemu_memfd_free(pixman_image_get_data(image), size,
+                    GPOINTER_TO_INT(opaque));
+}
+#endif
+
 static void qemu_alloc_display(DisplaySurface *surface, int width, int height)
 {
+    size_t size = (size_t)width * 4 * height;
+    void *data = NULL;
+    int fd = -1;
+
     qemu_pixman_image_unref(surface->image);
     surface->image = NULL;
 
+#ifdef CONFIG_POSIX
+    if (shm_surfaces && size) {
+        data = qemu_memfd_alloc("qemu-surface", size,
+                                F_SEAL_GROW | F_SEAL_SHRINK, &fd);
+        if (!data) {
+            fd = -1;
+        }
+    }
+#endif
+
     surface->format = PIXMAN_x8r8g8b8;
     surface->image = pixman_image_create_bits(surface->format,
                                               width, height,
-                                              NULL, width * 4);
+                                              data, width * 4);
     assert(surface->image != NULL);
+#ifdef CONFIG_POSIX
+    if (data) {
+        pixman_image_set_destroy_function(surface->image,
+                                          qemu_free_shm_display,
+                                          GINT_TO_POINTER(fd));
+    }
+#endif
 
     surface->flags = QEMU_ALLOCATED_FLAG;
+    surface->shmfd = fd;
 }
 
 DisplaySurface *qemu_create_displaysurface(int width, int height)
@@ -1256,6 +1444,7 @@ DisplaySurface *qemu_create_displaysurface_from(int width, int height,
 
     trace_displaysurface_create_from(surface, width, height, format);
     surface->format = format;
+    surface->shmfd = -1;
     surface->image = pixman_image_create_bits(surface->format,
                                               width, height,
                                               (void *)data, linesize);
@@ -1342,6 +1531,11 @@ void register_displaychangelistener(DisplayChangeListener *dcl)
     dcl->ds = get_alloc_displaystate();
     QLIST_INSERT_HEAD(&dcl->ds->listeners, dcl, next);
     gui_setup_refresh(dcl->ds);
+    if (dcl->ops->dpy_refresh && !dcl->ds->refreshing) {
+        /* refresh the new listener right away */
+        timer_mod_anticipate(dcl->ds->gui_timer,
+                             qemu_clock_get_ms(QEMU_CLOCK_REALTIME));
+    }
     if (dcl->con) {
         dcl->con->dcls++;
         con = dcl->con;
@@ -1367,8 +1561,10 @@ void update_displaychangelistener(DisplayChangeListener *dcl,
     DisplayState *ds = dcl->ds;
 
     dcl->update_interval = interval;
-    if (!ds->refreshing && ds->update_interval > interval) {
-        timer_mod(ds->gui_timer, ds->last_update + interval);
+    dcl->refresh_interval = dcl_refresh_base(dcl);
+    if (!ds->refreshing && ds->gui_timer) {
+        timer_mod_anticipate(ds->gui_timer,
+                             dcl->last_refresh + dcl->refresh_interval);
     }
 }
 
@@ -1414,6 +1610,7 @@ void dpy_gfx_update(QemuConsole *con, int x, int y, int w, int h)
         if (con != (dcl->con ? dcl->con : active_console)) {
             continue;
         }
+        dcl_refresh_activity(dcl);
         if (dcl->ops->dpy_gfx_update) {
             dcl->ops->dpy_gfx_update(dcl, x, y, w, h);
         }
@@ -1432,6 +1629,7 @@ void dpy_gfx_replace_surface(QemuConsole *con,
         if (con != (dcl->con ? dcl->con : active_console)) {
             continue;
         }
+        dcl_refresh_activity(dcl);
         if (dcl->ops->dpy_gfx_switch) {
             dcl->ops->dpy_gfx_switch(dcl, surface);
         }
@@ -1464,14 +1662,38 @@ bool dpy_gfx_check_format(QemuConsole *con,
     return true;
 }
 
+static int64_t dpy_refresh_cpu_clock(void)
+{
+#ifdef CLOCK_THREAD_CPUTIME_ID
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) == 0) {
+        return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+    }
+#endif
+    return get_clock();
+}
+
 static void dpy_refresh(DisplayState *s)
 {
     DisplayChangeListener *dcl;
+    uint64_t now = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    int64_t start;
 
     QLIST_FOREACH(dcl, &s->listeners, next) {
-        if (dcl->ops->dpy_refresh) {
-            dcl->ops->dpy_refresh(dcl);
+        if (!dcl->ops->dpy_refresh ||
+            now < dcl->last_refresh + dcl->refresh_interval) {
+            continue;
+        }
+        start = dpy_refresh_cpu_clock();
+        dcl->ops->dpy_refresh(dcl);
+        dcl->refresh_cpu_ns += dpy_refresh_cpu_clock() - start;
+        dcl->refresh_count++;
+        if (dcl->refresh_activity) {
+            dcl->refresh_active_count++;
         }
+        dcl->last_refresh = now;
+        dcl_refresh_govern(dcl);
     }
 }
 
@@ -1488,6 +1710,7 @@ void dpy_gfx_copy(QemuConsole *con, int src_x, int src_y,
         if (con != (dcl->con ? dcl->con : active_console)) {
             continue;
         }
+        dcl_refresh_activity(dcl);
         if (dcl->ops->dpy_gfx_copy) {
             dcl->ops->dpy_gfx_copy(dcl, src_x, src_y, dst_x, dst_y, w, h);
         } else { /* TODO */
@@ -1526,6 +1749,7 @@ void dpy_text_update(QemuConsole *con, int x, int y, int w, int h)
         if (con != (dcl->con ? dcl->con : active_console)) {
             continue;
         }
+        dcl_refresh_activity(dcl);
         if (dcl->ops->dpy_text_update) {
             dcl->ops->dpy_text_update(dcl, x, y, w, h);
         }
@@ -1544,6 +1768,7 @@ void dpy_text_resize(QemuConsole *con, int w, int h)
         if (con != (dcl->con ? dcl->con : active_console)) {
             continue;
         }
+        dcl_refresh_activity(dcl);
         if (dcl->ops->dpy_text_resize) {
             dcl->ops->dpy_text_resize(dcl, w, h);
         }
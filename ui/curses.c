@@ -361,6 +361,7 @@ static void curses_keyboard_setup(void)
 
 static const DisplayChangeListenerOps dcl_ops = {
     .dpy_name        = "curses",
+    .dpy_refresh_polls_input = true,
     .dpy_text_update = curses_update,
     .dpy_text_resize = curses_resize,
     .dpy_refresh     = curses_refresh,
@@ -331,6 +331,7 @@ void qemu_input_event_sync(void)
     }
 
     trace_input_event_sync();
+    dpy_input_activity();
 
     QTAILQ_FOREACH(s, &handlers, node) {
         if (!s->events) {
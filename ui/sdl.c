@@ -900,6 +900,7 @@ static void sdl_cleanup(void)
 
 static const DisplayChangeListenerOps dcl_ops = {
     .dpy_name             = "sdl",
+    .dpy_refresh_polls_input = true,
     .dpy_gfx_update       = sdl_update,
     .dpy_gfx_switch       = sdl_switch,
     .dpy_gfx_check_format = sdl_check_format,
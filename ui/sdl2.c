@@ -669,6 +669,7 @@ static void sdl_cleanup(void)
 
 static const DisplayChangeListenerOps dcl_2d_ops = {
     .dpy_name             = "sdl2-2d",
+    .dpy_refresh_polls_input = true,
     .dpy_gfx_update       = sdl2_2d_update,
     .dpy_gfx_switch       = sdl2_2d_switch,
     .dpy_gfx_check_format = sdl2_2d_check_format,
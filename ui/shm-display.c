@@ -0,0 +1,394 @@
+/*
+ * QEMU shared memory display
+ *
+ * Copyright (c) 2015 agent <agent@local>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * Exports a console to viewers on the same host without copying pixels
+ * through a socket: the surface is passed as a memfd and damage is
+ * published through a ring in a second memfd.  See include/ui/shm-display.h
+ * for the protocol.
+ *
+ * Surfaces that QEMU allocates itself are placed in shared memory as soon
+ * as -shm-display is used, so the viewer maps the very pixels the device
+ * model renders to.  Surfaces that point into guest RAM (e.g. VGA in
+ * direct mode) are mirrored into a memfd, but only the damaged rectangles
+ * are copied.
+ */
+
+#include "qemu-common.h"
+#include "qemu/atomic.h"
+#include "qemu/config-file.h"
+#include "qemu/error-report.h"
+#include "qemu/main-loop.h"
+#include "qemu/memfd.h"
+#include "qemu/sockets.h"
+#include "ui/console.h"
+#include "ui/shm-display.h"
+
+#include <sys/socket.h>
+#include <sys/un.h>
+
+typedef struct ShmDisplay ShmDisplay;
+
+typedef struct ShmDisplayClient {
+    ShmDisplay *sd;
+    int fd;
+    QTAILQ_ENTRY(ShmDisplayClient) next;
+} ShmDisplayClient;
+
+struct ShmDisplay {
+    DisplayChangeListener dcl;
+    DisplaySurface *ds;
+    int lsock;
+    QTAILQ_HEAD(, ShmDisplayClient) clients;
+
+    ShmDisplayRing *ring;
+    size_t ring_bytes;
+    int ring_fd;
+    uint32_t notified_head;
+
+    /* copy of a surface that is not in shared memory itself */
+    uint8_t *mirror;
+    size_t mirror_bytes;
+    int mirror_fd;
+};
+
+/* @fd, if any, is sent read-only, so the viewer can neither draw into
+ * nor truncate memory that QEMU renders to.
+ */
+static int shm_display_send(ShmDisplayClient *client, ShmDisplayMsg *msg,
+                            int fd)
+{
+    struct iovec iov = { .iov_base = msg, .iov_len = sizeof(*msg) };
+    struct msghdr mh = { .msg_iov = &iov, .msg_iovlen = 1 };
+    char control[CMSG_SPACE(sizeof(int))];
+    struct cmsghdr *cmsg;
+    ssize_t ret;
+    int ro_fd = -1;
+
+    if (fd >= 0) {
+        ro_fd = qemu_memfd_open_readonly(fd);
+        if (ro_fd < 0) {
+            error_report("shm-display: cannot reopen shared memory "
+                         "read-only: %s", strerror(errno));
+            return -1;
+        }
+        memset(control, 0, sizeof(control));
+        mh.msg_control = control;
+        mh.msg_controllen = sizeof(control);
+        cmsg = CMSG_FIRSTHDR(&mh);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &ro_fd, sizeof(int));
+    }
+
+    do {
+        ret = sendmsg(client->fd, &mh, MSG_DONTWAIT | MSG_NOSIGNAL);
+    } while (ret < 0 && errno == EINTR);
+    if (ro_fd >= 0) {
+        close(ro_fd);
+    }
+    return ret == sizeof(*msg) ? 0 : -1;
+}
+
+static void shm_display_client_close(ShmDisplayClient *client)
+{
+    ShmDisplay *sd = client->sd;
+
+    qemu_set_fd_handler2(client->fd, NULL, NULL, NULL, NULL);
+    closesocket(client->fd);
+    QTAILQ_REMOVE(&sd->clients, client, next);
+    g_free(client);
+}
+
+static int shm_display_surface_fd(ShmDisplay *sd)
+{
+    return sd->ds->shmfd >= 0 ? sd->ds->shmfd : sd->mirror_fd;
+}
+
+static int shm_display_send_surface(ShmDisplayClient *client)
+{
+    ShmDisplay *sd = client->sd;
+    ShmDisplayMsg msg = {
+        .type = SHM_DISPLAY_MSG_SURFACE,
+        .generation = sd->ring->generation,
+        .width = surface_width(sd->ds),
+        .height = surface_height(sd->ds),
+        .stride = surface_stride(sd->ds),
+        .format = sd->ds->format,
+        .head = sd->ring->head,
+    };
+    int fd = shm_display_surface_fd(sd);
+
+    /* without the pixels, the viewer could only show garbage */
+    if (fd < 0) {
+        return -1;
+    }
+    return shm_display_send(client, &msg, fd);
+}
+
+/*
+ * Damage notifications may be dropped if the viewer does not keep up;
+ * the next one covers them since head only grows.  Losing a surface
+ * change would leave the viewer with a stale mapping, so a client whose
+ * socket is full at that point is disconnected.
+ */
+static void shm_display_notify(ShmDisplay *sd)
+{
+    ShmDisplayClient *client, *next;
+    ShmDisplayMsg msg = {
+        .type = SHM_DISPLAY_MSG_DAMAGE,
+        .generation = sd->ring->generation,
+        .head = sd->ring->head,
+    };
+
+    QTAILQ_FOREACH_SAFE(client, &sd->clients, next, next) {
+        if (shm_display_send(client, &msg, -1) < 0 && errno != EAGAIN) {
+            shm_display_client_close(client);
+        }
+    }
+    sd->notified_head = msg.head;
+}
+
+static void shm_display_mirror(ShmDisplay *sd, int x, int y, int w, int h)
+{
+    int stride = surface_stride(sd->ds);
+    int bpp = surface_bytes_per_pixel(sd->ds);
+    uint8_t *src = surface_data(sd->ds) + y * stride + x * bpp;
+    uint8_t *dst = sd->mirror + y * stride + x * bpp;
+
+    for (; h > 0; h--) {
+        memcpy(dst, src, w * bpp);
+        src += stride;
+        dst += stride;
+    }
+}
+
+static void shm_display_update(DisplayChangeListener *dcl,
+                               int x, int y, int w, int h)
+{
+    ShmDisplay *sd = container_of(dcl, ShmDisplay, dcl);
+    ShmDisplayRect *rect;
+    uint32_t head = sd->ring->head;
+
+    x = MAX(x, 0);
+    y = MAX(y, 0);
+    w = MIN(x + w, surface_width(sd->ds)) - x;
+    h = MIN(y + h, surface_height(sd->ds)) - y;
+    if (w <= 0 || h <= 0) {
+        return;
+    }
+
+    if (sd->mirror) {
+        shm_display_mirror(sd, x, y, w, h);
+    }
+
+    rect = &sd->ring->rects[head % SHM_DISPLAY_RING_SIZE];
+    rect->x = x;
+    rect->y = y;
+    rect->w = w;
+    rect->h = h;
+    smp_wmb();
+    atomic_set(&sd->ring->head, head + 1);
+}
+
+static void shm_display_free_mirror(ShmDisplay *sd)
+{
+    if (sd->mirror) {
+        qemu_memfd_free(sd->mirror, sd->mirror_bytes, sd->mirror_fd);
+        sd->mirror = NULL;
+        sd->mirror_fd = -1;
+    }
+}
+
+static void shm_display_switch(DisplayChangeListener *dcl,
+                               DisplaySurface *new_surface)
+{
+    ShmDisplay *sd = container_of(dcl, ShmDisplay, dcl);
+    ShmDisplayClient *client, *next;
+
+    shm_display_free_mirror(sd);
+    sd->ds = new_surface;
+    atomic_set(&sd->ring->generation, sd->ring->generation + 1);
+
+    if (new_surface->shmfd < 0) {
+        sd->mirror_bytes = (size_t)surface_stride(new_surface) *
+            surface_height(new_surface);
+        sd->mirror = qemu_memfd_alloc("qemu-shm-display", sd->mirror_bytes,
+                                      F_SEAL_GROW | F_SEAL_SHRINK,
+                                      &sd->mirror_fd);
+        if (!sd->mirror) {
+            error_report("shm-display: cannot allocate %zu bytes of shared "
+                         "memory", sd->mirror_bytes);
+            sd->mirror_fd = -1;
+        } else {
+            memcpy(sd->mirror, surface_data(new_surface), sd->mirror_bytes);
+        }
+    }
+
+    QTAILQ_FOREACH_SAFE(client, &sd->clients, next, next) {
+        if (shm_display_send_surface(client) < 0) {
+            shm_display_client_close(client);
+        }
+    }
+    sd->notified_head = sd->ring->head;
+}
+
+static void shm_display_refresh(DisplayChangeListener *dcl)
+{
+    ShmDisplay *sd = container_of(dcl, ShmDisplay, dcl);
+
+    if (QTAILQ_EMPTY(&sd->clients)) {
+        return;
+    }
+    graphic_hw_update(dcl->con);
+    if (sd->ring->head != sd->notified_head) {
+        shm_display_notify(sd);
+    }
+}
+
+static const DisplayChangeListenerOps shm_display_ops = {
+    .dpy_name             = "shm-display",
+    .dpy_refresh          = shm_display_refresh,
+    .dpy_gfx_update       = shm_display_update,
+    .dpy_gfx_switch       = shm_display_switch,
+    .dpy_gfx_check_format = qemu_pixman_check_format,
+};
+
+static void shm_display_client_read(void *opaque)
+{
+    ShmDisplayClient *client = opaque;
+    char buf[64];
+    ssize_t ret;
+
+    /* Viewers do not talk back; this only notices them going away.  */
+    ret = recv(client->fd, buf, sizeof(buf), MSG_DONTWAIT);
+    if (ret == 0 || (ret < 0 && errno != EAGAIN && errno != EINTR)) {
+        shm_display_client_close(client);
+    }
+}
+
+static void shm_display_accept(void *opaque)
+{
+    ShmDisplay *sd = opaque;
+    ShmDisplayClient *client;
+    ShmDisplayMsg msg = {
+        .type = SHM_DISPLAY_MSG_HELLO,
+        .generation = sd->ring->generation,
+        .head = sd->ring->head,
+    };
+    struct sockaddr_un addr;
+    socklen_t addrlen = sizeof(addr);
+    int fd;
+
+    fd = qemu_accept(sd->lsock, (struct sockaddr *)&addr, &addrlen);
+    if (fd < 0) {
+        return;
+    }
+    qemu_set_nonblock(fd);
+
+    client = g_new0(ShmDisplayClient, 1);
+    client->sd = sd;
+    client->fd = fd;
+    QTAILQ_INSERT_TAIL(&sd->clients, client, next);
+    qemu_set_fd_handler2(fd, NULL, shm_display_client_read, NULL, client);
+
+    /* Nobody asked the device for updates while there were no viewers,
+     * so the mirror may be stale: copy the whole surface again.
+     */
+    if (sd->mirror) {
+        shm_display_mirror(sd, 0, 0, surface_width(sd->ds),
+                           surface_height(sd->ds));
+    }
+    if (shm_display_send(client, &msg, sd->ring_fd) < 0 ||
+        (sd->ds && shm_display_send_surface(client) < 0)) {
+        shm_display_client_close(client);
+    }
+}
+
+static QemuOptsList qemu_shm_display_opts = {
+    .name = "shm-display",
+    .head = QTAILQ_HEAD_INITIALIZER(qemu_shm_display_opts.head),
+    .implied_opt_name = "path",
+    .desc = {
+        {
+            .name = "path",
+            .type = QEMU_OPT_STRING,
+        },{
+            .name = "console",
+            .type = QEMU_OPT_NUMBER,
+        },
+        { /* end of list */ }
+    },
+};
+
+QemuOpts *shm_display_parse(const char *str)
+{
+    QemuOpts *opts = qemu_opts_parse(qemu_find_opts("shm-display"), str, 1);
+
+    if (opts) {
+        /* surfaces created from now on can be handed out directly */
+        qemu_console_set_shm_surfaces(true);
+    }
+    return opts;
+}
+
+int shm_display_init_func(QemuOpts *opts, void *opaque)
+{
+    const char *path = qemu_opt_get(opts, "path");
+    int index = qemu_opt_get_number(opts, "console", 0);
+    Error *local_err = NULL;
+    QemuConsole *con;
+    ShmDisplay *sd;
+
+    if (!path) {
+        error_report("shm-display: no socket path given");
+        exit(1);
+    }
+    con = qemu_console_lookup_by_index(index);
+    if (!con || !qemu_console_is_graphic(con)) {
+        error_report("shm-display: console %d is not a graphic console",
+                     index);
+        exit(1);
+    }
+
+    sd = g_new0(ShmDisplay, 1);
+    QTAILQ_INIT(&sd->clients);
+    sd->mirror_fd = -1;
+
+    sd->ring_bytes = sizeof(ShmDisplayRing) +
+        SHM_DISPLAY_RING_SIZE * sizeof(ShmDisplayRect);
+    sd->ring = qemu_memfd_alloc("qemu-shm-display-ring", sd->ring_bytes,
+                                F_SEAL_GROW | F_SEAL_SHRINK, &sd->ring_fd);
+    if (!sd->ring) {
+        error_report("shm-display: cannot allocate the damage ring: %s",
+                     strerror(errno));
+        exit(1);
+    }
+    sd->ring->magic = SHM_DISPLAY_MAGIC;
+    sd->ring->version = SHM_DISPLAY_VERSION;
+    sd->ring->size = SHM_DISPLAY_RING_SIZE;
+
+    sd->lsock = unix_listen(path, NULL, 0, &local_err);
+    if (sd->lsock < 0) {
+        error_report("shm-display: %s", error_get_pretty(local_err));
+        error_free(local_err);
+        exit(1);
+    }
+    qemu_set_fd_handler2(sd->lsock, NULL, shm_display_accept, NULL, sd);
+
+    sd->dcl.ops = &shm_display_ops;
+    sd->dcl.con = con;
+    register_displaychangelistener(&sd->dcl);
+    return 0;
+}
+
+static void shm_display_register_config(void)
+{
+    qemu_add_opts(&qemu_shm_display_opts);
+}
+machine_init(shm_display_register_config);
@@ -34,6 +34,7 @@
 #include "qapi/qmp/qjson.h"
 #include "qemu/notify.h"
 #include "migration/migration.h"
+#include "sysemu/iothread.h"
 #include "hw/hw.h"
 #include "ui/spice-display.h"
 #include "qapi-event.h"
@@ -52,29 +53,125 @@ int using_spice = 0;
 
 static QemuThread me;
 
+/*
+ * With -spice iothread=<id>, the sockets and timers of the spice server
+ * are served by that IOThread instead of the main loop, and the server
+ * state belongs to its AioContext:
+ *
+ * - QEMU code calling into the server brackets the call with
+ *   qemu_spice_lock() and qemu_spice_unlock().
+ *
+ * - The watch and timer handlers take the global mutex before they
+ *   enter the server, because its callbacks touch device, chardev and
+ *   monitor state just like they do from the main loop.  The AioContext
+ *   is dropped while waiting for the mutex, so that the lock order is the
+ *   same as everywhere else: global mutex first, then the AioContext.
+ *   This must happen before the server runs: dropping the AioContext in
+ *   the middle of a callback would let the main loop re-enter the server.
+ *
+ * The qxl dispatcher (spice_qxl_*) talks to the display worker through
+ * its own pipe and needs neither.
+ */
+static IOThread *spice_iothread;
+
+static bool spice_in_iothread(void)
+{
+    return spice_iothread && qemu_thread_is_self(&spice_iothread->thread);
+}
+
+void qemu_spice_lock(void)
+{
+    if (spice_iothread) {
+        aio_context_acquire(iothread_get_aio_context(spice_iothread));
+    }
+}
+
+void qemu_spice_unlock(void)
+{
+    if (spice_iothread) {
+        aio_context_release(iothread_get_aio_context(spice_iothread));
+    }
+}
+
+/*
+ * Called by the IOThread handlers before they enter the server.  While
+ * the AioContext is dropped the main loop may remove, cancel or re-arm
+ * the watch or timer that fired, so the handlers look it up again after.
+ */
+static bool spice_dispatch_begin(void)
+{
+    AioContext *ctx;
+
+    if (!spice_in_iothread()) {
+        return false;
+    }
+    ctx = iothread_get_aio_context(spice_iothread);
+    aio_context_release(ctx);
+    qemu_mutex_lock_iothread();
+    aio_context_acquire(ctx);
+    return true;
+}
+
+static void spice_dispatch_end(bool locked)
+{
+    if (locked) {
+        qemu_mutex_unlock_iothread();
+    }
+}
+
 struct SpiceTimer {
     QEMUTimer *timer;
+    SpiceTimerFunc func;
+    void *opaque;
+    bool armed;
     QTAILQ_ENTRY(SpiceTimer) next;
 };
 static QTAILQ_HEAD(, SpiceTimer) timers = QTAILQ_HEAD_INITIALIZER(timers);
 
+static void timer_fire(void *opaque)
+{
+    bool locked = spice_dispatch_begin();
+    SpiceTimer *timer;
+
+    QTAILQ_FOREACH(timer, &timers, next) {
+        if (timer == opaque) {
+            break;
+        }
+    }
+    if (timer && timer->armed && !timer_pending(timer->timer)) {
+        timer->armed = false;
+        timer->func(timer->opaque);
+    }
+    spice_dispatch_end(locked);
+}
+
 static SpiceTimer *timer_add(SpiceTimerFunc func, void *opaque)
 {
     SpiceTimer *timer;
 
     timer = g_malloc0(sizeof(*timer));
-    timer->timer = timer_new_ms(QEMU_CLOCK_REALTIME, func, opaque);
+    timer->func = func;
+    timer->opaque = opaque;
+    if (spice_iothread) {
+        timer->timer = aio_timer_new(iothread_get_aio_context(spice_iothread),
+                                     QEMU_CLOCK_REALTIME, SCALE_MS,
+                                     timer_fire, timer);
+    } else {
+        timer->timer = timer_new_ms(QEMU_CLOCK_REALTIME, func, opaque);
+    }
     QTAILQ_INSERT_TAIL(&timers, timer, next);
     return timer;
 }
 
 static void timer_start(SpiceTimer *timer, uint32_t ms)
 {
+    timer->armed = true;
     timer_mod(timer->timer, qemu_clock_get_ms(QEMU_CLOCK_REALTIME) + ms);
 }
 
 static void timer_cancel(SpiceTimer *timer)
 {
+    timer->armed = false;
     timer_del(timer->timer);
 }
 
@@ -95,16 +192,30 @@ struct SpiceWatch {
 };
 static QTAILQ_HEAD(, SpiceWatch) watches = QTAILQ_HEAD_INITIALIZER(watches);
 
+static void watch_dispatch(void *opaque, int event)
+{
+    bool locked = spice_dispatch_begin();
+    SpiceWatch *watch;
+
+    QTAILQ_FOREACH(watch, &watches, next) {
+        if (watch == opaque) {
+            break;
+        }
+    }
+    if (watch && (watch->event_mask & event)) {
+        watch->func(watch->fd, event, watch->opaque);
+    }
+    spice_dispatch_end(locked);
+}
+
 static void watch_read(void *opaque)
 {
-    SpiceWatch *watch = opaque;
-    watch->func(watch->fd, SPICE_WATCH_EVENT_READ, watch->opaque);
+    watch_dispatch(opaque, SPICE_WATCH_EVENT_READ);
 }
 
 static void watch_write(void *opaque)
 {
-    SpiceWatch *watch = opaque;
-    watch->func(watch->fd, SPICE_WATCH_EVENT_WRITE, watch->opaque);
+    watch_dispatch(opaque, SPICE_WATCH_EVENT_WRITE);
 }
 
 static void watch_update_mask(SpiceWatch *watch, int event_mask)
@@ -119,7 +230,12 @@ static void watch_update_mask(SpiceWatch *watch, int event_mask)
     if (watch->event_mask & SPICE_WATCH_EVENT_WRITE) {
         on_write = watch_write;
     }
-    qemu_set_fd_handler(watch->fd, on_read, on_write, watch);
+    if (spice_iothread) {
+        aio_set_fd_handler(iothread_get_aio_context(spice_iothread),
+                           watch->fd, on_read, on_write, watch);
+    } else {
+        qemu_set_fd_handler(watch->fd, on_read, on_write, watch);
+    }
 }
 
 static SpiceWatch *watch_add(int fd, int event_mask, SpiceWatchFunc func, void *opaque)
@@ -138,7 +254,7 @@ static SpiceWatch *watch_add(int fd, int event_mask, SpiceWatchFunc func, void *
 
 static void watch_remove(SpiceWatch *watch)
 {
-    qemu_set_fd_handler(watch->fd, NULL, NULL, NULL);
+    watch_update_mask(watch, 0);
     QTAILQ_REMOVE(&watches, watch, next);
     g_free(watch);
 }
@@ -211,7 +327,7 @@ static void channel_event(int event, SpiceChannelEventInfo *info)
      * thread and grab the iothread lock if so before calling qemu
      * functions.
      */
-    bool need_lock = !qemu_thread_is_self(&me);
+    bool need_lock = !qemu_thread_is_self(&me) && !spice_in_iothread();
     if (need_lock) {
         qemu_mutex_lock_iothread();
     }
@@ -504,6 +620,9 @@ static QemuOptsList qemu_spice_opts = {
         }, {
             .name = "seamless-migration",
             .type = QEMU_OPT_BOOL,
+        },{
+            .name = "iothread",
+            .type = QEMU_OPT_STRING,
         },
         { /* end of list */ }
     },
@@ -554,9 +673,11 @@ SpiceInfo *qmp_query_spice(Error **errp)
         info->tls_port = tls_port;
     }
 
+    qemu_spice_lock();
     info->mouse_mode = spice_server_is_server_mouse(spice_server) ?
                        SPICE_QUERY_MOUSE_MODE_SERVER :
                        SPICE_QUERY_MOUSE_MODE_CLIENT;
+    qemu_spice_unlock();
 
     /* for compatibility with the original command */
     info->has_channels = true;
@@ -573,6 +694,7 @@ static void migration_state_notifier(Notifier *notifier, void *data)
         return;
     }
 
+    qemu_spice_lock();
     if (migration_in_setup(s)) {
         spice_server_migrate_start(spice_server);
     } else if (migration_has_finished(s)) {
@@ -582,6 +704,7 @@ static void migration_state_notifier(Notifier *notifier, void *data)
         spice_server_migrate_end(spice_server, false);
         spice_have_target_host = false;
     }
+    qemu_spice_unlock();
 }
 
 int qemu_spice_migrate_info(const char *hostname, int port, int tls_port,
@@ -590,11 +713,13 @@ int qemu_spice_migrate_info(const char *hostname, int port, int tls_port,
 {
     int ret;
 
+    qemu_spice_lock();
     spice_migrate.connect_complete.cb = cb;
     spice_migrate.connect_complete.opaque = opaque;
     ret = spice_server_migrate_connect(spice_server, hostname,
                                        port, tls_port, subject);
     spice_have_target_host = true;
+    qemu_spice_unlock();
     return ret;
 }
 
@@ -672,6 +797,15 @@ void qemu_spice_init(void)
     }
     password = qemu_opt_get(opts, "password");
 
+    str = qemu_opt_get(opts, "iothread");
+    if (str) {
+        spice_iothread = iothread_find(str);
+        if (!spice_iothread) {
+            error_report("spice: iothread '%s' not found", str);
+            exit(1);
+        }
+    }
+
     if (tls_port) {
         x509_dir = qemu_opt_get(opts, "x509-dir");
         if (!x509_dir) {
@@ -804,10 +938,12 @@ void qemu_spice_init(void)
 
     seamless_migration = qemu_opt_get_bool(opts, "seamless-migration", 0);
     spice_server_set_seamless_migration(spice_server, seamless_migration);
+    qemu_spice_lock();
     if (spice_server_init(spice_server, &core_interface) != 0) {
         error_report("failed to initialize spice server");
         exit(1);
     };
+    qemu_spice_unlock();
     using_spice = 1;
 
     migration_state.notify = migration_state_notifier;
@@ -832,6 +968,8 @@ void qemu_spice_init(void)
 
 int qemu_spice_add_interface(SpiceBaseInstance *sin)
 {
+    int ret;
+
     if (!spice_server) {
         if (QTAILQ_FIRST(&qemu_spice_opts.head) != NULL) {
             error_report("Oops: spice configured but not active");
@@ -850,7 +988,17 @@ int qemu_spice_add_interface(SpiceBaseInstance *sin)
         qemu_add_vm_change_state_handler(vm_change_state_handler, NULL);
     }
 
-    return spice_server_add_interface(spice_server, sin);
+    qemu_spice_lock();
+    ret = spice_server_add_interface(spice_server, sin);
+    qemu_spice_unlock();
+    return ret;
+}
+
+void qemu_spice_remove_interface(SpiceBaseInstance *sin)
+{
+    qemu_spice_lock();
+    spice_server_remove_interface(sin);
+    qemu_spice_unlock();
 }
 
 static GSList *spice_consoles;
@@ -877,6 +1025,7 @@ static int qemu_spice_set_ticket(bool fail_if_conn, bool disconnect_if_conn)
 {
     time_t lifetime, now = time(NULL);
     char *passwd;
+    int ret;
 
     if (now < auth_expires) {
         passwd = auth_passwd;
@@ -888,8 +1037,11 @@ static int qemu_spice_set_ticket(bool fail_if_conn, bool disconnect_if_conn)
         passwd = NULL;
         lifetime = 1;
     }
-    return spice_server_set_ticket(spice_server, passwd, lifetime,
-                                   fail_if_conn, disconnect_if_conn);
+    qemu_spice_lock();
+    ret = spice_server_set_ticket(spice_server, passwd, lifetime,
+                                  fail_if_conn, disconnect_if_conn);
+    qemu_spice_unlock();
+    return ret;
 }
 
 int qemu_spice_set_passwd(const char *passwd,
@@ -912,22 +1064,31 @@ int qemu_spice_set_pw_expire(time_t expires)
 
 int qemu_spice_display_add_client(int csock, int skipauth, int tls)
 {
+    int ret;
+
+    qemu_spice_lock();
     if (tls) {
-        return spice_server_add_ssl_client(spice_server, csock, skipauth);
+        ret = spice_server_add_ssl_client(spice_server, csock, skipauth);
     } else {
-        return spice_server_add_client(spice_server, csock, skipauth);
+        ret = spice_server_add_client(spice_server, csock, skipauth);
     }
+    qemu_spice_unlock();
+    return ret;
 }
 
 void qemu_spice_display_start(void)
 {
     spice_display_is_running = true;
+    qemu_spice_lock();
     spice_server_vm_start(spice_server);
+    qemu_spice_unlock();
 }
 
 void qemu_spice_display_stop(void)
 {
+    qemu_spice_lock();
     spice_server_vm_stop(spice_server);
+    qemu_spice_unlock();
     spice_display_is_running = false;
 }
 
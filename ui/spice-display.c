@@ -17,6 +17,8 @@
 
 #include "qemu-common.h"
 #include "ui/qemu-spice.h"
+#include "qemu/bitmap.h"
+#include "qemu/bitops.h"
 #include "qemu/timer.h"
 #include "qemu/queue.h"
 #include "monitor/monitor.h"
@@ -25,6 +27,7 @@
 #include "trace.h"
 
 #include "ui/spice-display.h"
+#include "ui/vnc-cmp.h"
 
 static int debug = 0;
 
@@ -126,6 +129,64 @@ void qemu_spice_wakeup(SimpleSpiceDisplay *ssd)
     spice_qxl_wakeup(&ssd->qxl);
 }
 
+/*
+ * Image ids are derived from the pixels, so that the same content gets
+ * the same id whenever it is sent.  The client caches bitmaps by id
+ * alone, so the shape and format go into the hash too: a solid 64x128
+ * tile must not be drawn from the cached 128x64 one.  The top bit keeps
+ * the ids apart from the counter-based ids used for everything else.
+ */
+static uint64_t qemu_spice_image_id(const QXLBitmap *bitmap,
+                                    const uint8_t *data)
+{
+    size_t len = (size_t)bitmap->stride * bitmap->y;
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    uint64_t word;
+    size_t i;
+
+    hash = (hash ^ bitmap->x) * 0x100000001b3ULL;
+    hash = (hash ^ bitmap->y) * 0x100000001b3ULL;
+    hash = (hash ^ bitmap->stride) * 0x100000001b3ULL;
+    hash = (hash ^ bitmap->format) * 0x100000001b3ULL;
+
+    for (i = 0; i + 8 <= len; i += 8) {
+        memcpy(&word, data + i, 8);
+        hash = rol64(hash ^ (word * 0x9e3779b97f4a7c15ULL), 27) *
+            0x100000001b3ULL;
+    }
+    for (; i < len; i++) {
+        hash = (hash ^ data[i]) * 0x100000001b3ULL;
+    }
+    hash ^= hash >> 32;
+    return hash | (1ULL << 63);
+}
+
+/*
+ * Ask the client to cache an image only the second time its content is
+ * sent, so that one-off updates do not push useful entries out of the
+ * client cache.  A new id replaces the least recently seen one of its set.
+ */
+static bool qemu_spice_image_seen(SimpleSpiceDisplay *ssd, uint64_t id)
+{
+    SpiceImageEntry *set = ssd->image_ids[id % SPICE_IMAGE_SETS];
+    SpiceImageEntry *victim = &set[0];
+    int i;
+
+    ssd->image_clock++;
+    for (i = 0; i < SPICE_IMAGE_WAYS; i++) {
+        if (set[i].id == id) {
+            set[i].used = ssd->image_clock;
+            return true;
+        }
+        if (set[i].used < victim->used) {
+            victim = &set[i];
+        }
+    }
+    victim->id = id;
+    victim->used = ssd->image_clock;
+    return false;
+}
+
 static void qemu_spice_create_one_update(SimpleSpiceDisplay *ssd,
                                          QXLRect *rect)
 {
@@ -168,7 +229,6 @@ static void qemu_spice_create_one_update(SimpleSpiceDisplay *ssd,
     drawable->u.copy.src_area.right  = bw;
     drawable->u.copy.src_area.bottom = bh;
 
-    QXL_SET_IMAGE_ID(image, QXL_IMAGE_GROUP_DEVICE, ssd->unique++);
     image->descriptor.type   = SPICE_IMAGE_TYPE_BITMAP;
     image->bitmap.flags      = QXL_BITMAP_DIRECT | QXL_BITMAP_TOP_DOWN;
     image->bitmap.stride     = bw * 4;
@@ -178,81 +238,104 @@ static void qemu_spice_create_one_update(SimpleSpiceDisplay *ssd,
     image->bitmap.palette = 0;
     image->bitmap.format = SPICE_BITMAP_FMT_32BIT;
 
+    /* the mirror was brought up to date by qemu_spice_create_update */
     dest = pixman_image_create_bits(PIXMAN_x8r8g8b8, bw, bh,
                                     (void *)update->bitmap, bw * 4);
-    pixman_image_composite(PIXMAN_OP_SRC, ssd->surface, NULL, ssd->mirror,
-                           rect->left, rect->top, 0, 0,
-                           rect->left, rect->top, bw, bh);
     pixman_image_composite(PIXMAN_OP_SRC, ssd->mirror, NULL, dest,
                            rect->left, rect->top, 0, 0,
                            0, 0, bw, bh);
     pixman_image_unref(dest);
 
+    image->descriptor.id = qemu_spice_image_id(&image->bitmap, update->bitmap);
+    if (qemu_spice_image_seen(ssd, image->descriptor.id)) {
+        trace_qemu_spice_create_update_cache(image->descriptor.id);
+        image->descriptor.flags = SPICE_IMAGE_FLAGS_CACHE_ME;
+    }
+
     cmd->type = QXL_CMD_DRAW;
     cmd->data = (uintptr_t)drawable;
 
     QTAILQ_INSERT_TAIL(&ssd->updates, update, next);
 }
 
+/*
+ * Send the changed tiles of the band starting at line @band.  A tile is
+ * sent whole, whatever part of it changed, and always from the same grid
+ * position, so that its id only depends on its content: content that
+ * shows up again at a tile position is found in the client cache.
+ */
+static void qemu_spice_create_band_updates(SimpleSpiceDisplay *ssd,
+                                           const bool *changed, int tiles,
+                                           int band)
+{
+    QXLRect rect;
+    int t;
+
+    rect.top = band;
+    rect.bottom = MIN(band + SPICE_TILE_SIZE, surface_height(ssd->ds));
+    for (t = 0; t < tiles; t++) {
+        if (changed[t]) {
+            rect.left = t * SPICE_TILE_SIZE;
+            rect.right = MIN(rect.left + SPICE_TILE_SIZE,
+                             surface_width(ssd->ds));
+            qemu_spice_create_one_update(ssd, &rect);
+        }
+    }
+}
+
 static void qemu_spice_create_update(SimpleSpiceDisplay *ssd)
 {
-    static const int blksize = 32;
-    int blocks = (surface_width(ssd->ds) + blksize - 1) / blksize;
-    int dirty_top[blocks];
-    int y, yoff, x, xoff, blk, bw;
+    int tiles = DIV_ROUND_UP(surface_width(ssd->ds), SPICE_TILE_SIZE);
     int bpp = surface_bytes_per_pixel(ssd->ds);
+    int gstride = surface_stride(ssd->ds);
+    int mstride = pixman_image_get_stride(ssd->mirror);
+    int left = ssd->dirty.left;
+    size_t len = (ssd->dirty.right - left) * bpp;
+    int ncells = DIV_ROUND_UP(len, VNC_CMP_CELL_BYTES);
+    unsigned long dirty[BITS_TO_LONGS(ncells ?: 1)];
+    unsigned long changed[BITS_TO_LONGS(ncells ?: 1)];
+    bool tile_changed[tiles];
+    int band, y, i;
     uint8_t *guest, *mirror;
 
     if (qemu_spice_rect_is_empty(&ssd->dirty)) {
         return;
     };
 
-    for (blk = 0; blk < blocks; blk++) {
-        dirty_top[blk] = -1;
-    }
-
-    guest = surface_data(ssd->ds);
-    mirror = (void *)pixman_image_get_data(ssd->mirror);
-    for (y = ssd->dirty.top; y < ssd->dirty.bottom; y++) {
-        yoff = y * surface_stride(ssd->ds);
-        for (x = ssd->dirty.left; x < ssd->dirty.right; x += blksize) {
-            xoff = x * bpp;
-            blk = x / blksize;
-            bw = MIN(blksize, ssd->dirty.right - x);
-            if (memcmp(guest + yoff + xoff,
-                       mirror + yoff + xoff,
-                       bw * bpp) == 0) {
-                if (dirty_top[blk] != -1) {
-                    QXLRect update = {
-                        .top    = dirty_top[blk],
-                        .bottom = y,
-                        .left   = x,
-                        .right  = x + bw,
-                    };
-                    qemu_spice_create_one_update(ssd, &update);
-                    dirty_top[blk] = -1;
-                }
-            } else {
-                if (dirty_top[blk] == -1) {
-                    dirty_top[blk] = y;
+    /*
+     * Compare each dirty line with the mirror, one cache line at a time,
+     * copying what changed.  Afterwards the mirror holds everything that
+     * needs to be sent.
+     */
+    bitmap_fill(dirty, ncells);
+    guest = surface_data(ssd->ds) + left * bpp;
+    mirror = (uint8_t *)pixman_image_get_data(ssd->mirror) + left * bpp;
+    for (band = ssd->dirty.top - ssd->dirty.top % SPICE_TILE_SIZE;
+         band < ssd->dirty.bottom; band += SPICE_TILE_SIZE) {
+        int top = MAX(band, ssd->dirty.top);
+        int bottom = MIN(band + SPICE_TILE_SIZE, ssd->dirty.bottom);
+
+        memset(tile_changed, 0, sizeof(tile_changed));
+        for (y = top; y < bottom; y++) {
+            if (!vnc_cmp_copy_row(mirror + y * mstride, guest + y * gstride,
+                                  len, dirty, changed, ncells)) {
+                continue;
+            }
+            for (i = find_first_bit(changed, ncells); i < ncells;
+                 i = find_next_bit(changed, ncells, i + 1)) {
+                size_t start = (size_t)i * VNC_CMP_CELL_BYTES;
+                size_t end = MIN(start + VNC_CMP_CELL_BYTES, len);
+                int x0 = left + start / bpp;
+                int x1 = left + DIV_ROUND_UP(end, bpp);
+                int t;
+
+                for (t = x0 / SPICE_TILE_SIZE;
+                     t <= (x1 - 1) / SPICE_TILE_SIZE; t++) {
+                    tile_changed[t] = true;
                 }
             }
         }
-    }
-
-    for (x = ssd->dirty.left; x < ssd->dirty.right; x += blksize) {
-        blk = x / blksize;
-        bw = MIN(blksize, ssd->dirty.right - x);
-        if (dirty_top[blk] != -1) {
-            QXLRect update = {
-                .top    = dirty_top[blk],
-                .bottom = ssd->dirty.bottom,
-                .left   = x,
-                .right  = x + bw,
-            };
-            qemu_spice_create_one_update(ssd, &update);
-            dirty_top[blk] = -1;
-        }
+        qemu_spice_create_band_updates(ssd, tile_changed, tiles, band);
     }
 
     memset(&ssd->dirty, 0, sizeof(ssd->dirty));
@@ -90,7 +90,9 @@ static void kbd_leds(void *opaque, int ledstate)
     if (ledstate & QEMU_CAPS_LOCK_LED) {
         kbd->ledstate |= SPICE_KEYBOARD_MODIFIER_FLAGS_CAPS_LOCK;
     }
+    qemu_spice_lock();
     spice_server_kbd_leds(&kbd->sin, ledstate);
+    qemu_spice_unlock();
 }
 
 /* mouse bits */
@@ -222,7 +224,7 @@ static void mouse_mode_notifier(Notifier *notifier, void *data)
     if (is_absolute) {
         qemu_spice_add_interface(&pointer->tablet.base);
     } else {
-        spice_server_remove_interface(&pointer->tablet.base);
+        qemu_spice_remove_interface(&pointer->tablet.base);
     }
     pointer->absolute = is_absolute;
 }
@@ -0,0 +1,56 @@
+/*
+ * QEMU VNC display driver: framebuffer compare and copy, row loop
+ *
+ * Copyright (C) 2015 agent <agent@local>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * Included once per implementation, with NAME set to its suffix and
+ * CELL_COPY to a function that compares and copies one full cell and
+ * returns true if it differed.
+ */
+
+#define CONCAT_I(a, b) a ## b
+#define CONCAT(a, b) CONCAT_I(a, b)
+
+static int CONCAT(vnc_cmp_copy_row_, NAME)(uint8_t *dst, const uint8_t *src,
+                                           size_t len,
+                                           const unsigned long *dirty,
+                                           unsigned long *changed, int ncells)
+{
+    int i, count = 0;
+
+    for (i = 0; i < BITS_TO_LONGS(ncells); i++) {
+        unsigned long bits = dirty[i];
+        unsigned long out = 0;
+
+        if (i == ncells / BITS_PER_LONG) {
+            bits &= BITMAP_LAST_WORD_MASK(ncells);
+        }
+        while (bits) {
+            int bit = ctzl(bits);
+            size_t off = ((size_t)i * BITS_PER_LONG + bit) *
+                         VNC_CMP_CELL_BYTES;
+            bool differs;
+
+            bits &= bits - 1;
+            if (off + VNC_CMP_CELL_BYTES <= len) {
+                differs = CELL_COPY(dst + off, src + off);
+            } else {
+                differs = vnc_cmp_copy_tail(dst + off, src + off, len - off);
+            }
+            if (differs) {
+                out |= 1UL << bit;
+                count++;
+            }
+        }
+        changed[i] = out;
+    }
+    return count;
+}
+
+#undef NAME
+#undef CELL_COPY
+#undef CONCAT_I
+#undef CONCAT
@@ -0,0 +1,130 @@
+/*
+ * QEMU VNC display driver: framebuffer compare and copy
+ *
+ * Copyright (C) 2015 agent <agent@local>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * The refresh timer walks the guest dirty bitmap and, for every dirty
+ * cell, checks whether the guest really changed it before copying it to
+ * the server surface and flagging it for the clients.  A cell is one
+ * cache line, so the vector versions load it once from each surface,
+ * compare it in registers and store the guest copy straight away.
+ */
+
+#include "qemu-common.h"
+#include "qemu/bitmap.h"
+#include "qemu/host-utils.h"
+#include "vnc-cmp.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+static bool vnc_cmp_copy_tail(uint8_t *dst, const uint8_t *src, size_t len)
+{
+    if (memcmp(dst, src, len) == 0) {
+        return false;
+    }
+    memcpy(dst, src, len);
+    return true;
+}
+
+static inline bool vnc_cmp_copy_cell_generic(uint8_t *dst, const uint8_t *src)
+{
+    return vnc_cmp_copy_tail(dst, src, VNC_CMP_CELL_BYTES);
+}
+
+#define NAME generic
+#define CELL_COPY vnc_cmp_copy_cell_generic
+#include "vnc-cmp-template.h"
+
+#ifdef __SSE2__
+static inline bool vnc_cmp_copy_cell_sse2(uint8_t *dst, const uint8_t *src)
+{
+    __m128i *d = (__m128i *)dst;
+    const __m128i *s = (const __m128i *)src;
+    __m128i s0 = _mm_loadu_si128(s + 0);
+    __m128i s1 = _mm_loadu_si128(s + 1);
+    __m128i s2 = _mm_loadu_si128(s + 2);
+    __m128i s3 = _mm_loadu_si128(s + 3);
+    __m128i eq01 = _mm_and_si128(_mm_cmpeq_epi8(s0, _mm_loadu_si128(d + 0)),
+                                 _mm_cmpeq_epi8(s1, _mm_loadu_si128(d + 1)));
+    __m128i eq23 = _mm_and_si128(_mm_cmpeq_epi8(s2, _mm_loadu_si128(d + 2)),
+                                 _mm_cmpeq_epi8(s3, _mm_loadu_si128(d + 3)));
+
+    if (_mm_movemask_epi8(_mm_and_si128(eq01, eq23)) == 0xffff) {
+        return false;
+    }
+    _mm_storeu_si128(d + 0, s0);
+    _mm_storeu_si128(d + 1, s1);
+    _mm_storeu_si128(d + 2, s2);
+    _mm_storeu_si128(d + 3, s3);
+    return true;
+}
+
+#define NAME sse2
+#define CELL_COPY vnc_cmp_copy_cell_sse2
+#include "vnc-cmp-template.h"
+#endif
+
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#include <immintrin.h>
+
+static inline bool vnc_cmp_copy_cell_avx2(uint8_t *dst, const uint8_t *src)
+{
+    __m256i *d = (__m256i *)dst;
+    const __m256i *s = (const __m256i *)src;
+    __m256i s0 = _mm256_loadu_si256(s + 0);
+    __m256i s1 = _mm256_loadu_si256(s + 1);
+    __m256i eq = _mm256_and_si256(
+        _mm256_cmpeq_epi8(s0, _mm256_loadu_si256(d + 0)),
+        _mm256_cmpeq_epi8(s1, _mm256_loadu_si256(d + 1)));
+
+    if (_mm256_movemask_epi8(eq) == -1) {
+        return false;
+    }
+    _mm256_storeu_si256(d + 0, s0);
+    _mm256_storeu_si256(d + 1, s1);
+    return true;
+}
+
+#define NAME avx2
+#define CELL_COPY vnc_cmp_copy_cell_avx2
+#include "vnc-cmp-template.h"
+
+#pragma GCC pop_options
+#endif
+
+VncCmpCopyImpl vnc_cmp_copy_impls[] = {
+    { "generic", vnc_cmp_copy_row_generic, true },
+#ifdef __SSE2__
+    { "sse2", vnc_cmp_copy_row_sse2, true },
+#endif
+#ifdef CONFIG_AVX2_OPT
+    { "avx2", vnc_cmp_copy_row_avx2, false },
+#endif
+    { NULL, NULL, false }
+};
+
+VncCmpCopyFunc *vnc_cmp_copy_row = vnc_cmp_copy_row_generic;
+
+static void __attribute__((constructor)) vnc_cmp_init(void)
+{
+    VncCmpCopyImpl *impl;
+
+    for (impl = vnc_cmp_copy_impls; impl->name; impl++) {
+#ifdef CONFIG_AVX2_OPT
+        if (impl->fn == vnc_cmp_copy_row_avx2) {
+            impl->usable = host_cpu_has_avx2();
+        }
+#endif
+        /* The table is sorted from slowest to fastest.  */
+        if (impl->usable) {
+            vnc_cmp_copy_row = impl->fn;
+        }
+    }
+}
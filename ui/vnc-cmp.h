@@ -0,0 +1,46 @@
+/*
+ * QEMU VNC display driver: framebuffer compare and copy
+ *
+ * Copyright (C) 2015 agent <agent@local>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef VNC_CMP_H
+#define VNC_CMP_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/* One dirty bit covers 16 pixels of 32 bits, i.e. a 64-byte cache line. */
+#define VNC_CMP_CELL_BYTES 64
+
+/*
+ * Refresh one row of the server surface from the guest surface.
+ *
+ * For every bit set in the first @ncells bits of @dirty, the matching
+ * VNC_CMP_CELL_BYTES bytes of @src are compared with @dst and copied over
+ * if they differ.  Only the first @len bytes of the row are touched, so
+ * the last cell may be shorter.  On return, @changed holds one bit per
+ * cell that was copied (BITS_TO_LONGS(@ncells) words are written) and
+ * the number of such cells is returned.  @dirty is left unchanged.
+ */
+typedef int VncCmpCopyFunc(uint8_t *dst, const uint8_t *src, size_t len,
+                           const unsigned long *dirty,
+                           unsigned long *changed, int ncells);
+
+typedef struct VncCmpCopyImpl {
+    const char *name;
+    VncCmpCopyFunc *fn;
+    bool usable;        /* supported by the host CPU */
+} VncCmpCopyImpl;
+
+/* All implementations built in, terminated by an entry with a NULL name. */
+extern VncCmpCopyImpl vnc_cmp_copy_impls[];
+
+/* The fastest usable implementation, picked at startup. */
+extern VncCmpCopyFunc *vnc_cmp_copy_row;
+
+#endif /* VNC_CMP_H */
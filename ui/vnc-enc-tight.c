@@ -884,6 +884,16 @@ static int tight_compress_data(VncState *vs, int stream_id, size_t bytes,
     return bytes;
 }
 
+/*
+ * Write the compression control byte of a rectangle, together with the
+ * stream reset bits still owed to the client.
+ */
+static void tight_write_control(VncState *vs, uint8_t control)
+{
+    vnc_write_u8(vs, control | vs->tight.stream_reset);
+    vs->tight.stream_reset = 0;
+}
+
 /*
  * Subencoding implementations.
  */
@@ -928,7 +938,7 @@ static int send_full_color_rect(VncState *vs, int x, int y, int w, int h)
     }
 #endif
 
-    vnc_write_u8(vs, stream << 4); /* no flushing, no filter */
+    tight_write_control(vs, stream << 4); /* no flushing, no filter */
 
     if (vs->tight.pixel24) {
         tight_pack24(vs, vs->tight.tight.buffer, w * h, &vs->tight.tight.offset);
@@ -948,7 +958,7 @@ static int send_solid_rect(VncState *vs)
 {
     size_t bytes;
 
-    vnc_write_u8(vs, VNC_TIGHT_FILL << 4); /* no flushing, no filter */
+    tight_write_control(vs, VNC_TIGHT_FILL << 4); /* no flushing, no filter */
 
     if (vs->tight.pixel24) {
         tight_pack24(vs, vs->tight.tight.buffer, 1, &vs->tight.tight.offset);
@@ -984,7 +994,7 @@ static int send_mono_rect(VncState *vs, int x, int y,
 
     bytes = ((w + 7) / 8) * h;
 
-    vnc_write_u8(vs, (stream | VNC_TIGHT_EXPLICIT_FILTER) << 4);
+    tight_write_control(vs, (stream | VNC_TIGHT_EXPLICIT_FILTER) << 4);
     vnc_write_u8(vs, VNC_TIGHT_FILTER_PALETTE);
     vnc_write_u8(vs, 1);
 
@@ -1050,7 +1060,7 @@ static bool send_gradient_rect(VncState *vs, int x, int y, int w, int h)
         return send_full_color_rect(vs, x, y, w, h);
     }
 
-    vnc_write_u8(vs, (stream | VNC_TIGHT_EXPLICIT_FILTER) << 4);
+    tight_write_control(vs, (stream | VNC_TIGHT_EXPLICIT_FILTER) << 4);
     vnc_write_u8(vs, VNC_TIGHT_FILTER_GRADIENT);
 
     buffer_reserve(&vs->tight.gradient, w * 3 * sizeof (int));
@@ -1092,7 +1102,7 @@ static int send_palette_rect(VncState *vs, int x, int y,
 
     colors = palette_size(palette);
 
-    vnc_write_u8(vs, (stream | VNC_TIGHT_EXPLICIT_FILTER) << 4);
+    tight_write_control(vs, (stream | VNC_TIGHT_EXPLICIT_FILTER) << 4);
     vnc_write_u8(vs, VNC_TIGHT_FILTER_PALETTE);
     vnc_write_u8(vs, colors - 1);
 
@@ -1223,7 +1233,7 @@ static int send_jpeg_rect(VncState *vs, int x, int y, int w, int h, int quality)
     jpeg_finish_compress(&cinfo);
     jpeg_destroy_compress(&cinfo);
 
-    vnc_write_u8(vs, VNC_TIGHT_JPEG << 4);
+    tight_write_control(vs, VNC_TIGHT_JPEG << 4);
 
     tight_send_compact_size(vs, vs->tight.jpeg.offset);
     vnc_write(vs, vs->tight.jpeg.buffer, vs->tight.jpeg.offset);
@@ -1373,7 +1383,7 @@ static int send_png_rect(VncState *vs, int x, int y, int w, int h,
 
     png_destroy_write_struct(&png_ptr, &info_ptr);
 
-    vnc_write_u8(vs, VNC_TIGHT_PNG << 4);
+    tight_write_control(vs, VNC_TIGHT_PNG << 4);
 
     tight_send_compact_size(vs, vs->tight.png.offset);
     vnc_write(vs, vs->tight.png.buffer, vs->tight.png.offset);
@@ -1424,14 +1434,14 @@ static int send_sub_rect_nojpeg(VncState *vs, int x, int y, int w, int h,
 #ifdef CONFIG_VNC_JPEG
 static int send_sub_rect_jpeg(VncState *vs, int x, int y, int w, int h,
                               int bg, int fg, int colors,
-                              VncPalette *palette, bool force)
+                              VncPalette *palette, bool force, int level)
 {
     int ret;
 
     if (colors == 0) {
-        if (force || (tight_jpeg_conf[vs->tight.quality].jpeg_full &&
+        if (force || (tight_jpeg_conf[level].jpeg_full &&
                       tight_detect_smooth_image(vs, w, h))) {
-            int quality = tight_conf[vs->tight.quality].jpeg_quality;
+            int quality = tight_conf[level].jpeg_quality;
 
             ret = send_jpeg_rect(vs, x, y, w, h, quality);
         } else {
@@ -1443,9 +1453,9 @@ static int send_sub_rect_jpeg(VncState *vs, int x, int y, int w, int h,
         ret = send_mono_rect(vs, x, y, w, h, bg, fg);
     } else if (colors <= 256) {
         if (force || (colors > 96 &&
-                      tight_jpeg_conf[vs->tight.quality].jpeg_idx &&
+                      tight_jpeg_conf[level].jpeg_idx &&
                       tight_detect_smooth_image(vs, w, h))) {
-            int quality = tight_conf[vs->tight.quality].jpeg_quality;
+            int quality = tight_conf[level].jpeg_quality;
 
             ret = send_jpeg_rect(vs, x, y, w, h, quality);
         } else {
@@ -1467,6 +1477,7 @@ static int send_sub_rect(VncState *vs, int x, int y, int w, int h)
 #ifdef CONFIG_VNC_JPEG
     bool force_jpeg = false;
     bool allow_jpeg = true;
+    int level = vs->tight.quality;
 #endif
 
     vnc_framebuffer_update(vs, x, y, w, h, vs->tight.type);
@@ -1479,12 +1490,21 @@ static int send_sub_rect(VncState *vs, int x, int y, int w, int h)
     if (!vs->vd->non_adaptive && vs->tight.quality != (uint8_t)-1) {
         double freq = vnc_update_freq(vs, x, y, w, h);
 
-        if (freq < tight_jpeg_conf[vs->tight.quality].jpeg_freq_min) {
-            allow_jpeg = false;
-        }
-        if (freq >= tight_jpeg_conf[vs->tight.quality].jpeg_freq_threshold) {
+        if (vnc_video_rect(vs, x, y, w, h)) {
+            /* video frame: quality chosen from the client link */
+            level = MIN(vs->video.quality, level);
             force_jpeg = true;
             vnc_sent_lossy_rect(vs, x, y, w, h);
+        } else if (vnc_lossy_refine(vs, x, y, w, h)) {
+            allow_jpeg = false;
+        } else {
+            if (freq < tight_jpeg_conf[level].jpeg_freq_min) {
+                allow_jpeg = false;
+            }
+            if (freq >= tight_jpeg_conf[level].jpeg_freq_threshold) {
+                force_jpeg = true;
+                vnc_sent_lossy_rect(vs, x, y, w, h);
+            }
         }
     }
 #endif
@@ -1494,7 +1514,7 @@ static int send_sub_rect(VncState *vs, int x, int y, int w, int h)
 #ifdef CONFIG_VNC_JPEG
     if (allow_jpeg && vs->tight.quality != (uint8_t)-1) {
         ret = send_sub_rect_jpeg(vs, x, y, w, h, bg, fg, colors, palette,
-                                 force_jpeg);
+                                 force_jpeg, level);
     } else {
         ret = send_sub_rect_nojpeg(vs, x, y, w, h, bg, fg, colors, palette);
     }
@@ -1645,7 +1665,8 @@ static int tight_send_framebuffer_update(VncState *vs, int x, int y,
     if (vs->tight.quality != (uint8_t)-1) {
         double freq = vnc_update_freq(vs, x, y, w, h);
 
-        if (freq > tight_jpeg_conf[vs->tight.quality].jpeg_freq_threshold) {
+        if (freq > tight_jpeg_conf[vs->tight.quality].jpeg_freq_threshold ||
+            vnc_video_rect(vs, x, y, w, h)) {
             return send_rect_simple(vs, x, y, w, h, false);
         }
     }
@@ -1677,6 +1698,23 @@ int vnc_tight_png_send_framebuffer_update(VncState *vs, int x, int y,
     return tight_send_framebuffer_update(vs, x, y, w, h);
 }
 
+/*
+ * Restart the compression streams for a new tile.  The first rectangle of
+ * the tile tells the client to reset its streams too, so the tile can be
+ * decoded without anything that was compressed before it.
+ */
+void vnc_tight_start_tile(VncState *vs)
+{
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(vs->tight.stream); i++) {
+        if (vs->tight.stream[i].opaque) {
+            deflateReset(&vs->tight.stream[i]);
+        }
+    }
+    vs->tight.stream_reset = (1 << ARRAY_SIZE(vs->tight.stream)) - 1;
+}
+
 void vnc_tight_clear(VncState *vs)
 {
     int i;
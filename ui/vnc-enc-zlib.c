@@ -45,6 +45,9 @@ void vnc_zlib_zfree(void *x, void *addr)
     g_free(addr);
 }
 
+/* zlib stream header: deflate, 32K window, no preset dictionary */
+const uint8_t vnc_zlib_header[2] = { 0x78, 0x01 };
+
 static void vnc_zlib_start(VncState *vs)
 {
     buffer_reset(&vs->zlib.zlib);
@@ -57,7 +60,7 @@ static void vnc_zlib_start(VncState *vs)
 static int vnc_zlib_stop(VncState *vs)
 {
     z_streamp zstream = &vs->zlib.stream;
-    int previous_out;
+    int previous_out, header;
 
     // switch back to normal output/zlib buffers
     vs->zlib.zlib = vs->output;
@@ -66,8 +69,8 @@ static int vnc_zlib_stop(VncState *vs)
     // compress the zlib buffer
 
     // initialize the stream
-    // XXX need one stream per session
-    if (zstream->opaque != vs) {
+    /* raw deflate, see vnc_zlib_start_tile() */
+    if (zstream->opaque == NULL) {
         int err;
 
         VNC_DEBUG("VNC: initializing zlib stream\n");
@@ -75,8 +78,8 @@ static int vnc_zlib_stop(VncState *vs)
         zstream->zalloc = vnc_zlib_zalloc;
         zstream->zfree = vnc_zlib_zfree;
 
-        err = deflateInit2(zstream, vs->tight.compression, Z_DEFLATED, MAX_WBITS,
-                           MAX_MEM_LEVEL, Z_DEFAULT_STRATEGY);
+        err = deflateInit2(zstream, vs->tight.compression, Z_DEFLATED,
+                           -MAX_WBITS, MAX_MEM_LEVEL, Z_DEFAULT_STRATEGY);
 
         if (err != Z_OK) {
             fprintf(stderr, "VNC: error initializing zlib\n");
@@ -95,6 +98,14 @@ static int vnc_zlib_stop(VncState *vs)
         vs->zlib.level = vs->tight.compression;
     }
 
+    /* the first data of the client's stream carries the zlib header */
+    header = 0;
+    if (!vs->zlib.started) {
+        vnc_write(vs, vnc_zlib_header, sizeof(vnc_zlib_header));
+        header = sizeof(vnc_zlib_header);
+        vs->zlib.started = true;
+    }
+
     // reserve memory in output buffer
     buffer_reserve(&vs->output, vs->zlib.zlib.offset + 64);
 
@@ -113,7 +124,7 @@ static int vnc_zlib_stop(VncState *vs)
     }
 
     vs->output.offset = vs->output.capacity - zstream->avail_out;
-    return previous_out - zstream->avail_out;
+    return header + previous_out - zstream->avail_out;
 }
 
 int vnc_zlib_send_framebuffer_update(VncState *vs, int x, int y, int w, int h)
@@ -143,6 +154,19 @@ int vnc_zlib_send_framebuffer_update(VncState *vs, int x, int y, int w, int h)
     return 1;
 }
 
+/*
+ * Restart the stream for a new tile.  The stream produces raw deflate
+ * blocks ending in a sync flush, which reference nothing compressed before
+ * the tile.  Tiles compressed by different workers can therefore follow
+ * each other in the single zlib stream the client decodes.
+ */
+void vnc_zlib_start_tile(VncState *vs)
+{
+    if (vs->zlib.stream.opaque) {
+        deflateReset(&vs->zlib.stream);
+    }
+}
+
 void vnc_zlib_clear(VncState *vs)
 {
     if (vs->zlib.stream.opaque) {
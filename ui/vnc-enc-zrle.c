@@ -74,13 +74,14 @@ static int zrle_compress_data(VncState *vs, int level)
 
     buffer_reset(&vs->zrle.zlib);
 
-    if (zstream->opaque != vs) {
+    if (zstream->opaque == NULL) {
         int err;
 
         zstream->zalloc = vnc_zlib_zalloc;
         zstream->zfree = vnc_zlib_zfree;
 
-        err = deflateInit2(zstream, level, Z_DEFLATED, MAX_WBITS,
+        /* raw deflate, see vnc_zrle_start_tile() */
+        err = deflateInit2(zstream, level, Z_DEFLATED, -MAX_WBITS,
                            MAX_MEM_LEVEL, Z_DEFAULT_STRATEGY);
 
         if (err != Z_OK) {
@@ -94,6 +95,13 @@ static int zrle_compress_data(VncState *vs, int level)
     /* reserve memory in output buffer */
     buffer_reserve(&vs->zrle.zlib, vs->zrle.zrle.offset + 64);
 
+    /* the first data of the client's stream carries the zlib header */
+    if (!vs->zrle.started) {
+        buffer_append(&vs->zrle.zlib, vnc_zlib_header,
+                      sizeof(vnc_zlib_header));
+        vs->zrle.started = true;
+    }
+
     /* set pointers */
     zstream->next_in = vs->zrle.zrle.buffer;
     zstream->avail_in = vs->zrle.zrle.offset;
@@ -355,6 +363,14 @@ int vnc_zywrle_send_framebuffer_update(VncState *vs, int x, int y, int w, int h)
     return zrle_send_framebuffer_update(vs, x, y, w, h);
 }
 
+/* Restart the stream for a new tile, see vnc_zlib_start_tile() */
+void vnc_zrle_start_tile(VncState *vs)
+{
+    if (vs->zrle.stream.opaque) {
+        deflateReset(&vs->zrle.stream);
+    }
+}
+
 void vnc_zrle_clear(VncState *vs)
 {
     if (vs->zrle.stream.opaque) {
@@ -35,25 +35,59 @@
  *
  * There are three levels of locking:
  * - jobs queue lock: for each operation on the queue (push, pop, isEmpty?)
- * - VncDisplay global lock: mainly used for framebuffer updates to avoid
- *                      screen corruption if the framebuffer is updated
- *                      while the worker is doing something.
+ * - VncDisplay global lock: protects VncDisplay::encoders, the number of
+ *                      workers currently reading the server surface.
+ *                      vnc_refresh() leaves the surface alone while it is
+ *                      not zero, to avoid screen corruption (this does not
+ *                      block vnc_refresh() because it uses trylock()).
  * - VncState::output lock: used to make sure the output buffer is not corrupted
  *                          if two threads try to write on it at the same time
  *
- * While the VNC worker thread is working, the VncDisplay global lock is held
- * to avoid screen corruption (this does not block vnc_refresh() because it
- * uses trylock()) but the output lock is not held because the thread works on
- * its own output buffer.
- * When the encoding job is done, the worker thread will hold the output lock
- * and copy its output buffer in vs->output.
+ * The queue is served by a pool of worker threads.  The jobs of one client
+ * are taken in order and by one worker at a time, while jobs of different
+ * clients are encoded in parallel.  A job is additionally split into bands
+ * that idle workers encode in parallel; the worker owning the job then
+ * emits them in order.
+ *
+ * The zlib based encodings (zlib, tight, zrle) are always encoded in bands.
+ * Each worker compresses with its own streams, which are restarted for
+ * every band: tight tells the client to reset its streams with the first
+ * rectangle of the band, while zlib and zrle emit raw deflate blocks that
+ * do not refer to anything before the band, so that bands from different
+ * workers form one valid stream on the client side.
+ *
+ * Workers do not hold the output lock while encoding, because each one
+ * works on its own output buffer.  When the encoding job is done, the
+ * worker owning it holds the output lock and copies its output buffer
+ * in vs->output.
+ */
+
+#define VNC_WORKERS_MAX 8
+
+/*
+ * Height of the bands a job is split into for parallel encoding.  Bands
+ * are aligned to the lossy_rect grid, so that no two of them update the
+ * same entry.
  */
+#define VNC_TILE_HEIGHT VNC_STAT_RECT
+
+struct VncTile {
+    VncRect rect;
+    Buffer output;
+    int n;
+};
+
+/* Encoder state owned by one worker thread */
+typedef struct VncWorker {
+    Buffer buffer;
+    VncState vs;        /* Persistent compression streams and buffers */
+} VncWorker;
 
 struct VncJobQueue {
     QemuCond cond;
     QemuMutex mutex;
-    QemuThread thread;
-    Buffer buffer;
+    QemuThread threads[VNC_WORKERS_MAX];
+    int nthreads;
     bool exit;
     QTAILQ_HEAD(, VncJob) jobs;
 };
@@ -61,8 +95,8 @@ struct VncJobQueue {
 typedef struct VncJobQueue VncJobQueue;
 
 /*
- * We use a single global queue, but most of the functions are
- * already reentrant, so we can easily add more than one encoding thread
+ * We use a single global queue, shared by all the clients of all the
+ * displays and served by several encoding threads.
  */
 static VncJobQueue *queue;
 
@@ -102,11 +136,22 @@ int vnc_job_add_rect(VncJob *job, int x, int y, int w, int h)
     return 1;
 }
 
+static void vnc_job_free(VncJob *job)
+{
+    VncRectEntry *entry, *tmp;
+
+    QLIST_FOREACH_SAFE(entry, &job->rectangles, next, tmp) {
+        QLIST_REMOVE(entry, next);
+        g_free(entry);
+    }
+    g_free(job);
+}
+
 void vnc_job_push(VncJob *job)
 {
     vnc_lock_queue(queue);
     if (queue->exit || QLIST_EMPTY(&job->rectangles)) {
-        g_free(job);
+        vnc_job_free(job);
     } else {
         QTAILQ_INSERT_TAIL(&queue->jobs, job, next);
         qemu_cond_broadcast(&queue->cond);
@@ -142,8 +187,10 @@ void vnc_jobs_clear(VncState *vs)
 
     vnc_lock_queue(queue);
     QTAILQ_FOREACH_SAFE(job, &queue->jobs, next, tmp) {
-        if (job->vs == vs || !vs) {
+        /* Jobs being encoded are removed by their worker. */
+        if ((job->vs == vs || !vs) && !job->busy) {
             QTAILQ_REMOVE(&queue->jobs, job, next);
+            vnc_job_free(job);
         }
     }
     vnc_unlock_queue(queue);
@@ -165,6 +212,7 @@ void vnc_jobs_consume_buffer(VncState *vs)
 
     vnc_lock_output(vs);
     if (vs->jobs_buffer.offset) {
+        vnc_update_queued(vs, vs->jobs_buffer.offset);
         vnc_write(vs, vs->jobs_buffer.buffer, vs->jobs_buffer.offset);
         buffer_reset(&vs->jobs_buffer);
     }
@@ -179,12 +227,14 @@ void vnc_jobs_consume_buffer(VncState *vs)
 /*
  * Copy data for local use
  */
-static void vnc_async_encoding_start(VncState *orig, VncState *local)
+static void vnc_async_encoding_start(VncState *orig, VncState *local,
+                                     Buffer *buffer)
 {
     local->vnc_encoding = orig->vnc_encoding;
     local->features = orig->features;
     local->vd = orig->vd;
     local->lossy_rect = orig->lossy_rect;
+    local->video = orig->video;
     local->write_pixels = orig->write_pixels;
     local->client_pf = orig->client_pf;
     local->client_be = orig->client_be;
@@ -192,43 +242,264 @@ static void vnc_async_encoding_start(VncState *orig, VncState *local)
     local->zlib = orig->zlib;
     local->hextile = orig->hextile;
     local->zrle = orig->zrle;
-    local->output =  queue->buffer;
+    local->output = *buffer;
     local->csock = -1; /* Don't do any network work on this thread */
+    memset(&local->stats, 0, sizeof(local->stats));
 
     buffer_reset(&local->output);
 }
 
-static void vnc_async_encoding_end(VncState *orig, VncState *local)
+static void vnc_async_encoding_end(VncState *orig, VncState *local,
+                                   Buffer *buffer)
 {
+    int i;
+
+    for (i = 0; i < VNC_RECT_ENCODING_MAX; i++) {
+        orig->stats.enc_rects[i] += local->stats.enc_rects[i];
+        orig->stats.enc_bytes[i] += local->stats.enc_bytes[i];
+    }
     orig->tight = local->tight;
     orig->zlib = local->zlib;
     orig->hextile = local->hextile;
     orig->zrle = local->zrle;
     orig->lossy_rect = local->lossy_rect;
 
-    queue->buffer = local->output;
+    *buffer = local->output;
+}
+
+/*
+ * Copy the client settings to the encoder state of a worker, keeping the
+ * worker's own compression streams and buffers.  @first is set for the
+ * first band of a job.
+ */
+static void vnc_tile_encoding_start(VncState *orig, VncState *local,
+                                    Buffer *buffer, bool first)
+{
+    local->vnc_encoding = orig->vnc_encoding;
+    local->features = orig->features;
+    local->vd = orig->vd;
+    local->lossy_rect = orig->lossy_rect;
+    local->video = orig->video;
+    local->write_pixels = orig->write_pixels;
+    local->client_pf = orig->client_pf;
+    local->client_be = orig->client_be;
+    local->tight.type = orig->tight.type;
+    local->tight.quality = orig->tight.quality;
+    local->tight.compression = orig->tight.compression;
+    local->tight.pixel24 = orig->tight.pixel24;
+    local->hextile = orig->hextile;
+    local->output = *buffer;
+    local->csock = -1; /* Don't do any network work on this thread */
+    memset(&local->stats, 0, sizeof(local->stats));
+
+    buffer_reset(&local->output);
+
+    /* Only the very first band sent to the client opens its zlib streams */
+    local->zlib.started = orig->zlib.started || !first;
+    local->zrle.started = orig->zrle.started || !first;
+    vnc_zlib_start_tile(local);
+    vnc_tight_start_tile(local);
+    vnc_zrle_start_tile(local);
+}
+
+/*
+ * Whether to split the rectangles of a job into bands.  The zlib based
+ * encodings always are, see above; the others only if there are other
+ * workers to help.
+ */
+static bool vnc_job_tiled(VncState *vs)
+{
+    switch (vs->vnc_encoding) {
+    case VNC_ENCODING_ZLIB:
+    case VNC_ENCODING_TIGHT:
+    case VNC_ENCODING_TIGHT_PNG:
+    case VNC_ENCODING_ZRLE:
+    case VNC_ENCODING_ZYWRLE:
+        return true;
+    default:
+        return queue->nthreads > 1;
+    }
+}
+
+/* Split the rectangles of @job into bands of the VNC_TILE_HEIGHT grid. */
+static VncTile *vnc_job_split(VncJob *job, int *ntiles)
+{
+    VncRectEntry *entry, *tmp;
+    VncTile *tiles;
+    int n = 0, i = 0, y, bottom;
+
+    QLIST_FOREACH(entry, &job->rectangles, next) {
+        bottom = entry->rect.y + entry->rect.h;
+        n += (bottom - 1) / VNC_TILE_HEIGHT -
+             entry->rect.y / VNC_TILE_HEIGHT + 1;
+    }
+
+    tiles = g_new0(VncTile, n);
+    QLIST_FOREACH_SAFE(entry, &job->rectangles, next, tmp) {
+        bottom = entry->rect.y + entry->rect.h;
+        for (y = entry->rect.y; y < bottom;
+             y = ROUND_UP(y + 1, VNC_TILE_HEIGHT)) {
+            tiles[i].rect.x = entry->rect.x;
+            tiles[i].rect.y = y;
+            tiles[i].rect.w = entry->rect.w;
+            tiles[i].rect.h = MIN(ROUND_UP(y + 1, VNC_TILE_HEIGHT),
+                                  bottom) - y;
+            i++;
+        }
+        QLIST_REMOVE(entry, next);
+        g_free(entry);
+    }
+
+    *ntiles = n;
+    return tiles;
+}
+
+static void vnc_encode_tile(VncJob *job, VncTile *tile, VncWorker *worker)
+{
+    VncState *vs = &worker->vs;
+
+    /* Start from the owner's copy, which is stable for the whole job. */
+    vnc_tile_encoding_start(job->encoder, vs, &tile->output,
+                            tile == job->tiles);
+    tile->n = vnc_send_framebuffer_update(vs, tile->rect.x, tile->rect.y,
+                                          tile->rect.w, tile->rect.h);
+    tile->output = vs->output;
 }
 
-static int vnc_worker_thread_loop(VncJobQueue *queue)
+/* Encode unclaimed tiles of @job.  Called with the queue locked. */
+static void vnc_encode_tiles_locked(VncJobQueue *queue, VncJob *job,
+                                    VncWorker *worker)
+{
+    while (job->next_tile < job->ntiles) {
+        VncTile *tile = &job->tiles[job->next_tile++];
+
+        vnc_unlock_queue(queue);
+        if (job->vs->csock != -1) {
+            vnc_encode_tile(job, tile, worker);
+        } else {
+            tile->n = -1;
+        }
+        vnc_lock_queue(queue);
+
+        if (++job->done_tiles == job->ntiles) {
+            qemu_cond_broadcast(&queue->cond);
+        }
+    }
+}
+
+/* Encode @job in parallel bands and append them to @vs in order. */
+static int vnc_encode_job_tiled(VncJobQueue *queue, VncJob *job, VncState *vs,
+                                VncWorker *worker)
+{
+    VncTile *tiles;
+    int i, ntiles, n_rectangles = 0;
+
+    tiles = vnc_job_split(job, &ntiles);
+
+    vnc_lock_queue(queue);
+    job->encoder = vs;
+    job->tiles = tiles;
+    job->ntiles = ntiles;
+    job->next_tile = 0;
+    job->done_tiles = 0;
+    qemu_cond_broadcast(&queue->cond);
+
+    vnc_encode_tiles_locked(queue, job, worker);
+    while (job->done_tiles < job->ntiles) {
+        qemu_cond_wait(&queue->cond, &queue->mutex);
+    }
+    job->encoder = NULL;
+    job->tiles = NULL;
+    job->ntiles = 0;
+    vnc_unlock_queue(queue);
+
+    for (i = 0; i < ntiles; i++) {
+        if (tiles[i].n > 0) {
+            n_rectangles += tiles[i].n;
+            vnc_write(vs, tiles[i].output.buffer, tiles[i].output.offset);
+            vnc_account_rects(vs, vs->vnc_encoding, tiles[i].n,
+                              tiles[i].output.offset);
+        }
+        buffer_free(&tiles[i].output);
+    }
+    g_free(tiles);
+
+    if (ntiles) {
+        vs->zlib.started |= vs->vnc_encoding == VNC_ENCODING_ZLIB;
+        vs->zrle.started |= vs->vnc_encoding == VNC_ENCODING_ZRLE ||
+                            vs->vnc_encoding == VNC_ENCODING_ZYWRLE;
+    }
+    return n_rectangles;
+}
+
+/*
+ * Pick the first job whose client has no older job in the queue, so that
+ * the updates of a client are encoded and sent in order.  Called with the
+ * queue locked.
+ */
+static VncJob *vnc_next_job_locked(VncJobQueue *queue)
+{
+    VncJob *job, *prev;
+
+    QTAILQ_FOREACH(job, &queue->jobs, next) {
+        if (job->busy) {
+            continue;
+        }
+        QTAILQ_FOREACH(prev, &queue->jobs, next) {
+            if (prev == job || prev->vs == job->vs) {
+                break;
+            }
+        }
+        if (prev == job) {
+            return job;
+        }
+    }
+    return NULL;
+}
+
+/* Find a job with tiles left to encode.  Called with the queue locked. */
+static VncJob *vnc_next_tiled_job_locked(VncJobQueue *queue)
 {
     VncJob *job;
+
+    QTAILQ_FOREACH(job, &queue->jobs, next) {
+        if (job->busy && job->next_tile < job->ntiles) {
+            return job;
+        }
+    }
+    return NULL;
+}
+
+static int vnc_worker_thread_loop(VncJobQueue *queue, VncWorker *worker)
+{
+    Buffer *buffer = &worker->buffer;
+    VncJob *job;
     VncRectEntry *entry, *tmp;
     VncState vs;
     int n_rectangles;
     int saved_offset;
 
     vnc_lock_queue(queue);
-    while (QTAILQ_EMPTY(&queue->jobs) && !queue->exit) {
+    for (;;) {
+        if (queue->exit) {
+            vnc_unlock_queue(queue);
+            return -1;
+        }
+        job = vnc_next_job_locked(queue);
+        if (job) {
+            job->busy = true;
+            break;
+        }
+        job = vnc_next_tiled_job_locked(queue);
+        if (job) {
+            /* Help another worker with its job. */
+            vnc_encode_tiles_locked(queue, job, worker);
+            continue;
+        }
         qemu_cond_wait(&queue->cond, &queue->mutex);
     }
-    /* Here job can only be NULL if queue->exit is true */
-    job = QTAILQ_FIRST(&queue->jobs);
     vnc_unlock_queue(queue);
 
-    if (queue->exit) {
-        return -1;
-    }
-
     vnc_lock_output(job->vs);
     if (job->vs->csock == -1 || job->vs->abort == true) {
         vnc_unlock_output(job->vs);
@@ -237,7 +508,7 @@ static int vnc_worker_thread_loop(VncJobQueue *queue)
     vnc_unlock_output(job->vs);
 
     /* Make a local copy of vs and switch output buffers */
-    vnc_async_encoding_start(job->vs, &vs);
+    vnc_async_encoding_start(job->vs, &vs, buffer);
 
     /* Start sending rectangles */
     n_rectangles = 0;
@@ -246,26 +517,31 @@ static int vnc_worker_thread_loop(VncJobQueue *queue)
     saved_offset = vs.output.offset;
     vnc_write_u16(&vs, 0);
 
-    vnc_lock_display(job->vs->vd);
-    QLIST_FOREACH_SAFE(entry, &job->rectangles, next, tmp) {
-        int n;
-
-        if (job->vs->csock == -1) {
-            vnc_unlock_display(job->vs->vd);
-            /* Copy persistent encoding data */
-            vnc_async_encoding_end(job->vs, &vs);
-            goto disconnected;
-        }
-
-        n = vnc_send_framebuffer_update(&vs, entry->rect.x, entry->rect.y,
-                                        entry->rect.w, entry->rect.h);
-
-        if (n >= 0) {
-            n_rectangles += n;
+    vnc_encode_begin(job->vs->vd);
+    if (vnc_job_tiled(&vs)) {
+        n_rectangles = vnc_encode_job_tiled(queue, job, &vs, worker);
+    } else {
+        QLIST_FOREACH_SAFE(entry, &job->rectangles, next, tmp) {
+            int n;
+
+            if (job->vs->csock == -1) {
+                vnc_encode_end(job->vs->vd);
+                /* Copy persistent encoding data */
+                vnc_async_encoding_end(job->vs, &vs, buffer);
+                goto disconnected;
+            }
+
+            n = vnc_send_framebuffer_update(&vs, entry->rect.x, entry->rect.y,
+                                            entry->rect.w, entry->rect.h);
+
+            if (n >= 0) {
+                n_rectangles += n;
+            }
+            QLIST_REMOVE(entry, next);
+            g_free(entry);
         }
-        g_free(entry);
     }
-    vnc_unlock_display(job->vs->vd);
+    vnc_encode_end(job->vs->vd);
 
     /* Put n_rectangles at the beginning of the message */
     vs.output.buffer[saved_offset] = (n_rectangles >> 8) & 0xFF;
@@ -277,12 +553,12 @@ static int vnc_worker_thread_loop(VncJobQueue *queue)
         buffer_append(&job->vs->jobs_buffer, vs.output.buffer,
                       vs.output.offset);
         /* Copy persistent encoding data */
-        vnc_async_encoding_end(job->vs, &vs);
+        vnc_async_encoding_end(job->vs, &vs, buffer);
 
 	qemu_bh_schedule(job->vs->bh);
     }  else {
         /* Copy persistent encoding data */
-        vnc_async_encoding_end(job->vs, &vs);
+        vnc_async_encoding_end(job->vs, &vs, buffer);
     }
     vnc_unlock_output(job->vs);
 
@@ -291,7 +567,7 @@ disconnected:
     QTAILQ_REMOVE(&queue->jobs, job, next);
     vnc_unlock_queue(queue);
     qemu_cond_broadcast(&queue->cond);
-    g_free(job);
+    vnc_job_free(job);
     return 0;
 }
 
@@ -309,7 +585,6 @@ static void vnc_queue_clear(VncJobQueue *q)
 {
     qemu_cond_destroy(&queue->cond);
     qemu_mutex_destroy(&queue->mutex);
-    buffer_free(&queue->buffer);
     g_free(q);
     queue = NULL; /* Unset global queue */
 }
@@ -317,11 +592,24 @@ static void vnc_queue_clear(VncJobQueue *q)
 static void *vnc_worker_thread(void *arg)
 {
     VncJobQueue *queue = arg;
+    VncWorker *worker = g_new0(VncWorker, 1);
+    bool last;
 
-    qemu_thread_get_self(&queue->thread);
+    while (!vnc_worker_thread_loop(queue, worker)) {
+        /* Do nothing */
+    }
+    buffer_free(&worker->buffer);
+    vnc_zlib_clear(&worker->vs);
+    vnc_tight_clear(&worker->vs);
+    vnc_zrle_clear(&worker->vs);
+    g_free(worker);
 
-    while (!vnc_worker_thread_loop(queue)) ;
-    vnc_queue_clear(queue);
+    vnc_lock_queue(queue);
+    last = --queue->nthreads == 0;
+    vnc_unlock_queue(queue);
+    if (last) {
+        vnc_queue_clear(queue);
+    }
     return NULL;
 }
 
@@ -330,15 +618,30 @@ static bool vnc_worker_thread_running(void)
     return queue; /* Check global queue */
 }
 
+/* One encoding thread per host CPU, up to VNC_WORKERS_MAX. */
+static int vnc_worker_thread_count(void)
+{
+    long n = 1;
+
+#ifdef _SC_NPROCESSORS_ONLN
+    n = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    return MAX(1, MIN(n, VNC_WORKERS_MAX));
+}
+
 void vnc_start_worker_thread(void)
 {
     VncJobQueue *q;
+    int i;
 
     if (vnc_worker_thread_running())
         return ;
 
     q = vnc_queue_init();
-    qemu_thread_create(&q->thread, "vnc_worker", vnc_worker_thread, q,
-                       QEMU_THREAD_DETACHED);
+    q->nthreads = vnc_worker_thread_count();
+    for (i = 0; i < q->nthreads; i++) {
+        qemu_thread_create(&q->threads[i], "vnc_worker", vnc_worker_thread, q,
+                           QEMU_THREAD_DETACHED);
+    }
     queue = q; /* Set global queue */
 }
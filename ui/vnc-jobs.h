@@ -42,9 +42,21 @@ void vnc_jobs_consume_buffer(VncState *vs);
 void vnc_start_worker_thread(void);
 
 /* Locks */
+
+/*
+ * Lock the display unless a worker is encoding from the server surface.
+ * Returns 0 on success.
+ */
 static inline int vnc_trylock_display(VncDisplay *vd)
 {
-    return qemu_mutex_trylock(&vd->mutex);
+    if (qemu_mutex_trylock(&vd->mutex)) {
+        return -1;
+    }
+    if (vd->encoders) {
+        qemu_mutex_unlock(&vd->mutex);
+        return -1;
+    }
+    return 0;
 }
 
 static inline void vnc_lock_display(VncDisplay *vd)
@@ -57,6 +69,21 @@ static inline void vnc_unlock_display(VncDisplay *vd)
     qemu_mutex_unlock(&vd->mutex);
 }
 
+/* Several workers may read the server surface at the same time. */
+static inline void vnc_encode_begin(VncDisplay *vd)
+{
+    vnc_lock_display(vd);
+    vd->encoders++;
+    vnc_unlock_display(vd);
+}
+
+static inline void vnc_encode_end(VncDisplay *vd)
+{
+    vnc_lock_display(vd);
+    vd->encoders--;
+    vnc_unlock_display(vd);
+}
+
 static inline void vnc_lock_output(VncState *vs)
 {
     qemu_mutex_lock(&vs->output_mutex);
@@ -26,6 +26,7 @@
 
 #include "vnc.h"
 #include "vnc-jobs.h"
+#include "vnc-cmp.h"
 #include "trace.h"
 #include "hw/qdev.h"
 #include "sysemu/sysemu.h"
@@ -40,11 +41,29 @@
 #include "qapi-event.h"
 
 #define VNC_REFRESH_INTERVAL_BASE GUI_REFRESH_INTERVAL_DEFAULT
-#define VNC_REFRESH_INTERVAL_INC  50
 #define VNC_REFRESH_INTERVAL_MAX  GUI_REFRESH_INTERVAL_IDLE
 static const struct timeval VNC_REFRESH_STATS = { 0, 500000 };
 static const struct timeval VNC_REFRESH_LOSSY = { 2, 0 };
 
+/*
+ * Video regions: areas updated at VNC_VIDEO_FREQ_MIN or more for
+ * VNC_VIDEO_PERIODS stats periods in a row are sent to Tight/JPEG
+ * clients as one rectangle per frame, at a quality and frame rate
+ * that the client link sustains.  Once idle, they are refreshed
+ * losslessly.
+ */
+#define VNC_VIDEO_FREQ_MIN    10.0
+#define VNC_VIDEO_PERIODS     2
+#define VNC_VIDEO_MIN_CELLS   4       /* in VNC_STAT_RECT squares */
+#define VNC_VIDEO_FPS_MAX     30
+
+/* Link estimation and pacing, see vnc_update_acked() */
+#define VNC_BANDWIDTH_SAMPLE_MIN  16384   /* bytes */
+#define VNC_PACING_MIN_BYTES      65536
+
+/* lossy_rect value: resend the area without lossy encodings */
+#define VNC_LOSSY_REFINE      2
+
 #include "vnc_keysym.h"
 #include "d3des.h"
 
@@ -329,6 +348,63 @@ static void vnc_qmp_event(VncState *vs, QAPIEvent event)
     qapi_free_VncServerInfo(si);
 }
 
+static void vnc_stats_roll(VncTrafficStats *s, int64_t now)
+{
+    int64_t elapsed = now - s->window_start;
+
+    if (elapsed < get_ticks_per_sec()) {
+        return;
+    }
+    s->bytes_rate = s->window_bytes * get_ticks_per_sec() / elapsed;
+    s->update_rate = (double)s->window_updates * get_ticks_per_sec() /
+                     elapsed;
+    s->window_start = now;
+    s->window_bytes = 0;
+    s->window_updates = 0;
+}
+
+static VncClientStats *qmp_query_vnc_client_stats(const VncState *client)
+{
+    const VncTrafficStats *s = &client->stats;
+    VncClientStats *info = g_new0(VncClientStats, 1);
+    VncEncodingStatsList *list = NULL, *item;
+    int64_t elapsed;
+    int i;
+
+    info->bytes_sent = s->bytes_sent;
+    info->bytes_per_second = s->bytes_rate;
+    info->updates = s->updates;
+    info->updates_per_second = s->update_rate;
+    /* the current window is complete, but was not rolled for lack of traffic */
+    elapsed = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - s->window_start;
+    if (elapsed >= get_ticks_per_sec()) {
+        info->bytes_per_second = s->window_bytes * get_ticks_per_sec() /
+                                 elapsed;
+        info->updates_per_second = (double)s->window_updates *
+                                   get_ticks_per_sec() / elapsed;
+    }
+    info->updates_skipped = s->updates_skipped;
+    info->rtt = s->rtt / SCALE_US;
+    info->bandwidth = s->bandwidth;
+    info->in_flight = s->update_start ? s->update_bytes : 0;
+
+    for (i = VNC_RECT_ENCODING_MAX - 1; i >= 0; i--) {
+        if (!s->enc_rects[i]) {
+            continue;
+        }
+        item = g_new0(VncEncodingStatsList, 1);
+        item->value = g_new0(VncEncodingStats, 1);
+        item->value->encoding = i;
+        item->value->rects = s->enc_rects[i];
+        item->value->bytes = s->enc_bytes[i];
+        item->next = list;
+        list = item;
+    }
+    info->encodings = list;
+
+    return info;
+}
+
 static VncClientInfo *qmp_query_vnc_client(const VncState *client)
 {
     struct sockaddr_storage sa;
@@ -370,6 +446,9 @@ static VncClientInfo *qmp_query_vnc_client(const VncState *client)
     }
 #endif
 
+    info->has_stats = true;
+    info->stats = qmp_query_vnc_client_stats(client);
+
     return info;
 }
 
@@ -877,8 +956,47 @@ int vnc_raw_send_framebuffer_update(VncState *vs, int x, int y, int w, int h)
     return 1;
 }
 
+void vnc_account_rects(VncState *vs, int encoding, int n, size_t bytes)
+{
+    VncRectEncoding e;
+
+    switch (encoding) {
+    case VNC_ENCODING_RAW:
+        e = VNC_RECT_ENCODING_RAW;
+        break;
+    case VNC_ENCODING_COPYRECT:
+        e = VNC_RECT_ENCODING_COPYRECT;
+        break;
+    case VNC_ENCODING_HEXTILE:
+        e = VNC_RECT_ENCODING_HEXTILE;
+        break;
+    case VNC_ENCODING_ZLIB:
+        e = VNC_RECT_ENCODING_ZLIB;
+        break;
+    case VNC_ENCODING_TIGHT:
+        e = VNC_RECT_ENCODING_TIGHT;
+        break;
+    case VNC_ENCODING_TIGHT_PNG:
+        e = VNC_RECT_ENCODING_TIGHT_PNG;
+        break;
+    case VNC_ENCODING_ZRLE:
+        e = VNC_RECT_ENCODING_ZRLE;
+        break;
+    case VNC_ENCODING_ZYWRLE:
+        e = VNC_RECT_ENCODING_ZYWRLE;
+        break;
+    default:
+        return;
+    }
+    if (n > 0) {
+        vs->stats.enc_rects[e] += n;
+        vs->stats.enc_bytes[e] += bytes;
+    }
+}
+
 int vnc_send_framebuffer_update(VncState *vs, int x, int y, int w, int h)
 {
+    size_t offset = vs->output.offset;
     int n = 0;
 
     switch(vs->vnc_encoding) {
@@ -906,6 +1024,7 @@ int vnc_send_framebuffer_update(VncState *vs, int x, int y, int w, int h)
             n = vnc_raw_send_framebuffer_update(vs, x, y, w, h);
             break;
     }
+    vnc_account_rects(vs, vs->vnc_encoding, n, vs->output.offset - offset);
     return n;
 }
 
@@ -919,6 +1038,7 @@ static void vnc_copy(VncState *vs, int src_x, int src_y, int dst_x, int dst_y, i
     vnc_framebuffer_update(vs, dst_x, dst_y, w, h, VNC_ENCODING_COPYRECT);
     vnc_write_u16(vs, src_x);
     vnc_write_u16(vs, src_y);
+    vnc_account_rects(vs, VNC_ENCODING_COPYRECT, 1, 16);
     vnc_unlock_output(vs);
     vnc_flush(vs);
 }
@@ -1061,15 +1181,109 @@ static int find_and_clear_dirty_height(struct VncState *vs,
     return h;
 }
 
+static bool vnc_video_enabled(VncState *vs)
+{
+    return vs->vd->video && vs->tight.quality != (uint8_t)-1 &&
+           (vs->vnc_encoding == VNC_ENCODING_TIGHT ||
+            vs->vnc_encoding == VNC_ENCODING_TIGHT_PNG);
+}
+
+/* Clear the dirty bits covering @r, return whether there were any. */
+static bool vnc_clear_region_dirty(VncState *vs, const VncVideoRegion *r)
+{
+    int x = r->x / VNC_DIRTY_PIXELS_PER_BIT;
+    int n = DIV_ROUND_UP(r->w, VNC_DIRTY_PIXELS_PER_BIT);
+    bool dirty = false;
+    int y;
+
+    for (y = r->y; y < r->y + r->h; y++) {
+        if (find_next_bit(vs->dirty[y], x + n, x) < x + n) {
+            bitmap_clear(vs->dirty[y], x, n);
+            dirty = true;
+        }
+    }
+    return dirty;
+}
+
+/*
+ * Queue the dirty video regions as a single rectangle each, at most
+ * once per frame interval.  The dirty bits of regions that are not due
+ * yet are cleared too, so that the rest of the update does not send
+ * them piecemeal; their bits are set in *held and the caller marks them
+ * dirty again afterwards.
+ */
+static int vnc_update_video(VncState *vs, VncJob *job, int width, int height,
+                            unsigned *held)
+{
+    VncVideo *v = &vs->video;
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    bool due = now - v->last_frame >= v->frame_interval;
+    int i, n = 0;
+
+    *held = 0;
+    v->nregions = 0;
+    if (!vnc_video_enabled(vs)) {
+        return 0;
+    }
+
+    memcpy(v->regions, vs->vd->video_regions, sizeof(v->regions));
+    v->nregions = vs->vd->nr_video_regions;
+    for (i = 0; i < v->nregions; i++) {
+        VncVideoRegion *r = &v->regions[i];
+
+        if (r->x + r->w > width || r->y + r->h > height ||
+            !vnc_clear_region_dirty(vs, r)) {
+            continue;
+        }
+        if (!due) {
+            *held |= 1 << i;
+            continue;
+        }
+        n += vnc_job_add_rect(job, r->x, r->y, r->w, r->h);
+    }
+
+    if (n) {
+        v->last_frame = now;
+        v->update_video = true;
+    }
+    return n;
+}
+
+/*
+ * With a pacing latency, hold updates back while the client has not
+ * acknowledged as much data as its link delivers in that time.  The
+ * changes keep accumulating in the dirty map and go out together with
+ * the next update.
+ */
+static bool vnc_update_paced(VncState *vs)
+{
+    VncTrafficStats *s = &vs->stats;
+    uint64_t budget;
+
+    if (!vs->vd->pacing_latency || vs->force_update) {
+        return false;
+    }
+    if (vnc_has_job(vs)) {
+        return true;
+    }
+    if (!s->update_start) {
+        return false;
+    }
+
+    budget = s->bandwidth * vs->vd->pacing_latency / get_ticks_per_sec();
+    return s->update_bytes >= MAX(budget, VNC_PACING_MIN_BYTES);
+}
+
 static int vnc_update_client(VncState *vs, int has_dirty, bool sync)
 {
     vs->has_dirty += has_dirty;
     if (vs->need_update && vs->csock != -1) {
         VncDisplay *vd = vs->vd;
         VncJob *job;
-        int y;
+        int y, i;
         int height, width;
         int n = 0;
+        unsigned held;
 
         if (vs->output.offset && !vs->audio_cap && !vs->force_update)
             /* kernel send buffers are full -> drop frames to throttle */
@@ -1078,6 +1292,11 @@ static int vnc_update_client(VncState *vs, int has_dirty, bool sync)
         if (!vs->has_dirty && !vs->audio_cap && !vs->force_update)
             return 0;
 
+        if (vnc_update_paced(vs)) {
+            vs->stats.updates_skipped++;
+            return 0;
+        }
+
         /*
          * Send screen updates to the vnc client using the server
          * surface and server dirty map.  guest surface updates
@@ -1089,6 +1308,8 @@ static int vnc_update_client(VncState *vs, int has_dirty, bool sync)
         height = pixman_image_get_height(vd->server);
         width = pixman_image_get_width(vd->server);
 
+        n += vnc_update_video(vs, job, width, height, &held);
+
         y = 0;
         for (;;) {
             int x, h;
@@ -1119,12 +1340,21 @@ static int vnc_update_client(VncState *vs, int has_dirty, bool sync)
             }
         }
 
+        for (i = 0; i < vs->video.nregions; i++) {
+            VncVideoRegion *r = &vs->video.regions[i];
+
+            if (held & (1 << i)) {
+                vnc_set_area_dirty(vs->dirty, width, height,
+                                   r->x, r->y, r->w, r->h);
+            }
+        }
+
         vnc_job_push(job);
         if (sync) {
             vnc_jobs_join(vs);
         }
         vs->force_update = 0;
-        vs->has_dirty = 0;
+        vs->has_dirty = held ? 1 : 0;
         return n;
     }
 
@@ -1356,7 +1586,10 @@ long vnc_client_write_buf(VncState *vs, const uint8_t *data, size_t datalen)
     }
 #endif /* CONFIG_VNC_TLS */
     VNC_DEBUG("Wrote wire %p %zd -> %ld\n", data, datalen, ret);
-    return vnc_client_io_error(vs, ret, socket_error());
+    ret = vnc_client_io_error(vs, ret, socket_error());
+    vs->stats.bytes_sent += ret;
+    vs->stats.window_bytes += ret;
+    return ret;
 }
 
 
@@ -1395,6 +1628,9 @@ static long vnc_client_write_plain(VncState *vs)
 
     if (vs->output.offset == 0) {
         qemu_set_fd_handler2(vs->csock, NULL, vnc_client_read, NULL, vs);
+        if (vs->stats.update_start) {
+            vs->stats.update_flushed = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+        }
     }
 
     return ret;
@@ -2051,12 +2287,95 @@ static void ext_key_event(VncState *vs, int down,
     }
 }
 
+static int64_t vnc_ewma(int64_t avg, int64_t sample)
+{
+    return avg ? avg - avg / 8 + sample / 8 : sample;
+}
+
+/*
+ * Pick the quality and frame interval of video frames so that a frame
+ * is delivered, given the measured latency and bandwidth, before the
+ * next one is due.
+ */
+static void vnc_video_adjust(VncState *vs)
+{
+    VncVideo *v = &vs->video;
+    VncTrafficStats *s = &vs->stats;
+    double freq = 1;
+    int64_t target, frame;
+    int i;
+
+    for (i = 0; i < v->nregions; i++) {
+        freq = MAX(freq, v->regions[i].freq);
+    }
+    target = get_ticks_per_sec() / MIN(freq, VNC_VIDEO_FPS_MAX);
+    frame = s->rtt;
+    if (s->bandwidth) {
+        frame += s->update_bytes * get_ticks_per_sec() / s->bandwidth;
+    }
+
+    v->quality = MIN(v->quality, vs->tight.quality);
+    if (frame > target && v->quality > 0) {
+        v->quality--;
+    } else if (frame < target / 2 && v->quality < vs->tight.quality) {
+        v->quality++;
+    }
+    v->frame_interval = MAX(target, frame);
+}
+
+void vnc_update_queued(VncState *vs, size_t bytes)
+{
+    VncTrafficStats *s = &vs->stats;
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+
+    if (!s->update_start) {
+        s->update_start = now;
+        s->update_flushed = 0;
+        s->update_bytes = 0;
+    }
+    s->update_bytes += bytes;
+    s->updates++;
+    s->window_updates++;
+    vnc_stats_roll(s, now);
+}
+
+/*
+ * Clients ask for the next update once they have processed the previous
+ * one, which closes the round trip of the update in flight.
+ */
+static void vnc_update_acked(VncState *vs)
+{
+    VncTrafficStats *s = &vs->stats;
+    int64_t now, cycle;
+
+    if (!s->update_start) {
+        return;
+    }
+
+    now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    cycle = MAX(now - s->update_start, 1);
+    if (s->update_flushed) {
+        s->rtt = vnc_ewma(s->rtt, now - s->update_flushed);
+    }
+    if (s->update_bytes >= VNC_BANDWIDTH_SAMPLE_MIN) {
+        s->bandwidth = vnc_ewma(s->bandwidth, s->update_bytes *
+                                get_ticks_per_sec() / cycle);
+    }
+    if (vs->video.update_video) {
+        vnc_video_adjust(vs);
+    }
+
+    s->update_start = 0;
+    vs->video.update_video = false;
+}
+
 static void framebuffer_update_request(VncState *vs, int incremental,
                                        int x, int y, int w, int h)
 {
     int width = pixman_image_get_width(vs->vd->server);
     int height = pixman_image_get_height(vs->vd->server);
 
+    vnc_update_acked(vs);
     vs->need_update = 1;
 
     if (incremental) {
@@ -2746,6 +3065,51 @@ void vnc_sent_lossy_rect(VncState *vs, int x, int y, int w, int h)
     }
 }
 
+/*
+ * Return whether part of the area is being refreshed after lossy updates
+ * and must therefore be sent losslessly.
+ */
+bool vnc_lossy_refine(VncState *vs, int x, int y, int w, int h)
+{
+    bool refine = false;
+    int i, j;
+
+    if (!vs->vd->video) {
+        return false;
+    }
+
+    w = (x + w - 1) / VNC_STAT_RECT;
+    h = (y + h - 1) / VNC_STAT_RECT;
+    x /= VNC_STAT_RECT;
+    y /= VNC_STAT_RECT;
+
+    for (j = y; j <= h; j++) {
+        for (i = x; i <= w; i++) {
+            if (vs->lossy_rect[j][i] == VNC_LOSSY_REFINE) {
+                vs->lossy_rect[j][i] = 0;
+                refine = true;
+            }
+        }
+    }
+    return refine;
+}
+
+/* Return whether the area is part of a video frame. */
+bool vnc_video_rect(VncState *vs, int x, int y, int w, int h)
+{
+    int i;
+
+    for (i = 0; i < vs->video.nregions; i++) {
+        VncVideoRegion *r = &vs->video.regions[i];
+
+        if (x >= r->x && y >= r->y &&
+            x + w <= r->x + r->w && y + h <= r->y + r->h) {
+            return true;
+        }
+    }
+    return false;
+}
+
 static int vnc_refresh_lossy_rect(VncDisplay *vd, int x, int y)
 {
     VncState *vs;
@@ -2768,7 +3132,7 @@ static int vnc_refresh_lossy_rect(VncDisplay *vd, int x, int y)
             continue;
         }
 
-        vs->lossy_rect[sty][stx] = 0;
+        vs->lossy_rect[sty][stx] = vd->video ? VNC_LOSSY_REFINE : 0;
         for (j = 0; j < VNC_STAT_RECT; ++j) {
             bitmap_set(vs->dirty[y + j],
                        x / VNC_DIRTY_PIXELS_PER_BIT,
@@ -2780,6 +3144,90 @@ static int vnc_refresh_lossy_rect(VncDisplay *vd, int x, int y)
     return has_dirty;
 }
 
+static bool vnc_stat_is_video(VncDisplay *vd, int col, int row)
+{
+    return vd->guest.stats[row][col].video_periods >= VNC_VIDEO_PERIODS;
+}
+
+/*
+ * Group the stats squares that look like video into connected areas and
+ * keep the bounding boxes of the VNC_VIDEO_REGIONS_MAX largest ones.
+ */
+static void vnc_update_video_regions(VncDisplay *vd, int width, int height)
+{
+    static const int dx[] = { 1, -1, 0, 0 }, dy[] = { 0, 0, 1, -1 };
+    int cols = DIV_ROUND_UP(width, VNC_STAT_RECT);
+    int rows = DIV_ROUND_UP(height, VNC_STAT_RECT);
+    bool seen[VNC_STAT_ROWS][VNC_STAT_COLS];
+    int stack[VNC_STAT_ROWS * VNC_STAT_COLS];
+    int row, col, i;
+
+    memset(seen, 0, sizeof(seen));
+    vd->nr_video_regions = 0;
+    for (row = 0; row < rows; row++) {
+        for (col = 0; col < cols; col++) {
+            int x1 = col, x2 = col, y1 = row, y2 = row;
+            int sp = 0, cells = 0, smallest = 0;
+            VncVideoRegion r;
+            double freq = 0;
+
+            if (seen[row][col] || !vnc_stat_is_video(vd, col, row)) {
+                continue;
+            }
+
+            seen[row][col] = true;
+            stack[sp++] = row * VNC_STAT_COLS + col;
+            while (sp) {
+                int cx = stack[--sp] % VNC_STAT_COLS;
+                int cy = stack[sp] / VNC_STAT_COLS;
+
+                cells++;
+                freq += vd->guest.stats[cy][cx].freq;
+                x1 = MIN(x1, cx);
+                x2 = MAX(x2, cx);
+                y1 = MIN(y1, cy);
+                y2 = MAX(y2, cy);
+                for (i = 0; i < ARRAY_SIZE(dx); i++) {
+                    int nx = cx + dx[i], ny = cy + dy[i];
+
+                    if (nx < 0 || nx >= cols || ny < 0 || ny >= rows ||
+                        seen[ny][nx] || !vnc_stat_is_video(vd, nx, ny)) {
+                        continue;
+                    }
+                    seen[ny][nx] = true;
+                    stack[sp++] = ny * VNC_STAT_COLS + nx;
+                }
+            }
+            if (cells < VNC_VIDEO_MIN_CELLS) {
+                continue;
+            }
+
+            r.x = x1 * VNC_STAT_RECT;
+            r.y = y1 * VNC_STAT_RECT;
+            r.w = MIN((x2 + 1) * VNC_STAT_RECT, width) - r.x;
+            r.h = MIN((y2 + 1) * VNC_STAT_RECT, height) - r.y;
+            r.freq = freq / cells;
+
+            if (vd->nr_video_regions < VNC_VIDEO_REGIONS_MAX) {
+                vd->video_regions[vd->nr_video_regions++] = r;
+                continue;
+            }
+            for (i = 1; i < VNC_VIDEO_REGIONS_MAX; i++) {
+                VncVideoRegion *s = &vd->video_regions[i];
+                VncVideoRegion *m = &vd->video_regions[smallest];
+
+                if (s->w * s->h < m->w * m->h) {
+                    smallest = i;
+                }
+            }
+            if (r.w * r.h > vd->video_regions[smallest].w *
+                            vd->video_regions[smallest].h) {
+                vd->video_regions[smallest] = r;
+            }
+        }
+    }
+}
+
 static int vnc_update_stats(VncDisplay *vd,  struct timeval * tv)
 {
     int width = pixman_image_get_width(vd->guest.fb);
@@ -2810,6 +3258,7 @@ static int vnc_update_stats(VncDisplay *vd,  struct timeval * tv)
             struct timeval min, max;
 
             if (!timerisset(&rect->times[count - 1])) {
+                rect->video_periods = 0;
                 continue ;
             }
 
@@ -2818,6 +3267,7 @@ static int vnc_update_stats(VncDisplay *vd,  struct timeval * tv)
 
             if (timercmp(&res, &VNC_REFRESH_LOSSY, >)) {
                 rect->freq = 0;
+                rect->video_periods = 0;
                 has_dirty += vnc_refresh_lossy_rect(vd, x, y);
                 memset(rect->times, 0, sizeof (rect->times));
                 continue ;
@@ -2830,8 +3280,19 @@ static int vnc_update_stats(VncDisplay *vd,  struct timeval * tv)
             rect->freq = res.tv_sec + res.tv_usec / 1000000.;
             rect->freq /= count;
             rect->freq = 1. / rect->freq;
+
+            if (rect->freq >= VNC_VIDEO_FREQ_MIN) {
+                rect->video_periods = MIN(rect->video_periods + 1,
+                                          VNC_VIDEO_PERIODS);
+            } else {
+                rect->video_periods = 0;
+            }
         }
     }
+
+    if (vd->video) {
+        vnc_update_video_regions(vd, width, height);
+    }
     return has_dirty;
 }
 
@@ -2877,8 +3338,10 @@ static int vnc_refresh_server_surface(VncDisplay *vd)
                     pixman_image_get_width(vd->server));
     int height = MIN(pixman_image_get_height(vd->guest.fb),
                      pixman_image_get_height(vd->server));
-    int cmp_bytes, server_stride, min_stride, guest_stride, y = 0;
+    int ncells = DIV_ROUND_UP(width, VNC_DIRTY_PIXELS_PER_BIT);
+    int server_stride, min_stride, guest_stride, y = 0;
     uint8_t *guest_row0 = NULL, *server_row0;
+    unsigned long changed[BITS_TO_LONGS(VNC_DIRTY_BITS)];
     VncState *vs;
     int has_dirty = 0;
     pixman_image_t *tmpbuf = NULL;
@@ -2892,13 +3355,13 @@ static int vnc_refresh_server_surface(VncDisplay *vd)
 
     /*
      * Walk through the guest dirty map.
-     * Check and copy modified bits from guest to server surface.
-     * Update server dirty map.
+     * Check and copy modified cells from guest to server surface, a row
+     * at a time.  Update server dirty map.
      */
+    QEMU_BUILD_BUG_ON(VNC_DIRTY_PIXELS_PER_BIT * VNC_SERVER_FB_BYTES !=
+                      VNC_CMP_CELL_BYTES);
     server_row0 = (uint8_t *)pixman_image_get_data(vd->server);
     server_stride = guest_stride = pixman_image_get_stride(vd->server);
-    cmp_bytes = MIN(VNC_DIRTY_PIXELS_PER_BIT * VNC_SERVER_FB_BYTES,
-                    server_stride);
     if (vd->guest.format != VNC_SERVER_FB_FORMAT) {
         int width = pixman_image_get_width(vd->server);
         tmpbuf = qemu_pixman_linebuf_create(VNC_SERVER_FB_FORMAT, width);
@@ -2909,7 +3372,7 @@ static int vnc_refresh_server_surface(VncDisplay *vd)
     min_stride = MIN(server_stride, guest_stride);
 
     for (;;) {
-        int x;
+        int x, count;
         uint8_t *guest_ptr, *server_ptr;
         unsigned long offset = find_next_bit((unsigned long *) &vd->guest.dirty,
                                              height * VNC_DIRTY_BPL(&vd->guest),
@@ -2919,9 +3382,8 @@ static int vnc_refresh_server_surface(VncDisplay *vd)
             break;
         }
         y = offset / VNC_DIRTY_BPL(&vd->guest);
-        x = offset % VNC_DIRTY_BPL(&vd->guest);
 
-        server_ptr = server_row0 + y * server_stride + x * cmp_bytes;
+        server_ptr = server_row0 + y * server_stride;
 
         if (vd->guest.format != VNC_SERVER_FB_FORMAT) {
             qemu_pixman_linebuf_fill(tmpbuf, vd->guest.fb, width, 0, y);
@@ -2929,29 +3391,22 @@ static int vnc_refresh_server_surface(VncDisplay *vd)
         } else {
             guest_ptr = guest_row0 + y * guest_stride;
         }
-        guest_ptr += x * cmp_bytes;
 
-        for (; x < DIV_ROUND_UP(width, VNC_DIRTY_PIXELS_PER_BIT);
-             x++, guest_ptr += cmp_bytes, server_ptr += cmp_bytes) {
-            int _cmp_bytes = cmp_bytes;
-            if (!test_and_clear_bit(x, vd->guest.dirty[y])) {
-                continue;
-            }
-            if ((x + 1) * cmp_bytes > min_stride) {
-                _cmp_bytes = min_stride - x * cmp_bytes;
-            }
-            if (memcmp(server_ptr, guest_ptr, _cmp_bytes) == 0) {
-                continue;
-            }
-            memcpy(server_ptr, guest_ptr, _cmp_bytes);
+        count = vnc_cmp_copy_row(server_ptr, guest_ptr, min_stride,
+                                 vd->guest.dirty[y], changed, ncells);
+        bitmap_zero(vd->guest.dirty[y], VNC_DIRTY_BITS);
+        if (count) {
             if (!vd->non_adaptive) {
-                vnc_rect_updated(vd, x * VNC_DIRTY_PIXELS_PER_BIT,
-                                 y, &tv);
+                for (x = find_first_bit(changed, ncells); x < ncells;
+                     x = find_next_bit(changed, ncells, x + 1)) {
+                    vnc_rect_updated(vd, x * VNC_DIRTY_PIXELS_PER_BIT,
+                                     y, &tv);
+                }
             }
             QTAILQ_FOREACH(vs, &vd->clients, next) {
-                set_bit(x, vs->dirty[y]);
+                bitmap_or(vs->dirty[y], vs->dirty[y], changed, ncells);
             }
-            has_dirty++;
+            has_dirty += count;
         }
 
         y++;
@@ -2964,7 +3419,8 @@ static void vnc_refresh(DisplayChangeListener *dcl)
 {
     VncDisplay *vd = container_of(dcl, VncDisplay, dcl);
     VncState *vs, *vn;
-    int has_dirty, rects = 0;
+    int has_dirty, held;
+    bool pending = false;
 
     if (QTAILQ_EMPTY(&vd->clients)) {
         update_displaychangelistener(&vd->dcl, VNC_REFRESH_INTERVAL_MAX);
@@ -2982,20 +3438,15 @@ static void vnc_refresh(DisplayChangeListener *dcl)
     vnc_unlock_display(vd);
 
     QTAILQ_FOREACH_SAFE(vs, &vd->clients, next, vn) {
-        rects += vnc_update_client(vs, has_dirty, false);
+        held = vs->has_dirty + has_dirty;
+        if (!vnc_update_client(vs, has_dirty, false) && held) {
+            /* throttled or paced, try again soon */
+            pending = true;
+        }
         /* vs might be free()ed here */
     }
-
-    if (has_dirty && rects) {
-        vd->dcl.update_interval /= 2;
-        if (vd->dcl.update_interval < VNC_REFRESH_INTERVAL_BASE) {
-            vd->dcl.update_interval = VNC_REFRESH_INTERVAL_BASE;
-        }
-    } else {
-        vd->dcl.update_interval += VNC_REFRESH_INTERVAL_INC;
-        if (vd->dcl.update_interval > VNC_REFRESH_INTERVAL_MAX) {
-            vd->dcl.update_interval = VNC_REFRESH_INTERVAL_MAX;
-        }
+    if (pending) {
+        dpy_refresh_pending(&vd->dcl);
     }
 }
 
@@ -3024,6 +3475,8 @@ static void vnc_connect(VncDisplay *vd, int csock,
     for (i = 0; i < VNC_STAT_ROWS; ++i) {
         vs->lossy_rect[i] = g_malloc0(VNC_STAT_COLS * sizeof (uint8_t));
     }
+    vs->video.quality = 9;
+    vs->stats.window_start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
 
     VNC_DEBUG("New client on socket %d\n", csock);
     update_displaychangelistener(&vd->dcl, VNC_REFRESH_INTERVAL_BASE);
@@ -3313,6 +3766,12 @@ static QemuOptsList qemu_vnc_opts = {
         },{
             .name = "non-adaptive",
             .type = QEMU_OPT_BOOL,
+        },{
+            .name = "video",
+            .type = QEMU_OPT_BOOL,
+        },{
+            .name = "latency",
+            .type = QEMU_OPT_NUMBER,
         },
         { /* end of list */ }
     },
@@ -3457,6 +3916,7 @@ void vnc_display_open(const char *id, Error **errp)
 
 #ifdef CONFIG_VNC_JPEG
     vs->lossy = qemu_opt_get_bool(opts, "lossy", false);
+    vs->video = qemu_opt_get_bool(opts, "video", false);
 #endif
     vs->non_adaptive = qemu_opt_get_bool(opts, "non-adaptive", false);
     /* adaptive updates are only used with tight encoding and
@@ -3465,6 +3925,12 @@ void vnc_display_open(const char *id, Error **errp)
     if (!vs->lossy) {
         vs->non_adaptive = true;
     }
+    /* video regions are found from the adaptive encoding statistics */
+    if (vs->non_adaptive) {
+        vs->video = false;
+    }
+    vs->nr_video_regions = 0;
+    vs->pacing_latency = qemu_opt_get_number(opts, "latency", 0) * SCALE_MS;
 
 #ifdef CONFIG_VNC_TLS
     if (acl && x509 && vs->tls.x509verify) {
@@ -66,6 +66,7 @@ typedef struct VncState VncState;
 typedef struct VncJob VncJob;
 typedef struct VncRect VncRect;
 typedef struct VncRectEntry VncRectEntry;
+typedef struct VncTile VncTile;
 
 typedef int VncReadEvent(VncState *vs, uint8_t *data, size_t len);
 
@@ -120,10 +121,51 @@ struct VncRectStat
 
     double freq;        /* Update frequency (in Hz) */
     bool updated;       /* Already updated during this refresh */
+    int video_periods;  /* Consecutive stats periods at video frequency */
 };
 
 typedef struct VncRectStat VncRectStat;
 
+/* Screen areas updated at a sustained high rate, see vnc_update_stats() */
+#define VNC_VIDEO_REGIONS_MAX 4
+
+typedef struct VncVideoRegion {
+    int x, y, w, h;
+    double freq;        /* Average update frequency (in Hz) */
+} VncVideoRegion;
+
+typedef struct VncVideo {
+    VncVideoRegion regions[VNC_VIDEO_REGIONS_MAX];
+    int nregions;
+    int quality;                /* Tight quality level for video frames */
+    int64_t frame_interval;     /* Minimum time between frames (ns) */
+    int64_t last_frame;
+    bool update_video;          /* Update in flight carries video frames */
+} VncVideo;
+
+/* Link estimation and statistics, see vnc_update_acked() */
+typedef struct VncTrafficStats {
+    /* Round trip of the updates in flight, until the next update request */
+    int64_t update_start;       /* First update queued for sending */
+    int64_t update_flushed;     /* Last update handed to the kernel */
+    size_t update_bytes;
+    int64_t rtt;                /* Flush to next request (ns, averaged) */
+    uint64_t bandwidth;         /* Bytes per second (averaged) */
+
+    uint64_t bytes_sent;
+    uint64_t updates;
+    uint64_t updates_skipped;   /* Merged into a later update by pacing */
+    uint64_t enc_rects[VNC_RECT_ENCODING_MAX];
+    uint64_t enc_bytes[VNC_RECT_ENCODING_MAX];
+
+    /* Rates over the last second */
+    int64_t window_start;
+    uint64_t window_bytes;
+    uint64_t window_updates;
+    uint64_t bytes_rate;
+    double update_rate;
+} VncTrafficStats;
+
 struct VncSurface
 {
     struct timeval last_freq_check;
@@ -165,6 +207,7 @@ struct VncDisplay
     kbd_layout_t *kbd_layout;
     int lock_key_sync;
     QemuMutex mutex;
+    int encoders;       /* Workers reading the server surface */
 
     QEMUCursor *cursor;
     int cursor_msize;
@@ -182,6 +225,10 @@ struct VncDisplay
     int auth;
     bool lossy;
     bool non_adaptive;
+    bool video;
+    VncVideoRegion video_regions[VNC_VIDEO_REGIONS_MAX];
+    int nr_video_regions;
+    int64_t pacing_latency;     /* Target latency of paced updates (ns) */
 #ifdef CONFIG_VNC_TLS
     int subauth; /* Used by VeNCrypt */
     VncDisplayTLS tls;
@@ -208,6 +255,7 @@ typedef struct VncTight {
 #endif
     int levels[4];
     z_stream stream[4];
+    uint8_t stream_reset;   /* Reset bits for the next rectangle */
 } VncTight;
 
 typedef struct VncHextile {
@@ -219,6 +267,7 @@ typedef struct VncZlib {
     Buffer tmp;
     z_stream stream;
     int level;
+    bool started;           /* zlib header sent to the client */
 } VncZlib;
 
 typedef struct VncZrle {
@@ -229,6 +278,7 @@ typedef struct VncZrle {
     Buffer zlib;
     z_stream stream;
     VncPalette palette;
+    bool started;           /* zlib header sent to the client */
 } VncZrle;
 
 typedef struct VncZywrle {
@@ -252,6 +302,14 @@ struct VncRectEntry
 struct VncJob
 {
     VncState *vs;
+    bool busy;              /* Being encoded by a worker */
+
+    /* Bands encoded in parallel by several workers, see vnc-jobs.c */
+    VncState *encoder;
+    VncTile *tiles;
+    int ntiles;
+    int next_tile;
+    int done_tiles;
 
     QLIST_HEAD(, VncRectEntry) rectangles;
     QTAILQ_ENTRY(VncJob) next;
@@ -264,6 +322,8 @@ struct VncState
     DECLARE_BITMAP(dirty[VNC_MAX_HEIGHT], VNC_DIRTY_BITS);
     uint8_t **lossy_rect; /* Not an Array to avoid costly memcpy in
                            * vnc-jobs-async.c */
+    VncVideo video;
+    VncTrafficStats stats;
 
     VncDisplay *vd;
     int need_update;
@@ -578,6 +638,10 @@ int vnc_server_fb_stride(VncDisplay *vd);
 void vnc_convert_pixel(VncState *vs, uint8_t *buf, uint32_t v);
 double vnc_update_freq(VncState *vs, int x, int y, int w, int h);
 void vnc_sent_lossy_rect(VncState *vs, int x, int y, int w, int h);
+bool vnc_lossy_refine(VncState *vs, int x, int y, int w, int h);
+bool vnc_video_rect(VncState *vs, int x, int y, int w, int h);
+void vnc_update_queued(VncState *vs, size_t bytes);
+void vnc_account_rects(VncState *vs, int encoding, int n, size_t bytes);
 
 /* Encodings */
 int vnc_send_framebuffer_update(VncState *vs, int x, int y, int w, int h);
@@ -588,18 +652,22 @@ int vnc_hextile_send_framebuffer_update(VncState *vs, int x,
                                          int y, int w, int h);
 void vnc_hextile_set_pixel_conversion(VncState *vs, int generic);
 
+extern const uint8_t vnc_zlib_header[2];
 void *vnc_zlib_zalloc(void *x, unsigned items, unsigned size);
 void vnc_zlib_zfree(void *x, void *addr);
 int vnc_zlib_send_framebuffer_update(VncState *vs, int x, int y, int w, int h);
+void vnc_zlib_start_tile(VncState *vs);
 void vnc_zlib_clear(VncState *vs);
 
 int vnc_tight_send_framebuffer_update(VncState *vs, int x, int y, int w, int h);
 int vnc_tight_png_send_framebuffer_update(VncState *vs, int x, int y,
                                           int w, int h);
+void vnc_tight_start_tile(VncState *vs);
 void vnc_tight_clear(VncState *vs);
 
 int vnc_zrle_send_framebuffer_update(VncState *vs, int x, int y, int w, int h);
 int vnc_zywrle_send_framebuffer_update(VncState *vs, int x, int y, int w, int h);
+void vnc_zrle_start_tile(VncState *vs);
 void vnc_zrle_clear(VncState *vs);
 
 #endif /* __QEMU_VNC_H */
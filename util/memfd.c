@@ -0,0 +1,113 @@
+/*
+ * memfd.c
+ *
+ * Copyright (c) 2015 agent <agent@local>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * Anonymous shared memory that can be handed to other processes over a
+ * unix socket.  memfd_create() is used where the kernel has it, so that
+ * the receiver can check the seals; otherwise fall back to an unlinked
+ * temporary file.
+ */
+
+#include "qemu-common.h"
+#include "qemu/memfd.h"
+
+#include <sys/mman.h>
+#ifdef CONFIG_LINUX
+#include <sys/syscall.h>
+#endif
+
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 0x0001U
+#endif
+
+#ifndef MFD_ALLOW_SEALING
+#define MFD_ALLOW_SEALING 0x0002U
+#endif
+
+static int qemu_memfd_create(const char *name, unsigned int flags)
+{
+#if defined(CONFIG_LINUX) && defined(__NR_memfd_create)
+    return syscall(__NR_memfd_create, name, flags);
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+static int memfd_tmpfile(const char *dir, const char *name)
+{
+    char *path = g_strdup_printf("%s/%s-XXXXXX", dir, name);
+    int fd;
+
+    fd = mkstemp(path);
+    if (fd >= 0) {
+        unlink(path);
+        qemu_set_cloexec(fd);
+    }
+    g_free(path);
+    return fd;
+}
+
+void *qemu_memfd_alloc(const char *name, size_t size, unsigned int seals,
+                       int *fd)
+{
+    void *ptr;
+    int mfd;
+
+    mfd = qemu_memfd_create(name, MFD_CLOEXEC |
+                            (seals ? MFD_ALLOW_SEALING : 0));
+    if (mfd < 0) {
+        mfd = memfd_tmpfile("/dev/shm", name);
+        seals = 0;
+    }
+    if (mfd < 0) {
+        mfd = memfd_tmpfile(g_get_tmp_dir(), name);
+    }
+    if (mfd < 0) {
+        return NULL;
+    }
+
+    if (ftruncate(mfd, size) < 0) {
+        goto err;
+    }
+    if (seals && fcntl(mfd, F_ADD_SEALS, seals) < 0) {
+        goto err;
+    }
+
+    ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, mfd, 0);
+    if (ptr == MAP_FAILED) {
+        goto err;
+    }
+
+    *fd = mfd;
+    return ptr;
+
+err:
+    close(mfd);
+    return NULL;
+}
+
+int qemu_memfd_open_readonly(int fd)
+{
+    char *path = g_strdup_printf("/proc/self/fd/%d", fd);
+    int ro_fd;
+
+    /* a dup() would share the read-write open file description */
+    ro_fd = qemu_open(path, O_RDONLY);
+    g_free(path);
+    return ro_fd;
+}
+
+void qemu_memfd_free(void *ptr, size_t size, int fd)
+{
+    if (ptr) {
+        munmap(ptr, size);
+    }
+    if (fd != -1) {
+        close(fd);
+    }
+}
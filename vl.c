@@ -3483,6 +3483,17 @@ int main(int argc, char **argv, char **envp)
 #else
                 fprintf(stderr, "VNC support is disabled\n");
                 exit(1);
+#endif
+                break;
+            case QEMU_OPTION_shm_display:
+#ifdef CONFIG_LINUX
+                if (shm_display_parse(optarg) == NULL) {
+                    exit(1);
+                }
+#else
+                fprintf(stderr, "shared memory display is only supported "
+                        "on Linux\n");
+                exit(1);
 #endif
                 break;
             case QEMU_OPTION_no_acpi:
@@ -4295,6 +4306,10 @@ int main(int argc, char **argv, char **envp)
                vnc_display_local_addr("default"));
     }
 #endif
+#ifdef CONFIG_LINUX
+    qemu_opts_foreach(qemu_find_opts("shm-display"), shm_display_init_func,
+                      NULL, 0);
+#endif
 #ifdef CONFIG_SPICE
     if (using_spice) {
         qemu_spice_display_init();